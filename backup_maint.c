@@ -0,0 +1,585 @@
+/*
+ * backup_maint.c
+ * Retention, garbage collection and packing of the backup store,
+ * see backup_maint.h.
+ *
+ * A cycle never blocks FUSE requests for long: listing, marking, reading
+ * and packing run without locks. Saves that happen meanwhile pin the
+ * digests they reference (vs_gc_begin), and deletions of chunks run in
+ * short batches under vs_gc_lock, re-checking the pins, so a chunk a new
+ * version just started to use is never removed. Loose objects are only
+ * unlinked once the pack holding them is committed and published.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "backup_maint.h"
+#include "version_store.h"
+#include "pack_file.h"
+#include "version_catalog.h"
+
+#define BM_DELETE_BATCH 256             // số chunk xóa trong một lần giữ vs_gc_lock
+
+struct version {
+    char *name;
+    char *path;
+    int64_t created;
+    uint64_t size;
+    int packed;
+    int keep;
+};
+
+struct version_list {
+    struct version *v;
+    size_t n;
+    size_t cap;
+    int error;
+};
+
+// Gom object vào pack, tự sang pack mới khi đủ PACK_TARGET_SIZE
+struct packer {
+    struct pack_writer *w;
+    char **loose;                       // file rời đã nằm trong w, xóa sau commit
+    size_t nloose;
+    size_t cap;
+    int failed;
+    struct bm_report *report;
+};
+
+struct dropped_pack {
+    uint32_t id;
+    uint8_t (*dead)[SHA256_DIGEST_LEN]; // chunk bỏ lại, phải chưa bị pin mới xóa được pack
+    size_t ndead;
+};
+
+static struct bm_policy policy;
+static unsigned interval = BM_DEFAULT_INTERVAL;
+static int full_gc_pending = 1;         // lần chạy đầu dọn cả rác còn sót từ trước
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t maint_thread;
+static int maint_running = 0;
+static int maint_stop = 0;
+static pthread_mutex_t maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+
+void bm_set_policy(const struct bm_policy *p) {
+    policy = *p;
+}
+
+void bm_set_interval(unsigned seconds) {
+    interval = seconds;
+}
+
+static int policy_active(void) {
+    return policy.keep_last || policy.keep_days || policy.thin;
+}
+
+static int read_loose(int dirfd, const char *rel, void **data, size_t *len) {
+    int fd = openat(dirfd, rel, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf) {
+        close(fd);
+        return -ENOMEM;
+    }
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = pread(fd, buf + done, st.st_size - done, done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+    if (done != (size_t)st.st_size) {
+        free(buf);
+        return -EIO;
+    }
+    *data = buf;
+    *len = done;
+    return 0;
+}
+
+static int parse_hex_digest(const char *hex, uint8_t out[SHA256_DIGEST_LEN]) {
+    if (strlen(hex) != SHA256_DIGEST_LEN * 2) return -1;
+    for (int i = 0; i < SHA256_DIGEST_LEN * 2; i++) {
+        char c = hex[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0) return -1;
+        if (i % 2 == 0) out[i / 2] = (uint8_t)(v << 4);
+        else out[i / 2] |= (uint8_t)v;
+    }
+    return 0;
+}
+
+static void chunk_rel(char out[PATH_MAX], const uint8_t digest[SHA256_DIGEST_LEN]) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[SHA256_DIGEST_LEN * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA256_DIGEST_LEN * 2] = '\0';
+    snprintf(out, PATH_MAX, "chunks/%.2s/%s", hex, hex);
+}
+
+// ---- 1. liệt kê + retention ----
+
+static int collect_version(void *ctx, const char *name, const struct vs_manifest *m, int packed) {
+    struct version_list *l = ctx;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        struct version *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) {
+            l->error = -ENOMEM;
+            return 1;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    struct version *v = &l->v[l->n];
+    v->name = strdup(name);
+    v->path = strdup(m->path);
+    if (!v->name || !v->path) {
+        free(v->name);
+        free(v->path);
+        l->error = -ENOMEM;
+        return 1;
+    }
+    v->created = m->hdr.created;
+    v->size = m->hdr.file_size;
+    v->packed = packed;
+    v->keep = 1;
+    l->n++;
+    return 0;
+}
+
+// Theo path, rồi mới nhất trước
+static int version_cmp(const void *a, const void *b) {
+    const struct version *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    if (c) return c;
+    if (x->created != y->created) return x->created > y->created ? -1 : 1;
+    return strcmp(y->name, x->name);
+}
+
+static void apply_policy(struct version_list *l, time_t now) {
+    if (!policy_active()) return;
+    qsort(l->v, l->n, sizeof(*l->v), version_cmp);
+
+    size_t rank = 0;
+    int64_t last_bucket = -1;
+    for (size_t i = 0; i < l->n; i++) {
+        struct version *v = &l->v[i];
+        if (i == 0 || strcmp(v->path, l->v[i - 1].path) != 0) {
+            rank = 0;
+            last_bucket = -1;
+        }
+        int64_t age = (int64_t)now - v->created;
+
+        int keep = rank == 0;           // bản mới nhất của mỗi path luôn được giữ
+        if (policy.keep_last && rank < policy.keep_last) keep = 1;
+        if (policy.keep_days && age < (int64_t)policy.keep_days * 86400) keep = 1;
+        if (policy.thin) {
+            if (age < 86400) {
+                keep = 1;
+            } else {
+                // Bucket theo giờ (1-7 ngày) hoặc theo ngày; giữ bản mới nhất mỗi bucket.
+                // Bucket ngày được đánh số âm để không trùng bucket giờ.
+                int64_t bucket = age < 7 * 86400 ? v->created / 3600 : -2 - v->created / 86400;
+                if (bucket != last_bucket) keep = 1;
+                last_bucket = bucket;
+            }
+        }
+        v->keep = keep;
+        rank++;
+    }
+}
+
+// ---- 3. đóng gói ----
+
+static int packer_commit(struct packer *p) {
+    if (!p->w) return 0;
+    int res = pack_writer_commit(p->w);
+    p->w = NULL;
+    if (res == 0) {
+        p->report->packs_written++;
+        for (size_t i = 0; i < p->nloose; i++) {
+            if (unlinkat(vs_backup_fd(), p->loose[i], 0) == 0) p->report->packed++;
+        }
+    } else {
+        fprintf(stderr, "[WARN] Backup maintenance: cannot write pack: %s\n", strerror(-res));
+        p->failed = 1;
+    }
+    for (size_t i = 0; i < p->nloose; i++) free(p->loose[i]);
+    p->nloose = 0;
+    return res;
+}
+
+static int packer_ready(struct packer *p) {
+    if (p->w && pack_writer_size(p->w) >= PACK_TARGET_SIZE && packer_commit(p) != 0) return -EIO;
+    if (!p->w && !(p->w = pack_writer_new())) {
+        p->failed = 1;
+        return -EIO;
+    }
+    return 0;
+}
+
+static int packer_add_loose(struct packer *p, const uint8_t key[SHA256_DIGEST_LEN], int type,
+                            const char *name, const char *rel) {
+    void *data = NULL;
+    size_t len = 0;
+    int res = read_loose(vs_backup_fd(), rel, &data, &len);
+    if (res == -ENOENT) return 0;       // file loose đã biến mất: không có gì để đóng gói
+    if (res != 0) return res;
+
+    if (p->nloose == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 256;
+        char **l = realloc(p->loose, cap * sizeof(*l));
+        if (!l) {
+            free(data);
+            return -ENOMEM;
+        }
+        p->loose = l;
+        p->cap = cap;
+    }
+    char *copy = strdup(rel);
+    res = copy ? packer_ready(p) : -ENOMEM;
+    if (res == 0) res = pack_writer_add(p->w, key, type, name, data, len);
+    free(data);
+    if (res != 0) {
+        free(copy);
+        return res;
+    }
+    p->loose[p->nloose++] = copy;
+    return 0;
+}
+
+static int packer_copy(struct packer *p, uint32_t id, const struct pack_entry *e) {
+    int res = packer_ready(p);
+    return res ? res : pack_writer_copy(p->w, id, e);
+}
+
+// ---- chu kỳ ----
+
+static void free_versions(struct version_list *l) {
+    for (size_t i = 0; i < l->n; i++) {
+        free(l->v[i].name);
+        free(l->v[i].path);
+    }
+    free(l->v);
+}
+
+// Chunk mà các version được giữ còn trỏ tới; -errno nếu không đọc được
+// một manifest (khi đó không xóa chunk nào)
+static int mark_live(const struct version_list *l, struct vs_digest_set *live) {
+    for (size_t i = 0; i < l->n; i++) {
+        if (!l->v[i].keep) continue;
+        struct vs_manifest m;
+        int res = vs_manifest_load(l->v[i].name, &m);
+        if (res != 0) return res;
+        for (uint32_t c = 0; c < m.hdr.chunk_count && res == 0; c++) res = vs_set_add(live, m.digests[c]);
+        vs_manifest_free(&m);
+        if (res != 0) return res;
+    }
+    return 0;
+}
+
+// Chunk rời: chết -> dead, còn sống -> đóng gói (nếu pack_loose)
+static int scan_loose_chunks(const struct vs_digest_set *live, int have_live, struct packer *p,
+                             int pack_loose, uint8_t (**dead)[SHA256_DIGEST_LEN], size_t *ndead,
+                             size_t *nlive) {
+    size_t cap = 0;
+    int res = 0;
+    for (int b = 0; b < 256 && res == 0; b++) {
+        char dir[32];
+        snprintf(dir, sizeof(dir), "chunks/%02x", b);
+        int fd = openat(vs_backup_fd(), dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) continue;
+        DIR *d = fdopendir(fd);
+        if (!d) {
+            close(fd);
+            continue;
+        }
+        struct dirent *de;
+        while (res == 0 && (de = readdir(d)) != NULL) {
+            uint8_t digest[SHA256_DIGEST_LEN];
+            if (parse_hex_digest(de->d_name, digest) != 0) continue;
+            if (have_live && !vs_set_has(live, digest)) {
+                if (*ndead == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    uint8_t (*n)[SHA256_DIGEST_LEN] = realloc(*dead, cap * SHA256_DIGEST_LEN);
+                    if (!n) {
+                        res = -ENOMEM;
+                        break;
+                    }
+                    *dead = n;
+                }
+                memcpy((*dead)[(*ndead)++], digest, SHA256_DIGEST_LEN);
+            } else {
+                (*nlive)++;
+                if (pack_loose) {
+                    char rel[PATH_MAX];
+                    chunk_rel(rel, digest);
+                    res = packer_add_loose(p, digest, PACK_CHUNK, NULL, rel);
+                }
+            }
+        }
+        closedir(d);
+    }
+    return res;
+}
+
+static int entry_dead(const struct pack_entry *e, const struct vs_digest_set *dead_manifests,
+                      const struct vs_digest_set *live, int have_live) {
+    if (e->type == PACK_MANIFEST) return vs_set_has(dead_manifests, e->key);
+    return have_live && !vs_set_has(live, e->key);
+}
+
+// 1 = pack manifest, 0 = pack chunk
+static int pack_kind(const struct pack_info *p) {
+    for (uint32_t j = 0; j < p->count; j++)
+        if (p->entries[j].type == PACK_MANIFEST) return 1;
+    return 0;
+}
+
+int bm_run(struct bm_report *report) {
+    struct bm_report local;
+    if (!report) report = &local;
+    memset(report, 0, sizeof(*report));
+    if (vs_backup_fd() == -1) return -EINVAL;
+
+    pthread_mutex_lock(&run_lock);
+    pack_cleanup();
+    vs_gc_begin();
+
+    int res = 0;
+    int have_live = 0, pack_loose = 0;
+    int dirfd = vs_backup_fd();
+    struct version_list versions = {0};
+    struct vs_digest_set dead_manifests = {0}, live = {0};
+    uint8_t (*dead_chunks)[SHA256_DIGEST_LEN] = NULL;
+    size_t ndead_chunks = 0, nloose_chunks = 0;
+    // Manifest và chunk vào pack riêng: pack manifest nhỏ, viết lại ngay khi
+    // có version bị xóa; pack chunk chỉ khi phần lớn là rác
+    struct packer packers[2] = { { .report = report }, { .report = report } };
+    struct pack_info *packs = NULL;
+    size_t npacks = 0;
+    struct dropped_pack *drops = NULL;
+    size_t ndrops = 0;
+
+    // 1. Liệt kê + retention
+    res = vs_list(collect_version, &versions);
+    if (res == 0) res = versions.error;
+    if (res != 0) goto out;
+    report->versions = versions.n;
+    apply_policy(&versions, time(NULL));
+
+    for (size_t i = 0; i < versions.n; i++) {
+        struct version *v = &versions.v[i];
+        if (v->keep) {
+            // Đối chiếu catalog: version lưu ngay trước một lần crash có thể
+            // chưa kịp vào log (đã có thì không làm gì)
+            vc_add(v->path, v->name, v->created, v->size);
+            continue;
+        }
+        vc_remove(v->path, v->name);
+        uint8_t key[SHA256_DIGEST_LEN];
+        sha256(v->name, strlen(v->name), key);
+        // Có thể còn bản trong pack (lần trước dừng giữa commit và unlink)
+        if (vs_set_add(&dead_manifests, key) != 0) {
+            res = -ENOMEM;
+            goto out;
+        }
+        if (!v->packed) unlinkat(dirfd, v->name, 0);
+        report->pruned++;
+    }
+
+    // 2. Mark: chỉ cần khi có version bị xóa (hoặc lần đầu, dọn rác cũ)
+    if (report->pruned > 0 || full_gc_pending) {
+        res = mark_live(&versions, &live);
+        if (res != 0) {
+            fprintf(stderr, "[WARN] Backup maintenance: cannot read a manifest (%s), skipping GC\n", strerror(-res));
+            vs_set_free(&live);
+            res = 0;
+        } else {
+            have_live = 1;
+        }
+    }
+
+    // 3. Pack nào phải viết lại: chứa manifest đã xóa, phần lớn là rác,
+    // hoặc quá nhỏ (gộp các pack nhỏ cùng loại)
+    if (pack_snapshot(&packs, &npacks) != 0) npacks = 0;
+    size_t nsmall[2] = { 0, 0 };
+    for (size_t i = 0; i < npacks; i++)
+        if (packs[i].size < PACK_TARGET_SIZE / 8) nsmall[pack_kind(&packs[i])]++;
+    drops = calloc(npacks ? npacks : 1, sizeof(*drops));
+    if (!drops) {
+        res = -ENOMEM;
+        goto out;
+    }
+    for (size_t i = 0; i < npacks; i++) {
+        uint64_t dead_bytes = 0;
+        int dead_manifest = 0;
+        for (uint32_t j = 0; j < packs[i].count; j++) {
+            const struct pack_entry *e = &packs[i].entries[j];
+            if (!entry_dead(e, &dead_manifests, &live, have_live)) continue;
+            dead_bytes += e->stored_len;
+            if (e->type == PACK_MANIFEST) dead_manifest = 1;
+        }
+        int small = packs[i].size < PACK_TARGET_SIZE / 8 && nsmall[pack_kind(&packs[i])] >= 2;
+        if (dead_manifest || dead_bytes * 2 > packs[i].size || small) drops[ndrops++].id = packs[i].id;
+    }
+
+    // 4. Đếm object rời còn sống để quyết định có đóng gói không
+    size_t nloose_manifests = 0;
+    for (size_t i = 0; i < versions.n; i++)
+        if (versions.v[i].keep && !versions.v[i].packed) nloose_manifests++;
+    res = scan_loose_chunks(&live, have_live, &packers[0], 0, &dead_chunks, &ndead_chunks, &nloose_chunks);
+    if (res != 0) goto out;
+    pack_loose = nloose_chunks + nloose_manifests >= BM_PACK_MIN_OBJECTS || ndrops > 0;
+
+    if (pack_loose) {
+        // Pack bị viết lại: chép record còn sống, nhớ chunk bỏ lại để kiểm tra pin
+        for (size_t d = 0; d < ndrops && res == 0; d++) {
+            struct pack_info *pi = packs;
+            while (pi->id != drops[d].id) pi++;
+            drops[d].dead = malloc((pi->count ? pi->count : 1) * (size_t)SHA256_DIGEST_LEN);
+            if (!drops[d].dead) {
+                res = -ENOMEM;
+                break;
+            }
+            for (uint32_t j = 0; j < pi->count && res == 0; j++) {
+                const struct pack_entry *e = &pi->entries[j];
+                if (!entry_dead(e, &dead_manifests, &live, have_live))
+                    res = packer_copy(&packers[e->type == PACK_MANIFEST], pi->id, e);
+                else if (e->type == PACK_CHUNK) memcpy(drops[d].dead[drops[d].ndead++], e->key, SHA256_DIGEST_LEN);
+            }
+        }
+        // Manifest rời còn giữ
+        for (size_t i = 0; i < versions.n && res == 0; i++) {
+            struct version *v = &versions.v[i];
+            if (!v->keep || v->packed) continue;
+            uint8_t key[SHA256_DIGEST_LEN];
+            sha256(v->name, strlen(v->name), key);
+            res = packer_add_loose(&packers[1], key, PACK_MANIFEST, v->name, v->name);
+        }
+        // Chunk rời còn sống (lần quét thứ hai, lần này đóng gói)
+        if (res == 0) {
+            size_t ignored = 0, nd = 0;
+            uint8_t (*d2)[SHA256_DIGEST_LEN] = NULL;
+            res = scan_loose_chunks(&live, have_live, &packers[0], 1, &d2, &nd, &ignored);
+            free(d2);
+        }
+        for (int k = 0; k < 2 && res == 0; k++) res = packer_commit(&packers[k]);
+    }
+
+    // 5. Xóa: chunk rời chết và pack đã được chép sang pack mới
+    if (have_live && ndead_chunks > 0) {
+        for (size_t i = 0; i < ndead_chunks; i += BM_DELETE_BATCH) {
+            vs_gc_lock();
+            for (size_t j = i; j < ndead_chunks && j < i + BM_DELETE_BATCH; j++) {
+                char rel[PATH_MAX];
+                if (vs_gc_pinned(dead_chunks[j])) continue;
+                chunk_rel(rel, dead_chunks[j]);
+                if (unlinkat(dirfd, rel, 0) == 0) report->chunks_freed++;
+            }
+            vs_gc_unlock();
+        }
+    }
+    if (pack_loose && res == 0 && !packers[0].failed && !packers[1].failed) {
+        for (size_t d = 0; d < ndrops; d++) {
+            vs_gc_lock();
+            int pinned = 0;
+            for (size_t j = 0; j < drops[d].ndead && !pinned; j++) pinned = vs_gc_pinned(drops[d].dead[j]);
+            // Chunk bị bỏ lại vừa được dùng lại: giữ pack tới lần sau
+            if (!pinned && pack_drop(drops[d].id) == 0) {
+                report->packs_dropped++;
+                report->chunks_freed += drops[d].ndead;
+            }
+            vs_gc_unlock();
+        }
+    }
+    if (have_live) full_gc_pending = 0;
+    vc_compact();
+
+out:
+    vs_gc_end();
+    pthread_mutex_unlock(&run_lock);
+    for (int k = 0; k < 2; k++) {
+        if (packers[k].w) pack_writer_abort(packers[k].w);
+        for (size_t i = 0; i < packers[k].nloose; i++) free(packers[k].loose[i]);
+        free(packers[k].loose);
+    }
+    for (size_t d = 0; d < ndrops; d++) free(drops[d].dead);
+    free(drops);
+    if (packs) pack_snapshot_free(packs, npacks);
+    free(dead_chunks);
+    vs_set_free(&live);
+    vs_set_free(&dead_manifests);
+    free_versions(&versions);
+    return res;
+}
+
+// ---- thread nền ----
+
+static void *maint_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&maint_lock);
+    while (!maint_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval;
+        while (!maint_stop && pthread_cond_timedwait(&maint_cond, &maint_lock, &deadline) != ETIMEDOUT);
+        if (maint_stop) break;
+        pthread_mutex_unlock(&maint_lock);
+
+        struct bm_report r;
+        int res = bm_run(&r);
+        if (res != 0) {
+            fprintf(stderr, "[WARN] Backup maintenance failed: %s\n", strerror(-res));
+        } else if (r.pruned || r.chunks_freed || r.packed || r.packs_dropped) {
+            fprintf(stderr, "[INFO] Backup maintenance: %zu versions, %zu pruned, %zu chunks freed, "
+                    "%zu objects packed, %zu packs written, %zu dropped\n",
+                    r.versions, r.pruned, r.chunks_freed, r.packed, r.packs_written, r.packs_dropped);
+        }
+
+        pthread_mutex_lock(&maint_lock);
+    }
+    pthread_mutex_unlock(&maint_lock);
+    return NULL;
+}
+
+int bm_start(void) {
+    if (interval == 0 || maint_running) return 0;
+    maint_stop = 0;
+    if (pthread_create(&maint_thread, NULL, maint_main, NULL) != 0) return -1;
+    maint_running = 1;
+    return 0;
+}
+
+void bm_stop(void) {
+    if (!maint_running) return;
+    pthread_mutex_lock(&maint_lock);
+    maint_stop = 1;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_lock);
+    // Chu kỳ đang chạy dở được làm xong (không để pack tạm lại)
+    pthread_join(maint_thread, NULL);
+    maint_running = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef BACKUP_MAINT_H
+#define BACKUP_MAINT_H
+
+#include <stddef.h>
+
+// Background maintenance of the backup store (.backup).
+//
+// Each cycle, run by its own thread every --maint-interval seconds:
+//   1. retention: deletes versions the policy no longer keeps (the newest
+//      version of every path is always kept);
+//   2. garbage collection: chunks no remaining version references are
+//      deleted, loose or packed;
+//   3. packing: loose chunks and manifests are compressed into pack files
+//      (pack_file.h) and removed, and packs that are mostly garbage or
+//      small are rewritten together.
+// With no retention option set, nothing is ever deleted, only packed.
+
+#define BM_DEFAULT_INTERVAL 600         // giây
+#define BM_PACK_MIN_OBJECTS 256         // ít object rời hơn thì để lần sau
+
+struct bm_policy {
+    unsigned keep_last;                 // N newest versions per path (0 = off)
+    unsigned keep_days;                 // every version younger than D days (0 = off)
+    int thin;                           // older than 1 day: one per hour, older than 7 days: one per day
+};
+
+struct bm_report {
+    size_t versions;                    // versions seen
+    size_t pruned;                      // versions deleted by retention
+    size_t chunks_freed;                // unreferenced chunks deleted
+    size_t packed;                      // loose objects moved into packs
+    size_t packs_written;
+    size_t packs_dropped;
+};
+
+void bm_set_policy(const struct bm_policy *policy);
+// Seconds between cycles; 0 disables the thread
+void bm_set_interval(unsigned seconds);
+
+// One full cycle in the calling thread
+int bm_run(struct bm_report *report);
+
+// Start after fuse has daemonized (init), stop in destroy
+int bm_start(void);
+void bm_stop(void);
+
+#endif
@@ -0,0 +1,778 @@
+/*
+ * vfs_bench.c
+ * In-process benchmark of the high-level backend: calls the vfs_operations
+ * function pointers directly (fuse_get_context and the fuse_buf helpers are
+ * stubbed below), so it needs neither /dev/fuse nor root, only the fuse
+ * headers.
+ *
+ * A source tree of --files files of --file-size bytes, spread over
+ * directories --fanout wide and --depth deep, is generated in a work
+ * directory, which also holds .vfs_storage and .backup like a real mount.
+ * Every benchmark runs with 1 thread and with --threads threads and
+ * reports ops/sec and p50/p99/p999 latency.
+ *
+ * --layers=N stacks N-1 extra lower layers above that tree, each with the
+ * same directories and a few files of its own, so every lookup has to get
+ * past them (the "lookup" benchmark measures uncached lookups).
+ *
+ * --csv prints machine-readable results; --baseline=FILE compares against
+ * such a file and exits 1 when ops/sec dropped by more than --tolerance
+ * percent, so a saved run can serve as a regression gate.
+ */
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "operations.h"
+#include "logging.h"
+#include "version_store.h"
+#include "version_catalog.h"
+#include "path_cache.h"
+#include "path_lock.h"
+#include "dir_cache.h"
+#include "whiteout.h"
+#include "lazy_copy.h"
+#include "write_buffer.h"
+#include "block_cache.h"
+#include "backup_maint.h"
+#include "layers.h"
+
+// main.c không được link: các biến toàn cục nó định nghĩa nằm ở đây
+char g_source_dir[PATH_MAX];
+int g_source_fd = -1;
+int g_storage_fd = -1;
+
+// Thay cho libfuse: mỗi thread là một "process" gọi vào VFS
+static __thread struct fuse_context bench_ctx;
+
+struct fuse_context *fuse_get_context(void) {
+    if (bench_ctx.pid == 0) {
+        bench_ctx.uid = getuid();
+        bench_ctx.gid = getgid();
+        bench_ctx.pid = getpid();
+    }
+    return &bench_ctx;
+}
+
+// read_buf/write_buf không được gọi ở đây (cần /dev/fuse để splice), chỉ để link
+size_t fuse_buf_size(const struct fuse_bufvec *bufv) {
+    size_t size = 0;
+    for (size_t i = 0; i < bufv->count; i++) size += bufv->buf[i].size;
+    return size;
+}
+
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags) {
+    (void)dst; (void)src; (void)flags;
+    return -ENOSYS;
+}
+
+#define MAX_RESULTS 64
+
+static struct {
+    unsigned files;
+    unsigned depth;
+    unsigned fanout;
+    long long file_size;
+    long long io_size;
+    unsigned threads;
+    unsigned ops;
+    unsigned copyup_ops;
+    unsigned layers;
+    const char *dir;
+    const char *only;
+    const char *baseline;
+    unsigned tolerance;
+    int csv;
+    int keep;
+} opt = {
+    .files = 2000, .depth = 3, .fanout = 8, .file_size = 4096, .io_size = 4096,
+    .threads = 0, .ops = 20000, .copyup_ops = 500, .layers = 1, .tolerance = 20,
+};
+
+static char **files;        // FUSE path của file Source ("/d0/d3/f12")
+static char **dirs;         // mọi thư mục, kể cả "/"
+static unsigned ndirs;
+
+struct result {
+    char name[16];
+    unsigned threads;
+    unsigned long long ops;
+    unsigned long long errors;
+    double ops_per_sec;
+    double p50, p99, p999;  // micro giây
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+struct bench;
+
+struct worker {
+    const struct bench *b;
+    unsigned id;
+    unsigned run;           // chỉ số lần chạy (copy-up dùng file riêng mỗi lần)
+    unsigned ops;
+    uint64_t *lat;          // ns
+    unsigned long long errors;
+    uint64_t rng;
+    void *state;
+    pthread_barrier_t *start;
+};
+
+struct bench {
+    const char *name;
+    int (*setup)(struct worker *w);         // không tính giờ
+    int (*op)(struct worker *w, unsigned i);
+    void (*teardown)(struct worker *w);
+    unsigned (*ops)(void);                  // số op mỗi thread
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_rand(struct worker *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ull;
+}
+
+static int parse_size(const char *name, const char *v, long long *out) {
+    char *end;
+    long long n = strtoll(v, &end, 10);
+    if (*end == 'K' || *end == 'k') { n <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { n <<= 20; end++; }
+    else if (*end == 'G' || *end == 'g') { n <<= 30; end++; }
+    if (end == v || *end != '\0' || n < 0) {
+        fprintf(stderr, "Invalid --%s '%s' (bytes, K/M/G suffix allowed)\n", name, v);
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+static int parse_count(const char *name, const char *v, unsigned *out) {
+    char *end;
+    long n = strtol(v, &end, 10);
+    if (end == v || *end != '\0' || n < 0 || n > 100000000) {
+        fprintf(stderr, "Invalid --%s '%s'\n", name, v);
+        return -1;
+    }
+    *out = (unsigned)n;
+    return 0;
+}
+
+// ---- cây Source ----
+
+static int write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -errno;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n == -1) {
+            int err = -errno;
+            close(fd);
+            return err;
+        }
+        done += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static int add_dir(const char *path, char ***list, unsigned *n, unsigned *cap) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        char **l = realloc(*list, *cap * sizeof(*l));
+        if (!l) return -ENOMEM;
+        *list = l;
+    }
+    (*list)[(*n)++] = strdup(path);
+    return (*list)[*n - 1] ? 0 : -ENOMEM;
+}
+
+static int mkdir_src(const char *fuse_path) {
+    char real[PATH_MAX];
+    if (snprintf(real, sizeof(real), "src%s", fuse_path) >= (int)sizeof(real)) return -ENAMETOOLONG;
+    return mkdir(real, 0755) == -1 && errno != EEXIST ? -errno : 0;
+}
+
+// Thư mục: fanout^1 + ... + fanout^depth, file chia đều vào các lá
+static int generate_tree(void) {
+    unsigned cap = 0;
+    if (mkdir("src", 0755) == -1 && errno != EEXIST) return -errno;
+    if (add_dir("/", &dirs, &ndirs, &cap) != 0) return -ENOMEM;
+
+    unsigned first_leaf = 0, nleaves = 1;
+    for (unsigned level = 0; level < opt.depth; level++) {
+        unsigned start = ndirs;
+        for (unsigned p = first_leaf; p < first_leaf + nleaves; p++) {
+            for (unsigned k = 0; k < opt.fanout; k++) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s%sd%u", dirs[p], strcmp(dirs[p], "/") ? "/" : "", k);
+                int res = add_dir(path, &dirs, &ndirs, &cap);
+                if (res == 0) res = mkdir_src(path);
+                if (res != 0) return res;
+            }
+        }
+        first_leaf = start;
+        nleaves = ndirs - start;
+    }
+
+    char *data = malloc(opt.file_size ? opt.file_size : 1);
+    files = calloc(opt.files ? opt.files : 1, sizeof(*files));
+    if (!data || !files) return -ENOMEM;
+    for (long long i = 0; i < opt.file_size; i++) data[i] = (char)('a' + i % 26);
+
+    for (unsigned i = 0; i < opt.files; i++) {
+        const char *dir = dirs[first_leaf + i % nleaves];
+        char path[PATH_MAX], real[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%sf%u", dir, strcmp(dir, "/") ? "/" : "", i);
+        int res = snprintf(real, sizeof(real), "src%s", path) >= (int)sizeof(real) ? -ENAMETOOLONG
+                                                                                  : write_file(real, data, opt.file_size);
+        if (res != 0) {
+            free(data);
+            return res;
+        }
+        files[i] = strdup(path);
+        if (!files[i]) return -ENOMEM;
+    }
+
+    // File riêng cho copy-up: mỗi lần chạy, mỗi thread một thư mục, không dùng lại
+    int res = mkdir_src("/copyup");
+    if (res != 0) {
+        free(data);
+        return res;
+    }
+    for (unsigned run = 0; run < 2; run++) {
+        unsigned nthreads = run ? opt.threads : 1;
+        for (unsigned t = 0; t < nthreads; t++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "/copyup/r%u_t%u", run, t);
+            res = mkdir_src(path);
+            for (unsigned k = 0; k < opt.copyup_ops && res == 0; k++) {
+                char real[PATH_MAX];
+                res = snprintf(real, sizeof(real), "src%s/f%u", path, k) >= (int)sizeof(real)
+                          ? -ENAMETOOLONG : write_file(real, data, opt.file_size);
+            }
+            if (res != 0) {
+                free(data);
+                return res;
+            }
+        }
+    }
+    free(data);
+
+    // Layer phía trên: cùng cây thư mục, mỗi thư mục một file riêng của layer
+    for (unsigned k = 1; k < opt.layers; k++) {
+        char real[PATH_MAX];
+        snprintf(real, sizeof(real), "layer%u", k);
+        if (mkdir(real, 0755) == -1 && errno != EEXIST) return -errno;
+        for (unsigned d = 0; d < ndirs; d++) {
+            snprintf(real, sizeof(real), "layer%u%s", k, dirs[d]);
+            if (mkdir(real, 0755) == -1 && errno != EEXIST) return -errno;
+            snprintf(real, sizeof(real), "layer%u%s%so%u", k, dirs[d], strcmp(dirs[d], "/") ? "/" : "", k);
+            res = write_file(real, "x", 1);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
+}
+
+// Mở các layer: layer1 trên cùng, src (cây chính) dưới cùng
+static int open_layers(void) {
+    const char *top = opt.layers > 1 ? "layer1" : "src";
+    if (!realpath(top, g_source_dir)) return -errno;
+    g_source_fd = open(top, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_source_fd == -1) return -errno;
+    layer_init(g_source_fd);
+    for (unsigned k = 2; k <= opt.layers; k++) {
+        char dir[16];
+        if (k < opt.layers) snprintf(dir, sizeof(dir), "layer%u", k);
+        else snprintf(dir, sizeof(dir), "src");
+        int res = layer_add(dir);
+        if (res != 0) return res;
+    }
+    return 0;
+}
+
+// ---- benchmark ----
+
+static unsigned default_ops(void) { return opt.ops; }
+static unsigned copyup_ops(void) { return opt.copyup_ops; }
+
+static int op_getattr(struct worker *w, unsigned i) {
+    (void)i;
+    struct stat st;
+    uint64_t r = next_rand(w);
+    // 1/8 là thư mục
+    const char *path = (r & 7) == 0 ? dirs[(r >> 3) % ndirs] : files[(r >> 3) % opt.files];
+    return vfs_operations.getattr(path, &st);
+}
+
+// Lookup không qua path_cache: Storage + các lower layer (thư mục cha vẫn cache)
+static int op_lookup(struct worker *w, unsigned i) {
+    (void)i;
+    struct stat st;
+    const char *path = files[next_rand(w) % opt.files];
+    path_cache_invalidate(path);
+    return vfs_operations.getattr(path, &st);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+    (void)name; (void)st; (void)off;
+    (*(unsigned *)buf)++;
+    return 0;
+}
+
+static int op_readdir(struct worker *w, unsigned i) {
+    (void)i;
+    const char *path = dirs[next_rand(w) % ndirs];
+    struct fuse_file_info fi;
+    unsigned n = 0;
+    memset(&fi, 0, sizeof(fi));
+    int res = vfs_operations.opendir(path, &fi);
+    if (res != 0) return res;
+    res = vfs_operations.readdir(path, &n, count_entry, 0, &fi);
+    vfs_operations.releasedir(path, &fi);
+    return res != 0 ? res : (n < 2 ? -EIO : 0);
+}
+
+static int op_read(struct worker *w, unsigned i) {
+    (void)i;
+    const char *path = files[next_rand(w) % opt.files];
+    char *buf = w->state;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    int res = vfs_operations.open(path, &fi);
+    if (res != 0) return res;
+    off_t off = 0;
+    for (;;) {
+        res = vfs_operations.read(path, buf, opt.io_size, off, &fi);
+        if (res <= 0) break;
+        off += res;
+    }
+    vfs_operations.release(path, &fi);
+    return res < 0 ? res : (off == opt.file_size ? 0 : -EIO);
+}
+
+static int setup_buffer(struct worker *w) {
+    w->state = malloc(opt.io_size ? opt.io_size : 1);
+    if (!w->state) return -ENOMEM;
+    memset(w->state, 'w', opt.io_size);
+    return 0;
+}
+
+static void teardown_buffer(struct worker *w) {
+    free(w->state);
+}
+
+// write: mỗi thread ghi vào file riêng (đã nằm ở Storage), handle mở suốt lần chạy
+struct write_state {
+    char path[64];
+    struct fuse_file_info fi;
+    char *buf;
+};
+
+static int setup_write(struct worker *w) {
+    struct write_state *s = calloc(1, sizeof(*s));
+    if (!s) return -ENOMEM;
+    s->buf = malloc(opt.io_size ? opt.io_size : 1);
+    if (!s->buf) {
+        free(s);
+        return -ENOMEM;
+    }
+    memset(s->buf, 'w', opt.io_size);
+    snprintf(s->path, sizeof(s->path), "/bench_write/r%u_t%u", w->run, w->id);
+    s->fi.flags = O_RDWR;
+    int res = vfs_operations.create(s->path, 0644, &s->fi);
+    if (res == 0) res = vfs_operations.truncate(s->path, opt.file_size > opt.io_size ? opt.file_size : opt.io_size);
+    if (res != 0) {
+        free(s->buf);
+        free(s);
+        return res;
+    }
+    w->state = s;
+    return 0;
+}
+
+static int op_write(struct worker *w, unsigned i) {
+    (void)i;
+    struct write_state *s = w->state;
+    long long blocks = opt.file_size > opt.io_size && opt.io_size ? opt.file_size / opt.io_size : 1;
+    off_t off = (off_t)(next_rand(w) % blocks) * opt.io_size;
+    int res = vfs_operations.write(s->path, s->buf, opt.io_size, off, &s->fi);
+    return res == opt.io_size ? 0 : (res < 0 ? res : -EIO);
+}
+
+static void teardown_write(struct worker *w) {
+    struct write_state *s = w->state;
+    vfs_operations.release(s->path, &s->fi);
+    free(s->buf);
+    free(s);
+}
+
+// copy-up: mở để ghi một file Source chưa từng bị đụng tới
+static int op_copyup(struct worker *w, unsigned i) {
+    char path[PATH_MAX];
+    struct fuse_file_info fi;
+    snprintf(path, sizeof(path), "/copyup/r%u_t%u/f%u", w->run, w->id, i);
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    int res = vfs_operations.open(path, &fi);
+    if (res != 0) return res;
+    return vfs_operations.release(path, &fi);
+}
+
+// rename: đổi qua đổi lại tên một file Storage riêng của thread
+struct rename_state {
+    char a[64], b[64];
+};
+
+static int setup_rename(struct worker *w) {
+    struct rename_state *s = malloc(sizeof(*s));
+    if (!s) return -ENOMEM;
+    snprintf(s->a, sizeof(s->a), "/bench_rename/r%u_t%u_a", w->run, w->id);
+    snprintf(s->b, sizeof(s->b), "/bench_rename/r%u_t%u_b", w->run, w->id);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    int res = vfs_operations.create(s->a, 0644, &fi);
+    if (res != 0) {
+        free(s);
+        return res;
+    }
+    vfs_operations.release(s->a, &fi);
+    w->state = s;
+    return 0;
+}
+
+static int op_rename(struct worker *w, unsigned i) {
+    struct rename_state *s = w->state;
+    return i % 2 == 0 ? vfs_operations.rename(s->a, s->b) : vfs_operations.rename(s->b, s->a);
+}
+
+static void teardown_rename(struct worker *w) {
+    free(w->state);
+}
+
+static const struct bench benches[] = {
+    { "getattr", NULL, op_getattr, NULL, default_ops },
+    { "lookup", NULL, op_lookup, NULL, default_ops },
+    { "readdir", NULL, op_readdir, NULL, default_ops },
+    { "read", setup_buffer, op_read, teardown_buffer, default_ops },
+    { "write", setup_write, op_write, teardown_write, default_ops },
+    { "rename", setup_rename, op_rename, teardown_rename, default_ops },
+    { "copyup", NULL, op_copyup, NULL, copyup_ops },
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    pthread_barrier_wait(w->start);
+    for (unsigned i = 0; i < w->ops; i++) {
+        uint64_t t0 = now_ns();
+        int res = w->b->op(w, i);
+        w->lat[i] = now_ns() - t0;
+        if (res != 0) w->errors++;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static int run_bench(const struct bench *b, unsigned run, unsigned nthreads) {
+    unsigned ops = b->ops();
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    pthread_t *tids = calloc(nthreads, sizeof(*tids));
+    uint64_t *lat = malloc((size_t)nthreads * (ops ? ops : 1) * sizeof(*lat));
+    pthread_barrier_t start;
+    int res = 0;
+    if (!w || !tids || !lat) {
+        free(w);
+        free(tids);
+        free(lat);
+        return -ENOMEM;
+    }
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+
+    unsigned ready = 0;
+    for (; ready < nthreads; ready++) {
+        struct worker *x = &w[ready];
+        x->b = b;
+        x->id = ready;
+        x->run = run;
+        x->ops = ops;
+        x->lat = lat + (size_t)ready * ops;
+        x->rng = 0x9e3779b97f4a7c15ull * (ready + 1) + run;
+        x->start = &start;
+        if (b->setup && (res = b->setup(x)) != 0) {
+            fprintf(stderr, "%s: setup failed: %s\n", b->name, strerror(-res));
+            break;
+        }
+    }
+
+    unsigned started = 0;
+    for (; res == 0 && started < nthreads; started++) {
+        if (pthread_create(&tids[started], NULL, worker_main, &w[started]) != 0) {
+            // Barrier chờ đủ nthreads + 1, không chạy thiếu thread được
+            fprintf(stderr, "%s: cannot start %u threads\n", b->name, nthreads);
+            exit(2);
+        }
+    }
+    if (res != 0) {
+        for (unsigned t = 0; t < ready; t++)
+            if (b->teardown) b->teardown(&w[t]);
+        pthread_barrier_destroy(&start);
+        free(w);
+        free(tids);
+        free(lat);
+        return res;
+    }
+
+    uint64_t t0 = now_ns();
+    pthread_barrier_wait(&start);
+    for (unsigned t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    uint64_t elapsed = now_ns() - t0;
+    pthread_barrier_destroy(&start);
+
+    for (unsigned t = 0; t < nthreads; t++)
+        if (b->teardown) b->teardown(&w[t]);
+
+    if (nresults < MAX_RESULTS) {
+        struct result *r = &results[nresults++];
+        size_t n = (size_t)nthreads * ops;
+        snprintf(r->name, sizeof(r->name), "%s", b->name);
+        r->threads = nthreads;
+        r->ops = n;
+        for (unsigned t = 0; t < nthreads; t++) r->errors += w[t].errors;
+        r->ops_per_sec = elapsed ? n * 1e9 / elapsed : 0;
+        qsort(lat, n, sizeof(*lat), cmp_u64);
+        r->p50 = percentile_us(lat, n, 0.50);
+        r->p99 = percentile_us(lat, n, 0.99);
+        r->p999 = percentile_us(lat, n, 0.999);
+
+        if (opt.csv) {
+            printf("%s,%u,%llu,%.0f,%.2f,%.2f,%.2f,%llu\n", r->name, r->threads, r->ops,
+                   r->ops_per_sec, r->p50, r->p99, r->p999, r->errors);
+        } else {
+            printf("%-8s %4u %9llu %12.0f %10.2f %10.2f %10.2f %7llu\n", r->name, r->threads, r->ops,
+                   r->ops_per_sec, r->p50, r->p99, r->p999, r->errors);
+        }
+        fflush(stdout);
+    }
+    free(w);
+    free(tids);
+    free(lat);
+    return 0;
+}
+
+// So với một lần chạy --csv trước đó; 1 nếu có benchmark chậm đi quá tolerance
+static int check_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open baseline %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    int regressed = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char name[16];
+        unsigned threads;
+        double ops_per_sec;
+        if (sscanf(line, "%15[^,],%u,%*u,%lf", name, &threads, &ops_per_sec) != 3) continue;
+        for (int i = 0; i < nresults; i++) {
+            const struct result *r = &results[i];
+            if (strcmp(r->name, name) != 0 || r->threads != threads) continue;
+            double floor = ops_per_sec * (100 - opt.tolerance) / 100.0;
+            if (r->ops_per_sec < floor) {
+                fprintf(stderr, "REGRESSION %s/%u: %.0f ops/s, baseline %.0f (-%u%% allowed)\n",
+                        name, threads, r->ops_per_sec, ops_per_sec, opt.tolerance);
+                regressed = 1;
+            }
+        }
+    }
+    fclose(f);
+    return regressed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--files=N] [--depth=N] [--fanout=N] [--file-size=SIZE] [--io-size=SIZE]\n"
+            "          [--threads=N] [--ops=N] [--copyup-ops=N] [--only=NAME[,NAME]] [--dir=PATH] [--keep]\n"
+            "          [--lazy-copyup=SIZE] [--writeback=SIZE] [--block-cache=SIZE]\n"
+            "          [--layers=N] [--layer-index=auto|on|off]\n"
+            "          [--csv] [--baseline=FILE] [--tolerance=PCT]\n"
+            "Benchmarks: getattr lookup readdir read write rename copyup\n", prog);
+}
+
+static int parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        long long v;
+        int res = 0;
+        if (strncmp(a, "--files=", 8) == 0) res = parse_count("files", a + 8, &opt.files);
+        else if (strncmp(a, "--depth=", 8) == 0) res = parse_count("depth", a + 8, &opt.depth);
+        else if (strncmp(a, "--fanout=", 9) == 0) res = parse_count("fanout", a + 9, &opt.fanout);
+        else if (strncmp(a, "--file-size=", 12) == 0) res = parse_size("file-size", a + 12, &opt.file_size);
+        else if (strncmp(a, "--io-size=", 10) == 0) res = parse_size("io-size", a + 10, &opt.io_size);
+        else if (strncmp(a, "--threads=", 10) == 0) res = parse_count("threads", a + 10, &opt.threads);
+        else if (strncmp(a, "--ops=", 6) == 0) res = parse_count("ops", a + 6, &opt.ops);
+        else if (strncmp(a, "--copyup-ops=", 13) == 0) res = parse_count("copyup-ops", a + 13, &opt.copyup_ops);
+        else if (strncmp(a, "--layers=", 9) == 0) res = parse_count("layers", a + 9, &opt.layers);
+        else if (strncmp(a, "--tolerance=", 12) == 0) res = parse_count("tolerance", a + 12, &opt.tolerance);
+        else if (strncmp(a, "--only=", 7) == 0) opt.only = a + 7;
+        else if (strncmp(a, "--dir=", 6) == 0) opt.dir = a + 6;
+        else if (strncmp(a, "--baseline=", 11) == 0) opt.baseline = a + 11;
+        else if (strcmp(a, "--csv") == 0) opt.csv = 1;
+        else if (strcmp(a, "--keep") == 0) opt.keep = 1;
+        else if (strncmp(a, "--lazy-copyup=", 14) == 0) {
+            if ((res = parse_size("lazy-copyup", a + 14, &v)) == 0) lazy_set_threshold((off_t)v);
+        } else if (strncmp(a, "--writeback=", 12) == 0) {
+            if ((res = parse_size("writeback", a + 12, &v)) == 0) wb_set_budget((size_t)v);
+        } else if (strncmp(a, "--block-cache=", 14) == 0) {
+            if ((res = parse_size("block-cache", a + 14, &v)) == 0) bc_set_budget((size_t)v);
+        } else if (strcmp(a, "--layer-index=auto") == 0) {
+            layer_set_index(LAYER_INDEX_AUTO);
+        } else if (strcmp(a, "--layer-index=on") == 0) {
+            layer_set_index(LAYER_INDEX_ON);
+        } else if (strcmp(a, "--layer-index=off") == 0) {
+            layer_set_index(LAYER_INDEX_OFF);
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+        if (res != 0) return -1;
+    }
+    if (opt.files == 0 || opt.fanout == 0 || opt.layers == 0 || opt.layers > LAYER_MAX || opt.io_size == 0 || opt.tolerance > 100) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (opt.threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        opt.threads = n > 1 ? (unsigned)n : 2;
+    }
+    return 0;
+}
+
+static int selected(const char *name) {
+    if (!opt.only) return 1;
+    size_t len = strlen(name);
+    for (const char *p = opt.only; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == opt.only || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv) != 0) return 2;
+
+    char tmpl[] = "/tmp/vfs_bench.XXXXXX";
+    char workdir[PATH_MAX];
+    if (opt.dir) {
+        if (mkdir(opt.dir, 0755) == -1 && errno != EEXIST) {
+            perror("Error creating work directory");
+            return 2;
+        }
+        snprintf(workdir, sizeof(workdir), "%s", opt.dir);
+    } else if (mkdtemp(tmpl)) {
+        snprintf(workdir, sizeof(workdir), "%s", tmpl);
+    } else {
+        perror("Error creating work directory");
+        return 2;
+    }
+    if (chdir(workdir) == -1) {
+        perror("Error entering work directory");
+        return 2;
+    }
+    // Mỗi lần chạy bắt đầu từ trạng thái sạch như lúc mount
+    if (system("rm -rf src layer* " STORAGE_DIR " " BACKUP_DIR " bench.log") != 0) {
+        fprintf(stderr, "Cannot clean %s\n", workdir);
+        return 2;
+    }
+
+    if (!opt.csv) fprintf(stderr, "[INFO] Generating %u files of %lld bytes in %s...\n", opt.files, opt.file_size, workdir);
+    int res = generate_tree();
+    if (res != 0) {
+        fprintf(stderr, "Error generating source tree: %s\n", strerror(-res));
+        return 2;
+    }
+
+    if (mkdir(STORAGE_DIR, 0755) == -1 && errno != EEXIST) return 2;
+    g_storage_fd = open(STORAGE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (open_layers() != 0 || g_storage_fd == -1) {
+        perror("Error opening layers");
+        return 2;
+    }
+
+    // Như main.c, trừ thread bảo trì backup (nhiễu số đo)
+    init_logging("bench.log");
+    path_cache_init();
+    path_lock_init();
+    dir_cache_init();
+    wo_init();
+    if (vs_init(BACKUP_DIR) != 0) {
+        perror("Error preparing backup store");
+        return 2;
+    }
+    vc_init(vs_backup_fd());
+    bm_set_interval(0);
+    if (vfs_operations.init) vfs_operations.init(NULL);
+    // Đo khi name index đã dựng xong, không đo lúc còn fstatat từng layer
+    layer_index_wait();
+
+    if (opt.csv) printf("name,threads,ops,ops_per_sec,p50_us,p99_us,p999_us,errors\n");
+    else printf("%-8s %4s %9s %12s %10s %10s %10s %7s\n", "bench", "thr", "ops", "ops/s", "p50(us)", "p99(us)", "p999(us)", "errors");
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (!selected(benches[i].name)) continue;
+        for (unsigned run = 0; run < 2; run++) {
+            unsigned nthreads = run ? opt.threads : 1;
+            if (run && nthreads == 1) break;
+            if (run_bench(&benches[i], run, nthreads) != 0) failed = 1;
+        }
+    }
+    for (int i = 0; i < nresults; i++)
+        if (results[i].errors) failed = 1;
+
+    if (vfs_operations.destroy) vfs_operations.destroy(NULL);
+
+    int regressed = opt.baseline ? check_baseline(opt.baseline) : 0;
+
+    if (!opt.keep) {
+        close(g_source_fd);
+        close(g_storage_fd);
+        if (chdir("/") == 0 && !opt.dir) {
+            char cmd[PATH_MAX + 16];
+            snprintf(cmd, sizeof(cmd), "rm -rf '%s'", workdir);
+            if (system(cmd) != 0) fprintf(stderr, "[WARN] Cannot remove %s\n", workdir);
+        }
+    }
+    if (failed) fprintf(stderr, "Some operations failed (see errors column)\n");
+    return regressed ? regressed : failed;
+}
@@ -0,0 +1,557 @@
+/*
+ * block_cache.c
+ * Source-layer block cache, see block_cache.h.
+ *
+ * Each shard owns a slice of the page arena, a hash of resident blocks,
+ * the two 2Q queues and a ring of ghost keys. Lists are linked by page
+ * index so the whole bookkeeping lives in a few flat arrays. A miss takes
+ * a page off the free list (or evicts one), drops the shard lock for the
+ * pread and re-checks on return: two readers missing the same block both
+ * read it, the second one just gives its page back.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "block_cache.h"
+
+#define BC_RA_THREADS 2
+#define BC_RA_QUEUE 256
+
+enum { Q_NONE = 0, Q_FREE, Q_A1IN, Q_AM };
+
+struct bc_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t blk;
+};
+
+struct bc_page {
+    struct bc_key key;
+    int64_t mtime_ns;           // mtime của file Source lúc đọc block
+    uint32_t len;               // số byte hợp lệ (< BC_BLOCK_SIZE ở cuối file)
+    int queue;
+    int32_t prev, next;         // trong free / A1in / Am
+    int32_t hnext;              // chuỗi hash
+};
+
+struct bc_ghost {
+    struct bc_key key;
+    int used;
+    int32_t hnext;
+};
+
+struct bc_list {
+    int32_t head, tail;         // head = mới nhất
+    int count;
+};
+
+struct bc_shard {
+    pthread_mutex_t lock;
+    struct bc_page *pages;
+    char *data;
+    int npages;
+    int kin;                    // kích thước mục tiêu của A1in
+    int32_t *buckets;
+    int32_t *gbuckets;
+    int nbuckets;
+    struct bc_list free, a1in, am;
+    struct bc_ghost *ghosts;    // A1out: vòng FIFO chỉ giữ key
+    int nghosts;
+    int ghost_pos;
+};
+
+struct ra_fd {
+    int fd;
+    int refs;
+};
+
+struct ra_req {
+    struct ra_fd *rf;
+    struct bc_key key;
+    int64_t mtime_ns;
+};
+
+static size_t bc_budget = 0;
+static struct bc_shard shards[BC_SHARDS];
+static char *arena = NULL;
+static size_t arena_size = 0;
+static size_t total_pages = 0;
+
+static uint64_t stat_hits = 0, stat_misses = 0, stat_readahead = 0, stat_evictions = 0;
+
+static struct ra_req ra_queue[BC_RA_QUEUE];
+static int ra_head = 0, ra_count = 0;
+static int ra_stop = 0;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t ra_threads[BC_RA_THREADS];
+static int ra_running = 0;
+
+void bc_set_budget(size_t bytes) {
+    bc_budget = bytes;
+}
+
+int bc_enabled(void) {
+    return arena != NULL;
+}
+
+static uint64_t key_hash(const struct bc_key *k) {
+    uint64_t h = k->ino * 0x9E3779B97F4A7C15ULL;
+    h ^= k->dev + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+    h ^= k->blk * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static int key_eq(const struct bc_key *a, const struct bc_key *b) {
+    return a->blk == b->blk && a->ino == b->ino && a->dev == b->dev;
+}
+
+static struct bc_shard *shard_of(const struct bc_key *k, uint64_t *h) {
+    *h = key_hash(k);
+    return &shards[*h % BC_SHARDS];
+}
+
+static size_t bucket_of(struct bc_shard *sh, uint64_t h) {
+    return (h / BC_SHARDS) % (uint64_t)sh->nbuckets;
+}
+
+// ---- danh sách theo index ----
+
+static void list_unlink(struct bc_shard *sh, struct bc_list *l, int32_t i) {
+    struct bc_page *p = &sh->pages[i];
+    if (p->prev >= 0) sh->pages[p->prev].next = p->next; else l->head = p->next;
+    if (p->next >= 0) sh->pages[p->next].prev = p->prev; else l->tail = p->prev;
+    p->prev = p->next = -1;
+    l->count--;
+}
+
+static void list_push(struct bc_shard *sh, struct bc_list *l, int32_t i) {
+    struct bc_page *p = &sh->pages[i];
+    p->prev = -1;
+    p->next = l->head;
+    if (l->head >= 0) sh->pages[l->head].prev = i; else l->tail = i;
+    l->head = i;
+    l->count++;
+}
+
+static struct bc_list *queue_list(struct bc_shard *sh, int q) {
+    switch (q) {
+    case Q_FREE: return &sh->free;
+    case Q_A1IN: return &sh->a1in;
+    case Q_AM: return &sh->am;
+    }
+    return NULL;
+}
+
+// ---- hash trang & ghost ----
+
+static int32_t page_find(struct bc_shard *sh, const struct bc_key *k, uint64_t h) {
+    for (int32_t i = sh->buckets[bucket_of(sh, h)]; i >= 0; i = sh->pages[i].hnext)
+        if (key_eq(&sh->pages[i].key, k)) return i;
+    return -1;
+}
+
+static void page_unhash(struct bc_shard *sh, int32_t i) {
+    int32_t *pp = &sh->buckets[bucket_of(sh, key_hash(&sh->pages[i].key))];
+    while (*pp >= 0 && *pp != i) pp = &sh->pages[*pp].hnext;
+    if (*pp == i) *pp = sh->pages[i].hnext;
+    sh->pages[i].hnext = -1;
+}
+
+static void ghost_unhash(struct bc_shard *sh, int32_t g) {
+    int32_t *pp = &sh->gbuckets[bucket_of(sh, key_hash(&sh->ghosts[g].key))];
+    while (*pp >= 0 && *pp != g) pp = &sh->ghosts[*pp].hnext;
+    if (*pp == g) *pp = sh->ghosts[g].hnext;
+    sh->ghosts[g].used = 0;
+    sh->ghosts[g].hnext = -1;
+}
+
+static void ghost_add(struct bc_shard *sh, const struct bc_key *k) {
+    int32_t g = sh->ghost_pos;
+    sh->ghost_pos = (sh->ghost_pos + 1) % sh->nghosts;
+    if (sh->ghosts[g].used) ghost_unhash(sh, g);
+    size_t b = bucket_of(sh, key_hash(k));
+    sh->ghosts[g].key = *k;
+    sh->ghosts[g].used = 1;
+    sh->ghosts[g].hnext = sh->gbuckets[b];
+    sh->gbuckets[b] = g;
+}
+
+// Xóa key khỏi A1out nếu có; trả 1 nếu có (=> block "nóng", vào thẳng Am)
+static int ghost_take(struct bc_shard *sh, const struct bc_key *k, uint64_t h) {
+    for (int32_t g = sh->gbuckets[bucket_of(sh, h)]; g >= 0; g = sh->ghosts[g].hnext) {
+        if (key_eq(&sh->ghosts[g].key, k)) {
+            ghost_unhash(sh, g);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bỏ trang khỏi cache, trả về free list
+static void page_drop(struct bc_shard *sh, int32_t i) {
+    list_unlink(sh, queue_list(sh, sh->pages[i].queue), i);
+    page_unhash(sh, i);
+    sh->pages[i].queue = Q_FREE;
+    list_push(sh, &sh->free, i);
+}
+
+// Trang trống cho một lần đọc: free list, không thì đuổi theo 2Q.
+// Trang trả về không nằm trong list hay hash nào; -1 nếu mọi trang đang bận.
+static int32_t page_grab(struct bc_shard *sh) {
+    int32_t i;
+    if (sh->free.count > 0) {
+        i = sh->free.tail;
+        list_unlink(sh, &sh->free, i);
+    } else if (sh->a1in.count > 0 && (sh->a1in.count > sh->kin || sh->am.count == 0)) {
+        i = sh->a1in.tail;
+        list_unlink(sh, &sh->a1in, i);
+        page_unhash(sh, i);
+        ghost_add(sh, &sh->pages[i].key);
+        __atomic_add_fetch(&stat_evictions, 1, __ATOMIC_RELAXED);
+    } else if (sh->am.count > 0) {
+        i = sh->am.tail;
+        list_unlink(sh, &sh->am, i);
+        page_unhash(sh, i);
+        __atomic_add_fetch(&stat_evictions, 1, __ATOMIC_RELAXED);
+    } else {
+        return -1;
+    }
+    sh->pages[i].queue = Q_NONE;
+    return i;
+}
+
+// Trang hợp lệ của key (đã bỏ trang cũ nếu file Source bị sửa ngoài VFS)
+static int32_t page_lookup(struct bc_shard *sh, const struct bc_key *k, uint64_t h, int64_t mtime_ns) {
+    int32_t i = page_find(sh, k, h);
+    if (i >= 0 && sh->pages[i].mtime_ns != mtime_ns) {
+        page_drop(sh, i);
+        i = -1;
+    }
+    return i;
+}
+
+static size_t page_copy(struct bc_shard *sh, int32_t i, char *dst, size_t start, size_t want) {
+    struct bc_page *p = &sh->pages[i];
+    if (start >= p->len) return 0;
+    if (want > p->len - start) want = p->len - start;
+    memcpy(dst, sh->data + (size_t)i * BC_BLOCK_SIZE + start, want);
+    return want;
+}
+
+/*
+ * Lấy block k (dst != NULL: chép [start, start+want) ra dst).
+ * dst == NULL là readahead: chỉ nạp nếu chưa có, không tính hit/miss.
+ * Trả về số byte chép được hoặc -errno.
+ */
+static ssize_t fetch(int fd, const struct bc_key *k, int64_t mtime_ns, char *dst, size_t start, size_t want) {
+    uint64_t h;
+    struct bc_shard *sh = shard_of(k, &h);
+    off_t boff = (off_t)(k->blk * BC_BLOCK_SIZE);
+
+    pthread_mutex_lock(&sh->lock);
+    int32_t i = page_lookup(sh, k, h, mtime_ns);
+    if (i >= 0) {
+        size_t n = 0;
+        if (dst) {
+            // 2Q: hit trong Am -> lên đầu LRU; hit trong A1in giữ nguyên
+            // (các lần đọc liền nhau của cùng một luồng không tính là "nóng")
+            if (sh->pages[i].queue == Q_AM) {
+                list_unlink(sh, &sh->am, i);
+                list_push(sh, &sh->am, i);
+            }
+            n = page_copy(sh, i, dst, start, want);
+            __atomic_add_fetch(&stat_hits, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&sh->lock);
+        return (ssize_t)n;
+    }
+    i = page_grab(sh);
+    pthread_mutex_unlock(&sh->lock);
+
+    if (dst) __atomic_add_fetch(&stat_misses, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&stat_readahead, 1, __ATOMIC_RELAXED);
+
+    if (i < 0) {
+        // Shard nhỏ và mọi trang đang được nạp: đọc thẳng, bỏ qua cache
+        if (!dst) return 0;
+        ssize_t r = pread(fd, dst, want, boff + (off_t)start);
+        return r < 0 ? -errno : r;
+    }
+
+    char *page = sh->data + (size_t)i * BC_BLOCK_SIZE;
+    ssize_t r;
+    size_t got = 0;
+    // Đọc đủ block (file mạng có thể trả về ngắn giữa chừng)
+    while (got < BC_BLOCK_SIZE) {
+        r = pread(fd, page + got, BC_BLOCK_SIZE - got, boff + (off_t)got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            int err = -errno;
+            pthread_mutex_lock(&sh->lock);
+            sh->pages[i].queue = Q_FREE;
+            list_push(sh, &sh->free, i);
+            pthread_mutex_unlock(&sh->lock);
+            return err;
+        }
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    int32_t other = page_lookup(sh, k, h, mtime_ns);
+    if (other >= 0) {
+        // Thread khác nạp trước: trả trang của mình
+        sh->pages[i].queue = Q_FREE;
+        list_push(sh, &sh->free, i);
+        i = other;
+    } else {
+        struct bc_page *p = &sh->pages[i];
+        size_t b = bucket_of(sh, h);
+        p->key = *k;
+        p->mtime_ns = mtime_ns;
+        p->len = (uint32_t)got;
+        p->hnext = sh->buckets[b];
+        sh->buckets[b] = i;
+        // Bị đuổi khỏi A1in gần đây rồi lại được đọc -> vào Am
+        p->queue = ghost_take(sh, k, h) ? Q_AM : Q_A1IN;
+        list_push(sh, queue_list(sh, p->queue), i);
+    }
+    size_t n = dst ? page_copy(sh, i, dst, start, want) : 0;
+    pthread_mutex_unlock(&sh->lock);
+    return (ssize_t)n;
+}
+
+// ---- readahead ----
+
+static void ra_fd_put(struct ra_fd *rf) {
+    if (__atomic_sub_fetch(&rf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(rf->fd);
+        free(rf);
+    }
+}
+
+static void *ra_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ra_lock);
+    for (;;) {
+        while (ra_count == 0 && !ra_stop)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        if (ra_stop) break;
+        struct ra_req req = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % BC_RA_QUEUE;
+        ra_count--;
+        pthread_mutex_unlock(&ra_lock);
+
+        fetch(req.rf->fd, &req.key, req.mtime_ns, NULL, 0, 0);
+        ra_fd_put(req.rf);
+
+        pthread_mutex_lock(&ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+// Xếp hàng các block [from, to) của f; bỏ phần thừa nếu hàng đợi đầy
+static void ra_submit(const struct bc_file *f, uint64_t from, uint64_t to) {
+    if (!ra_running || from >= to) return;
+    struct ra_fd *rf = malloc(sizeof(*rf));
+    if (!rf) return;
+    // fd của handle có thể bị đóng trước khi thread nạp xong
+    rf->fd = dup(f->fd);
+    if (rf->fd < 0) {
+        free(rf);
+        return;
+    }
+    rf->refs = 1;
+
+    pthread_mutex_lock(&ra_lock);
+    for (uint64_t b = from; b < to && ra_count < BC_RA_QUEUE; b++) {
+        struct ra_req *req = &ra_queue[(ra_head + ra_count) % BC_RA_QUEUE];
+        req->rf = rf;
+        req->key.dev = f->dev;
+        req->key.ino = f->ino;
+        req->key.blk = b;
+        req->mtime_ns = f->mtime_ns;
+        __atomic_add_fetch(&rf->refs, 1, __ATOMIC_RELAXED);
+        ra_count++;
+    }
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+    ra_fd_put(rf);
+}
+
+// Đọc nối tiếp lần trước -> nhân đôi cửa sổ và đọc trước phần chưa xin
+static void ra_update(const struct bc_file *f, struct bc_stream *s, off_t offset, size_t done) {
+    if (offset != s->next) {
+        s->window = 0;
+        s->ra_end = 0;
+        s->next = offset + (off_t)done;
+        return;
+    }
+    s->next = offset + (off_t)done;
+    if (done == 0 || f->size <= 0) return;
+
+    s->window = s->window ? s->window * 2 : 2;
+    if (s->window > BC_MAX_READAHEAD) s->window = BC_MAX_READAHEAD;
+
+    uint64_t end_blk = (uint64_t)(s->next - 1) / BC_BLOCK_SIZE + 1;
+    uint64_t nblocks = ((uint64_t)f->size + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    uint64_t from = s->ra_end > end_blk ? s->ra_end : end_blk;
+    uint64_t to = end_blk + s->window;
+    if (to > nblocks) to = nblocks;
+    if (from < to) {
+        ra_submit(f, from, to);
+        s->ra_end = to;
+    }
+}
+
+// ---- API ----
+
+int bc_file_init(struct bc_file *f, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return -errno;
+    f->fd = fd;
+    f->dev = (uint64_t)st.st_dev;
+    f->ino = (uint64_t)st.st_ino;
+    f->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    f->size = st.st_size;
+    return 0;
+}
+
+ssize_t bc_read(const struct bc_file *f, struct bc_stream *s, void *buf, size_t size, off_t offset) {
+    if (offset >= f->size || size == 0) {
+        if (s) s->next = offset;
+        return 0;
+    }
+    if ((off_t)size > f->size - offset) size = (size_t)(f->size - offset);
+
+    size_t done = 0;
+    uint64_t blk = (uint64_t)offset / BC_BLOCK_SIZE;
+    size_t start = (size_t)(offset - (off_t)(blk * BC_BLOCK_SIZE));
+    while (done < size) {
+        size_t want = BC_BLOCK_SIZE - start;
+        if (want > size - done) want = size - done;
+        struct bc_key k = { f->dev, f->ino, blk };
+        ssize_t n = fetch(f->fd, &k, f->mtime_ns, (char *)buf + done, start, want);
+        if (n < 0) {
+            if (done == 0) return n;
+            break;
+        }
+        done += (size_t)n;
+        if ((size_t)n < want) break;   // EOF
+        blk++;
+        start = 0;
+    }
+    if (s) ra_update(f, s, offset, done);
+    return (ssize_t)done;
+}
+
+void bc_get_stats(struct bc_stats *out) {
+    out->hits = __atomic_load_n(&stat_hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&stat_misses, __ATOMIC_RELAXED);
+    out->readahead = __atomic_load_n(&stat_readahead, __ATOMIC_RELAXED);
+    out->evictions = __atomic_load_n(&stat_evictions, __ATOMIC_RELAXED);
+    out->pages = total_pages;
+}
+
+static int shard_init(struct bc_shard *sh, char *data, int npages) {
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->data = data;
+    sh->npages = npages;
+    sh->kin = npages / 4 > 0 ? npages / 4 : 1;
+    sh->nghosts = npages / 2 > 0 ? npages / 2 : 1;
+    sh->nbuckets = npages * 2;
+    sh->pages = calloc((size_t)npages, sizeof(*sh->pages));
+    sh->ghosts = calloc((size_t)sh->nghosts, sizeof(*sh->ghosts));
+    sh->buckets = malloc((size_t)sh->nbuckets * sizeof(int32_t));
+    sh->gbuckets = malloc((size_t)sh->nbuckets * sizeof(int32_t));
+    if (!sh->pages || !sh->ghosts || !sh->buckets || !sh->gbuckets) return -1;
+
+    for (int b = 0; b < sh->nbuckets; b++) sh->buckets[b] = sh->gbuckets[b] = -1;
+    for (int g = 0; g < sh->nghosts; g++) sh->ghosts[g].hnext = -1;
+    sh->free.head = sh->free.tail = -1;
+    sh->a1in.head = sh->a1in.tail = -1;
+    sh->am.head = sh->am.tail = -1;
+    sh->free.count = sh->a1in.count = sh->am.count = 0;
+    sh->ghost_pos = 0;
+    for (int32_t i = 0; i < npages; i++) {
+        sh->pages[i].hnext = -1;
+        sh->pages[i].queue = Q_FREE;
+        list_push(sh, &sh->free, i);
+    }
+    return 0;
+}
+
+static void shard_free(struct bc_shard *sh) {
+    free(sh->pages);
+    free(sh->ghosts);
+    free(sh->buckets);
+    free(sh->gbuckets);
+    pthread_mutex_destroy(&sh->lock);
+    memset(sh, 0, sizeof(*sh));
+}
+
+int bc_init(void) {
+    if (bc_budget == 0 || arena) return 0;
+
+    // Ít nhất một trang mỗi shard
+    size_t per_shard = bc_budget / BC_BLOCK_SIZE / BC_SHARDS;
+    if (per_shard == 0) per_shard = 1;
+    if (per_shard > INT32_MAX / 2) per_shard = INT32_MAX / 2;
+    total_pages = per_shard * BC_SHARDS;
+    arena_size = total_pages * BC_BLOCK_SIZE;
+
+    // mmap: bộ nhớ chỉ thực sự cấp khi trang được dùng tới
+    arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        arena = NULL;
+        return -1;
+    }
+    for (int s = 0; s < BC_SHARDS; s++) {
+        if (shard_init(&shards[s], arena + (size_t)s * per_shard * BC_BLOCK_SIZE, (int)per_shard) != 0) {
+            for (int j = 0; j <= s; j++) shard_free(&shards[j]);
+            munmap(arena, arena_size);
+            arena = NULL;
+            return -1;
+        }
+    }
+
+    ra_stop = 0;
+    ra_head = ra_count = 0;
+    int started = 0;
+    for (int t = 0; t < BC_RA_THREADS; t++)
+        if (pthread_create(&ra_threads[started], NULL, ra_main, NULL) == 0) started++;
+    ra_running = started;
+    return 0;
+}
+
+void bc_shutdown(void) {
+    if (!arena) return;
+    if (ra_running) {
+        pthread_mutex_lock(&ra_lock);
+        ra_stop = 1;
+        pthread_cond_broadcast(&ra_cond);
+        pthread_mutex_unlock(&ra_lock);
+        for (int t = 0; t < ra_running; t++) pthread_join(ra_threads[t], NULL);
+        ra_running = 0;
+    }
+    // Yêu cầu chưa chạy: chỉ nhả fd
+    while (ra_count > 0) {
+        ra_fd_put(ra_queue[ra_head].rf);
+        ra_head = (ra_head + 1) % BC_RA_QUEUE;
+        ra_count--;
+    }
+    for (int s = 0; s < BC_SHARDS; s++) shard_free(&shards[s]);
+    munmap(arena, arena_size);
+    arena = NULL;
+    total_pages = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Shared cache of Source-layer file blocks (--block-cache=SIZE).
+//
+// The budget is carved into fixed BC_BLOCK_SIZE pages at start-up and
+// split over BC_SHARDS independently locked shards. Replacement is 2Q:
+// new blocks enter a small FIFO (A1in) and only move to the main LRU (Am)
+// when they are referenced again after having been evicted (remembered in
+// the ghost list A1out), so one large sequential scan cannot flush the
+// hot set. Source files never change under the overlay; a block is
+// additionally tagged with the file's mtime so an out-of-band edit of the
+// source tree is treated as a miss.
+//
+// Sequential readers (per handle) get asynchronous readahead with a
+// window that doubles up to BC_MAX_READAHEAD blocks.
+
+#define BC_BLOCK_SIZE (64 * 1024)
+#define BC_SHARDS 16
+#define BC_MAX_READAHEAD 32             // blocks (2 MiB)
+
+// Identity of an open Source file, filled once at open
+struct bc_file {
+    int fd;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    off_t size;
+};
+
+// Per-handle sequential detection
+struct bc_stream {
+    off_t next;                 // offset right after the previous read
+    uint64_t ra_end;            // first block not yet requested for readahead
+    uint32_t window;            // current readahead window (blocks)
+};
+
+struct bc_stats {
+    uint64_t hits;              // blocks served from memory
+    uint64_t misses;            // blocks read from the source
+    uint64_t readahead;         // blocks loaded by the readahead threads
+    uint64_t evictions;
+    size_t pages;               // capacity in blocks
+};
+
+// Budget in bytes, 0 disables (default). bc_init allocates the arena and
+// starts the readahead threads; call it after fuse has daemonized.
+void bc_set_budget(size_t bytes);
+int bc_enabled(void);
+int bc_init(void);
+void bc_shutdown(void);
+
+int bc_file_init(struct bc_file *f, int fd);
+
+// pread() through the cache; returns bytes (short only at EOF) or -errno
+ssize_t bc_read(const struct bc_file *f, struct bc_stream *s, void *buf, size_t size, off_t offset);
+
+void bc_get_stats(struct bc_stats *out);
+
+#endif
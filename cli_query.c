@@ -1,26 +1,583 @@
 /*
  * cli_query.c
  * Simple log query tool for the virtual file system.
- * Usage: ./cli_query [--log path] [--user username|uid] [--file filename] [--op OPERATION]
+ * Usage: ./cli_query [--log path | --segments [dir]] [--threads N] [--user username|uid] [--file filename] [--op OPERATION]
+ *
+ * --segments searches the binary log segments (see log_segment.h): the
+ * user/op/path indexes select the candidate records, so only matching
+ * records are touched instead of scanning the whole log.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "log_segment.h"
 
 int starts_with(const char *s, const char *prefix) {
     return strncmp(s, prefix, strlen(prefix)) == 0;
 }
 
+// --- Binary segment search ---
+
+struct seg_view {
+    const uint8_t *base;
+    size_t size;
+    const struct seg_footer *f;
+    const struct seg_record *recs;
+};
+
+// A postings list inside the mapped segment
+struct plist {
+    const uint32_t *ids;
+    uint32_t count;
+};
+
+static int seg_range_ok(const struct seg_view *v, uint64_t off, uint64_t len) {
+    return off <= v->size && len <= v->size - off;
+}
+
+static int strtab_get(const struct seg_view *v, uint64_t tab_off, uint32_t id,
+                      const char **s, uint32_t *len) {
+    const struct seg_strtab *t = (const void *)(v->base + tab_off);
+    if (id >= t->count) return -1;
+    const struct seg_strent *e = (const void *)(t + 1);
+    const char *blob = (const char *)(e + t->count);
+    *s = blob + e[id].off;
+    *len = e[id].len;
+    return 0;
+}
+
+static const struct seg_user *find_user(const struct seg_view *v, uint32_t uid) {
+    const struct seg_user *u = (const void *)(v->base + v->f->user_off);
+    uint32_t lo = 0, hi = v->f->user_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (u[mid].uid == uid) return &u[mid];
+        if (u[mid].uid < uid) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct plist postings_at(const struct seg_view *v, uint64_t off, uint32_t count) {
+    struct plist p = { NULL, 0 };
+    if (seg_range_ok(v, off, (uint64_t)count * sizeof(uint32_t))) {
+        p.ids = (const void *)(v->base + off);
+        p.count = count;
+    }
+    return p;
+}
+
+static void print_seg_record(const struct seg_view *v, const struct seg_record *r) {
+    char ts[64];
+    time_t t = (time_t)r->ts;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S%z", &tm);
+
+    const char *op = "", *path = "", *name = "unknown";
+    uint32_t op_len = 0, path_len = 0, name_len = 7;
+    strtab_get(v, v->f->op_dict_off, r->op_id, &op, &op_len);
+    strtab_get(v, v->f->path_dict_off, r->path_id, &path, &path_len);
+    const struct seg_user *u = find_user(v, r->uid);
+    if (u) {
+        name = (const char *)(v->base + v->f->user_blob_off + u->name_off);
+        name_len = u->name_len;
+    }
+
+    printf("%s | uid=%u(%.*s) pid=%d | %.*s %.*s | result=%d\n", ts, r->uid, (int)name_len, name,
+           r->pid, (int)op_len, op, (int)path_len, path, r->result);
+}
+
+static int query_segment(const char *file, const char *filter_user,
+                         const char *filter_file, const char *filter_op) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)(sizeof(struct seg_file_header) + sizeof(struct seg_footer))) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct seg_view v = { map, st.st_size, NULL, NULL };
+    v.f = (const void *)(v.base + v.size - sizeof(struct seg_footer));
+    const struct seg_file_header *h = map;
+    if (memcmp(h->magic, SEG_MAGIC, sizeof(SEG_MAGIC)) != 0 ||
+        memcmp(v.f->magic, SEG_FOOTER_MAGIC, sizeof(SEG_FOOTER_MAGIC)) != 0 ||
+        h->record_size != sizeof(struct seg_record) ||
+        !seg_range_ok(&v, v.f->records_off, v.f->record_count * sizeof(struct seg_record)) ||
+        !seg_range_ok(&v, v.f->op_index_off, (uint64_t)v.f->op_count * sizeof(struct seg_postings)) ||
+        !seg_range_ok(&v, v.f->path_index_off, (uint64_t)v.f->path_count * sizeof(struct seg_postings)) ||
+        !seg_range_ok(&v, v.f->user_off, (uint64_t)v.f->user_count * sizeof(struct seg_user))) {
+        fprintf(stderr, "Skipping invalid segment: %s\n", file);
+        munmap(map, v.size);
+        return -1;
+    }
+    v.recs = (const void *)(v.base + v.f->records_off);
+    const struct seg_postings *op_idx = (const void *)(v.base + v.f->op_index_off);
+    const struct seg_postings *path_idx = (const void *)(v.base + v.f->path_index_off);
+    const struct seg_user *users = (const void *)(v.base + v.f->user_off);
+    const char *user_blob = (const char *)(v.base + v.f->user_blob_off);
+
+    // Mỗi filter -> danh sách postings ứng viên; filter nào không khớp gì thì bỏ qua segment
+    struct plist *user_lists = NULL, *path_lists = NULL;
+    uint32_t *user_uids = NULL;
+    uint32_t n_user = 0, n_path = 0;
+    uint64_t user_total = 0, path_total = 0;
+    uint8_t *path_match = NULL;
+    int op_id = -1;
+    int skip = 0;
+
+    if (filter_user) {
+        user_lists = calloc(v.f->user_count + 1, sizeof(*user_lists));
+        user_uids = calloc(v.f->user_count + 1, sizeof(*user_uids));
+        for (uint32_t i = 0; i < v.f->user_count; i++) {
+            char uid_str[16];
+            snprintf(uid_str, sizeof(uid_str), "%u", users[i].uid);
+            size_t flen = strlen(filter_user);
+            int by_name = users[i].name_len == flen && memcmp(user_blob + users[i].name_off, filter_user, flen) == 0;
+            if (strcmp(uid_str, filter_user) == 0 || by_name) {
+                user_uids[n_user] = users[i].uid;
+                user_lists[n_user] = postings_at(&v, users[i].postings_off, users[i].count);
+                user_total += user_lists[n_user++].count;
+            }
+        }
+        if (n_user == 0) skip = 1;
+    }
+    if (filter_op && !skip) {
+        for (uint32_t i = 0; i < v.f->op_count; i++) {
+            const char *s;
+            uint32_t len;
+            if (strtab_get(&v, v.f->op_dict_off, i, &s, &len) == 0 &&
+                len == strlen(filter_op) && memcmp(s, filter_op, len) == 0) {
+                op_id = i;
+                break;
+            }
+        }
+        if (op_id < 0) skip = 1;
+    }
+    if (filter_file && !skip) {
+        // match substring of path, một lần cho mỗi path khác nhau thay vì mỗi record
+        path_match = calloc(v.f->path_count + 1, 1);
+        path_lists = calloc(v.f->path_count + 1, sizeof(*path_lists));
+        size_t flen = strlen(filter_file);
+        for (uint32_t i = 0; i < v.f->path_count; i++) {
+            const char *s;
+            uint32_t len;
+            if (strtab_get(&v, v.f->path_dict_off, i, &s, &len) == 0 && memmem(s, len, filter_file, flen)) {
+                path_match[i] = 1;
+                path_lists[n_path] = postings_at(&v, path_idx[i].postings_off, path_idx[i].count);
+                path_total += path_lists[n_path++].count;
+            }
+        }
+        if (n_path == 0) skip = 1;
+    }
+
+    if (!skip) {
+        // Chọn filter có ít ứng viên nhất làm danh sách duyệt
+        struct plist *drive = NULL, op_list;
+        uint32_t n_drive = 0;
+        uint64_t best = v.f->record_count;
+        if (op_id >= 0 && op_idx[op_id].count <= best) {
+            op_list = postings_at(&v, op_idx[op_id].postings_off, op_idx[op_id].count);
+            drive = &op_list;
+            n_drive = 1;
+            best = op_list.count;
+        }
+        if (filter_user && user_total <= best) {
+            drive = user_lists;
+            n_drive = n_user;
+            best = user_total;
+        }
+        if (filter_file && path_total <= best) {
+            drive = path_lists;
+            n_drive = n_path;
+            best = path_total;
+        }
+
+        uint32_t *ids = NULL;
+        uint64_t n_ids = 0;
+        if (drive) {
+            // Hợp các postings (rời nhau: mỗi record chỉ có 1 uid/1 path) rồi sắp xếp lại
+            ids = malloc((best + 1) * sizeof(*ids));
+            for (uint32_t i = 0; i < n_drive; i++) {
+                memcpy(ids + n_ids, drive[i].ids, drive[i].count * sizeof(*ids));
+                n_ids += drive[i].count;
+            }
+            if (n_drive > 1) qsort(ids, n_ids, sizeof(*ids), cmp_u32);
+        } else {
+            n_ids = v.f->record_count;
+        }
+
+        for (uint64_t k = 0; k < n_ids; k++) {
+            uint64_t id = ids ? ids[k] : k;
+            if (id >= v.f->record_count) continue;
+            const struct seg_record *r = &v.recs[id];
+            if (op_id >= 0 && r->op_id != op_id) continue;
+            if (path_match && (r->path_id >= v.f->path_count || !path_match[r->path_id])) continue;
+            if (filter_user) {
+                uint32_t i = 0;
+                while (i < n_user && user_uids[i] != r->uid) i++;
+                if (i == n_user) continue;
+            }
+            print_seg_record(&v, r);
+        }
+        free(ids);
+    }
+
+    free(user_lists);
+    free(user_uids);
+    free(path_lists);
+    free(path_match);
+    munmap(map, v.size);
+    return 0;
+}
+
+static int seg_name_cmp(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int seg_filter(const struct dirent *de) {
+    size_t len = strlen(de->d_name);
+    return len > 4 && strcmp(de->d_name + len - 4, ".seg") == 0;
+}
+
+static int query_segments(const char *dir, const char *filter_user,
+                          const char *filter_file, const char *filter_op) {
+    struct dirent **list;
+    int n = scandir(dir, &list, seg_filter, seg_name_cmp);
+    if (n < 0) {
+        fprintf(stderr, "Failed to open segment directory: %s\n", dir);
+        return 2;
+    }
+    // Tên seg-NNNNNN tăng dần theo thời gian -> in theo đúng thứ tự ghi
+    for (int i = 0; i < n; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+        query_segment(path, filter_user, filter_file, filter_op);
+        free(list[i]);
+    }
+    free(list);
+    return 0;
+}
+
+// --- Parallel text log scan ---
+//
+// The log is mmapped and cut into line-aligned chunks; worker threads take
+// chunks in any order, format matches into a per-chunk buffer, and the main
+// thread prints the buffers in file order. Field separators are located with
+// SSE2 (16 bytes per compare) and filters are checked on the raw bytes, so
+// lines are never copied or tokenized in place.
+
+#define SCAN_CHUNK_BYTES (4u << 20)
+#define SCAN_FIELDS 7
+
+struct scan_filter {
+    const char *user, *file, *op;
+    size_t user_len, file_len, op_len;
+    // Longest literal every matching line must contain; used to jump
+    // straight to candidate lines with memmem
+    char needle[512];
+    size_t needle_len;
+};
+
+struct scan_chunk {
+    const char *begin, *end;
+    char *out;
+    size_t out_len, out_cap;
+    int done;
+};
+
+struct scan_ctx {
+    const struct scan_filter *flt;
+    struct scan_chunk *chunks;
+    size_t nchunks;
+    atomic_size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Split one line into fields. Returns the start of the next line; *nf is
+// the number of fields found (the 7th field stops at the next '|', like the
+// old strsep loop).
+static const char *split_line(const char *p, const char *end,
+                              const char **fs, size_t *fl, int *nf) {
+    const char *field = p;
+    int n = 0;
+
+#ifdef __SSE2__
+    const __m128i pipe = _mm_set1_epi8('|');
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (p + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, pipe), _mm_cmpeq_epi8(v, nl)));
+        while (mask) {
+            const char *hit = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (*hit == '\n') {
+                if (n < SCAN_FIELDS) { fs[n] = field; fl[n++] = hit - field; }
+                *nf = n;
+                return hit + 1;
+            }
+            if (n < SCAN_FIELDS) { fs[n] = field; fl[n++] = hit - field; }
+            field = hit + 1;
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p != '|' && *p != '\n') continue;
+        if (n < SCAN_FIELDS) { fs[n] = field; fl[n++] = p - field; }
+        if (*p == '\n') {
+            *nf = n;
+            return p + 1;
+        }
+        field = p + 1;
+    }
+    // Dòng cuối không có '\n'
+    if (field < end && n < SCAN_FIELDS) { fs[n] = field; fl[n++] = end - field; }
+    *nf = n;
+    return end;
+}
+
+static int field_eq(const char *f, size_t len, const char *s, size_t slen) {
+    return len == slen && memcmp(f, s, len) == 0;
+}
+
+static void out_append(struct scan_chunk *c, const char *s, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : 65536;
+        while (cap < c->out_len + len) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (!p) return;
+        c->out = p;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, s, len);
+    c->out_len += len;
+}
+
+#define OUT_LIT(c, lit) out_append(c, lit, sizeof(lit) - 1)
+
+// Check one line against the filters and append it to the chunk output
+static const char *scan_line(struct scan_chunk *c, const struct scan_filter *flt,
+                             const char *p, const char *end) {
+    const char *fs[SCAN_FIELDS];
+    size_t fl[SCAN_FIELDS];
+    int nf;
+    const char *next = split_line(p, end, fs, fl, &nf);
+    if (nf < SCAN_FIELDS) return next;  // malformed
+
+    // Trim '\r' (log ghi từ Windows)
+    if (fl[6] && fs[6][fl[6] - 1] == '\r') fl[6]--;
+
+    if (flt->user && !field_eq(fs[1], fl[1], flt->user, flt->user_len) &&
+        !field_eq(fs[2], fl[2], flt->user, flt->user_len)) return next;
+    if (flt->file && !memmem(fs[5], fl[5], flt->file, flt->file_len)) return next;
+    if (flt->op && !field_eq(fs[4], fl[4], flt->op, flt->op_len)) return next;
+
+    out_append(c, fs[0], fl[0]);
+    OUT_LIT(c, " | uid=");
+    out_append(c, fs[1], fl[1]);
+    OUT_LIT(c, "(");
+    out_append(c, fs[2], fl[2]);
+    OUT_LIT(c, ") pid=");
+    out_append(c, fs[3], fl[3]);
+    OUT_LIT(c, " | ");
+    out_append(c, fs[4], fl[4]);
+    OUT_LIT(c, " ");
+    out_append(c, fs[5], fl[5]);
+    OUT_LIT(c, " | result=");
+    out_append(c, fs[6], fl[6]);
+    OUT_LIT(c, "\n");
+    return next;
+}
+
+static void scan_chunk(struct scan_chunk *c, const struct scan_filter *flt) {
+    const char *p = c->begin;
+
+    if (flt->needle_len == 0) {
+        while (p < c->end) p = scan_line(c, flt, p, c->end);
+        return;
+    }
+
+    // Nhảy thẳng tới dòng có chứa needle, bỏ qua phần còn lại
+    while (p < c->end) {
+        const char *hit = memmem(p, c->end - p, flt->needle, flt->needle_len);
+        if (!hit) break;
+        const char *line = memrchr(p, '\n', hit - p);
+        line = line ? line + 1 : p;
+        p = scan_line(c, flt, line, c->end);
+    }
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_ctx *ctx = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&ctx->next, 1);
+        if (i >= ctx->nchunks) break;
+        scan_chunk(&ctx->chunks[i], ctx->flt);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->chunks[i].done = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+static void build_filter(struct scan_filter *flt, const char *user, const char *file, const char *op) {
+    memset(flt, 0, sizeof(*flt));
+    flt->user = user;
+    flt->file = file;
+    flt->op = op;
+    flt->user_len = user ? strlen(user) : 0;
+    flt->file_len = file ? strlen(file) : 0;
+    flt->op_len = op ? strlen(op) : 0;
+
+    // "|OP|" và "|user|" là các field nguyên vẹn trong dòng log
+    if (op && flt->op_len + 2 < sizeof(flt->needle)) {
+        flt->needle_len = snprintf(flt->needle, sizeof(flt->needle), "|%s|", op);
+    }
+    if (user && flt->user_len + 2 > flt->needle_len && flt->user_len + 2 < sizeof(flt->needle)) {
+        flt->needle_len = snprintf(flt->needle, sizeof(flt->needle), "|%s|", user);
+    }
+    if (file && flt->file_len > flt->needle_len && flt->file_len < sizeof(flt->needle)) {
+        flt->needle_len = snprintf(flt->needle, sizeof(flt->needle), "%s", file);
+    }
+}
+
+static int scan_buffer(const char *data, size_t size, const struct scan_filter *flt, int threads) {
+    size_t nchunks = size / SCAN_CHUNK_BYTES + 1;
+    struct scan_chunk *chunks = calloc(nchunks, sizeof(*chunks));
+    if (!chunks) return 2;
+
+    // Cắt theo ranh giới dòng
+    const char *p = data, *end = data + size;
+    size_t n = 0;
+    while (p < end) {
+        const char *stop = p + SCAN_CHUNK_BYTES < end ? p + SCAN_CHUNK_BYTES : end;
+        if (stop < end) {
+            const char *nl = memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+        }
+        chunks[n].begin = p;
+        chunks[n].end = stop;
+        n++;
+        p = stop;
+    }
+
+    struct scan_ctx ctx = { flt, chunks, n, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    if (threads < 1) threads = 1;
+    if ((size_t)threads > n) threads = n ? (int)n : 1;
+    pthread_t *tids = calloc((size_t)threads, sizeof(*tids));
+    int started = 0;
+    for (int i = 0; i < threads && tids; i++) {
+        if (pthread_create(&tids[i], NULL, scan_worker, &ctx) == 0) started++;
+    }
+    if (started == 0) scan_worker(&ctx);
+
+    // In theo đúng thứ tự trong file
+    for (size_t i = 0; i < n; i++) {
+        pthread_mutex_lock(&ctx.lock);
+        while (!chunks[i].done) pthread_cond_wait(&ctx.cond, &ctx.lock);
+        pthread_mutex_unlock(&ctx.lock);
+        if (chunks[i].out_len) fwrite(chunks[i].out, 1, chunks[i].out_len, stdout);
+        free(chunks[i].out);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    free(chunks);
+    return 0;
+}
+
+static int query_text_log(const char *log_path, const char *filter_user, const char *filter_file,
+                          const char *filter_op, int threads) {
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open log file: %s\n", log_path);
+        return 2;
+    }
+
+    struct scan_filter flt;
+    build_filter(&flt, filter_user, filter_file, filter_op);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Failed to map log file: %s\n", log_path);
+            return 2;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+        int res = scan_buffer(map, st.st_size, &flt, threads);
+        munmap(map, st.st_size);
+        return res;
+    }
+
+    // Pipe/FIFO: không mmap được -> đọc hết vào bộ nhớ rồi quét như file thường
+    size_t len = 0, cap = 1 << 20;
+    char *buf = malloc(cap);
+    ssize_t r;
+    while (buf && (r = read(fd, buf + len, cap - len)) > 0) {
+        len += r;
+        if (len == cap) {
+            char *nb = realloc(buf, cap * 2);
+            if (!nb) break;
+            buf = nb;
+            cap *= 2;
+        }
+    }
+    close(fd);
+    int res = buf ? scan_buffer(buf, len, &flt, threads) : 2;
+    free(buf);
+    return res;
+}
+
 int main(int argc, char **argv) {
     const char *log_path = "virtual_fs.log";
     const char *filter_user = NULL;
     const char *filter_file = NULL;
     const char *filter_op = NULL;
+    const char *segment_dir = NULL;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = ncpu > 0 ? (int)ncpu : 1;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--log") == 0 && i+1 < argc) {
             log_path = argv[++i];
+        } else if (strcmp(argv[i], "--segments") == 0) {
+            segment_dir = (i+1 < argc && argv[i+1][0] != '-') ? argv[++i] : "virtual_fs.segments";
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) threads = 1;
         } else if (strcmp(argv[i], "--user") == 0 && i+1 < argc) {
             filter_user = argv[++i];
         } else if (strcmp(argv[i], "--file") == 0 && i+1 < argc) {
@@ -28,55 +585,12 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[i], "--op") == 0 && i+1 < argc) {
             filter_op = argv[++i];
         } else if (strcmp(argv[i], "--help") == 0) {
-            printf("Usage: %s [--log path] [--user username|uid] [--file filename] [--op OPERATION]\n", argv[0]);
+            printf("Usage: %s [--log path | --segments [dir]] [--threads N] [--user username|uid] [--file filename] [--op OPERATION]\n", argv[0]);
             return 0;
         }
     }
 
-    FILE *f = fopen(log_path, "r");
-    if (!f) {
-        fprintf(stderr, "Failed to open log file: %s\n", log_path);
-        return 2;
-    }
-
-    char line[4096];
-    while (fgets(line, sizeof(line), f)) {
-        // Trim newline
-        size_t L = strlen(line);
-        if (L && (line[L-1] == '\n' || line[L-1] == '\r')) line[--L] = '\0';
+    if (segment_dir) return query_segments(segment_dir, filter_user, filter_file, filter_op);
 
-        // Split by '|'
-        char *parts[7];
-        char *p = line;
-        int idx = 0;
-        char *tok;
-        while ((tok = strsep(&p, "|")) != NULL && idx < 7) {
-            parts[idx++] = tok;
-        }
-        if (idx < 7) continue; // malformed
-
-        const char *ts = parts[0];
-        const char *uid = parts[1];
-        const char *username = parts[2];
-        const char *pid = parts[3];
-        const char *op = parts[4];
-        const char *path = parts[5];
-        const char *result = parts[6];
-
-        if (filter_user) {
-            if (!(strcmp(filter_user, uid) == 0 || strcmp(filter_user, username) == 0)) continue;
-        }
-        if (filter_file) {
-            // match substring of path
-            if (!strstr(path, filter_file)) continue;
-        }
-        if (filter_op) {
-            if (strcmp(filter_op, op) != 0) continue;
-        }
-
-        printf("%s | uid=%s(%s) pid=%s | %s %s | result=%s\n", ts, uid, username, pid, op, path, result);
-    }
-
-    fclose(f);
-    return 0;
+    return query_text_log(log_path, filter_user, filter_file, filter_op, threads);
 }
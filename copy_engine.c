@@ -0,0 +1,138 @@
+/*
+ * copy_engine.c
+ * Zero-copy file copy used by copy-up and backup restore.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "copy_engine.h"
+
+#define COPY_BUF_SIZE (1 << 20)
+
+// Các lỗi nghĩa là "cách này không dùng được ở đây", thử cách tiếp theo
+static int fallback_errno(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+           err == ENOTSUP || err == EBADF || err == ETXTBSY || err == ESPIPE;
+}
+
+static int copy_buffered(int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len) {
+    if (len <= 0) return -EINVAL;     // copy_range chỉ gọi khi còn dữ liệu; len âm là lỗi của caller
+    char *buf = malloc(len < COPY_BUF_SIZE ? (size_t)len : COPY_BUF_SIZE);
+    if (!buf) return -ENOMEM;
+
+    int res = 0;
+    while (len > 0) {
+        size_t want = len < COPY_BUF_SIZE ? (size_t)len : COPY_BUF_SIZE;
+        ssize_t n = pread(src_fd, buf, want, src_off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            res = -errno;
+            break;
+        }
+        if (n == 0) break;      // file ngắn lại giữa chừng
+
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = dst_off == -1 ? write(dst_fd, buf + done, n - done)
+                                      : pwrite(dst_fd, buf + done, n - done, dst_off + done);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                res = -errno;
+                break;
+            }
+            done += w;
+        }
+        if (res != 0) break;
+        src_off += n;
+        if (dst_off != -1) dst_off += n;
+        len -= n;
+    }
+    free(buf);
+    return res;
+}
+
+int copy_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len) {
+    // 1. copy_file_range: copy trong kernel, reflink/server-side copy nếu FS hỗ trợ
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &src_off, dst_fd, dst_off == -1 ? NULL : &dst_off, len, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (!fallback_errno(errno)) return -errno;
+            break;
+        }
+        if (n == 0) return 0;
+        len -= n;
+    }
+    if (len == 0) return 0;
+
+    // 2. sendfile: vẫn trong kernel, nhưng ghi tại vị trí hiện tại của dst
+    if (dst_off == -1 || lseek(dst_fd, dst_off, SEEK_SET) != -1) {
+        while (len > 0) {
+            ssize_t n = sendfile(dst_fd, src_fd, &src_off, len > 0x7ffff000 ? 0x7ffff000 : (size_t)len);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                if (!fallback_errno(errno)) return -errno;
+                break;
+            }
+            if (n == 0) return 0;
+            if (dst_off != -1) dst_off += n;
+            len -= n;
+        }
+        if (len == 0) return 0;
+    }
+
+    // 3. Buffer lớn qua user space
+    return copy_buffered(src_fd, src_off, dst_fd, dst_off, len);
+}
+
+// Copy các vùng có dữ liệu (SEEK_DATA/SEEK_HOLE), bỏ qua hole
+static int copy_extents(int src_fd, int dst_fd, off_t size) {
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) break;                      // chỉ còn hole tới EOF
+            if (pos == 0) return copy_range(src_fd, 0, dst_fd, 0, size);  // FS không hỗ trợ SEEK_DATA
+            return -errno;
+        }
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole == -1 || hole > size) hole = size;
+
+        int res = copy_range(src_fd, data, dst_fd, data, hole - data);
+        if (res != 0) return res;
+        pos = hole;
+    }
+    return 0;
+}
+
+int copy_clone(int src_fd, int dst_fd) {
+    // Reflink: tức thì trên btrfs/XFS khi Source và Storage cùng filesystem
+    return ioctl(dst_fd, FICLONE, src_fd) == -1 ? -errno : 0;
+}
+
+int copy_file_all(int src_fd, int dst_fd, const struct stat *st) {
+    int res = 0;
+
+    if (copy_clone(src_fd, dst_fd) != 0) {
+        res = copy_extents(src_fd, dst_fd, st->st_size);
+        // Hole ở cuối file: đặt lại kích thước cho đúng
+        if (res == 0 && ftruncate(dst_fd, st->st_size) == -1) res = -errno;
+    }
+    if (res != 0) return res;
+    return copy_metadata(dst_fd, st);
+}
+
+int copy_metadata(int dst_fd, const struct stat *st) {
+    // chown có thể bị từ chối khi không chạy bằng root
+    if (fchown(dst_fd, st->st_uid, st->st_gid) == -1 && errno != EPERM) return -errno;
+    if (fchmod(dst_fd, st->st_mode & 07777) == -1) return -errno;
+
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (futimens(dst_fd, times) == -1) return -errno;
+    return 0;
+}
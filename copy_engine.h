@@ -0,0 +1,24 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Copy len bytes from src_fd@src_off to dst_fd@dst_off inside the kernel
+// when possible: copy_file_range -> sendfile -> 1 MiB buffer.
+// dst_off == -1 writes at dst_fd's current position (pipes, stdout).
+// Returns 0 or -errno.
+int copy_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len);
+
+// Copy a whole file for copy-up: reflink (FICLONE) when both fds share a
+// CoW filesystem, otherwise copy only the data extents so holes stay holes.
+// Mode, owner and timestamps from st are applied to dst_fd in the same pass.
+// Returns 0 or -errno.
+int copy_file_all(int src_fd, int dst_fd, const struct stat *st);
+
+// Reflink only; -errno when the filesystem cannot share extents
+int copy_clone(int src_fd, int dst_fd);
+// Apply owner, mode and timestamps from st to dst_fd
+int copy_metadata(int dst_fd, const struct stat *st);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * dir_cache.c
+ * Short-lived cache of merged directory listings for vfs_readdir.
+ *
+ * Listings are refcounted: an open directory handle keeps its snapshot
+ * even after the cache entry expires or is invalidated, so offsets handed
+ * to the kernel stay valid while the directory is being listed in pages.
+ * Entries live at most DIR_CACHE_TTL_MS; create/unlink/rename/mkdir drop
+ * them right away.
+ *
+ * Every invalidation bumps a generation counter. A caller takes it before
+ * building a listing and hands it to put, which drops the listing if an
+ * invalidation ran meanwhile, so a build that raced a create/unlink never
+ * republishes the old contents.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "dir_cache.h"
+
+struct dc_entry {
+    char *dir;
+    struct dir_listing *listing;
+    uint64_t expires_ms;
+};
+
+static struct dc_entry cache[DIR_CACHE_MAX];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_gen;              // tăng mỗi lần invalidate, đọc/ghi dưới cache_lock
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (uint8_t)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Append a NUL-terminated copy of name to a growable blob; returns its offset
+static long blob_append(char **blob, size_t *len, size_t *cap, const char *name) {
+    size_t n = strlen(name) + 1;
+    if (*len + n > *cap) {
+        size_t c = *cap ? *cap * 2 : 4096;
+        while (c < *len + n) c *= 2;
+        char *b = realloc(*blob, c);
+        if (!b) return -1;
+        *blob = b;
+        *cap = c;
+    }
+    memcpy(*blob + *len, name, n);
+    *len += n;
+    return (long)(*len - n);
+}
+
+// --- Listings ---
+
+struct dir_listing *dir_listing_new(void) {
+    struct dir_listing *l = calloc(1, sizeof(*l));
+    if (l) l->refs = 1;
+    return l;
+}
+
+int dir_listing_add(struct dir_listing *l, const char *name, ino_t ino, unsigned char type) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        struct dir_entry *e = realloc(l->entries, cap * sizeof(*e));
+        if (!e) return -1;
+        l->entries = e;
+        l->cap = cap;
+    }
+    long off = blob_append(&l->names, &l->names_len, &l->names_cap, name);
+    if (off < 0) return -1;
+    l->entries[l->count].name_off = (uint32_t)off;
+    l->entries[l->count].type = type;
+    l->entries[l->count].ino = ino;
+    l->count++;
+    return 0;
+}
+
+void dir_listing_release(struct dir_listing *l) {
+    if (!l) return;
+    if (__atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(l->entries);
+    free(l->names);
+    free(l);
+}
+
+// --- Name set (open addressing over a name blob) ---
+
+void name_set_init(struct name_set *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static int name_set_grow(struct name_set *s) {
+    uint32_t cap = s->cap ? s->cap * 2 : 256;
+    uint32_t *slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    for (uint32_t i = 0; i < s->cap; i++) {
+        if (!s->slots[i]) continue;
+        uint32_t h = hash_name(s->names + s->slots[i] - 1) & (cap - 1);
+        while (slots[h]) h = (h + 1) & (cap - 1);
+        slots[h] = s->slots[i];
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->cap = cap;
+    return 0;
+}
+
+int name_set_add(struct name_set *s, const char *name) {
+    if ((s->count + 1) * 2 > s->cap && name_set_grow(s) != 0) return -1;
+    uint32_t h = hash_name(name) & (s->cap - 1);
+    while (s->slots[h]) {
+        if (strcmp(s->names + s->slots[h] - 1, name) == 0) return 0;
+        h = (h + 1) & (s->cap - 1);
+    }
+    long off = blob_append(&s->names, &s->names_len, &s->names_cap, name);
+    if (off < 0) return -1;
+    s->slots[h] = (uint32_t)off + 1;
+    s->count++;
+    return 0;
+}
+
+int name_set_contains(const struct name_set *s, const char *name) {
+    if (s->count == 0) return 0;
+    uint32_t h = hash_name(name) & (s->cap - 1);
+    while (s->slots[h]) {
+        if (strcmp(s->names + s->slots[h] - 1, name) == 0) return 1;
+        h = (h + 1) & (s->cap - 1);
+    }
+    return 0;
+}
+
+void name_set_free(struct name_set *s) {
+    free(s->slots);
+    free(s->names);
+    memset(s, 0, sizeof(*s));
+}
+
+// --- Cache ---
+
+void dir_cache_init(void) {
+    memset(cache, 0, sizeof(cache));
+}
+
+// Caller holds cache_lock
+static void drop_slot(struct dc_entry *e) {
+    free(e->dir);
+    dir_listing_release(e->listing);
+    memset(e, 0, sizeof(*e));
+}
+
+struct dir_listing *dir_cache_get(const char *dir) {
+    struct dir_listing *l = NULL;
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < DIR_CACHE_MAX; i++) {
+        struct dc_entry *e = &cache[i];
+        if (!e->dir || strcmp(e->dir, dir) != 0) continue;
+        if (e->expires_ms <= now) {
+            drop_slot(e);
+        } else {
+            l = e->listing;
+            __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return l;
+}
+
+uint64_t dir_cache_gen(void) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t gen = cache_gen;
+    pthread_mutex_unlock(&cache_lock);
+    return gen;
+}
+
+void dir_cache_put(const char *dir, struct dir_listing *l, uint64_t gen) {
+    char *copy = strdup(dir);
+    if (!copy) return;
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_gen != gen) {
+        // Có invalidate trong lúc build: bản này có thể đã cũ, không cache
+        pthread_mutex_unlock(&cache_lock);
+        free(copy);
+        return;
+    }
+    // Thay bản cũ của cùng thư mục, nếu không thì slot trống/hết hạn, cuối cùng là slot cũ nhất
+    struct dc_entry *slot = NULL, *free_slot = NULL, *oldest = &cache[0];
+    for (int i = 0; i < DIR_CACHE_MAX; i++) {
+        struct dc_entry *e = &cache[i];
+        if (e->dir && strcmp(e->dir, dir) == 0) {
+            slot = e;
+            break;
+        }
+        if (!free_slot && (!e->dir || e->expires_ms <= now)) free_slot = e;
+        if (e->expires_ms < oldest->expires_ms) oldest = e;
+    }
+    if (!slot) slot = free_slot ? free_slot : oldest;
+    if (slot->dir) drop_slot(slot);
+    __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+    slot->dir = copy;
+    slot->listing = l;
+    slot->expires_ms = now + DIR_CACHE_TTL_MS;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void dir_cache_invalidate(const char *dir) {
+    pthread_mutex_lock(&cache_lock);
+    cache_gen++;
+    for (int i = 0; i < DIR_CACHE_MAX; i++) {
+        if (cache[i].dir && strcmp(cache[i].dir, dir) == 0) drop_slot(&cache[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void dir_cache_invalidate_parent(const char *path) {
+    char parent[4096];
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path) {
+        dir_cache_invalidate("/");
+        return;
+    }
+    size_t len = slash - path;
+    if (len >= sizeof(parent)) return;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    dir_cache_invalidate(parent);
+}
+
+void dir_cache_invalidate_tree(const char *dir) {
+    size_t len = strlen(dir);
+    pthread_mutex_lock(&cache_lock);
+    cache_gen++;
+    for (int i = 0; i < DIR_CACHE_MAX; i++) {
+        const char *d = cache[i].dir;
+        if (d && strncmp(d, dir, len) == 0 && (d[len] == '\0' || d[len] == '/')) drop_slot(&cache[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
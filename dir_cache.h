@@ -0,0 +1,64 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Merged (storage + source) directory listing. Built once per opendir or
+// taken from a short-lived cache, then streamed to readdir page by page:
+// entry i has offset i + 1, so a cursor stays valid for the whole handle.
+
+#define DIR_CACHE_TTL_MS 1000
+#define DIR_CACHE_MAX 64            // cached listings
+
+struct dir_entry {
+    uint32_t name_off;              // into dir_listing.names
+    unsigned char type;             // d_type (DT_*), i.e. st_mode >> 12
+    ino_t ino;
+};
+
+struct dir_listing {
+    struct dir_entry *entries;
+    size_t count, cap;
+    char *names;
+    size_t names_len, names_cap;
+    int refs;                       // cache + open handles
+};
+
+static inline const char *dir_entry_name(const struct dir_listing *l, size_t i) {
+    return l->names + l->entries[i].name_off;
+}
+
+struct dir_listing *dir_listing_new(void);
+int dir_listing_add(struct dir_listing *l, const char *name, ino_t ino, unsigned char type);
+void dir_listing_release(struct dir_listing *l);
+
+// Set of names used while merging (storage names + whiteout targets)
+struct name_set {
+    uint32_t *slots;                // offset + 1 into names, 0 = empty
+    uint32_t cap, count;
+    char *names;
+    size_t names_len, names_cap;
+};
+
+void name_set_init(struct name_set *s);
+int name_set_add(struct name_set *s, const char *name);
+int name_set_contains(const struct name_set *s, const char *name);
+void name_set_free(struct name_set *s);
+
+void dir_cache_init(void);
+// Cached listing of dir with an extra reference, or NULL
+struct dir_listing *dir_cache_get(const char *dir);
+// Generation to take before building a listing for dir_cache_put
+uint64_t dir_cache_gen(void);
+// Publish a freshly built listing (the cache takes its own reference);
+// dropped if an invalidation ran since gen was taken
+void dir_cache_put(const char *dir, struct dir_listing *l, uint64_t gen);
+// Drop the listing of dir itself
+void dir_cache_invalidate(const char *dir);
+// Drop the listing of the directory containing path
+void dir_cache_invalidate_parent(const char *path);
+// Drop dir and every listing below it (rename of a directory)
+void dir_cache_invalidate_tree(const char *dir);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * layers.c
+ * Stack of read-only lower layers and their name indexes, see layers.h.
+ *
+ * The index of a layer is a blocked Bloom filter: the path hash picks one
+ * 64-byte block and BLOOM_K bits inside it, so a probe touches a single
+ * cache line. It is sized at BLOOM_BITS_PER_PATH bits per path (rounded up
+ * to a power of two of blocks), which keeps false positives - a wasted
+ * fstatat, never a wrong answer - well under 1%. Building walks the layer
+ * once, collecting path hashes, then fills a filter of the right size and
+ * publishes it with a release store; lookups load it with acquire.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "layers.h"
+
+#define BLOOM_K 7                   // 7 bit x 9 bit vị trí = 63 bit của một hash
+#define BLOOM_BLOCK_WORDS 8         // 512 bit = 1 cache line
+#define BLOOM_BITS_PER_PATH 16
+
+struct bloom {
+    uint64_t mask;                  // số block - 1 (lũy thừa của 2)
+    uint64_t bits[];
+};
+
+struct layer {
+    int fd;
+    struct bloom *index;            // NULL: chưa có, tra thẳng bằng fstatat
+    pthread_t thread;
+    int building;
+};
+
+static struct layer layers[LAYER_MAX];
+static int nlayers;
+static enum layer_index_mode index_mode = LAYER_INDEX_AUTO;
+static int stopping;
+
+// ---- hash / Bloom filter ----
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// FNV-1a rồi trộn lại: bit thấp của FNV phân bố kém để chọn block
+static uint64_t path_hash(const char *rel) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)rel; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ull;
+    }
+    return mix(h);
+}
+
+static void bloom_add(struct bloom *b, uint64_t h) {
+    uint64_t *blk = b->bits + (h & b->mask) * BLOOM_BLOCK_WORDS;
+    uint64_t k = mix(h + 0x9e3779b97f4a7c15ull);
+    for (int i = 0; i < BLOOM_K; i++, k >>= 9) blk[(k >> 6) & 7] |= 1ull << (k & 63);
+}
+
+static int bloom_test(const struct bloom *b, uint64_t h) {
+    const uint64_t *blk = b->bits + (h & b->mask) * BLOOM_BLOCK_WORDS;
+    uint64_t k = mix(h + 0x9e3779b97f4a7c15ull);
+    for (int i = 0; i < BLOOM_K; i++, k >>= 9) {
+        if (!(blk[(k >> 6) & 7] & (1ull << (k & 63)))) return 0;
+    }
+    return 1;
+}
+
+static struct bloom *bloom_build(const uint64_t *hashes, size_t n) {
+    uint64_t want = ((uint64_t)n * BLOOM_BITS_PER_PATH + 511) / 512;
+    uint64_t nblocks = 1;
+    while (nblocks < want) nblocks <<= 1;
+    struct bloom *b = calloc(1, sizeof(*b) + nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    if (!b) return NULL;
+    b->mask = nblocks - 1;
+    for (size_t i = 0; i < n; i++) bloom_add(b, hashes[i]);
+    return b;
+}
+
+// ---- layers ----
+
+void layer_init(int source_fd) {
+    memset(layers, 0, sizeof(layers));
+    layers[0].fd = source_fd;
+    nlayers = 1;
+}
+
+int layer_add(const char *dir) {
+    if (nlayers == LAYER_MAX) return -E2BIG;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    layers[nlayers++].fd = fd;
+    return 0;
+}
+
+int layer_count(void) {
+    return nlayers;
+}
+
+int layer_dirfd(int layer) {
+    return layers[layer].fd;
+}
+
+uint32_t layer_all(void) {
+    return nlayers == LAYER_MAX ? UINT32_MAX : (1u << nlayers) - 1;
+}
+
+int layer_find(uint32_t mask, const char *rel, struct stat *st) {
+    uint64_t h = 0;
+    int hashed = 0;
+    for (int i = 0; i < nlayers && mask >> i; i++) {
+        if (!(mask & (1u << i))) continue;
+        const struct bloom *b = __atomic_load_n(&layers[i].index, __ATOMIC_ACQUIRE);
+        if (b) {
+            if (!hashed) {
+                h = path_hash(rel);
+                hashed = 1;
+            }
+            if (!bloom_test(b, h)) continue;
+        }
+        if (fstatat(layers[i].fd, rel, st, AT_SYMLINK_NOFOLLOW) == 0) return i;
+        // ENOTDIR: ở layer này một thư mục cha là file, path không có ở đây
+        if (errno != ENOENT && errno != ENOTDIR) return -errno;
+    }
+    return -ENOENT;
+}
+
+uint32_t layer_find_dirs(uint32_t mask, const char *rel) {
+    uint32_t dirs = 0;
+    struct stat st;
+    while (mask) {
+        int i = layer_find(mask, rel, &st);
+        if (i < 0 || !S_ISDIR(st.st_mode)) break;
+        dirs |= 1u << i;
+        mask &= ~((2u << i) - 1);   // chỉ các layer bên dưới i
+    }
+    return dirs;
+}
+
+uint32_t layer_path_dirs(const char *rel) {
+    char prefix[PATH_MAX];
+    size_t len = strlen(rel);
+    if (len >= sizeof(prefix)) return 0;
+    memcpy(prefix, rel, len + 1);
+
+    // Như resolve đi từ gốc xuống: mỗi thành phần chỉ hỏi các layer mà thư mục cha gộp vào
+    uint32_t mask = layer_all();
+    for (char *p = prefix; mask; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        mask = layer_find_dirs(mask, prefix);
+        if (c == '\0') break;
+        *p = c;
+    }
+    return mask;
+}
+
+int layer_open(const char *rel, int flags) {
+    struct stat st;
+    int i = layer_find(layer_all(), rel, &st);
+    if (i < 0) return i;
+    int fd = openat(layers[i].fd, rel, flags);
+    return fd == -1 ? -errno : fd;
+}
+
+// ---- index build ----
+
+struct walk {
+    uint64_t *hashes;
+    size_t n, cap;
+    char path[PATH_MAX];            // path tương đối của entry đang xét
+};
+
+static int add_hash(struct walk *w, uint64_t h) {
+    if (w->n == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        uint64_t *p = realloc(w->hashes, cap * sizeof(*p));
+        if (!p) return -ENOMEM;
+        w->hashes = p;
+        w->cap = cap;
+    }
+    w->hashes[w->n++] = h;
+    return 0;
+}
+
+// w->path[0..len) là thư mục đang duyệt ("" = gốc); đóng dfd
+static int walk_dir(struct walk *w, int dfd, size_t len) {
+    DIR *dp = fdopendir(dfd);
+    if (!dp) {
+        int err = -errno;
+        close(dfd);
+        return err;
+    }
+    int res = 0;
+    struct dirent *de;
+    while (res == 0) {
+        errno = 0;
+        if ((de = readdir(dp)) == NULL) {
+            res = -errno;
+            break;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+            res = -ECANCELED;
+            break;
+        }
+
+        size_t nlen = strlen(de->d_name);
+        size_t plen = len ? len + 1 + nlen : nlen;
+        if (plen >= sizeof(w->path)) {
+            res = -ENAMETOOLONG;
+            break;
+        }
+        if (len) w->path[len] = '/';
+        memcpy(w->path + plen - nlen, de->d_name, nlen + 1);
+        res = add_hash(w, path_hash(w->path));
+
+        if (res == 0 && (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN)) {
+            int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub != -1) res = walk_dir(w, sub, plen);
+            else if (de->d_type == DT_DIR || (errno != ENOTDIR && errno != ELOOP)) res = -errno;
+        }
+    }
+    closedir(dp);
+    return res;
+}
+
+static void *index_main(void *arg) {
+    int i = (int)(intptr_t)arg;
+    struct walk *w = calloc(1, sizeof(*w));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int res = w ? 0 : -ENOMEM;
+    if (res == 0) {
+        int dfd = openat(layers[i].fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        res = dfd == -1 ? -errno : walk_dir(w, dfd, 0);
+    }
+    if (res == 0) res = add_hash(w, path_hash("."));
+    struct bloom *b = NULL;
+    if (res == 0 && (b = bloom_build(w->hashes, w->n)) == NULL) res = -ENOMEM;
+
+    if (res == 0) {
+        __atomic_store_n(&layers[i].index, b, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+        fprintf(stderr, "[INFO] Layer %d indexed: %zu paths in %ld ms\n", i, w->n, ms);
+    } else if (res != -ECANCELED) {
+        // Layer không đọc hết được: giữ cách tra bằng fstatat, luôn đúng
+        fprintf(stderr, "[WARN] Cannot index layer %d: %s\n", i, strerror(-res));
+    }
+    if (w) free(w->hashes);
+    free(w);
+    return NULL;
+}
+
+void layer_set_index(enum layer_index_mode mode) {
+    index_mode = mode;
+}
+
+int layer_index_start(void) {
+    if (index_mode == LAYER_INDEX_OFF || (index_mode == LAYER_INDEX_AUTO && nlayers < 2)) return 0;
+    __atomic_store_n(&stopping, 0, __ATOMIC_RELAXED);
+    // Mỗi layer một thread: các layer thường nằm trên đĩa/thư mục khác nhau.
+    // Bỏ qua layer 0: Source vẫn được thêm file khi đang mount, filter không
+    // bao giờ build lại sẽ báo ENOENT cho file mới
+    int res = 0;
+    for (int i = 1; i < nlayers; i++) {
+        if (layers[i].building || layers[i].index) continue;
+        if (pthread_create(&layers[i].thread, NULL, index_main, (void *)(intptr_t)i) == 0) layers[i].building = 1;
+        else res = -1;
+    }
+    return res;
+}
+
+void layer_index_wait(void) {
+    for (int i = 0; i < nlayers; i++) {
+        if (!layers[i].building) continue;
+        pthread_join(layers[i].thread, NULL);
+        layers[i].building = 0;
+    }
+}
+
+void layer_index_stop(void) {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    layer_index_wait();
+    for (int i = 0; i < nlayers; i++) {
+        free(layers[i].index);
+        layers[i].index = NULL;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Read-only lower layers below Storage, layer 0 on top (the Source given on
+// the command line), then every --lower in order. A path is taken from the
+// topmost layer that has it; directories merge with the directories of the
+// same name further down.
+//
+// Each --lower layer can carry a name index: a Bloom filter of every path
+// in the layer, built when the mount starts by one thread per layer. A
+// lookup skips a layer whose filter says the path is not there with a few
+// memory probes instead of an fstatat; until a filter is ready the layer is
+// probed with fstatat as before. The filters are never updated, so indexed
+// lower layers must not be changed while mounted. Layer 0 (the Source) may
+// change under the mount and is never indexed.
+
+#define LAYER_MAX 32                // masks are uint32_t
+
+enum layer_index_mode {
+    LAYER_INDEX_AUTO,               // on when there is more than one layer
+    LAYER_INDEX_ON,
+    LAYER_INDEX_OFF,
+};
+
+// Layer 0; call before layer_add
+void layer_init(int source_fd);
+// Next lower layer; 0 or -errno
+int layer_add(const char *dir);
+int layer_count(void);
+int layer_dirfd(int layer);
+uint32_t layer_all(void);
+
+// Topmost layer of mask that has rel ("a/b", root "."), with its stat;
+// -ENOENT if none
+int layer_find(uint32_t mask, const char *rel, struct stat *st);
+// Layers of mask where rel is a directory merged into the topmost one:
+// stops at the first layer where rel is something else
+uint32_t layer_find_dirs(uint32_t mask, const char *rel);
+// Layers merged into the directory rel when it is reached from the root,
+// each component merging only with the layers its parent merged
+uint32_t layer_path_dirs(const char *rel);
+// open() of rel in the topmost layer that has it; fd or -errno
+int layer_open(const char *rel, int flags);
+
+void layer_set_index(enum layer_index_mode mode);
+int layer_index_start(void);
+// Wait until every index is built (or given up)
+void layer_index_wait(void);
+void layer_index_stop(void);
+
+#endif
@@ -0,0 +1,418 @@
+/*
+ * lazy_copy.c
+ * Block-granular (lazy) copy-up, see lazy_copy.h.
+ *
+ * Bits only ever go 0 -> 1 while a file is lazy, so readers check them
+ * without the lock; copying a block up and setting its bit happens under
+ * the per-file lock so two writers never copy over each other's data.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include "lazy_copy.h"
+#include "copy_engine.h"
+#include "layers.h"
+#include "storage.h"
+
+extern int g_storage_fd;
+
+struct lazy_file {
+    char *path;                 // virtual path; NULL once detached
+    int refs;
+    pthread_mutex_t lock;
+    int src_fd;                 // original source file (clean blocks)
+    int upper_fd;               // private O_RDWR fd on the Storage file
+    int bm_fd;                  // sidecar
+    off_t bits_off;             // offset of the bitmap in the sidecar
+    uint64_t src_size;
+    uint64_t nblocks;
+    uint8_t *bits;
+    struct lazy_file *next;
+};
+
+static off_t lazy_threshold = 0;
+
+// Các file đang mở dở (ít) -> danh sách liên kết là đủ
+static struct lazy_file *open_files = NULL;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lazy_set_threshold(off_t min_bytes) {
+    lazy_threshold = min_bytes;
+}
+
+int lazy_wants(const struct stat *st) {
+    return lazy_threshold > 0 && S_ISREG(st->st_mode) && st->st_size >= lazy_threshold;
+}
+
+// Ngưỡng chỉ quyết định copy-up mới; Storage giữ lại từ lần mount trước
+// (--storage-mode=persist) có thể còn sidecar dù lần này tắt lazy
+static int may_have_sidecars(void) {
+    return lazy_threshold > 0 || storage_reused();
+}
+
+static const char *rel_of(const char *path) {
+    while (*path == '/') path++;
+    return *path ? path : ".";
+}
+
+static void sidecar_path(char out[PATH_MAX], const char *path) {
+    const char *rel = rel_of(path);
+    const char *slash = strrchr(rel, '/');
+    if (slash) {
+        snprintf(out, PATH_MAX, "%.*s/" LAZY_PREFIX "%s", (int)(slash - rel), rel, slash + 1);
+    } else {
+        snprintf(out, PATH_MAX, LAZY_PREFIX "%s", rel);
+    }
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int block_dirty(struct lazy_file *lf, uint64_t b) {
+    // Block sau kích thước Source gốc luôn nằm ở Storage
+    if (b >= lf->nblocks) return 1;
+    return (__atomic_load_n(&lf->bits[b / 8], __ATOMIC_ACQUIRE) >> (b % 8)) & 1;
+}
+
+// Caller holds lf->lock
+static void mark_dirty(struct lazy_file *lf, uint64_t first, uint64_t last) {
+    if (first >= lf->nblocks) return;
+    if (last >= lf->nblocks) last = lf->nblocks - 1;
+    for (uint64_t b = first; b <= last; b++) {
+        __atomic_fetch_or(&lf->bits[b / 8], (uint8_t)(1u << (b % 8)), __ATOMIC_RELEASE);
+    }
+    size_t lo = first / 8, hi = last / 8;
+    if (pwrite(lf->bm_fd, lf->bits + lo, hi - lo + 1, lf->bits_off + lo) == -1) {
+        perror("lazy_copy: bitmap update");
+    }
+}
+
+// Copy block b from Source into the upper file. Caller holds lf->lock.
+static int materialize(struct lazy_file *lf, uint64_t b) {
+    if (block_dirty(lf, b)) return 0;
+    off_t off = (off_t)b * LAZY_BLOCK_SIZE;
+    off_t len = lf->src_size - off < LAZY_BLOCK_SIZE ? (off_t)(lf->src_size - off) : LAZY_BLOCK_SIZE;
+    int res = copy_range(lf->src_fd, off, lf->upper_fd, off, len);
+    if (res == 0) mark_dirty(lf, b, b);
+    return res;
+}
+
+int lazy_copy_up(const char *path, const char *src_rel, int src_fd, int dst_fd, const struct stat *st) {
+    // Reflink vẫn là lựa chọn tốt nhất: không cần bitmap
+    if (copy_clone(src_fd, dst_fd) == 0) return copy_metadata(dst_fd, st);
+
+    if (ftruncate(dst_fd, st->st_size) == -1) return -errno;
+    int res = copy_metadata(dst_fd, st);
+    if (res != 0) return res;
+
+    uint64_t nblocks = ((uint64_t)st->st_size + LAZY_BLOCK_SIZE - 1) / LAZY_BLOCK_SIZE;
+    struct lazy_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LAZY_MAGIC, sizeof(LAZY_MAGIC));
+    hdr.src_size = st->st_size;
+    hdr.block_size = LAZY_BLOCK_SIZE;
+    hdr.src_path_len = strlen(src_rel);
+
+    char bm[PATH_MAX];
+    sidecar_path(bm, path);
+    int fd = openat(g_storage_fd, bm, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return -errno;
+    // Bitmap toàn 0 = hole, chỉ cần ghi header + path
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(fd, src_rel, hdr.src_path_len, sizeof(hdr)) != (ssize_t)hdr.src_path_len ||
+        ftruncate(fd, sizeof(hdr) + hdr.src_path_len + (nblocks + 7) / 8) == -1) {
+        res = -errno;
+        close(fd);
+        unlinkat(g_storage_fd, bm, 0);
+        return res;
+    }
+    close(fd);
+    return 0;
+}
+
+static struct lazy_file *load(const char *path) {
+    char bm[PATH_MAX];
+    sidecar_path(bm, path);
+    int fd = openat(g_storage_fd, bm, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct lazy_header hdr;
+    char src_rel[PATH_MAX];
+    if (read_full(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, LAZY_MAGIC, sizeof(LAZY_MAGIC)) != 0 ||
+        hdr.block_size != LAZY_BLOCK_SIZE || hdr.src_path_len >= PATH_MAX ||
+        read_full(fd, src_rel, hdr.src_path_len, sizeof(hdr)) != (ssize_t)hdr.src_path_len) {
+        close(fd);
+        return NULL;
+    }
+    src_rel[hdr.src_path_len] = '\0';
+
+    struct lazy_file *lf = calloc(1, sizeof(*lf));
+    if (!lf) {
+        close(fd);
+        return NULL;
+    }
+    lf->bm_fd = fd;
+    lf->bits_off = sizeof(hdr) + hdr.src_path_len;
+    lf->src_size = hdr.src_size;
+    lf->nblocks = (hdr.src_size + LAZY_BLOCK_SIZE - 1) / LAZY_BLOCK_SIZE;
+    lf->bits = calloc((lf->nblocks + 7) / 8 + 1, 1);
+    lf->path = strdup(path);
+    // Source gốc lấy theo path lưu trong sidecar (file có thể đã bị rename),
+    // ở lower layer trên cùng có path đó
+    int src_fd = layer_open(src_rel, O_RDONLY | O_CLOEXEC);
+    lf->src_fd = src_fd < 0 ? -1 : src_fd;
+    lf->upper_fd = openat(g_storage_fd, rel_of(path), O_RDWR | O_CLOEXEC);
+    pthread_mutex_init(&lf->lock, NULL);
+
+    if (!lf->bits || !lf->path || lf->src_fd == -1 || lf->upper_fd == -1 ||
+        read_full(fd, lf->bits, (lf->nblocks + 7) / 8, lf->bits_off) < 0) {
+        lf->refs = 1;
+        lazy_release(lf);
+        return NULL;
+    }
+    return lf;
+}
+
+struct lazy_file *lazy_open(const char *path) {
+    if (!may_have_sidecars()) return NULL;
+
+    pthread_mutex_lock(&open_lock);
+    struct lazy_file *lf;
+    for (lf = open_files; lf; lf = lf->next) {
+        if (strcmp(lf->path, path) == 0) {
+            lf->refs++;
+            pthread_mutex_unlock(&open_lock);
+            return lf;
+        }
+    }
+    lf = load(path);
+    if (lf) {
+        lf->refs = 1;
+        lf->next = open_files;
+        open_files = lf;
+    }
+    pthread_mutex_unlock(&open_lock);
+    return lf;
+}
+
+// Remove lf from the open list; caller holds open_lock
+static void detach(struct lazy_file *lf) {
+    for (struct lazy_file **pp = &open_files; *pp; pp = &(*pp)->next) {
+        if (*pp == lf) {
+            *pp = lf->next;
+            break;
+        }
+    }
+    free(lf->path);
+    lf->path = NULL;
+    lf->next = NULL;
+}
+
+void lazy_release(struct lazy_file *lf) {
+    if (!lf) return;
+    pthread_mutex_lock(&open_lock);
+    if (--lf->refs > 0) {
+        pthread_mutex_unlock(&open_lock);
+        return;
+    }
+    if (lf->path) detach(lf);
+    pthread_mutex_unlock(&open_lock);
+
+    if (lf->src_fd != -1) close(lf->src_fd);
+    if (lf->upper_fd != -1) close(lf->upper_fd);
+    if (lf->bm_fd != -1) close(lf->bm_fd);
+    pthread_mutex_destroy(&lf->lock);
+    free(lf->bits);
+    free(lf);
+}
+
+off_t lazy_size(struct lazy_file *lf) {
+    struct stat st;
+    return fstat(lf->upper_fd, &st) == -1 ? -errno : st.st_size;
+}
+
+ssize_t lazy_read(struct lazy_file *lf, void *buf, size_t size, off_t offset) {
+    off_t fsize = lazy_size(lf);
+    if (fsize < 0) return fsize;
+    if (offset >= fsize) return 0;
+    if ((off_t)size > fsize - offset) size = fsize - offset;
+
+    char *out = buf;
+    size_t done = 0;
+    while (done < size) {
+        // Gom các block liên tiếp cùng trạng thái thành 1 lần pread
+        off_t pos = offset + done;
+        uint64_t b = pos / LAZY_BLOCK_SIZE;
+        int dirty = block_dirty(lf, b);
+        off_t run_end = (off_t)(b + 1) * LAZY_BLOCK_SIZE;
+        while (run_end < offset + (off_t)size && block_dirty(lf, run_end / LAZY_BLOCK_SIZE) == dirty) {
+            run_end += LAZY_BLOCK_SIZE;
+        }
+        size_t len = run_end - pos < (off_t)(size - done) ? (size_t)(run_end - pos) : size - done;
+
+        ssize_t n = read_full(dirty ? lf->upper_fd : lf->src_fd, out + done, len, pos);
+        if (n < 0) return done ? (ssize_t)done : n;
+        // Source ngắn hơn kích thước hiện tại (file đã được nới ra): phần còn lại là 0
+        if ((size_t)n < len) memset(out + done + n, 0, len - n);
+        done += len;
+    }
+    return done;
+}
+
+int lazy_prepare_write(struct lazy_file *lf, off_t offset, size_t size) {
+    if (size == 0) return 0;
+    uint64_t first = offset / LAZY_BLOCK_SIZE;
+    uint64_t last = (offset + size - 1) / LAZY_BLOCK_SIZE;
+    if (first >= lf->nblocks) return 0;
+    if (last >= lf->nblocks) last = lf->nblocks - 1;
+
+    int res = 0;
+    pthread_mutex_lock(&lf->lock);
+    for (uint64_t b = first; b <= last && res == 0; b++) {
+        if (block_dirty(lf, b)) continue;
+        off_t bstart = (off_t)b * LAZY_BLOCK_SIZE;
+        off_t bend = bstart + LAZY_BLOCK_SIZE < (off_t)lf->src_size ? bstart + LAZY_BLOCK_SIZE : (off_t)lf->src_size;
+        // Write phủ hết phần dữ liệu của block -> không cần copy. Block chỉ
+        // thành dirty khi dữ liệu đã ghi xong (lazy_commit_write)
+        if (offset > bstart || offset + (off_t)size < bend) res = materialize(lf, b);
+    }
+    pthread_mutex_unlock(&lf->lock);
+    return res;
+}
+
+int lazy_commit_write(struct lazy_file *lf, off_t offset, size_t written) {
+    if (written == 0) return 0;
+    uint64_t first = offset / LAZY_BLOCK_SIZE;
+    uint64_t last = (offset + written - 1) / LAZY_BLOCK_SIZE;
+    if (first >= lf->nblocks) return 0;
+    if (last >= lf->nblocks) last = lf->nblocks - 1;
+
+    // Block ghi đè một phần đã dirty từ lazy_prepare_write: thường không còn gì để làm
+    uint64_t b = first;
+    while (b <= last && block_dirty(lf, b)) b++;
+    if (b > last) return 0;
+
+    int res = 0;
+    pthread_mutex_lock(&lf->lock);
+    // Ghi thiếu dừng giữa block chưa copy: phần còn lại của block lấy từ Source
+    off_t end = offset + (off_t)written;
+    off_t lstart = (off_t)last * LAZY_BLOCK_SIZE;
+    off_t lend = lstart + LAZY_BLOCK_SIZE < (off_t)lf->src_size ? lstart + LAZY_BLOCK_SIZE : (off_t)lf->src_size;
+    uint64_t stop = last + 1;
+    if (end < lend && !block_dirty(lf, last)) {
+        res = copy_range(lf->src_fd, end, lf->upper_fd, end, lend - end);
+        // Không copy được: block đó vẫn đọc từ Source, các block trước vẫn hợp lệ
+        if (res != 0) stop = last;
+    }
+    if (b < stop) mark_dirty(lf, b, stop - 1);
+    pthread_mutex_unlock(&lf->lock);
+    return res;
+}
+
+int lazy_truncate_prepare(const char *path, off_t size) {
+    struct lazy_file *lf = lazy_open(path);
+    if (!lf) return 0;
+
+    int res = 0;
+    pthread_mutex_lock(&lf->lock);
+    uint64_t cut = size / LAZY_BLOCK_SIZE;
+    // Block chứa điểm cắt phải có bản copy thật trước khi ftruncate
+    if (size % LAZY_BLOCK_SIZE && cut < lf->nblocks) res = materialize(lf, cut);
+    pthread_mutex_unlock(&lf->lock);
+    lazy_release(lf);
+    return res;
+}
+
+void lazy_truncate(const char *path, off_t size) {
+    if (size == 0) {
+        // File rỗng: toàn bộ đã nằm ở Storage, bỏ sidecar
+        lazy_remove(path);
+        return;
+    }
+    struct lazy_file *lf = lazy_open(path);
+    if (!lf) return;
+
+    pthread_mutex_lock(&lf->lock);
+    // Block cắt dở đã được copy ở bước prepare; mọi block sau nó giờ là
+    // vùng 0 của file Storage
+    uint64_t keep = (size + LAZY_BLOCK_SIZE - 1) / LAZY_BLOCK_SIZE;
+    if (keep < lf->nblocks) mark_dirty(lf, keep, lf->nblocks - 1);
+    pthread_mutex_unlock(&lf->lock);
+    lazy_release(lf);
+}
+
+// path == root or path is below root
+static int in_tree(const char *path, const char *root) {
+    size_t len = strlen(root);
+    return strncmp(path, root, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+void lazy_rename(const char *from, const char *to) {
+    if (!may_have_sidecars()) return;
+
+    char bm_from[PATH_MAX], bm_to[PATH_MAX];
+    sidecar_path(bm_from, from);
+    sidecar_path(bm_to, to);
+    // Target cũ (nếu là file lazy) đã bị ghi đè
+    unlinkat(g_storage_fd, bm_to, 0);
+    renameat(g_storage_fd, bm_from, g_storage_fd, bm_to);
+
+    // Đổi key cho file đang mở, kể cả các file nằm trong thư mục bị rename
+    pthread_mutex_lock(&open_lock);
+    for (struct lazy_file **pp = &open_files; *pp; ) {
+        struct lazy_file *lf = *pp;
+        if (in_tree(lf->path, to)) {
+            // Bị ghi đè: handle cũ giữ state riêng, không còn tra được theo path
+            detach(lf);
+            continue;
+        }
+        pp = &lf->next;
+    }
+    size_t flen = strlen(from);
+    for (struct lazy_file *lf = open_files; lf; lf = lf->next) {
+        if (!in_tree(lf->path, from)) continue;
+        char *np = malloc(strlen(to) + strlen(lf->path + flen) + 1);
+        if (!np) continue;
+        sprintf(np, "%s%s", to, lf->path + flen);
+        free(lf->path);
+        lf->path = np;
+    }
+    pthread_mutex_unlock(&open_lock);
+}
+
+void lazy_remove(const char *path) {
+    if (!may_have_sidecars()) return;
+
+    char bm[PATH_MAX];
+    sidecar_path(bm, path);
+    unlinkat(g_storage_fd, bm, 0);
+
+    pthread_mutex_lock(&open_lock);
+    for (struct lazy_file *lf = open_files; lf; lf = lf->next) {
+        if (strcmp(lf->path, path) == 0) {
+            detach(lf);     // handle đang mở vẫn dùng được, path mới không thấy nó nữa
+            break;
+        }
+    }
+    pthread_mutex_unlock(&open_lock);
+}
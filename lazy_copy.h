@@ -0,0 +1,65 @@
+#ifndef LAZY_COPY_H
+#define LAZY_COPY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Block-granular copy-up for large source files.
+//
+// Instead of copying the whole file on first modification, the upper file
+// in Storage is created sparse at the source size and a sidecar bitmap
+// (.bm.<name> next to it) records which blocks have been overridden.
+// Clean blocks are read from the original source file, dirty ones from
+// Storage; a write only copies the (partial) blocks it touches.
+
+#define LAZY_BLOCK_SIZE (64 * 1024)
+#define LAZY_MAGIC "VFSLZY1"
+#define LAZY_PREFIX ".bm."
+
+// Sidecar layout: header, src_path_len bytes of the source-relative path
+// the clean blocks come from, then one bit per block (1 = in Storage)
+struct lazy_header {
+    char magic[8];
+    uint64_t src_size;
+    uint32_t block_size;
+    uint32_t src_path_len;
+};
+
+struct lazy_file;
+
+// Files of at least min_bytes are copied up lazily; 0 disables (default).
+// Lazy files already in a Storage kept by storage_open are served either way.
+void lazy_set_threshold(off_t min_bytes);
+int lazy_wants(const struct stat *st);
+
+// Copy-up src_fd -> dst_fd (new Storage file for path): reflink when
+// possible, otherwise sparse file + sidecar. Metadata is copied too.
+// src_rel is where src_fd lives in the lower layers.
+int lazy_copy_up(const char *path, const char *src_rel, int src_fd, int dst_fd, const struct stat *st);
+
+// Get the shared state of a partially copied-up file, or NULL if path is
+// fully in Storage. Every successful lazy_open needs a lazy_release.
+struct lazy_file *lazy_open(const char *path);
+void lazy_release(struct lazy_file *lf);
+
+// Read the merged view (short only at EOF); returns bytes or -errno
+ssize_t lazy_read(struct lazy_file *lf, void *buf, size_t size, off_t offset);
+// Logical file size (size of the upper file)
+off_t lazy_size(struct lazy_file *lf);
+// Copy up the blocks [offset, offset+size) only partly covers before a
+// write; fully covered blocks stay clean until lazy_commit_write
+int lazy_prepare_write(struct lazy_file *lf, off_t offset, size_t size);
+// After the write: mark the blocks of the written bytes as in Storage
+// (the rest of a block a short write stopped in is copied up); 0 or -errno
+int lazy_commit_write(struct lazy_file *lf, off_t offset, size_t written);
+
+// Path-level hooks for operations that change the upper file.
+// Truncate is two-step: prepare copies up the block the cut falls in before
+// the real truncate; lazy_truncate records the result only after it succeeded.
+int lazy_truncate_prepare(const char *path, off_t size);
+void lazy_truncate(const char *path, off_t size);
+void lazy_rename(const char *from, const char *to);
+void lazy_remove(const char *path);
+
+#endif
@@ -0,0 +1,544 @@
+/*
+ * log_segment.c
+ * Writer for the binary, indexed log segment format (see log_segment.h).
+ *
+ * Only the log writer thread calls into this file (under logging.c's
+ * format lock), so the in-memory dictionaries and postings need no locking.
+ * Dictionary entries are appended to a .dict sidecar before any record
+ * that uses them, which lets an unsealed segment left by a crash be
+ * replayed and sealed the next time the writer opens the directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "log_segment.h"
+
+#define SEG_PENDING_RECORDS 4096
+
+struct u32vec {
+    uint32_t *v;
+    uint32_t n, cap;
+};
+
+struct seg_uid {
+    uint32_t uid;
+    char *name;
+    struct u32vec postings;
+};
+
+struct strlist {
+    char **s;
+    struct u32vec *postings;
+    uint32_t n, cap;
+};
+
+static int seg_dirfd = -1;
+static unsigned int seg_next_seq = 1;
+static unsigned int seg_cur_seq;
+static int rec_fd = -1;
+static int dict_fd = -1;
+static uint64_t rec_count;
+static int64_t ts_min, ts_max;
+
+static struct strlist ops;
+static struct strlist paths;
+static uint32_t *path_hash;         // open addressing, stores id + 1
+static uint32_t path_hash_cap;
+static struct seg_uid *uids;
+static uint32_t uid_count, uid_cap;
+
+static struct seg_record pending[SEG_PENDING_RECORDS];
+static size_t pending_n;
+static char *dict_buf;
+static size_t dict_len, dict_cap;
+
+static int vec_push(struct u32vec *vec, uint32_t x) {
+    if (vec->n == vec->cap) {
+        uint32_t cap = vec->cap ? vec->cap * 2 : 16;
+        uint32_t *v = realloc(vec->v, cap * sizeof(*v));
+        if (!v) return -1;
+        vec->v = v;
+        vec->cap = cap;
+    }
+    vec->v[vec->n++] = x;
+    return 0;
+}
+
+static uint32_t hash_str(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (uint8_t)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void dict_add(char kind, uint32_t id, const char *text) {
+    size_t need = strlen(text) + 32;
+    if (dict_len + need > dict_cap) {
+        size_t cap = dict_cap ? dict_cap * 2 : 4096;
+        while (cap < dict_len + need) cap *= 2;
+        char *b = realloc(dict_buf, cap);
+        if (!b) return;
+        dict_buf = b;
+        dict_cap = cap;
+    }
+    dict_len += sprintf(dict_buf + dict_len, "%c %u %s\n", kind, id, text);
+}
+
+static int strlist_add(struct strlist *l, const char *s) {
+    if (l->n == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        char **ns = realloc(l->s, cap * sizeof(*ns));
+        if (!ns) return -1;
+        l->s = ns;
+        struct u32vec *np = realloc(l->postings, cap * sizeof(*np));
+        if (!np) return -1;
+        l->postings = np;
+        l->cap = cap;
+    }
+    l->s[l->n] = strdup(s);
+    memset(&l->postings[l->n], 0, sizeof(struct u32vec));
+    return l->n++;
+}
+
+static void strlist_free(struct strlist *l) {
+    for (uint32_t i = 0; i < l->n; i++) {
+        free(l->s[i]);
+        free(l->postings[i].v);
+    }
+    free(l->s);
+    free(l->postings);
+    memset(l, 0, sizeof(*l));
+}
+
+static int intern_op(const char *op, int log_new) {
+    // Số loại operation rất nhỏ -> tìm tuyến tính
+    for (uint32_t i = 0; i < ops.n; i++) {
+        if (strcmp(ops.s[i], op) == 0) return i;
+    }
+    if (ops.n >= 0xffff) return 0;
+    int id = strlist_add(&ops, op);
+    if (id >= 0 && log_new) dict_add('o', id, op);
+    return id;
+}
+
+static int path_hash_grow(void) {
+    uint32_t cap = path_hash_cap ? path_hash_cap * 2 : 1024;
+    uint32_t *t = calloc(cap, sizeof(*t));
+    if (!t) return -1;
+    for (uint32_t i = 0; i < paths.n; i++) {
+        uint32_t h = hash_str(paths.s[i]) & (cap - 1);
+        while (t[h]) h = (h + 1) & (cap - 1);
+        t[h] = i + 1;
+    }
+    free(path_hash);
+    path_hash = t;
+    path_hash_cap = cap;
+    return 0;
+}
+
+static int intern_path(const char *path, int log_new) {
+    if ((paths.n + 1) * 2 > path_hash_cap && path_hash_grow() != 0) return -1;
+
+    uint32_t h = hash_str(path) & (path_hash_cap - 1);
+    while (path_hash[h]) {
+        uint32_t id = path_hash[h] - 1;
+        if (strcmp(paths.s[id], path) == 0) return id;
+        h = (h + 1) & (path_hash_cap - 1);
+    }
+    int id = strlist_add(&paths, path);
+    if (id < 0) return -1;
+    path_hash[h] = id + 1;
+    if (log_new) dict_add('p', id, path);
+    return id;
+}
+
+static struct seg_uid *intern_uid(uint32_t uid, const char *name, int log_new) {
+    for (uint32_t i = 0; i < uid_count; i++) {
+        if (uids[i].uid == uid) return &uids[i];
+    }
+    if (uid_count == uid_cap) {
+        uint32_t cap = uid_cap ? uid_cap * 2 : 16;
+        struct seg_uid *n = realloc(uids, cap * sizeof(*n));
+        if (!n) return NULL;
+        uids = n;
+        uid_cap = cap;
+    }
+    struct seg_uid *u = &uids[uid_count++];
+    memset(u, 0, sizeof(*u));
+    u->uid = uid;
+    u->name = strdup(name ? name : "unknown");
+    if (log_new) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s", u->name);
+        dict_add('u', uid, line);
+    }
+    return u;
+}
+
+static void reset_state(void) {
+    strlist_free(&ops);
+    strlist_free(&paths);
+    free(path_hash);
+    path_hash = NULL;
+    path_hash_cap = 0;
+    for (uint32_t i = 0; i < uid_count; i++) {
+        free(uids[i].name);
+        free(uids[i].postings.v);
+    }
+    free(uids);
+    uids = NULL;
+    uid_count = uid_cap = 0;
+    rec_count = 0;
+    pending_n = 0;
+    dict_len = 0;
+}
+
+// Add postings for one record (live append and crash replay share this)
+static void index_record(const struct seg_record *r, struct seg_uid *u) {
+    uint32_t id = (uint32_t)rec_count;
+    if (u) vec_push(&u->postings, id);
+    if (r->op_id < ops.n) vec_push(&ops.postings[r->op_id], id);
+    if (r->path_id < paths.n) vec_push(&paths.postings[r->path_id], id);
+    if (rec_count == 0 || r->ts < ts_min) ts_min = r->ts;
+    if (rec_count == 0 || r->ts > ts_max) ts_max = r->ts;
+    rec_count++;
+}
+
+static void seg_name(char *out, size_t len, unsigned int seq, const char *ext) {
+    snprintf(out, len, "seg-%06u.%s", seq, ext);
+}
+
+// --- Sealing ---
+
+struct outbuf {
+    char *p;
+    size_t len, cap;
+};
+
+static void *out_reserve(struct outbuf *o, size_t len) {
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap * 2 : 65536;
+        while (cap < o->len + len) cap *= 2;
+        char *p = realloc(o->p, cap);
+        if (!p) return NULL;
+        o->p = p;
+        o->cap = cap;
+    }
+    void *at = o->p + o->len;
+    memset(at, 0, len);
+    o->len += len;
+    return at;
+}
+
+static void out_align(struct outbuf *o) {
+    size_t pad = (8 - (o->len & 7)) & 7;
+    if (pad) out_reserve(o, pad);
+}
+
+static uint64_t strtab_size(const struct strlist *l) {
+    uint64_t blob = 0;
+    for (uint32_t i = 0; i < l->n; i++) blob += strlen(l->s[i]);
+    return sizeof(struct seg_strtab) + (uint64_t)l->n * sizeof(struct seg_strent) + ((blob + 7) & ~7ull);
+}
+
+static void emit_strtab(struct outbuf *o, const struct strlist *l) {
+    uint32_t blob = 0;
+    for (uint32_t i = 0; i < l->n; i++) blob += strlen(l->s[i]);
+
+    struct seg_strtab *t = out_reserve(o, sizeof(*t));
+    t->count = l->n;
+    t->blob_len = blob;
+    size_t ent_at = o->len;
+    out_reserve(o, (size_t)l->n * sizeof(struct seg_strent));
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < l->n; i++) {
+        struct seg_strent *e = (struct seg_strent *)(o->p + ent_at) + i;
+        uint32_t len = strlen(l->s[i]);
+        e->off = off;
+        e->len = len;
+        memcpy(out_reserve(o, len), l->s[i], len);
+        off += len;
+    }
+    out_align(o);
+}
+
+static int cmp_uid(const void *a, const void *b) {
+    const struct seg_uid *x = a, *y = b;
+    return x->uid < y->uid ? -1 : x->uid > y->uid;
+}
+
+static int seal_segment(void) {
+    if (rec_fd == -1) return 0;
+
+    uint64_t base = sizeof(struct seg_file_header) + rec_count * sizeof(struct seg_record);
+    struct outbuf o = {0};
+    struct seg_footer f;
+    memset(&f, 0, sizeof(f));
+
+    qsort(uids, uid_count, sizeof(*uids), cmp_uid);
+
+    f.record_count = rec_count;
+    f.records_off = sizeof(struct seg_file_header);
+    f.op_dict_off = base;
+    f.op_count = ops.n;
+    f.path_dict_off = f.op_dict_off + strtab_size(&ops);
+    f.path_count = paths.n;
+    f.user_off = f.path_dict_off + strtab_size(&paths);
+    f.user_count = uid_count;
+    uint64_t name_blob = 0;
+    for (uint32_t i = 0; i < uid_count; i++) name_blob += strlen(uids[i].name);
+    f.user_blob_off = f.user_off + (uint64_t)uid_count * sizeof(struct seg_user);
+    f.op_index_off = f.user_blob_off + ((name_blob + 7) & ~7ull);
+    f.path_index_off = f.op_index_off + (uint64_t)ops.n * sizeof(struct seg_postings);
+    uint64_t postings_at = f.path_index_off + (uint64_t)paths.n * sizeof(struct seg_postings);
+    f.ts_min = ts_min;
+    f.ts_max = ts_max;
+    memcpy(f.magic, SEG_FOOTER_MAGIC, sizeof(SEG_FOOTER_MAGIC));
+
+    emit_strtab(&o, &ops);
+    emit_strtab(&o, &paths);
+
+    // User table + name blob; postings offsets are assigned in the order
+    // users, ops, paths
+    uint64_t post = postings_at;
+    uint32_t name_off = 0;
+    for (uint32_t i = 0; i < uid_count; i++) {
+        struct seg_user *u = out_reserve(&o, sizeof(*u));
+        u->uid = uids[i].uid;
+        u->name_off = name_off;
+        u->name_len = strlen(uids[i].name);
+        u->count = uids[i].postings.n;
+        u->postings_off = post;
+        post += (uint64_t)u->count * sizeof(uint32_t);
+        name_off += u->name_len;
+    }
+    for (uint32_t i = 0; i < uid_count; i++) {
+        size_t len = strlen(uids[i].name);
+        memcpy(out_reserve(&o, len), uids[i].name, len);
+    }
+    out_align(&o);
+    struct strlist *lists[2] = { &ops, &paths };
+    for (int l = 0; l < 2; l++) {
+        for (uint32_t i = 0; i < lists[l]->n; i++) {
+            struct seg_postings *p = out_reserve(&o, sizeof(*p));
+            p->count = lists[l]->postings[i].n;
+            p->postings_off = post;
+            post += (uint64_t)p->count * sizeof(uint32_t);
+        }
+    }
+    for (uint32_t i = 0; i < uid_count; i++) {
+        memcpy(out_reserve(&o, uids[i].postings.n * sizeof(uint32_t)), uids[i].postings.v,
+               uids[i].postings.n * sizeof(uint32_t));
+    }
+    for (int l = 0; l < 2; l++) {
+        for (uint32_t i = 0; i < lists[l]->n; i++) {
+            struct u32vec *v = &lists[l]->postings[i];
+            memcpy(out_reserve(&o, v->n * sizeof(uint32_t)), v->v, v->n * sizeof(uint32_t));
+        }
+    }
+    out_align(&o);
+    memcpy(out_reserve(&o, sizeof(f)), &f, sizeof(f));
+
+    int res = -1;
+    if (o.p && pwrite(rec_fd, o.p, o.len, base) == (ssize_t)o.len && fsync(rec_fd) == 0) {
+        char from[64], to[64], dict[64];
+        seg_name(from, sizeof(from), seg_cur_seq, "open");
+        seg_name(to, sizeof(to), seg_cur_seq, "seg");
+        seg_name(dict, sizeof(dict), seg_cur_seq, "dict");
+        if (renameat(seg_dirfd, from, seg_dirfd, to) == 0) {
+            unlinkat(seg_dirfd, dict, 0);
+            res = 0;
+        }
+    }
+    free(o.p);
+
+    close(rec_fd);
+    rec_fd = -1;
+    if (dict_fd != -1) close(dict_fd);
+    dict_fd = -1;
+    reset_state();
+    return res;
+}
+
+// --- Crash recovery: replay an unsealed segment, then seal it ---
+
+static void recover_segment(unsigned int seq) {
+    char name[64];
+    seg_cur_seq = seq;
+
+    seg_name(name, sizeof(name), seq, "dict");
+    int fd = openat(seg_dirfd, name, O_RDONLY);
+    if (fd != -1) {
+        FILE *f = fdopen(fd, "r");
+        char line[4096 + 64];
+        while (f && fgets(line, sizeof(line), f)) {
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n') break;     // dòng ghi dở
+            line[len - 1] = '\0';
+            char kind;
+            unsigned int id;
+            int consumed = 0;
+            if (sscanf(line, "%c %u %n", &kind, &id, &consumed) < 2) continue;
+            const char *text = line + consumed;
+            if (kind == 'o' && id == ops.n) intern_op(text, 0);
+            else if (kind == 'p' && id == paths.n) intern_path(text, 0);
+            else if (kind == 'u') intern_uid(id, text, 0);
+        }
+        if (f) fclose(f);
+        else close(fd);
+    }
+
+    seg_name(name, sizeof(name), seq, "open");
+    rec_fd = openat(seg_dirfd, name, O_RDWR);
+    if (rec_fd == -1) {
+        reset_state();
+        return;
+    }
+
+    struct stat st;
+    fstat(rec_fd, &st);
+    uint64_t n = st.st_size > (off_t)sizeof(struct seg_file_header)
+                 ? (st.st_size - sizeof(struct seg_file_header)) / sizeof(struct seg_record) : 0;
+    for (uint64_t i = 0; i < n; i += SEG_PENDING_RECORDS) {
+        size_t chunk = n - i < SEG_PENDING_RECORDS ? n - i : SEG_PENDING_RECORDS;
+        off_t off = sizeof(struct seg_file_header) + i * sizeof(struct seg_record);
+        if (pread(rec_fd, pending, chunk * sizeof(struct seg_record), off) != (ssize_t)(chunk * sizeof(struct seg_record))) {
+            n = i;
+            break;
+        }
+        for (size_t k = 0; k < chunk; k++) {
+            struct seg_record *r = &pending[k];
+            // Record trỏ tới dict entry chưa kịp ghi -> dừng tại đây
+            if (r->op_id >= ops.n || r->path_id >= paths.n) {
+                n = i + k;
+                break;
+            }
+            index_record(r, intern_uid(r->uid, NULL, 0));
+        }
+        if (rec_count < i + chunk) break;
+    }
+    pending_n = 0;
+    // Cắt phần record dở dang trước khi ghi index ngay sau đó
+    ftruncate(rec_fd, sizeof(struct seg_file_header) + rec_count * sizeof(struct seg_record));
+    seal_segment();
+}
+
+int seg_writer_open(const char *dir) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) return -errno;
+    seg_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (seg_dirfd == -1) return -errno;
+
+    // Tìm số segment lớn nhất và seal các segment .open còn sót lại
+    int scan_fd = dup(seg_dirfd);
+    DIR *d = scan_fd == -1 ? NULL : fdopendir(scan_fd);
+    unsigned int open_seqs[64];
+    int n_open = 0;
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            unsigned int seq;
+            char ext[8];
+            if (sscanf(de->d_name, "seg-%u.%7s", &seq, ext) != 2) continue;
+            if (seq >= seg_next_seq) seg_next_seq = seq + 1;
+            if (strcmp(ext, "open") == 0 && n_open < 64) open_seqs[n_open++] = seq;
+        }
+        closedir(d);
+    }
+    for (int i = 0; i < n_open; i++) recover_segment(open_seqs[i]);
+    return 0;
+}
+
+static int start_segment(void) {
+    char name[64];
+    seg_cur_seq = seg_next_seq++;
+    seg_name(name, sizeof(name), seg_cur_seq, "open");
+    rec_fd = openat(seg_dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec_fd == -1) return -1;
+
+    seg_name(name, sizeof(name), seg_cur_seq, "dict");
+    dict_fd = openat(seg_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (dict_fd == -1) {
+        close(rec_fd);
+        rec_fd = -1;
+        return -1;
+    }
+
+    struct seg_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SEG_MAGIC, sizeof(SEG_MAGIC));
+    hdr.version = SEG_VERSION;
+    hdr.record_size = sizeof(struct seg_record);
+    return write_all(rec_fd, &hdr, sizeof(hdr));
+}
+
+void seg_writer_flush(void) {
+    if (rec_fd == -1) return;
+    // Dict trước, record sau: record trên đĩa luôn tham chiếu tới dict đã có
+    if (dict_len) {
+        write_all(dict_fd, dict_buf, dict_len);
+        dict_len = 0;
+    }
+    if (pending_n) {
+        off_t off = sizeof(struct seg_file_header) + (rec_count - pending_n) * sizeof(struct seg_record);
+        pwrite(rec_fd, pending, pending_n * sizeof(struct seg_record), off);
+        pending_n = 0;
+    }
+}
+
+void seg_writer_append(time_t ts, uid_t uid, const char *username, pid_t pid,
+                       const char *op, const char *path, int result) {
+    if (seg_dirfd == -1) return;
+    if (rec_fd == -1 && start_segment() != 0) return;
+
+    int op_id = intern_op(op, 1);
+    int path_id = intern_path(path, 1);
+    struct seg_uid *u = intern_uid(uid, username, 1);
+    if (op_id < 0 || path_id < 0 || !u) return;
+
+    struct seg_record *r = &pending[pending_n++];
+    memset(r, 0, sizeof(*r));
+    r->ts = ts;
+    r->uid = uid;
+    r->pid = pid;
+    r->result = result;
+    r->path_id = path_id;
+    r->op_id = op_id;
+    index_record(r, u);
+
+    if (pending_n == SEG_PENDING_RECORDS) seg_writer_flush();
+    if (rec_count >= SEG_MAX_RECORDS) {
+        seg_writer_flush();
+        seal_segment();
+    }
+}
+
+void seg_writer_close(void) {
+    seg_writer_flush();
+    seal_segment();
+    if (seg_dirfd != -1) {
+        close(seg_dirfd);
+        seg_dirfd = -1;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef LOG_SEGMENT_H
+#define LOG_SEGMENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Binary log segments: fixed-size records plus, once a segment is sealed,
+// dictionaries and postings indexes that cli_query can mmap and search
+// without scanning every record.
+//
+// Active segment:  seg-NNNNNN.open  (records only)
+//                  seg-NNNNNN.dict  (append-only "o|p|u <id> <text>" lines)
+// Sealed segment:  seg-NNNNNN.seg   layout:
+//   [seg_file_header][seg_record * record_count]
+//   [op dict][path dict][user table][op index][path index][postings]
+//   [seg_footer]
+// All offsets are absolute file offsets; sections are 8-byte aligned.
+
+#define SEG_MAGIC "VFSSEG1"
+#define SEG_FOOTER_MAGIC "VFSEND1"
+#define SEG_VERSION 1
+#define SEG_MAX_RECORDS (1u << 20)      // seal after this many records
+
+struct seg_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct seg_record {
+    int64_t ts;
+    uint32_t uid;
+    int32_t pid;
+    int32_t result;
+    uint32_t path_id;
+    uint16_t op_id;
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+
+// String dictionary: seg_strtab header, count entries, then the blob
+struct seg_strtab {
+    uint32_t count;
+    uint32_t blob_len;
+};
+
+struct seg_strent {
+    uint32_t off;       // relative to the blob start
+    uint32_t len;
+};
+
+// One entry per distinct uid, sorted by uid; names live in the user blob
+struct seg_user {
+    uint32_t uid;
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t count;
+    uint64_t postings_off;
+};
+
+// One entry per op id / path id
+struct seg_postings {
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t postings_off;  // uint32 record ids, ascending
+};
+
+struct seg_footer {
+    uint64_t record_count;
+    uint64_t records_off;
+    uint64_t op_dict_off;
+    uint64_t path_dict_off;
+    uint64_t user_off;
+    uint64_t user_blob_off;
+    uint32_t user_count;
+    uint32_t op_count;
+    uint64_t op_index_off;
+    uint32_t path_count;
+    uint32_t reserved;
+    uint64_t path_index_off;
+    int64_t ts_min;
+    int64_t ts_max;
+    char magic[8];
+};
+
+// Writer side (used by logging.c from the log writer thread only)
+int seg_writer_open(const char *dir);
+void seg_writer_append(time_t ts, uid_t uid, const char *username, pid_t pid,
+                       const char *op, const char *path, int result);
+void seg_writer_flush(void);
+void seg_writer_close(void);
+
+#endif
@@ -2,50 +2,368 @@
 #include <stdlib.h>
 #include <time.h>
 #include "logging.h"
+#include "log_segment.h"
+#include "metrics.h"
 #include <string.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-static FILE *log_file = NULL;
+// Async pipeline: FUSE threads push fixed-size records into a bounded
+// lock-free multi-producer ring; one writer thread formats them and writes
+// whole batches with a single write(). Username lookups and timestamp
+// formatting happen only on the writer thread, behind small caches.
+
+#define LOG_QUEUE_CAPACITY 4096         // power of two
+#define LOG_BATCH_BYTES (256 * 1024)
+#define LOG_OP_MAX 32
+#define LOG_PATH_MAX 1024
+#define LOG_LINE_MAX (LOG_OP_MAX + LOG_PATH_MAX + 160)
+#define UID_CACHE_SIZE 256
+
+struct log_record {
+    time_t ts;
+    uid_t uid;
+    pid_t pid;
+    int result;
+    char op[LOG_OP_MAX];
+    char path[LOG_PATH_MAX];
+};
+
+struct log_slot {
+    atomic_size_t seq;
+    struct log_record rec;
+};
+
+struct uid_cache_entry {
+    int used;
+    uid_t uid;
+    char name[64];
+};
+
+static int log_fd = -1;
+static enum log_full_policy full_policy = LOG_FULL_BLOCK;
+static int log_format = LOG_FORMAT_TEXT;
+
+static struct log_slot *ring = NULL;
+static atomic_size_t ring_head;         // next slot producers claim
+static size_t ring_tail;                // next slot the writer consumes (writer only)
+static atomic_ulong dropped_events;
+
+static pthread_t writer_thread;
+static atomic_int writer_running;
+static atomic_int active_producers;     // log_event đang giữ/điền slot trong ring
+static atomic_int writer_stop;
+static char *batch_buf = NULL;
+// Held by whoever formats records: the writer thread per batch, or the
+// synchronous fallback path. Uncontended while the writer thread runs.
+static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writer-side caches (only touched under format_lock)
+static struct uid_cache_entry uid_cache[UID_CACHE_SIZE];
+static time_t ts_cached_sec = (time_t)-1;
+static char ts_cached[64];
 
 void init_logging(const char *log_path) {
     // Open in append mode so logs survive multiple mounts unless explicitly cleared
-    log_file = fopen(log_path, "a");
-    if (!log_file) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
         fprintf(stderr, "Failed to open log file: %s\n", log_path);
         exit(EXIT_FAILURE);
     }
+
+    ring = calloc(LOG_QUEUE_CAPACITY, sizeof(*ring));
+    if (!ring) {
+        fprintf(stderr, "Failed to allocate log queue\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < LOG_QUEUE_CAPACITY; i++) atomic_init(&ring[i].seq, i);
+    atomic_init(&ring_head, 0);
+    ring_tail = 0;
+}
+
+void set_log_full_policy(enum log_full_policy policy) {
+    full_policy = policy;
+}
+
+int init_log_segments(const char *dir, int format) {
+    log_format = format;
+    if (!(format & LOG_FORMAT_BINARY)) return 0;
+    int res = seg_writer_open(dir);
+    if (res != 0) {
+        // Không mở được thư mục segment: vẫn giữ log text
+        log_format = LOG_FORMAT_TEXT;
+    }
+    return res;
+}
+
+static const char *lookup_username(uid_t uid) {
+    struct uid_cache_entry *e = &uid_cache[uid % UID_CACHE_SIZE];
+    if (e->used && e->uid == uid) return e->name;
+
+    struct passwd pw, *result = NULL;
+    char buf[1024];
+    getpwuid_r(uid, &pw, buf, sizeof(buf), &result);
+
+    e->used = 1;
+    e->uid = uid;
+    snprintf(e->name, sizeof(e->name), "%s", result ? result->pw_name : "unknown");
+    return e->name;
+}
+
+static const char *format_timestamp(time_t now) {
+    // strftime chỉ chạy 1 lần mỗi giây
+    if (now != ts_cached_sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(ts_cached, sizeof(ts_cached), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        ts_cached_sec = now;
+    }
+    return ts_cached;
 }
 
 // Format: ISO8601|uid|username|pid|operation|path|result\n
-void log_event(const char *operation, const char *path, pid_t pid, uid_t uid, int result) {
-    if (!log_file) return;
+static int format_record(char *out, size_t cap, const struct log_record *rec) {
+    int n = snprintf(out, cap, "%s|%u|%s|%d|%s|%s|%d\n", format_timestamp(rec->ts),
+                     (unsigned int)rec->uid, lookup_username(rec->uid), (int)rec->pid,
+                     rec->op, rec->path, rec->result);
+    if (n < 0) return 0;
+    return (size_t)n < cap ? n : (int)cap - 1;
+}
 
-    time_t now = time(NULL);
-    struct tm tm;
-    localtime_r(&now, &tm);
-    char ts[64];
-    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S%z", &tm);
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
 
-    struct passwd *pw = getpwuid(uid);
-    const char *username = pw ? pw->pw_name : "unknown";
+static void fill_record(struct log_record *rec, const char *operation, const char *path,
+                        pid_t pid, uid_t uid, int result) {
+    rec->ts = time(NULL);
+    rec->uid = uid;
+    rec->pid = pid;
+    rec->result = result;
+    snprintf(rec->op, sizeof(rec->op), "%s", operation);
 
     // Escape any newlines in path and operation
-    char safe_path[1024];
-    size_t i, j=0;
-    for (i = 0; i < strlen(path) && j+1 < sizeof(safe_path); ++i) {
+    size_t j = 0;
+    for (size_t i = 0; path[i] && j + 1 < sizeof(rec->path); ++i) {
         if (path[i] == '\n' || path[i] == '\r') continue;
-        safe_path[j++] = path[i];
+        rec->path[j++] = path[i];
+    }
+    rec->path[j] = '\0';
+}
+
+// Format one record into batch (text) and/or hand it to the segment writer
+static size_t emit_record(char *batch, size_t len, const struct log_record *rec) {
+    if (log_format & LOG_FORMAT_BINARY) {
+        seg_writer_append(rec->ts, rec->uid, lookup_username(rec->uid), rec->pid,
+                          rec->op, rec->path, rec->result);
+    }
+    if (!(log_format & LOG_FORMAT_TEXT)) return len;
+    if (len + LOG_LINE_MAX > LOG_BATCH_BYTES) {
+        write_all(batch, len);
+        len = 0;
     }
-    safe_path[j] = '\0';
+    return len + format_record(batch + len, LOG_BATCH_BYTES - len, rec);
+}
+
+// Claim a slot in the ring. Returns NULL when the event has to be dropped.
+static struct log_slot *claim_slot(size_t *pos_out) {
+    size_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    int spins = 0;
 
-    fprintf(log_file, "%s|%u|%s|%d|%s|%s|%d\n", ts, (unsigned int)uid, username, (int)pid, operation, safe_path, result);
-    fflush(log_file);
+    for (;;) {
+        struct log_slot *slot = &ring[pos & (LOG_QUEUE_CAPACITY - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // Queue đầy. Writer đã dừng: không ai xả nữa, caller ghi đồng bộ
+            if (!atomic_load(&writer_running)) return NULL;
+            if (full_policy != LOG_FULL_BLOCK) {
+                atomic_fetch_add_explicit(&dropped_events, 1, memory_order_relaxed);
+                return NULL;
+            }
+            if (++spins < 64) {
+                sched_yield();
+            } else {
+                struct timespec ts = { 0, 100 * 1000 };
+                nanosleep(&ts, NULL);
+            }
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+}
+
+// Ghi thẳng một event khi không có writer thread
+static void write_sync(const char *operation, const char *path, pid_t pid, uid_t uid, int result) {
+    struct log_record rec;
+    char line[LOG_LINE_MAX];
+    fill_record(&rec, operation, path, pid, uid, result);
+    pthread_mutex_lock(&format_lock);
+    if (log_format & LOG_FORMAT_TEXT) write_all(line, format_record(line, sizeof(line), &rec));
+    if (log_format & LOG_FORMAT_BINARY) {
+        seg_writer_append(rec.ts, rec.uid, lookup_username(rec.uid), rec.pid,
+                          rec.op, rec.path, rec.result);
+        seg_writer_flush();
+    }
+    pthread_mutex_unlock(&format_lock);
+}
+
+void log_event(const char *operation, const char *path, pid_t pid, uid_t uid, int result) {
+    if (log_fd == -1) return;
+    uint64_t t0 = metrics_now();
+
+    // Đăng ký producer TRƯỚC khi đọc writer_running: stop_logging_thread hạ
+    // writer_running rồi chờ số này về 0 mới xả lần cuối, nên mọi slot đã
+    // claim đều được xả, còn producer đến sau thấy 0 và ghi đồng bộ
+    atomic_fetch_add(&active_producers, 1);
+    if (!atomic_load(&writer_running)) {
+        // Chưa có writer thread (trước init / sau destroy): ghi đồng bộ
+        atomic_fetch_sub(&active_producers, 1);
+        write_sync(operation, path, pid, uid, result);
+        metrics_record(METRIC_LOG_QUEUE, t0, 0, 0);
+        return;
+    }
+
+    size_t pos;
+    struct log_slot *slot = claim_slot(&pos);
+    if (!slot) {
+        atomic_fetch_sub(&active_producers, 1);
+        if (!atomic_load(&writer_running)) {
+            // Writer dừng trong lúc chờ slot trống
+            write_sync(operation, path, pid, uid, result);
+            metrics_record(METRIC_LOG_QUEUE, t0, 0, 0);
+            return;
+        }
+        // Queue đầy, event bị bỏ (--log-policy=drop|count)
+        metrics_record(METRIC_LOG_QUEUE, t0, -EAGAIN, 0);
+        return;
+    }
+
+    fill_record(&slot->rec, operation, path, pid, uid, result);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_sub(&active_producers, 1);
+    // Gồm cả thời gian chờ slot khi queue đầy (--log-policy=block)
+    metrics_record(METRIC_LOG_QUEUE, t0, 0, 0);
+}
+
+// Drain everything currently published; returns number of records written.
+// Caller holds format_lock.
+static size_t drain_queue(char *batch) {
+    size_t len = 0;
+    size_t count = 0;
+
+    for (;;) {
+        struct log_slot *slot = &ring[ring_tail & (LOG_QUEUE_CAPACITY - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != ring_tail + 1) break;
+
+        len = emit_record(batch, len, &slot->rec);
+        atomic_store_explicit(&slot->seq, ring_tail + LOG_QUEUE_CAPACITY, memory_order_release);
+        ring_tail++;
+        count++;
+    }
+
+    unsigned long dropped = 0;
+    if (full_policy == LOG_FULL_COUNT) {
+        dropped = atomic_exchange_explicit(&dropped_events, 0, memory_order_relaxed);
+    }
+    if (dropped) {
+        struct log_record rec;
+        fill_record(&rec, "LOG_DROPPED", "/", getpid(), getuid(), (int)dropped);
+        len = emit_record(batch, len, &rec);
+    }
+
+    if (len) write_all(batch, len);
+    if ((count || dropped) && (log_format & LOG_FORMAT_BINARY)) seg_writer_flush();
+    return count;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+
+    while (!atomic_load(&writer_stop)) {
+        pthread_mutex_lock(&format_lock);
+        size_t n = drain_queue(batch_buf);
+        pthread_mutex_unlock(&format_lock);
+        if (n == 0) {
+            // Queue rỗng: ngủ ngắn để gom batch, producer không phải signal
+            struct timespec ts = { 0, 2 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+int start_logging_thread(void) {
+    if (log_fd == -1 || atomic_load(&writer_running)) return 0;
+
+    batch_buf = malloc(LOG_BATCH_BYTES);
+    if (!batch_buf) return -1;
+
+    atomic_store(&writer_stop, 0);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        free(batch_buf);
+        batch_buf = NULL;
+        return -1;
+    }
+    atomic_store_explicit(&writer_running, 1, memory_order_release);
+    return 0;
+}
+
+void stop_logging_thread(void) {
+    if (!atomic_load(&writer_running)) return;
+
+    // Từ đây event mới ghi đồng bộ
+    atomic_store(&writer_running, 0);
+    atomic_store(&writer_stop, 1);
+    pthread_join(writer_thread, NULL);
+
+    // Producer đã thấy writer_running == 1 có thể chưa claim slot: chờ hết
+    // rồi mới xả lần cuối, không thì event của nó nằm lại trong ring
+    while (atomic_load(&active_producers) != 0) sched_yield();
+
+    // Xả nốt các slot đã claim
+    pthread_mutex_lock(&format_lock);
+    while (ring_tail != atomic_load(&ring_head)) {
+        if (drain_queue(batch_buf) == 0) sched_yield();
+    }
+    pthread_mutex_unlock(&format_lock);
+
+    free(batch_buf);
+    batch_buf = NULL;
 }
 
 void close_logging(void) {
-    if (log_file) {
-        fclose(log_file);
-        log_file = NULL;
+    stop_logging_thread();
+    if (log_format & LOG_FORMAT_BINARY) {
+        pthread_mutex_lock(&format_lock);
+        seg_writer_close();
+        log_format &= ~LOG_FORMAT_BINARY;
+        pthread_mutex_unlock(&format_lock);
     }
-}
\ No newline at end of file
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
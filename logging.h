@@ -3,9 +3,26 @@
 
 #include <sys/types.h>
 
+// What log_event does when the async queue is full
+enum log_full_policy {
+    LOG_FULL_BLOCK,     // wait for the writer thread (no event is lost)
+    LOG_FULL_DROP,      // drop the event silently
+    LOG_FULL_COUNT,     // drop the event and log how many were dropped
+};
+
+// Output formats (bit flags): text lines in the log file, binary segments, or both
+#define LOG_FORMAT_TEXT   1
+#define LOG_FORMAT_BINARY 2
+
 void init_logging(const char *log_path);
+void set_log_full_policy(enum log_full_policy policy);
+// Select output format; binary segments are written under dir
+int init_log_segments(const char *dir, int format);
+// Start/stop the background writer; until it runs, events are written synchronously
+int start_logging_thread(void);
+void stop_logging_thread(void);
 // Log an event with metadata: operation, path, pid, uid, result code
 void log_event(const char *operation, const char *path, pid_t pid, uid_t uid, int result);
 void close_logging(void);
 
-#endif
\ No newline at end of file
+#endif
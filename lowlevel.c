@@ -0,0 +1,1103 @@
+/*
+ * lowlevel.c
+ * Inode-based backend on the FUSE 3 low-level API.
+ *
+ * Each nodeid handed to the kernel is a struct ll_inode holding O_PATH fds
+ * to the object in Source and/or Storage plus its parent and name, so ops
+ * work on fds (*at() relative to the parent, /proc/self/fd for reopen)
+ * instead of rebuilding and walking a full path every time. Virtual paths
+ * are only assembled in memory for logging and the version store.
+ *
+ * Overlay rules are the same as operations.c: Storage wins, a whiteout
+ * (whiteout.c) hides the Source entry, an opaque Storage directory is not
+ * merged with its Source twin, writes copy the file up first.
+ * Permission checks are left to the kernel (default_permissions).
+ *
+ * Kernel caching: entries/attributes are cached for the configured
+ * timeouts and Source files are opened with keep_cache. Every overlay
+ * change (copy-up, write, truncate, chmod, rename, unlink) queues an
+ * invalidation that a notifier thread sends to the kernel, so long
+ * timeouts stay correct.
+ */
+
+#define _GNU_SOURCE
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 34
+#endif
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lowlevel.h"
+#include "logging.h"
+#include "version_store.h"
+#include "copy_engine.h"
+#include "dir_cache.h"
+#include "backup_maint.h"
+#include "storage.h"
+#include "whiteout.h"
+
+extern int g_source_fd;             // fd thư mục Source, mở 1 lần bên main.c
+extern int g_storage_fd;            // fd thư mục .vfs_storage, mở 1 lần bên main.c
+
+#define LL_BUCKETS 65536
+
+struct ll_inode {
+    struct ll_inode *parent;        // giữ 1 ref tới inode cha
+    char *name;
+    int src_fd;                     // O_PATH trong Source, -1 nếu không có
+    int stor_fd;                    // O_PATH trong Storage, -1 nếu chưa copy-up (chỉ đổi -1 -> fd)
+    mode_t type;                    // S_IFMT
+    uint64_t nlookup;               // ref từ kernel (lookup/create ... forget)
+    uint64_t refs;                  // ref nội bộ: số inode con đang trỏ tới
+    int hashed;                     // còn tra được theo (parent, name)
+    pthread_mutex_t lock;           // copy-up / tạo thư mục Storage / auto_cache
+    struct timespec cached_mtime;   // auto_cache: mtime/size lúc page cache được giữ lại
+    off_t cached_size;
+    struct ll_inode *hnext;
+};
+
+static struct ll_inode root;
+static struct ll_inode *table[LL_BUCKETS];
+// Bảo vệ bảng (parent, name), parent/name/nlookup/refs của mọi inode
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ll_options ll_opts;
+static struct fuse_session *ll_session;
+
+// --- Kernel cache invalidation ---
+// notify_inval_* không được gọi trong chính request đang giữ lock của inode
+// đó (kernel sẽ deadlock), nên các op chỉ xếp hàng, thread riêng gửi đi.
+
+struct ll_notify {
+    struct ll_notify *next;
+    fuse_ino_t ino;                 // inval_inode: ino; inval_entry: thư mục cha
+    off_t off;                      // inval_inode: < 0 = chỉ attributes
+    off_t len;                      // 0 = tới cuối file
+    int entry;
+    char name[];
+};
+
+static struct ll_notify *notify_head, *notify_tail;
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t notify_thread;
+static int notify_running;
+static int notify_stop;
+
+static void notify_push(struct ll_notify *n) {
+    pthread_mutex_lock(&notify_lock);
+    if (!notify_running) {
+        pthread_mutex_unlock(&notify_lock);
+        free(n);
+        return;
+    }
+    n->next = NULL;
+    if (notify_tail) notify_tail->next = n;
+    else notify_head = n;
+    notify_tail = n;
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_lock);
+}
+
+// Invalidate attributes (off < 0) or cached pages [off, off+len) of an inode
+static void ll_inval_inode(fuse_ino_t ino, off_t off, off_t len) {
+    struct ll_notify *n = malloc(sizeof(*n));
+    if (!n) return;
+    n->ino = ino;
+    n->off = off;
+    n->len = len;
+    n->entry = 0;
+    notify_push(n);
+}
+
+// Drop the kernel's dentry (positive or negative) for parent/name
+static void ll_inval_entry(fuse_ino_t parent, const char *name) {
+    size_t len = strlen(name);
+    struct ll_notify *n = malloc(sizeof(*n) + len + 1);
+    if (!n) return;
+    n->ino = parent;
+    n->entry = 1;
+    memcpy(n->name, name, len + 1);
+    notify_push(n);
+}
+
+static void *notify_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&notify_lock);
+    for (;;) {
+        while (!notify_head && !notify_stop) pthread_cond_wait(&notify_cond, &notify_lock);
+        struct ll_notify *batch = notify_head;
+        notify_head = notify_tail = NULL;
+        if (!batch && notify_stop) break;
+        pthread_mutex_unlock(&notify_lock);
+
+        while (batch) {
+            struct ll_notify *n = batch;
+            batch = n->next;
+            // -ENOENT: kernel đã quên inode/dentry đó rồi, không sao
+            if (n->entry) fuse_lowlevel_notify_inval_entry(ll_session, n->ino, n->name, strlen(n->name));
+            else fuse_lowlevel_notify_inval_inode(ll_session, n->ino, n->off, n->len);
+            free(n);
+        }
+        pthread_mutex_lock(&notify_lock);
+    }
+    pthread_mutex_unlock(&notify_lock);
+    return NULL;
+}
+
+static int notify_start(void) {
+    pthread_mutex_lock(&notify_lock);
+    notify_stop = 0;
+    notify_running = pthread_create(&notify_thread, NULL, notify_worker, NULL) == 0;
+    pthread_mutex_unlock(&notify_lock);
+    return notify_running ? 0 : -1;
+}
+
+// Gửi nốt hàng đợi rồi dừng thread; gọi trước fuse_session_unmount
+static void notify_finish(void) {
+    pthread_mutex_lock(&notify_lock);
+    if (!notify_running) {
+        pthread_mutex_unlock(&notify_lock);
+        return;
+    }
+    notify_stop = 1;
+    notify_running = 0;
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_lock);
+    pthread_join(notify_thread, NULL);
+}
+
+static struct ll_inode *ll_inode(fuse_ino_t ino) {
+    return ino == FUSE_ROOT_ID ? &root : (struct ll_inode *)(uintptr_t)ino;
+}
+
+static fuse_ino_t ll_ino(struct ll_inode *in) {
+    return in == &root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)in;
+}
+
+static uint32_t ll_hash(const struct ll_inode *parent, const char *name) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+    for (; *name; name++) {
+        h ^= (uint8_t)*name;
+        h *= 16777619u;
+    }
+    return h % LL_BUCKETS;
+}
+
+static int stor_fd_of(struct ll_inode *in) {
+    return __atomic_load_n(&in->stor_fd, __ATOMIC_ACQUIRE);
+}
+
+// O_PATH fd của layer đang "thắng" (Storage > Source)
+static int top_fd(struct ll_inode *in) {
+    int fd = stor_fd_of(in);
+    return fd != -1 ? fd : in->src_fd;
+}
+
+static void proc_path(char out[64], int fd) {
+    snprintf(out, 64, "/proc/self/fd/%d", fd);
+}
+
+// Virtual path ("/a/b") dựng trong bộ nhớ, chỉ dùng cho log, version store và journal của Storage
+static void ll_path(struct ll_inode *in, char out[PATH_MAX]) {
+    char tmp[PATH_MAX];
+    size_t pos = PATH_MAX - 1;
+    tmp[pos] = '\0';
+
+    pthread_mutex_lock(&table_lock);
+    for (; in && in != &root; in = in->parent) {
+        size_t len = strlen(in->name);
+        if (len + 1 > pos) break;
+        pos -= len;
+        memcpy(tmp + pos, in->name, len);
+        tmp[--pos] = '/';
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    snprintf(out, PATH_MAX, "%s", tmp[pos] ? tmp + pos : "/");
+}
+
+static void ll_child_path(struct ll_inode *parent, const char *name, char out[PATH_MAX]) {
+    ll_path(parent, out);
+    size_t len = strcmp(out, "/") == 0 ? 0 : strlen(out);
+    snprintf(out + len, PATH_MAX - len, "/%s", name);
+}
+
+static void ll_log(fuse_req_t req, const char *op, const char *path, int result) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if (ctx) log_event(op, path, ctx->pid, ctx->uid, result);
+}
+
+// --- Inode table ---
+
+// Caller holds table_lock
+static struct ll_inode *table_find(struct ll_inode *parent, const char *name) {
+    for (struct ll_inode *in = table[ll_hash(parent, name)]; in; in = in->hnext) {
+        if (in->parent == parent && strcmp(in->name, name) == 0) return in;
+    }
+    return NULL;
+}
+
+// Caller holds table_lock
+static void table_unhash(struct ll_inode *in) {
+    if (!in->hashed) return;
+    for (struct ll_inode **pp = &table[ll_hash(in->parent, in->name)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == in) {
+            *pp = in->hnext;
+            break;
+        }
+    }
+    in->hashed = 0;
+    in->hnext = NULL;
+}
+
+// Caller holds table_lock
+static void table_hash(struct ll_inode *in) {
+    uint32_t b = ll_hash(in->parent, in->name);
+    in->hnext = table[b];
+    table[b] = in;
+    in->hashed = 1;
+}
+
+// Free inodes nobody references any more, walking up the parent chain.
+// Caller holds table_lock.
+static void maybe_free(struct ll_inode *in) {
+    while (in && in != &root && in->nlookup == 0 && in->refs == 0) {
+        struct ll_inode *parent = in->parent;
+        table_unhash(in);
+        if (in->src_fd != -1) close(in->src_fd);
+        if (in->stor_fd != -1) close(in->stor_fd);
+        pthread_mutex_destroy(&in->lock);
+        free(in->name);
+        free(in);
+
+        parent->refs--;
+        in = parent;
+    }
+}
+
+// Resolve name inside a directory inode following the overlay rules.
+// Returns the layer fds (O_PATH) and the visible stat, or -errno.
+static int resolve_child(struct ll_inode *parent, const char *name,
+                         int *src_out, int *stor_out, struct stat *st) {
+    int pstor = stor_fd_of(parent);
+    struct stat s_st, x_st;
+    int in_stor = pstor != -1 && fstatat(pstor, name, &s_st, AT_SYMLINK_NOFOLLOW) == 0;
+
+    // Thư mục đã rename (redirect, ghi bởi ll_rename hoặc vfs): gộp với thư
+    // mục ở path cũ trong Source thay vì path của chính nó
+    char path[PATH_MAX], target[PATH_MAX];
+    int redirected = 0;
+    if (in_stor && S_ISDIR(s_st.st_mode)) {
+        ll_child_path(parent, name, path);
+        redirected = wo_redirect(path, target);
+    }
+
+    // Whiteout của thư mục cha nằm trong bộ nhớ (whiteout.c); thư mục cha
+    // không có ở Source (src_fd = -1) thì không cần xem
+    char dir[PATH_MAX];
+    int in_src = 0;
+    if (redirected) {
+        in_src = fstatat(g_source_fd, target, &x_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(x_st.st_mode);
+    } else if (parent->src_fd != -1) {
+        ll_path(parent, dir);
+        in_src = !wo_is_whiteout(dir, name) &&
+                 fstatat(parent->src_fd, name, &x_st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+    // Thư mục ở Storage chỉ gộp với thư mục cùng tên ở Source, trừ khi opaque
+    if (in_stor && in_src && (!S_ISDIR(s_st.st_mode) || !S_ISDIR(x_st.st_mode))) in_src = 0;
+    if (in_stor && in_src && !redirected && wo_is_opaque(path)) in_src = 0;
+    if (!in_stor && !in_src) return -ENOENT;
+
+    *stor_out = in_stor ? openat(pstor, name, O_PATH | O_NOFOLLOW | O_CLOEXEC) : -1;
+    *src_out = !in_src ? -1
+             : redirected ? openat(g_source_fd, target, O_PATH | O_NOFOLLOW | O_CLOEXEC)
+                          : openat(parent->src_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if ((in_stor && *stor_out == -1) || (in_src && *src_out == -1)) {
+        int err = -errno;
+        if (*stor_out != -1) close(*stor_out);
+        if (*src_out != -1) close(*src_out);
+        return err;
+    }
+    *st = in_stor ? s_st : x_st;
+    return 0;
+}
+
+// lookup + tăng nlookup; dùng chung cho lookup/create/mkdir
+static int do_lookup(struct ll_inode *parent, const char *name, struct fuse_entry_param *e) {
+    int src_fd, stor_fd;
+    struct stat st;
+    int res = resolve_child(parent, name, &src_fd, &stor_fd, &st);
+    if (res != 0) return res;
+
+    pthread_mutex_lock(&table_lock);
+    struct ll_inode *in = table_find(parent, name);
+    if (in) {
+        // Đã có inode: chỉ bổ sung fd Storage nếu vừa được tạo từ ngoài
+        if (stor_fd_of(in) == -1 && stor_fd != -1) {
+            __atomic_store_n(&in->stor_fd, stor_fd, __ATOMIC_RELEASE);
+            stor_fd = -1;
+        }
+        in->nlookup++;
+        pthread_mutex_unlock(&table_lock);
+        if (src_fd != -1) close(src_fd);
+        if (stor_fd != -1) close(stor_fd);
+    } else {
+        in = calloc(1, sizeof(*in));
+        char *nm = strdup(name);
+        if (!in || !nm) {
+            pthread_mutex_unlock(&table_lock);
+            free(in);
+            free(nm);
+            if (src_fd != -1) close(src_fd);
+            if (stor_fd != -1) close(stor_fd);
+            return -ENOMEM;
+        }
+        in->parent = parent;
+        in->name = nm;
+        in->src_fd = src_fd;
+        in->stor_fd = stor_fd;
+        in->type = st.st_mode & S_IFMT;
+        in->nlookup = 1;
+        pthread_mutex_init(&in->lock, NULL);
+        parent->refs++;
+        table_hash(in);
+        pthread_mutex_unlock(&table_lock);
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->ino = ll_ino(in);
+    e->attr = st;
+    e->attr_timeout = ll_opts.attr_timeout;
+    e->entry_timeout = ll_opts.entry_timeout;
+    return 0;
+}
+
+// --- Copy-up ---
+
+// Make sure a directory inode has a Storage counterpart (mkdir along the chain)
+static int ensure_storage_dir(struct ll_inode *dir) {
+    if (stor_fd_of(dir) != -1) return 0;
+
+    pthread_mutex_lock(&dir->lock);
+    int res = 0;
+    if (stor_fd_of(dir) == -1) {
+        pthread_mutex_lock(&table_lock);
+        struct ll_inode *parent = dir->parent;
+        char *name = strdup(dir->name);
+        pthread_mutex_unlock(&table_lock);
+
+        res = name ? ensure_storage_dir(parent) : -ENOMEM;
+        if (res == 0) {
+            struct stat st;
+            mode_t mode = fstatat(dir->src_fd, "", &st, AT_EMPTY_PATH) == 0 ? st.st_mode & 07777 : 0755;
+            int pstor = stor_fd_of(parent);
+            if (mkdirat(pstor, name, mode) == -1 && errno != EEXIST) res = -errno;
+            int fd = res == 0 ? openat(pstor, name, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+            if (res == 0 && fd == -1) res = -errno;
+            if (res == 0) __atomic_store_n(&dir->stor_fd, fd, __ATOMIC_RELEASE);
+        }
+        free(name);
+    }
+    pthread_mutex_unlock(&dir->lock);
+    return res;
+}
+
+// Copy a Source file into Storage. Caller holds in->lock.
+static int copy_up_locked(struct ll_inode *in) {
+    if (stor_fd_of(in) != -1) return 0;
+    if (in->type != S_IFREG) return -EXDEV;    // chỉ copy-up file thường
+
+    pthread_mutex_lock(&table_lock);
+    struct ll_inode *parent = in->parent;
+    char *name = strdup(in->name);
+    pthread_mutex_unlock(&table_lock);
+    if (!name) return -ENOMEM;
+
+    int res = ensure_storage_dir(parent);
+    if (res != 0) {
+        free(name);
+        return res;
+    }
+
+    char proc[64];
+    proc_path(proc, in->src_fd);
+    int src = open(proc, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (src == -1 || fstat(src, &st) == -1) {
+        res = -errno;
+        if (src != -1) close(src);
+        free(name);
+        return res;
+    }
+
+    char path[PATH_MAX];
+    ll_path(in, path);
+    storage_copyup_begin(path);
+    int pstor = stor_fd_of(parent);
+    int dst = openat(pstor, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (dst == -1) {
+        res = -errno;
+    } else {
+        res = copy_file_all(src, dst, &st);
+        close(dst);
+    }
+    close(src);
+
+    if (res == 0) {
+        int fd = openat(pstor, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) res = -errno;
+        else __atomic_store_n(&in->stor_fd, fd, __ATOMIC_RELEASE);
+    }
+    if (res != 0) unlinkat(pstor, name, 0);
+    else ll_inval_inode(ll_ino(in), -1, 0);        // attributes giờ lấy từ bản Storage
+    storage_copyup_end(path);
+    free(name);
+    return res;
+}
+
+static int copy_up(struct ll_inode *in) {
+    if (stor_fd_of(in) != -1) return 0;
+    pthread_mutex_lock(&in->lock);
+    int res = copy_up_locked(in);
+    pthread_mutex_unlock(&in->lock);
+    return res;
+}
+
+static void ll_save_backup(fuse_req_t req, struct ll_inode *in) {
+    char path[PATH_MAX], manifest[PATH_MAX], proc[64];
+    ll_path(in, path);
+    vs_manifest_name(path, manifest);
+
+    proc_path(proc, top_fd(in));
+    int fd = open(proc, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    if (vs_save(path, fd, manifest) == 0) ll_log(req, "BACKUP_CREATED", path, 0);
+    close(fd);
+}
+
+// --- FUSE low-level operations ---
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void)userdata;
+    (void)conn;
+    // init chạy sau khi fuse_daemonize, nên thread nền phải được tạo ở đây
+    if (start_logging_thread() != 0) {
+        fprintf(stderr, "[WARN] Async logging unavailable, logging synchronously\n");
+    }
+    if (bm_start() != 0) {
+        fprintf(stderr, "[WARN] Backup maintenance thread unavailable\n");
+    }
+    if (storage_start() != 0) {
+        fprintf(stderr, "[WARN] Cannot remove old storage in background\n");
+    }
+}
+
+static void ll_destroy(void *userdata) {
+    (void)userdata;
+    bm_stop();
+    storage_stop();
+    close_logging();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    int res = do_lookup(ll_inode(parent), name, &e);
+    if (res == -ENOENT && ll_opts.negative_timeout > 0) {
+        // ino 0 = negative entry, kernel nhớ "không tồn tại" trong negative_timeout
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = ll_opts.negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void forget_one(fuse_ino_t ino, uint64_t nlookup) {
+    struct ll_inode *in = ll_inode(ino);
+    pthread_mutex_lock(&table_lock);
+    in->nlookup = in->nlookup > nlookup ? in->nlookup - nlookup : 0;
+    maybe_free(in);
+    pthread_mutex_unlock(&table_lock);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) forget_one(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)fi;
+    struct stat st;
+    if (fstatat(top_fd(ll_inode(ino)), "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    fuse_reply_attr(req, &st, ll_opts.attr_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                       struct fuse_file_info *fi) {
+    struct ll_inode *in = ll_inode(ino);
+    char path[PATH_MAX], proc[64];
+    ll_path(in, path);
+
+    // Đổi metadata/kích thước của file Source -> copy-up trước
+    int res = copy_up(in);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    int fd = stor_fd_of(in);
+    proc_path(proc, fd);
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        if (fchmodat(AT_FDCWD, proc, attr->st_mode & 07777, 0) == -1) res = -errno;
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+        if (fchownat(fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) res = -errno;
+        ll_log(req, "CHOWN", path, res);
+    }
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        ll_save_backup(req, in);
+        if (fi) res = ftruncate(fi->fh, attr->st_size) == -1 ? -errno : 0;
+        else res = truncate(proc, attr->st_size) == -1 ? -errno : 0;
+        vs_forget(path);
+        if (res == 0) ll_inval_inode(ino, attr->st_size, 0);
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec tv[2];
+        tv[0].tv_nsec = UTIME_OMIT;
+        tv[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) tv[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME) tv[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) tv[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME) tv[1] = attr->st_mtim;
+        if (utimensat(AT_FDCWD, proc, tv, 0) == -1) res = -errno;
+        ll_log(req, "UTIMENS", path, res);
+    }
+
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) ll_inval_inode(ino, -1, 0);
+    ll_getattr(req, ino, fi);
+}
+
+// auto_cache: chỉ giữ page cache khi file Source không bị sửa từ bên ngoài
+static int source_cache_valid(struct ll_inode *in, int fd) {
+    if (!ll_opts.auto_cache) return 1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) return 0;
+
+    pthread_mutex_lock(&in->lock);
+    int same = in->cached_size == st.st_size &&
+               in->cached_mtime.tv_sec == st.st_mtim.tv_sec &&
+               in->cached_mtime.tv_nsec == st.st_mtim.tv_nsec;
+    in->cached_size = st.st_size;
+    in->cached_mtime = st.st_mtim;
+    pthread_mutex_unlock(&in->lock);
+    return same;
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_inode *in = ll_inode(ino);
+    char path[PATH_MAX], proc[64];
+    ll_path(in, path);
+
+    // Mở để GHI hoặc O_TRUNC (kể cả O_RDONLY|O_TRUNC) -> copy-up; O_TRUNC ->
+    // backup trước khi xóa trắng nội dung
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+        int res = copy_up(in);
+        if (res != 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+        if (fi->flags & O_TRUNC) ll_save_backup(req, in);
+    }
+
+    // fd trên Source không bao giờ được mang O_TRUNC: Source chỉ đọc
+    int flags = fi->flags & ~(O_NOFOLLOW | O_CREAT);
+    if (stor_fd_of(in) == -1) flags &= ~O_TRUNC;
+    proc_path(proc, top_fd(in));
+    int fd = open(proc, flags | O_CLOEXEC);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    if (fi->flags & O_TRUNC) {
+        vs_forget(path);
+        ll_inval_inode(ino, 0, 0);
+    }
+
+    // File Source chỉ đổi qua copy-up (đã invalidate) -> giữ page cache giữa các lần open
+    if (stor_fd_of(in) == -1) fi->keep_cache = source_cache_valid(in, fd);
+
+    fi->fh = fd;
+    ll_log(req, "OPEN", path, 0);
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+    char *buf = malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    ssize_t n = pread(fi->fh, buf, size, off);
+    if (n == -1) fuse_reply_err(req, errno);
+    else fuse_reply_buf(req, buf, n);
+    free(buf);
+
+    char path[PATH_MAX];
+    ll_path(ll_inode(ino), path);
+    ll_log(req, "READ", path, n == -1 ? -errno : (int)n);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                     struct fuse_file_info *fi) {
+    struct ll_inode *in = ll_inode(ino);
+    char path[PATH_MAX];
+    ll_path(in, path);
+
+    // Handle mở để ghi luôn trỏ vào Storage (copy-up đã làm lúc open/create)
+    ll_save_backup(req, in);
+    ssize_t n = pwrite(fi->fh, buf, size, off);
+    int res = n == -1 ? -errno : (int)n;
+    if (n == -1) {
+        fuse_reply_err(req, -res);
+    } else {
+        vs_note_write(path, off, n);
+        fuse_reply_write(req, n);
+        // Page cache đã được kernel cập nhật khi ghi; chỉ còn size/mtime
+        ll_inval_inode(ino, -1, 0);
+    }
+    ll_log(req, "WRITE", path, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    // Đóng một bản dup để giữ đúng ngữ nghĩa close() của file system bên dưới
+    int res = close(dup(fi->fh));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    int res = datasync ? fdatasync(fi->fh) : fsync(fi->fh);
+    int err = res == -1 ? errno : 0;
+
+    char path[PATH_MAX];
+    ll_path(ll_inode(ino), path);
+    ll_log(req, "FSYNC", path, -err);
+    fuse_reply_err(req, err);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    close(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                      struct fuse_file_info *fi) {
+    struct ll_inode *dir = ll_inode(parent);
+    char path[PATH_MAX];
+    ll_child_path(dir, name, path);
+
+    int res = ensure_storage_dir(dir);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    int fd = openat(stor_fd_of(dir), name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if (ctx) fchown(fd, ctx->uid, ctx->gid);
+    // File mới ở Storage thay chỗ của whiteout (nếu có)
+    wo_remove(path);
+
+    struct fuse_entry_param e;
+    res = do_lookup(dir, name, &e);
+    if (res != 0) {
+        close(fd);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = fd;
+    ll_log(req, "CREATE", path, 0);
+    fuse_reply_create(req, &e, fi);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct ll_inode *dir = ll_inode(parent);
+    char path[PATH_MAX];
+    ll_child_path(dir, name, path);
+
+    int res = ensure_storage_dir(dir);
+    if (res == 0 && mkdirat(stor_fd_of(dir), name, mode) == -1) res = -errno;
+    if (res == 0) {
+        const struct fuse_ctx *ctx = fuse_req_ctx(req);
+        if (ctx) fchownat(stor_fd_of(dir), name, ctx->uid, ctx->gid, AT_SYMLINK_NOFOLLOW);
+        // Tạo lại thư mục đã bị xóa: không gộp nội dung cũ ở Source
+        if (wo_remove(path) == 1 && wo_set_opaque(path) != 0) {
+            fprintf(stderr, "[WARN] Cannot mark %s opaque\n", path);
+        }
+    }
+
+    struct fuse_entry_param e;
+    if (res == 0) res = do_lookup(dir, name, &e);
+    ll_log(req, "MKDIR", path, res);
+    if (res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_entry(req, &e);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct ll_inode *dir = ll_inode(parent);
+    char path[PATH_MAX];
+    ll_child_path(dir, name, path);
+
+    int src_fd, stor_fd;
+    struct stat st;
+    int res = resolve_child(dir, name, &src_fd, &stor_fd, &st);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (src_fd != -1) close(src_fd);
+        if (stor_fd != -1) close(stor_fd);
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    // Backup trước khi xóa
+    char manifest[PATH_MAX], proc[64];
+    vs_manifest_name(path, manifest);
+    proc_path(proc, stor_fd != -1 ? stor_fd : src_fd);
+    int fd = open(proc, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (vs_save(path, fd, manifest) == 0) ll_log(req, "BACKUP_CREATED", path, 0);
+        close(fd);
+    }
+    if (src_fd != -1) close(src_fd);
+
+    const char *op = "UNLINK (Storage)";
+    if (stor_fd == -1) {
+        // File chỉ có ở Source: Source không bị sửa, chỉ che bằng whiteout
+        op = "UNLINK (Whiteout)";
+        res = ensure_storage_dir(dir);
+        if (res == 0) res = wo_add(path);
+    } else {
+        close(stor_fd);
+        res = unlinkat(stor_fd_of(dir), name, 0) == -1 ? -errno : 0;
+        // Bản gốc cùng tên ở Source không được hiện lại (resolve_child bỏ
+        // src_fd khi khác loại nên phải xem lại)
+        struct stat x_st;
+        if (res == 0 && dir->src_fd != -1 && fstatat(dir->src_fd, name, &x_st, AT_SYMLINK_NOFOLLOW) == 0)
+            res = wo_add(path);
+    }
+    if (res == 0) {
+        vs_forget(path);
+        // Tên không còn trỏ tới inode này; inode sống tới khi kernel forget
+        pthread_mutex_lock(&table_lock);
+        struct ll_inode *in = table_find(dir, name);
+        if (in) table_unhash(in);
+        pthread_mutex_unlock(&table_lock);
+        ll_inval_entry(parent, name);
+    }
+    ll_log(req, op, path, res);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    struct ll_inode *from_dir = ll_inode(parent);
+    struct ll_inode *to_dir = ll_inode(newparent);
+    char from[PATH_MAX], to[PATH_MAX];
+    ll_child_path(from_dir, name, from);
+    ll_child_path(to_dir, newname, to);
+
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    int res = do_lookup(from_dir, name, &e);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    struct ll_inode *in = ll_inode(e.ino);
+
+    // Thư mục có ở Source: chỉ rename phần Storage (tạo nếu chưa có) và ghi
+    // redirect về path cũ ở Source, như vfs; src_fd của inode vẫn đúng
+    int redirect = in->type == S_IFDIR && in->src_fd != -1;
+    if (redirect) res = ensure_storage_dir(in);
+
+    pthread_mutex_lock(&in->lock);
+    if (redirect) {
+        char lower[PATH_MAX];
+        if (res == 0 && !wo_redirect(from, lower)) {
+            res = wo_lower_path(from, lower);
+            if (res == 0) res = wo_set_redirect(from, lower);
+        }
+    } else {
+        // File Source -> copy sang Storage rồi rename ở đó
+        res = copy_up_locked(in);
+    }
+    if (res == 0) res = ensure_storage_dir(to_dir);
+    if (res == 0 && renameat(stor_fd_of(from_dir), name, stor_fd_of(to_dir), newname) == -1) res = -errno;
+    if (res == 0) {
+        // Sidecar whiteout của thư mục con đi theo thư mục
+        if (in->type == S_IFDIR) {
+            wo_invalidate_tree(from);
+            wo_invalidate_tree(to);
+        }
+        // Bản gốc ở Source vẫn còn -> che bằng whiteout
+        struct stat st;
+        if (from_dir->src_fd != -1 && fstatat(from_dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) wo_add(from);
+        // Tên mới: entry Storage thay chỗ whiteout, thư mục thì không gộp với Source
+        if (wo_remove(to) == 1 && in->type == S_IFDIR) wo_set_opaque(to);
+        vs_forget(from);
+        vs_forget(to);
+
+        pthread_mutex_lock(&table_lock);
+        struct ll_inode *victim = table_find(to_dir, newname);
+        if (victim && victim != in) table_unhash(victim);
+        char *nm = strdup(newname);
+        if (nm) {
+            table_unhash(in);
+            from_dir->refs--;
+            to_dir->refs++;
+            free(in->name);
+            in->name = nm;
+            in->parent = to_dir;
+            table_hash(in);
+        }
+        pthread_mutex_unlock(&table_lock);
+
+        ll_inval_entry(parent, name);
+        ll_inval_entry(newparent, newname);
+        ll_inval_inode(e.ino, -1, 0);
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    // Trả lại ref do do_lookup ở trên
+    forget_one(e.ino, 1);
+
+    ll_log(req, "RENAME", from, res);
+    fuse_reply_err(req, -res);
+}
+
+// opendir chụp danh sách đã merge cho handle: offset readdir là chỉ số trong
+// bản chụp, nên đọc theo trang vẫn đúng dù thư mục đổi giữa chừng
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_inode *in = ll_inode(ino);
+    struct dir_listing *l = dir_listing_new();
+    if (!l) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    struct name_set hidden;
+    name_set_init(&hidden);
+    int ok = dir_listing_add(l, ".", 0, S_IFDIR >> 12) == 0 && dir_listing_add(l, "..", 0, S_IFDIR >> 12) == 0;
+
+    char path[PATH_MAX];
+    ll_path(in, path);
+    int layer_fds[2] = { stor_fd_of(in), in->src_fd };
+    for (int layer = 0; layer < 2 && ok; layer++) {
+        if (layer_fds[layer] == -1) continue;
+        int dfd = openat(layer_fds[layer], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dp = dfd == -1 ? NULL : fdopendir(dfd);
+        if (dfd != -1 && !dp) close(dfd);
+        if (!dp) continue;
+
+        struct dirent *de;
+        while (ok && (de = readdir(dp)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+            if (layer == 0) {
+                // Storage: ghi nhớ tên thật, ẩn tên dành riêng (sidecar whiteout)
+                if (strncmp(de->d_name, WO_PREFIX, sizeof(WO_PREFIX) - 1) == 0) continue;
+                ok = name_set_add(&hidden, de->d_name) == 0;
+            } else if (name_set_contains(&hidden, de->d_name) || wo_is_whiteout(path, de->d_name)) {
+                continue;
+            }
+            if (ok) ok = dir_listing_add(l, de->d_name, de->d_ino, de->d_type) == 0;
+        }
+        closedir(dp);
+    }
+    name_set_free(&hidden);
+
+    if (!ok) {
+        dir_listing_release(l);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t)l;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi) {
+    struct dir_listing *l = (struct dir_listing *)(uintptr_t)fi->fh;
+    char *buf = malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    size_t used = 0;
+    for (size_t i = off; i < l->count; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = l->entries[i].ino;
+        st.st_mode = l->entries[i].type << 12;
+        size_t n = fuse_add_direntry(req, buf + used, size - used, dir_entry_name(l, i), &st, i + 1);
+        if (n > size - used) break;     // buffer đầy, kernel gọi lại với offset kế tiếp
+        used += n;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+
+    if (off == 0) {
+        char path[PATH_MAX];
+        ll_path(ll_inode(ino), path);
+        ll_log(req, "READDIR", path, 0);
+    }
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    dir_listing_release((struct dir_listing *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops ll_operations = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .open = ll_open,
+    .read = ll_read,
+    .write = ll_write,
+    .flush = ll_flush,
+    .fsync = ll_fsync,
+    .release = ll_release,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir,
+    .create = ll_create,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rename = ll_rename,
+};
+
+int vfs_lowlevel_main(int argc, char *argv[], const struct ll_options *options) {
+    ll_opts = *options;
+    int workers = ll_opts.workers;
+    int clone_fd = ll_opts.clone_fd;
+
+    root.parent = NULL;
+    root.name = "";
+    root.src_fd = g_source_fd;
+    root.stor_fd = g_storage_fd;
+    root.type = S_IFDIR;
+    root.nlookup = 2;               // không bao giờ bị forget hết
+    pthread_mutex_init(&root.lock, NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) return 1;
+    if (opts.show_help) {
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        fuse_opt_free_args(&args);
+        return 0;
+    }
+    if (!opts.mountpoint) {
+        fprintf(stderr, "Missing mount point\n");
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    // Quyền do kernel kiểm tra theo mode/owner mà getattr trả về
+    fuse_opt_add_arg(&args, "-odefault_permissions");
+
+    int res = 1;
+    struct fuse_session *se = fuse_session_new(&args, &ll_operations, sizeof(ll_operations), NULL);
+    if (!se) goto out_args;
+    if (fuse_set_signal_handlers(se) != 0) goto out_session;
+    if (fuse_session_mount(se, opts.mountpoint) != 0) goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+
+    ll_session = se;
+    if (notify_start() != 0) {
+        // Không invalidate được thì không được để kernel cache lâu
+        fprintf(stderr, "[WARN] Cannot start invalidation thread, disabling kernel caching\n");
+        ll_opts.entry_timeout = ll_opts.attr_timeout = ll_opts.negative_timeout = 0;
+    }
+
+    if (opts.singlethread) {
+        res = fuse_session_loop(se);
+    } else {
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+        struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(cfg, clone_fd || opts.clone_fd);
+        if (workers > 0) {
+            fuse_loop_cfg_set_max_threads(cfg, workers);
+            fuse_loop_cfg_set_idle_threads(cfg, workers);
+        }
+        res = fuse_session_loop_mt(se, cfg);
+        fuse_loop_cfg_destroy(cfg);
+#else
+        // Trước 3.12 libfuse tạo worker theo nhu cầu; workers giới hạn số thread rảnh được giữ lại
+        struct fuse_loop_config cfg = {
+            .clone_fd = clone_fd || opts.clone_fd,
+            .max_idle_threads = workers > 0 ? (unsigned int)workers : opts.max_idle_threads,
+        };
+        res = fuse_session_loop_mt(se, &cfg);
+#endif
+    }
+
+    notify_finish();
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_args:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return res ? 1 : 0;
+}
@@ -0,0 +1,22 @@
+#ifndef LOWLEVEL_H
+#define LOWLEVEL_H
+
+#ifndef STORAGE_DIR
+#define STORAGE_DIR ".vfs_storage"
+#endif
+
+struct ll_options {
+    int workers;                // worker threads for the multithreaded loop (0 = libfuse default)
+    int clone_fd;               // give each worker its own /dev/fuse fd
+    double entry_timeout;       // kernel caches name -> inode this long (seconds)
+    double attr_timeout;        // kernel caches attributes this long
+    double negative_timeout;    // kernel caches "no such entry" this long (0 = off)
+    int auto_cache;             // keep the page cache of Source files only while mtime/size are unchanged
+};
+
+// Inode-based backend on the FUSE 3 low-level API (build with -DVFS_LOWLEVEL).
+// argv is what is left after main.c removed the VFS options and the source
+// directory: [fuse options] <mount_point>.
+int vfs_lowlevel_main(int argc, char *argv[], const struct ll_options *opts);
+
+#endif
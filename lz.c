@@ -0,0 +1,141 @@
+/*
+ * lz.c
+ * LZ77 block codec, see lz.h.
+ *
+ * Sequence format: token (high nibble = literal count, low nibble =
+ * match length - LZ_MIN_MATCH, 15 = more length bytes follow, each 255
+ * adds and the first < 255 ends), literals, 2-byte little endian offset,
+ * extra match length bytes. The last sequence has literals only.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Ghi phần dư của một độ dài (>= 15) thành chuỗi byte 255 ... < 255
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit,
+                             size_t offset, size_t mlen, int last) {
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    size_t m = last ? 0 : mlen - LZ_MIN_MATCH;
+    *token = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (m < 15 ? m : 15));
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (last) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (m >= 15 && !(op = put_length(op, oend, m - 15))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *in = src;
+    const uint8_t *ip = in, *anchor = in;
+    const uint8_t *iend = in + n;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + (cap < n ? cap : n);   // không nhỏ hơn -> không đáng nén
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    memset(table, 0, sizeof(table));
+    if (n >= LZ_MIN_MATCH + 1) {
+        const uint8_t *limit = iend - LZ_MIN_MATCH;
+        ip++;
+        while (ip < limit) {
+            uint32_t v = read32(ip);
+            uint32_t h = hash4(v);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || read32(ref) != v) {
+                ip++;
+                continue;
+            }
+            // Kéo dài match về sau (và lùi lại phần literal trùng)
+            size_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < iend && ip[mlen] == ref[mlen]) mlen++;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+                mlen++;
+            }
+            op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen, 0);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+            if (ip < limit) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+    op = put_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0, 1);
+    if (!op || op >= oend) return 0;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t n, void *dst, size_t raw_len) {
+    const uint8_t *ip = src, *iend = ip + n;
+    uint8_t *out = dst, *op = out, *oend = out + raw_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_length(&ip, iend, &nlit) != 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) break;      // sequence cuối chỉ có literal
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) != 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < mlen) return -1;
+        // Match có thể chồng lên chính nó (offset < mlen) -> chép từng byte
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 block codec (LZ4-style sequences: token, literals, 16-bit
+// offset, match length) used to compress backup chunks in pack files.
+// Favors speed over ratio; a block is always decoded in one call.
+
+// Worst case output size for n input bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress src into dst (capacity cap). Returns the compressed size, or 0
+// when the output does not fit / would not be smaller than the input.
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Decompress into dst, which must hold exactly raw_len bytes.
+// Returns 0, or -1 on corrupt input.
+int lz_decompress(const void *src, size_t n, void *dst, size_t raw_len);
+
+#endif
@@ -1,24 +1,254 @@
+#ifndef VFS_LOWLEVEL
 #define FUSE_USE_VERSION 26
-
 #include <fuse.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
-#include "operations.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "logging.h"
+#include "version_store.h"
+#include "dir_cache.h"
+#include "backup_maint.h"
+#include "version_catalog.h"
+#include "storage.h"
+#include "whiteout.h"
+#ifdef VFS_LOWLEVEL
+#include "lowlevel.h"
+#else
+#include "operations.h"
+#include "path_cache.h"
+#include "path_lock.h"
+#include "lazy_copy.h"
+#include "write_buffer.h"
+#include "block_cache.h"
+#include "metrics.h"
+#include "layers.h"
+#endif
 
 // Biến toàn cục lưu đường dẫn Source
 char g_source_dir[PATH_MAX];
 
+// fd thư mục gốc của Source và Storage, mở 1 lần lúc khởi động.
+// operations.c resolve mọi path bằng *at() tương đối với 2 fd này,
+// nên không phụ thuộc cwd (fuse chdir("/") khi chạy nền).
+int g_source_fd = -1;
+int g_storage_fd = -1;
+
+#define LOG_SEGMENT_DIR "virtual_fs.segments"
+
+static int log_format = LOG_FORMAT_TEXT;
+static struct bm_policy backup_policy;
+
+// Cache của kernel (giây); mặc định giống libfuse
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+static double negative_timeout = 0.0;
+static int auto_cache = 0;
+
+#ifdef VFS_LOWLEVEL
+static int ll_workers = 0;          // 0 = để libfuse tự quyết
+static int ll_clone_fd = 0;
+#else
+static char cache_opts[128];        // "-o ..." thêm vào argv cho fuse_main
+// --lower: các lower layer dưới <source_dir>, theo thứ tự từ trên xuống
+static const char *lower_dirs[LAYER_MAX - 1];
+static int nlower;
+#endif
+
+#ifndef VFS_LOWLEVEL
+// Kích thước, cho phép hậu tố K/M/G (vd: 1G)
+static int parse_size(const char *name, const char *v, long long *out) {
+    char *end;
+    long long n = strtoll(v, &end, 10);
+    if (*end == 'K' || *end == 'k') { n <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { n <<= 20; end++; }
+    else if (*end == 'G' || *end == 'g') { n <<= 30; end++; }
+    if (end == v || *end != '\0' || n < 0) {
+        fprintf(stderr, "Invalid --%s '%s' (bytes, K/M/G suffix allowed)\n", name, v);
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+#endif
+
+static int parse_count(const char *name, const char *v, unsigned *out) {
+    char *end;
+    long n = strtol(v, &end, 10);
+    if (end == v || *end != '\0' || n < 0 || n > 1000000) {
+        fprintf(stderr, "Invalid --%s '%s'\n", name, v);
+        return -1;
+    }
+    *out = (unsigned)n;
+    return 0;
+}
+
+static int parse_timeout(const char *name, const char *v, double *out) {
+    char *end;
+    double t = strtod(v, &end);
+    if (end == v || *end != '\0' || t < 0) {
+        fprintf(stderr, "Invalid --%s '%s' (seconds)\n", name, v);
+        return -1;
+    }
+    *out = t;
+    return 0;
+}
+
+// Tách các option riêng của VFS (--tên=giá trị) khỏi argv trước khi đưa cho FUSE
+static int parse_vfs_options(int *argc, char *argv[]) {
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--log-policy=", 13) == 0) {
+            const char *v = arg + 13;
+            if (strcmp(v, "block") == 0) set_log_full_policy(LOG_FULL_BLOCK);
+            else if (strcmp(v, "drop") == 0) set_log_full_policy(LOG_FULL_DROP);
+            else if (strcmp(v, "count") == 0) set_log_full_policy(LOG_FULL_COUNT);
+            else {
+                fprintf(stderr, "Invalid --log-policy '%s' (block|drop|count)\n", v);
+                return -1;
+            }
+        } else if (strncmp(arg, "--log-format=", 13) == 0) {
+            const char *v = arg + 13;
+            if (strcmp(v, "text") == 0) log_format = LOG_FORMAT_TEXT;
+            else if (strcmp(v, "binary") == 0) log_format = LOG_FORMAT_BINARY;
+            else if (strcmp(v, "both") == 0) log_format = LOG_FORMAT_TEXT | LOG_FORMAT_BINARY;
+            else {
+                fprintf(stderr, "Invalid --log-format '%s' (text|binary|both)\n", v);
+                return -1;
+            }
+        } else if (strncmp(arg, "--entry-timeout=", 16) == 0) {
+            if (parse_timeout("entry-timeout", arg + 16, &entry_timeout) != 0) return -1;
+        } else if (strncmp(arg, "--attr-timeout=", 15) == 0) {
+            if (parse_timeout("attr-timeout", arg + 15, &attr_timeout) != 0) return -1;
+        } else if (strncmp(arg, "--negative-timeout=", 19) == 0) {
+            if (parse_timeout("negative-timeout", arg + 19, &negative_timeout) != 0) return -1;
+        } else if (strcmp(arg, "--auto-cache") == 0) {
+            auto_cache = 1;
+        } else if (strncmp(arg, "--keep-last=", 12) == 0) {
+            // Retention cho .backup (backup_maint.c)
+            if (parse_count("keep-last", arg + 12, &backup_policy.keep_last) != 0) return -1;
+        } else if (strncmp(arg, "--keep-days=", 12) == 0) {
+            if (parse_count("keep-days", arg + 12, &backup_policy.keep_days) != 0) return -1;
+        } else if (strcmp(arg, "--thin-backups") == 0) {
+            backup_policy.thin = 1;
+        } else if (strncmp(arg, "--maint-interval=", 17) == 0) {
+            unsigned v;
+            if (parse_count("maint-interval", arg + 17, &v) != 0) return -1;
+            bm_set_interval(v);
+        } else if (strncmp(arg, "--storage-mode=", 15) == 0) {
+            const char *v = arg + 15;
+            if (strcmp(v, "reset") == 0) storage_set_mode(STORAGE_RESET);
+            else if (strcmp(v, "persist") == 0) storage_set_mode(STORAGE_PERSIST);
+            else {
+                fprintf(stderr, "Invalid --storage-mode '%s' (reset|persist)\n", v);
+                return -1;
+            }
+#ifdef VFS_LOWLEVEL
+        } else if (strncmp(arg, "--workers=", 10) == 0) {
+            char *end;
+            long v = strtol(arg + 10, &end, 10);
+            if (end == arg + 10 || *end != '\0' || v < 1 || v > 1024) {
+                fprintf(stderr, "Invalid --workers '%s' (1-1024)\n", arg + 10);
+                return -1;
+            }
+            ll_workers = (int)v;
+        } else if (strcmp(arg, "--clone-fd") == 0) {
+            ll_clone_fd = 1;
+#else
+        } else if (strncmp(arg, "--lazy-copyup=", 14) == 0) {
+            // Ngưỡng kích thước file được copy-up theo block
+            long long v;
+            if (parse_size("lazy-copyup", arg + 14, &v) != 0) return -1;
+            lazy_set_threshold((off_t)v);
+        } else if (strncmp(arg, "--writeback=", 12) == 0) {
+            // Tổng bộ nhớ cho các buffer write-back (0 = tắt)
+            long long v;
+            if (parse_size("writeback", arg + 12, &v) != 0) return -1;
+            wb_set_budget((size_t)v);
+        } else if (strncmp(arg, "--block-cache=", 14) == 0) {
+            // Bộ nhớ cache block của Source (0 = tắt)
+            long long v;
+            if (parse_size("block-cache", arg + 14, &v) != 0) return -1;
+            bc_set_budget((size_t)v);
+        } else if (strncmp(arg, "--lower=", 8) == 0) {
+            if (nlower == LAYER_MAX - 1 || arg[8] == '\0') {
+                fprintf(stderr, "Invalid --lower '%s' (directory, at most %d)\n", arg + 8, LAYER_MAX - 1);
+                return -1;
+            }
+            lower_dirs[nlower++] = arg + 8;
+        } else if (strncmp(arg, "--layer-index=", 14) == 0) {
+            // Bloom filter tên file của từng lower layer (layers.c)
+            const char *v = arg + 14;
+            if (strcmp(v, "auto") == 0) layer_set_index(LAYER_INDEX_AUTO);
+            else if (strcmp(v, "on") == 0) layer_set_index(LAYER_INDEX_ON);
+            else if (strcmp(v, "off") == 0) layer_set_index(LAYER_INDEX_OFF);
+            else {
+                fprintf(stderr, "Invalid --layer-index '%s' (auto|on|off)\n", v);
+                return -1;
+            }
+#endif
+        } else {
+            argv[out++] = argv[i];
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    bm_set_policy(&backup_policy);
+
+#ifndef VFS_LOWLEVEL
+    snprintf(cache_opts, sizeof(cache_opts), "entry_timeout=%g,attr_timeout=%g,negative_timeout=%g%s",
+             entry_timeout, attr_timeout, negative_timeout, auto_cache ? ",auto_cache" : "");
+    vfs_set_keep_source_cache(!auto_cache);
+#endif
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
+    if (parse_vfs_options(&argc, argv) != 0) return 1;
+
     // Initialize logging
     init_logging("virtual_fs.log");
+    if (init_log_segments(LOG_SEGMENT_DIR, log_format) != 0) {
+        fprintf(stderr, "[WARN] Cannot open %s, falling back to text log\n", LOG_SEGMENT_DIR);
+    }
+
+#ifndef VFS_LOWLEVEL
+    path_cache_init();
+    path_lock_init();
+    // kill -USR1 <pid> ghi /.vfs_stats ra file này
+    if (metrics_set_dump_path("virtual_fs.stats") != 0) {
+        fprintf(stderr, "[WARN] Current directory path too long, SIGUSR1 stats file stays relative\n");
+    }
+#endif
+    dir_cache_init();
+    wo_init();
+
+    // Chunk store cho backup (.backup/chunks + manifest)
+    if (vs_init(BACKUP_DIR) != 0) {
+        perror("Error preparing backup store");
+        return 1;
+    }
+    // Catalog version (/.versions); vfs_ll chỉ giữ cho nó cập nhật
+    int vc_res = vc_init(vs_backup_fd());
+    if (vc_res != 0) {
+        fprintf(stderr, "[WARN] Version catalog unavailable (%s), /.versions disabled\n", strerror(-vc_res));
+    }
 
     // 1. KIỂM TRA THAM SỐ
     if ((argc < 3) || (argv[argc-2][0] == '-')) {
-        fprintf(stderr, "Usage: %s [options] <source_dir> <mount_point>\n", argv[0]);
+#ifdef VFS_LOWLEVEL
+        fprintf(stderr, "Usage: %s [options] [--log-policy=block|drop|count] [--log-format=text|binary|both] [--entry-timeout=S] [--attr-timeout=S] [--negative-timeout=S] [--auto-cache] [--keep-last=N] [--keep-days=N] [--thin-backups] [--maint-interval=S] [--storage-mode=reset|persist] [--workers=N] [--clone-fd] <source_dir> <mount_point>\n", argv[0]);
+#else
+        fprintf(stderr, "Usage: %s [options] [--log-policy=block|drop|count] [--log-format=text|binary|both] [--entry-timeout=S] [--attr-timeout=S] [--negative-timeout=S] [--auto-cache] [--keep-last=N] [--keep-days=N] [--thin-backups] [--maint-interval=S] [--storage-mode=reset|persist] [--lazy-copyup=SIZE] [--writeback=SIZE] [--block-cache=SIZE] [--lower=DIR]... [--layer-index=auto|on|off] <source_dir> <mount_point>\n", argv[0]);
+#endif
         return 1;
     }
 
@@ -31,12 +261,36 @@ int main(int argc, char *argv[]) {
     printf("[INFO] Source Directory: %s\n", g_source_dir);
     printf("[INFO] Mount Point: %s\n", argv[argc-1]);
 
-    // --- ĐOẠN CODE MỚI THÊM VÀO ---
-    // Xóa sạch thư mục lưu trữ tạm (.vfs_storage) để reset trạng thái về ban đầu
-    // Lệnh này đảm bảo mỗi lần chạy là VFS sẽ ánh xạ đúng theo Source gốc
-    printf("[INFO] Cleaning up previous session storage...\n");
-    system("rm -rf .vfs_storage");
-    // -----------------------------
+    // Mở fd cho 2 layer
+    g_source_fd = open(g_source_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_source_fd == -1) {
+        perror("Error opening source directory");
+        return 1;
+    }
+#ifndef VFS_LOWLEVEL
+    // Source là lower layer trên cùng, các --lower nằm dưới nó
+    layer_init(g_source_fd);
+    for (int i = 0; i < nlower; i++) {
+        int res = layer_add(lower_dirs[i]);
+        if (res != 0) {
+            fprintf(stderr, "Error opening lower layer %s: %s\n", lower_dirs[i], strerror(-res));
+            return 1;
+        }
+        printf("[INFO] Lower Layer %d: %s\n", i + 1, lower_dirs[i]);
+    }
+#endif
+    // Storage của phiên trước: dùng lại (--storage-mode=persist) hoặc đổi tên
+    // sang một bên để thread nền xóa; không phụ thuộc kích thước Storage
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    g_storage_fd = storage_open(STORAGE_DIR, g_source_fd);
+    if (g_storage_fd < 0) {
+        fprintf(stderr, "Error preparing storage directory: %s\n", strerror(-g_storage_fd));
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("[INFO] Storage ready in %.1f ms\n",
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
 
     // 3. ĐIỀU CHỈNH ARGV CHO FUSE
     argv[argc-2] = argv[argc-1]; 
@@ -46,5 +300,23 @@ int main(int argc, char *argv[]) {
     // Log startup event
     log_event("START", "/", (pid_t)getpid(), (uid_t)getuid(), 0);
 
-    return fuse_main(argc, argv, &vfs_operations, NULL);
+#ifdef VFS_LOWLEVEL
+    struct ll_options opts = {
+        .workers = ll_workers,
+        .clone_fd = ll_clone_fd,
+        .entry_timeout = entry_timeout,
+        .attr_timeout = attr_timeout,
+        .negative_timeout = negative_timeout,
+        .auto_cache = auto_cache,
+    };
+    return vfs_lowlevel_main(argc, argv, &opts);
+#else
+    // Chèn "-o <cache_opts>" ngay sau argv[0]
+    char *fuse_argv[argc + 3];
+    fuse_argv[0] = argv[0];
+    fuse_argv[1] = "-o";
+    fuse_argv[2] = cache_opts;
+    for (int i = 1; i <= argc; i++) fuse_argv[i + 2] = argv[i];
+    return fuse_main(argc + 2, fuse_argv, &vfs_operations, NULL);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,317 @@
+/*
+ * metrics.c
+ * Per-thread operation counters, see metrics.h.
+ *
+ * A thread's counters are allocated on its first record and only that
+ * thread writes them (relaxed atomic stores, so a concurrent reader never
+ * sees a torn value). When the thread exits its counters are folded into
+ * a shared total and freed, so libfuse starting and stopping worker
+ * threads does not grow the list.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+
+struct metric_counters {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_thread {
+    struct metric_counters c[METRIC_COUNT];
+    struct metrics_thread *next;
+    struct metrics_thread **pprev;
+};
+
+static const char *const metric_names[METRIC_COUNT] = {
+    [METRIC_GETATTR] = "getattr",
+    [METRIC_OPENDIR] = "opendir",
+    [METRIC_READDIR] = "readdir",
+    [METRIC_RELEASEDIR] = "releasedir",
+    [METRIC_OPEN] = "open",
+    [METRIC_READ] = "read",
+    [METRIC_WRITE] = "write",
+    [METRIC_FLUSH] = "flush",
+    [METRIC_FSYNC] = "fsync",
+    [METRIC_RELEASE] = "release",
+    [METRIC_CREATE] = "create",
+    [METRIC_MKDIR] = "mkdir",
+    [METRIC_UNLINK] = "unlink",
+    [METRIC_TRUNCATE] = "truncate",
+    [METRIC_CHMOD] = "chmod",
+    [METRIC_CHOWN] = "chown",
+    [METRIC_RENAME] = "rename",
+    [METRIC_UTIMENS] = "utimens",
+    [METRIC_COPY_UP] = "copy_up",
+    [METRIC_BACKUP] = "backup",
+    [METRIC_LOG_QUEUE] = "log_queue",
+};
+
+static __thread struct metrics_thread *my_counters;
+static struct metrics_thread *threads;                 // các thread đang sống
+static struct metric_counters retired[METRIC_COUNT];   // của các thread đã thoát
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static char dump_path[PATH_MAX] = "virtual_fs.stats";
+static int dump_pipe[2] = { -1, -1 };
+static pthread_t dump_thread;
+static int dump_running = 0;
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_counters(struct metric_counters *dst, const struct metric_counters *src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+    dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+    dst->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+        dst->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+}
+
+// Thread thoát: cộng dồn vào retired rồi bỏ khỏi danh sách
+static void thread_exit(void *arg) {
+    struct metrics_thread *t = arg;
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < METRIC_COUNT; i++) add_counters(&retired[i], &t->c[i]);
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    pthread_mutex_unlock(&threads_lock);
+    free(t);
+}
+
+static void make_key(void) {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+static struct metrics_thread *register_thread(void) {
+    pthread_once(&key_once, make_key);
+    struct metrics_thread *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    pthread_mutex_lock(&threads_lock);
+    t->next = threads;
+    t->pprev = &threads;
+    if (threads) threads->pprev = &t->next;
+    threads = t;
+    pthread_mutex_unlock(&threads_lock);
+    pthread_setspecific(exit_key, t);
+    my_counters = t;
+    return t;
+}
+
+// < 1 µs -> 0; [2^e, 2^(e+1)) chia 4 đều; >= 2^MAX_SHIFT -> bucket cuối
+static int bucket_of(uint64_t ns) {
+    if (ns < (1ull << METRICS_MIN_SHIFT)) return 0;
+    if (ns >= (1ull << METRICS_MAX_SHIFT)) return METRICS_BUCKETS - 1;
+    int e = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (e - 2)) & (METRICS_SUB_BUCKETS - 1);
+    return 1 + (e - METRICS_MIN_SHIFT) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Cận trên (ns) của bucket b < METRICS_BUCKETS - 1
+static uint64_t bucket_bound(int b) {
+    if (b == 0) return 1ull << METRICS_MIN_SHIFT;
+    int e = METRICS_MIN_SHIFT + (b - 1) / METRICS_SUB_BUCKETS;
+    uint64_t sub = (b - 1) % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub + 1) << (e - 2);
+}
+
+// Chỉ thread sở hữu ghi: load + store relaxed, không cần lock bus
+#define BUMP(field, v) __atomic_store_n(&(field), (field) + (v), __ATOMIC_RELAXED)
+
+void metrics_record(enum metric_id id, uint64_t start_ns, int result, uint64_t bytes) {
+    struct metrics_thread *t = my_counters ? my_counters : register_thread();
+    if (!t) return;
+    uint64_t ns = metrics_now() - start_ns;
+    struct metric_counters *c = &t->c[id];
+    BUMP(c->count, 1);
+    if (result < 0) BUMP(c->errors, 1);
+    BUMP(c->bytes, bytes);
+    BUMP(c->sum_ns, ns);
+    BUMP(c->buckets[bucket_of(ns)], 1);
+}
+
+static metrics_extra_fn extra_fn;
+
+void metrics_set_extra(metrics_extra_fn fn) {
+    __atomic_store_n(&extra_fn, fn, __ATOMIC_RELEASE);
+}
+
+char *metrics_format(size_t *len) {
+    struct metric_counters *total = calloc(METRIC_COUNT, sizeof(*total));
+    if (!total) return NULL;
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        add_counters(&total[i], &retired[i]);
+        for (struct metrics_thread *t = threads; t; t = t->next) add_counters(&total[i], &t->c[i]);
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&buf, &size);
+    if (!f) {
+        free(total);
+        return NULL;
+    }
+
+    static const struct {
+        const char *family;
+        const char *label;
+        int first, last;
+        const char *what;
+    } groups[] = {
+        { "vfs_op", "op", 0, METRIC_FIRST_PHASE, "FUSE operations" },
+        { "vfs_phase", "phase", METRIC_FIRST_PHASE, METRIC_COUNT, "Phases inside operations (copy-up, backup, log enqueue)" },
+    };
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        const char *fam = groups[g].family, *lbl = groups[g].label;
+        int first = groups[g].first, last = groups[g].last;
+
+        fprintf(f, "# HELP %s_total %s handled.\n# TYPE %s_total counter\n", fam, groups[g].what, fam);
+        for (int i = first; i < last; i++)
+            fprintf(f, "%s_total{%s=\"%s\"} %llu\n", fam, lbl, metric_names[i], (unsigned long long)total[i].count);
+        fprintf(f, "# HELP %s_errors_total %s that failed.\n# TYPE %s_errors_total counter\n", fam, groups[g].what, fam);
+        for (int i = first; i < last; i++)
+            fprintf(f, "%s_errors_total{%s=\"%s\"} %llu\n", fam, lbl, metric_names[i], (unsigned long long)total[i].errors);
+        fprintf(f, "# HELP %s_bytes_total Bytes moved.\n# TYPE %s_bytes_total counter\n", fam, fam);
+        for (int i = first; i < last; i++)
+            fprintf(f, "%s_bytes_total{%s=\"%s\"} %llu\n", fam, lbl, metric_names[i], (unsigned long long)total[i].bytes);
+
+        fprintf(f, "# HELP %s_duration_seconds Latency.\n# TYPE %s_duration_seconds histogram\n", fam, fam);
+        for (int i = first; i < last; i++) {
+            // Chỉ in bucket có dữ liệu: số đếm cộng dồn vẫn đúng với mọi le
+            uint64_t cum = 0;
+            for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+                if (!total[i].buckets[b]) continue;
+                cum += total[i].buckets[b];
+                fprintf(f, "%s_duration_seconds_bucket{%s=\"%s\",le=\"%.9g\"} %llu\n", fam, lbl, metric_names[i],
+                        bucket_bound(b) / 1e9, (unsigned long long)cum);
+            }
+            fprintf(f, "%s_duration_seconds_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", fam, lbl, metric_names[i],
+                    (unsigned long long)total[i].count);
+            fprintf(f, "%s_duration_seconds_sum{%s=\"%s\"} %.9f\n", fam, lbl, metric_names[i], total[i].sum_ns / 1e9);
+            fprintf(f, "%s_duration_seconds_count{%s=\"%s\"} %llu\n", fam, lbl, metric_names[i],
+                    (unsigned long long)total[i].count);
+        }
+    }
+    free(total);
+    metrics_extra_fn extra = __atomic_load_n(&extra_fn, __ATOMIC_ACQUIRE);
+    if (extra) extra(f);
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    if (len) *len = size;
+    return buf;
+}
+
+// ---- SIGUSR1 ----
+
+int metrics_set_dump_path(const char *path) {
+    char cwd[PATH_MAX], abs[PATH_MAX];
+    int n;
+    // fuse chdir("/") khi chạy nền: giữ đường dẫn tuyệt đối
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd))) n = snprintf(abs, sizeof(abs), "%s/%s", cwd, path);
+    else n = snprintf(abs, sizeof(abs), "%s", path);
+    if (n < 0 || (size_t)n >= sizeof(abs)) return -ENAMETOOLONG;
+    memcpy(dump_path, abs, n + 1);
+    return 0;
+}
+
+static void write_dump(void) {
+    size_t len;
+    char *text = metrics_format(&len);
+    if (!text) return;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dump_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd != -1;
+    for (size_t done = 0; ok && done < len;) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) ok = 0;
+        else done += n;
+    }
+    if (fd != -1) close(fd);
+    if (ok && rename(tmp, dump_path) == 0) {
+        fprintf(stderr, "[INFO] Stats written to %s\n", dump_path);
+    } else {
+        fprintf(stderr, "[WARN] Cannot write stats to %s\n", dump_path);
+        unlink(tmp);
+    }
+    free(text);
+}
+
+// Handler chỉ được dùng hàm async-signal-safe: đánh thức thread dump qua pipe
+static void on_sigusr1(int sig) {
+    (void)sig;
+    int saved = errno;
+    char c = 'd';
+    if (write(dump_pipe[1], &c, 1) == -1) { /* pipe đầy: đã có dump đang chờ */ }
+    errno = saved;
+}
+
+static void *dump_main(void *arg) {
+    (void)arg;
+    char c;
+    for (;;) {
+        ssize_t n = read(dump_pipe[0], &c, 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0 || c == 'q') break;
+        write_dump();
+    }
+    return NULL;
+}
+
+int metrics_start(void) {
+    if (dump_running) return 0;
+    if (pipe2(dump_pipe, O_CLOEXEC) == -1) return -errno;
+    fcntl(dump_pipe[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&dump_thread, NULL, dump_main, NULL) != 0) {
+        close(dump_pipe[0]);
+        close(dump_pipe[1]);
+        dump_pipe[0] = dump_pipe[1] = -1;
+        return -EAGAIN;
+    }
+    dump_running = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (!dump_running) return;
+    signal(SIGUSR1, SIG_IGN);
+    char c = 'q';
+    // Pipe non-blocking: nếu đầy thì thread đang đọc, thử lại
+    while (write(dump_pipe[1], &c, 1) == -1 && (errno == EAGAIN || errno == EINTR)) usleep(1000);
+    pthread_join(dump_thread, NULL);
+    close(dump_pipe[0]);
+    close(dump_pipe[1]);
+    dump_pipe[0] = dump_pipe[1] = -1;
+    dump_running = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Per-operation counters and latency histograms.
+//
+// Every thread records into its own counters (no shared cache line on the
+// hot path); readers sum all threads on demand. Latencies go into
+// log-linear buckets: 4 per power of two from 1 µs up to ~1 min.
+//
+// The text format is the Prometheus exposition format, served as
+// /.vfs_stats by operations.c and written to the dump file on SIGUSR1.
+
+enum metric_id {
+    // FUSE operations
+    METRIC_GETATTR,
+    METRIC_OPENDIR,
+    METRIC_READDIR,
+    METRIC_RELEASEDIR,
+    METRIC_OPEN,
+    METRIC_READ,
+    METRIC_WRITE,
+    METRIC_FLUSH,
+    METRIC_FSYNC,
+    METRIC_RELEASE,
+    METRIC_CREATE,
+    METRIC_MKDIR,
+    METRIC_UNLINK,
+    METRIC_TRUNCATE,
+    METRIC_CHMOD,
+    METRIC_CHOWN,
+    METRIC_RENAME,
+    METRIC_UTIMENS,
+    // Phases inside operations
+    METRIC_FIRST_PHASE,
+    METRIC_COPY_UP = METRIC_FIRST_PHASE,
+    METRIC_BACKUP,
+    METRIC_LOG_QUEUE,
+    METRIC_COUNT
+};
+
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_MIN_SHIFT 10            // bucket đầu: < 1024 ns
+#define METRICS_MAX_SHIFT 36            // bucket cuối: >= 2^36 ns (~69 s)
+#define METRICS_BUCKETS (2 + (METRICS_MAX_SHIFT - METRICS_MIN_SHIFT) * METRICS_SUB_BUCKETS)
+
+uint64_t metrics_now(void);
+
+// One finished operation started at start_ns (metrics_now); result < 0
+// counts as an error, bytes is the data moved
+void metrics_record(enum metric_id id, uint64_t start_ns, int result, uint64_t bytes);
+
+// All counters in Prometheus text format, malloc'ed; NULL on ENOMEM
+char *metrics_format(size_t *len);
+
+// Extra families appended to metrics_format by a module this file does not
+// link against (the block cache is not part of vfs_ll); NULL removes it
+typedef void (*metrics_extra_fn)(FILE *f);
+void metrics_set_extra(metrics_extra_fn fn);
+
+// SIGUSR1 writes metrics_format() to path (relative to the current
+// directory at the time of the call); 0, or -ENAMETOOLONG and the path is
+// left unchanged. start/stop around the fuse session.
+int metrics_set_dump_path(const char *path);
+int metrics_start(void);
+void metrics_stop(void);
+
+#endif
@@ -12,27 +12,175 @@
 #include <stdlib.h>
 #include <time.h>
 #include <libgen.h> 
+#include <stdint.h>
 #include "logging.h"
 #include "permissions.h"
+#include "version_store.h"
+#include "path_cache.h"
+#include "copy_engine.h"
+#include "lazy_copy.h"
+#include "dir_cache.h"
+#include "path_lock.h"
+#include "write_buffer.h"
+#include "block_cache.h"
+#include "backup_maint.h"
+#include "version_catalog.h"
+#include "metrics.h"
+#include "storage.h"
+#include "whiteout.h"
+#include "layers.h"
+
+extern int g_storage_fd;            // fd thư mục .vfs_storage, mở 1 lần bên main.c
+
+// Source không bị sửa qua VFS (mọi thay đổi copy-up sang Storage, lần open sau
+// mở bản Storage và kernel bỏ cache cũ), nên page cache của nó giữ lại được.
+static int keep_source_cache = 1;
+
+void vfs_set_keep_source_cache(int on) {
+    keep_source_cache = on;
+}
+
+// Handle lưu trong fi->fh: giữ fd thật suốt vòng đời open -> release,
+// để read/write không phải lookup + open/close lại cho mỗi chunk.
+struct vfs_handle {
+    int fd;
+    enum vfs_layer layer;
+    struct lazy_file *lazy;     // != NULL: file mới copy-up một phần (lazy_copy.c)
+    struct wb_file *wb;         // != NULL: write gom trong bộ nhớ (--writeback)
+    int cached;                 // 1: đọc Source qua block cache (--block-cache)
+    struct bc_file bc;
+    struct bc_stream ra;        // phát hiện đọc tuần tự cho readahead
+    struct vs_reader *version;  // != NULL: file trong /.versions, fd = -1
+    char *text;                 // != NULL: nội dung /.vfs_stats chụp lúc open, fd = -1
+    size_t text_len;
+};
+
+static inline struct vfs_handle *get_handle(struct fuse_file_info *fi) {
+    return (struct vfs_handle *)(uintptr_t)fi->fh;
+}
+
+static int attach_handle(struct fuse_file_info *fi, int fd, enum vfs_layer layer) {
+    struct vfs_handle *fh = malloc(sizeof(*fh));
+    if (!fh) return -ENOMEM;
+    fh->fd = fd;
+    fh->layer = layer;
+    fh->lazy = NULL;
+    fh->wb = NULL;
+    fh->cached = 0;
+    fh->version = NULL;
+    fh->text = NULL;
+    memset(&fh->ra, 0, sizeof(fh->ra));
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    return 0;
+}
 
-#define STORAGE_DIR ".vfs_storage"
-#define BACKUP_DIR ".backup"
+// Mọi thao tác đều dùng *at() tương đối với g_storage_fd / fd của lower layer:
+// FUSE path "/a/b" -> "a/b", root "/" -> "."
+static inline const char *rel_path(const char *path) {
+    while (*path == '/') path++;
+    return *path ? path : ".";
+}
 
-extern char g_source_dir[PATH_MAX]; // Định nghĩa bên main.c
-static int backup_counter = 0;      // Biến đếm để tránh trùng tên file backup
+static inline int layer_fd(const struct path_info *info) {
+    return info->layer == LAYER_STORAGE ? g_storage_fd : layer_dirfd(info->lower);
+}
+
+// Path ở lower layer: chính path, trừ khi nằm dưới một thư mục đã được
+// rename (redirect trong whiteout.c)
+static const char *lower_rel(const char *path, char buf[PATH_MAX]) {
+    return wo_lower_path(path, buf) == 0 ? buf : rel_path(path);
+}
 
-static void get_source_path(char fpath[PATH_MAX], const char *path) {
-    snprintf(fpath, PATH_MAX, "%s%s", g_source_dir, path);
+// Path tương đối với layer_fd(info)
+static const char *info_rel(const char *path, const struct path_info *info, char buf[PATH_MAX]) {
+    return info->layer == LAYER_SOURCE ? lower_rel(path, buf) : rel_path(path);
 }
 
-static void get_storage_path(char fpath[PATH_MAX], const char *path) {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        snprintf(fpath, PATH_MAX, "%s/%s%s", cwd, STORAGE_DIR, path);
+static int resolve_path(const char *path, struct path_info *info);
+
+// Các lower layer có thể chứa path: những layer gộp vào thư mục cha
+static int parent_lowers(const char *path, uint32_t *lowers) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || strcmp(path, "/") == 0) {
+        *lowers = layer_all();
+        return 0;
     }
+    // "/a/b" -> "/a", "/a" -> "/"
+    char parent[PATH_MAX];
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    if (len >= sizeof(parent)) return -ENAMETOOLONG;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+
+    struct path_info pinfo;
+    int res = resolve_path(parent, &pinfo);
+    if (res != 0) return res;
+    if (!S_ISDIR(pinfo.st.st_mode)) return -ENOTDIR;
+    *lowers = pinfo.lowers;
+    return 0;
 }
 
-// Hàm đệ quy tạo thư mục cha (mkdir -p)
+// Xác định path nằm ở layer nào (Storage > whiteout > lower layer trên cùng
+// có path) kèm stat. Chỉ các layer mà thư mục cha gộp vào được hỏi, và
+// layer có name index bỏ qua bằng Bloom filter thay vì fstatat (layers.c).
+// Kết quả (kể cả "không tồn tại") được cache, nên lookup lặp lại
+// không tốn syscall nào cho tới khi path bị invalidate.
+static int resolve_path(const char *path, struct path_info *info) {
+    if (path_cache_lookup(path, info)) {
+        return info->layer == LAYER_NONE ? -ENOENT : 0;
+    }
+
+    uint64_t gen = path_cache_gen(path);
+    uint32_t lowers;
+    int res = parent_lowers(path, &lowers);
+    if (res != 0) return res;
+
+    const char *rel = rel_path(path);
+    char lower[PATH_MAX];
+    const char *lrel = lower_rel(path, lower);
+    memset(info, 0, sizeof(*info));
+    info->layer = LAYER_NONE;
+
+    if (fstatat(g_storage_fd, rel, &info->st, AT_SYMLINK_NOFOLLOW) == 0) {
+        info->layer = LAYER_STORAGE;
+        // Thư mục Storage gộp với thư mục cùng tên bên dưới, trừ khi opaque/bị che;
+        // thư mục đã rename gộp với thư mục ở path cũ
+        if (S_ISDIR(info->st.st_mode)) {
+            char target[PATH_MAX];
+            if (wo_redirect(path, target)) info->lowers = layer_path_dirs(target);
+            else if (!wo_hidden(path) && !wo_is_opaque(path)) info->lowers = layer_find_dirs(lowers, lrel);
+        }
+    } else if (errno != ENOENT) {
+        return -errno;
+    } else if (wo_hidden(path)) {
+        // Whiteout/thư mục opaque (whiteout.c): kiểm tra trong bộ nhớ, không syscall
+        info->whiteout = 1;
+    } else {
+        int i = layer_find(lowers, lrel, &info->st);
+        if (i >= 0) {
+            info->layer = LAYER_SOURCE;
+            info->lower = i;
+            if (S_ISDIR(info->st.st_mode))
+                info->lowers = 1u << i | layer_find_dirs(lowers & ~((2u << i) - 1), lrel);
+        } else if (i != -ENOENT) {
+            return i;
+        }
+    }
+
+    path_cache_store(path, info, gen);
+    return info->layer == LAYER_NONE ? -ENOENT : 0;
+}
+
+// Path có bản ở một lower layer đang hiện ra (không bị whiteout che)
+static int source_visible(const char *path) {
+    uint32_t lowers;
+    struct stat st;
+    char lower[PATH_MAX];
+    return !wo_hidden(path) && parent_lowers(path, &lowers) == 0 &&
+           layer_find(lowers, lower_rel(path, lower), &st) >= 0;
+}
+
+// Hàm đệ quy tạo thư mục (mkdir -p), path tương đối với Storage
 static int mkdir_p(const char *path) {
     char tmp[PATH_MAX];
     char *p = NULL;
@@ -45,220 +193,617 @@ static int mkdir_p(const char *path) {
     for (p = tmp + 1; *p; p++) {
         if (*p == '/') {
             *p = 0;
-            mkdir(tmp, 0755);
+            mkdirat(g_storage_fd, tmp, 0755);
             *p = '/';
         }
     }
-    return mkdir(tmp, 0755);
+    return mkdirat(g_storage_fd, tmp, 0755);
+}
+
+// Tạo các thư mục cha trong Storage cho path
+static void make_parent_dirs(const char *path) {
+    char *tmp = strdup(rel_path(path));
+    if (!tmp) return;
+    mkdir_p(dirname(tmp));
+    free(tmp);
+}
+
+static ssize_t lazy_reader(void *ctx, void *buf, size_t len, off_t offset) {
+    return lazy_read(ctx, buf, len, offset);
 }
 
 static int save_backup(const char *path) {
-    char source_file_path[PATH_MAX];
-    char storage_file_path[PATH_MAX];
-    char final_read_path[PATH_MAX];
+    struct path_info info;
 
     // 1. Xác định file đang nằm ở đâu để đọc dữ liệu backup
-    get_storage_path(storage_file_path, path);
-    get_source_path(source_file_path, path);
-
     // Ưu tiên backup phiên bản trong Storage (nếu đã từng sửa)
-    if (access(storage_file_path, F_OK) == 0) {
-        strcpy(final_read_path, storage_file_path);
-    } else if (access(source_file_path, F_OK) == 0) {
-        strcpy(final_read_path, source_file_path);
-    } else {
+    if (resolve_path(path, &info) != 0) {
         return 0; // File không tồn tại -> Không cần backup
     }
 
-    // Kiểm tra file có rỗng không? (Tùy chọn: Nếu muốn backup cả file rỗng thì bỏ đoạn này)
-    struct stat st_check;
-    if (stat(final_read_path, &st_check) == 0) {
-        if (st_check.st_size == 0) {
-            // File rỗng, có thể không cần backup hoặc vẫn backup tùy nhu cầu.
-            // Ở đây tôi vẫn cho backup để theo dõi lịch sử đầy đủ.
-        }
-    }
+    uint64_t t0 = metrics_now();
+
+    // 2. Tạo tên manifest cho phiên bản này
+    char manifest[PATH_MAX];
+    vs_manifest_name(path, manifest);
 
-    // 2. Chuẩn bị thư mục .backup
-    struct stat st = {0};
-    if (stat(BACKUP_DIR, &st) == -1) {
-        if (mkdir(BACKUP_DIR, 0755) == -1) return -1;
+    // 3. Lưu vào version store: chỉ các chunk thay đổi được đọc + ghi,
+    // .bak giờ là manifest nhỏ liệt kê các chunk (khôi phục bằng vfs_restore)
+    int res;
+    struct lazy_file *lf = info.layer == LAYER_STORAGE ? lazy_open(path) : NULL;
+    if (lf) {
+        // File copy-up một phần: backup nội dung đã ghép Source + Storage
+        off_t size = lazy_size(lf);
+        res = size < 0 ? (int)size : vs_save_reader(path, lazy_reader, lf, size, manifest);
+        lazy_release(lf);
+    } else {
+        char lower[PATH_MAX];
+        int fd = openat(layer_fd(&info), info_rel(path, &info, lower), O_RDONLY);
+        res = fd == -1 ? -errno : vs_save(path, fd, manifest);
+        if (fd != -1) close(fd);
     }
+    metrics_record(METRIC_BACKUP, t0, res, res == 0 ? (uint64_t)info.st.st_size : 0);
+    if (res != 0) return res;
 
-    // 3. Tạo tên file backup
-    time_t now = time(NULL);
-    struct tm tm;
-    localtime_r(&now, &tm);
-    char ts[32];
-    strftime(ts, sizeof(ts), "%Y%m%d_%H%M%S", &tm);
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx) log_event("BACKUP_CREATED", path, ctx->pid, ctx->uid, 0);
 
-    const char *fname = path;
-    if (fname[0] == '/') fname++;
-    if (fname[0] == '\0') fname = "root";
+    return 0;
+}
 
-    char safe_fname[PATH_MAX];
-    snprintf(safe_fname, sizeof(safe_fname), "%s", fname);
-    for(int i=0; safe_fname[i]; i++) {
-        if(safe_fname[i] == '/') safe_fname[i] = '_';
-    }
 
-    char outpath[PATH_MAX];
-    snprintf(outpath, sizeof(outpath), "%s/%s_%s_%03d.bak", 
-             BACKUP_DIR, safe_fname, ts, backup_counter++);
+// *copied = số byte của file khi copy xong (lazy: chưa copy hết)
+static int copy_up(const char *path, off_t *copied) {
+    const char *rel = rel_path(path);
 
-    // 4. Copy dữ liệu
-    FILE *src = fopen(final_read_path, "rb");
-    if (!src) return -1;
-    
-    FILE *dst = fopen(outpath, "wb");
-    if (!dst) { fclose(src); return -1; }
+    // Copy-up chỉ làm một lần: thread khác có thể đã copy xong trước khi ta
+    // lấy được lock (path_cache có thể còn giữ kết quả resolve cũ)
+    struct stat cur;
+    if (fstatat(g_storage_fd, rel, &cur, AT_SYMLINK_NOFOLLOW) == 0) return 0;
+
+    // Copy từ lower layer đang hiện ra ở path
+    struct path_info info;
+    int res = resolve_path(path, &info);
+    if (res != 0) return res;
+    if (info.layer != LAYER_SOURCE) return -ENOENT;
+    char lower[PATH_MAX];
+    const char *lrel = lower_rel(path, lower);
+    int src = openat(layer_dirfd(info.lower), lrel, O_RDONLY);
+    if (src == -1) return -errno;
 
-    char buf[4096];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-        fwrite(buf, 1, n, dst);
+    make_parent_dirs(path);
+
+    struct stat st;
+    if (fstat(src, &st) == -1) {
+        int err = -errno;
+        close(src);
+        return err;
     }
-    
-    fclose(src);
-    fclose(dst);
 
-    struct fuse_context *ctx = fuse_get_context();
-    if (ctx) log_event("BACKUP_CREATED", path, ctx->pid, ctx->uid, 0);
+    // Journal: nếu daemon chết giữa chừng, lần mount sau xóa bản copy dở
+    storage_copyup_begin(path);
+    int dst = openat(g_storage_fd, rel, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (dst == -1) {
+        int err = -errno;
+        storage_copyup_end(path);
+        close(src);
+        return err;
+    }
 
+    // Reflink / copy_file_range / sendfile, giữ hole, mode, owner và thời gian.
+    // File lớn (--lazy-copyup) chỉ tạo file thưa + bitmap, block copy dần khi ghi.
+    res = lazy_wants(&st) ? lazy_copy_up(path, lrel, src, dst, &st)
+                              : copy_file_all(src, dst, &st);
+
+    close(src);
+    close(dst);
+    if (res != 0) {
+        // Không để lại bản copy dở dang trong Storage
+        unlinkat(g_storage_fd, rel, 0);
+        storage_copyup_end(path);
+        path_cache_invalidate_parents(path);
+        return res;
+    }
+    storage_copyup_end(path);
+
+    // File (và các thư mục cha vừa tạo) giờ đã nằm ở Storage
+    path_cache_invalidate_parents(path);
+    *copied = st.st_size;
     return 0;
 }
 
-
+// Quy ước khóa: copy_source_to_storage, writeback_flush_locked/_held và các
+// hàm *_locked chạy khi caller đã giữ path_lock độc quyền của path (vfs_*
+// tương ứng lấy lock rồi gọi chúng), nên không tự lấy lock lần nữa.
 static int copy_source_to_storage(const char *path) {
-    char src_path[PATH_MAX];
-    char dst_path[PATH_MAX];
-    
-    get_source_path(src_path, path);
-    get_storage_path(dst_path, path);
+    uint64_t t0 = metrics_now();
+    off_t copied = -1;
+    int res = copy_up(path, &copied);
+    // Chỉ đếm lần copy thật (file đã ở Storage thì không có gì để đo)
+    if (copied >= 0 || res != 0) metrics_record(METRIC_COPY_UP, t0, res, copied > 0 ? (uint64_t)copied : 0);
+    return res;
+}
 
-    if (access(src_path, F_OK) == -1) return -errno;
+// --- Write-back (--writeback) ---
 
-    char *dst_dir = strdup(dst_path);
-    mkdir_p(dirname(dst_dir));
-    free(dst_dir);
+struct writeback_ctx {
+    const char *path;
+    int fd;
+    struct lazy_file *lazy;
+    size_t total;
+};
 
-    FILE *src = fopen(src_path, "rb");
-    if (!src) return -errno;
-    
-    FILE *dst = fopen(dst_path, "wb");
-    if (!dst) { fclose(src); return -errno; }
+static int write_extent(void *arg, const void *data, size_t len, off_t offset) {
+    struct writeback_ctx *c = arg;
+    if (c->lazy) {
+        int res = lazy_prepare_write(c->lazy, offset, len);
+        if (res != 0) return res;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(c->fd, (const char *)data + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            int err = -errno;
+            // Phần đã ghi vẫn phải hiện ra ở lần đọc sau
+            if (c->lazy) lazy_commit_write(c->lazy, offset, done);
+            return err;
+        }
+        done += n;
+    }
+    if (c->lazy) {
+        int res = lazy_commit_write(c->lazy, offset, len);
+        if (res != 0) return res;
+    }
+    vs_note_write(c->path, offset, len);
+    c->total += len;
+    return 0;
+}
+
+// Ghi các extent đang đệm ra Storage: một backup + một dòng log cho cả đợt.
+static int writeback_flush_locked(const char *path, struct wb_file *f) {
+    if (!wb_dirty(f)) return 0;
+
+    save_backup(path);
+    struct writeback_ctx c = { path, wb_fd(f), lazy_open(path), 0 };
+    int res = wb_drain(f, write_extent, &c);
+    lazy_release(c.lazy);
+    path_cache_invalidate(path);
+
+    pid_t pid;
+    uid_t uid;
+    wb_writer(f, &pid, &uid);
+    log_event("WRITE", path, pid, uid, res != 0 ? res : (int)c.total);
+    return res;
+}
 
-    char buf[4096];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-        fwrite(buf, 1, n, dst);
+// Xả dữ liệu đệm của path (nếu có) trước thao tác cần thấy nội dung thật.
+static int writeback_flush_held(const char *path) {
+    if (!wb_enabled()) return 0;
+    struct wb_file *f = wb_find(path);
+    if (!f) return 0;
+    int res = writeback_flush_locked(path, f);
+    wb_release(f);
+    return res;
+}
+
+// Như trên nhưng tự lấy lock (read, timer thread)
+static int writeback_flush_path(const char *path) {
+    if (!wb_enabled()) return 0;
+    struct wb_file *f = wb_find(path);
+    if (!f) return 0;
+    int res = 0;
+    if (wb_dirty(f)) {
+        pthread_rwlock_t *lock = path_lock(path, 1);
+        res = writeback_flush_locked(path, f);
+        path_unlock(lock);
     }
-    
+    wb_release(f);
+    return res;
+}
+
+static void writeback_timer_flush(const char *path) {
+    struct wb_file *f = wb_find(path);
+    if (!f) return;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = writeback_flush_locked(path, f);
+    path_unlock(lock);
+    // Không có ai để trả lỗi lúc này: giữ cho flush/fsync/close kế tiếp
+    if (res != 0) wb_set_error(f, res);
+    wb_release(f);
+}
+
+// --- Cây version chỉ đọc (/.versions) ---
+// /.versions/<path>/<stamp> là nội dung của một version, đọc thẳng từ
+// chunk store qua vs_reader, không restore ra file tạm.
+
+#define VERSIONS_DIR "/.versions"
+
+static time_t versions_mtime;       // thời gian của thư mục ảo (lúc mount)
+
+// "/.versions/a/b" -> "/a/b", "/.versions" -> "/"; NULL nếu không thuộc cây
+static const char *versions_path(const char *path) {
+    size_t n = sizeof(VERSIONS_DIR) - 1;
+    if (!vc_enabled() || strncmp(path, VERSIONS_DIR, n) != 0) return NULL;
+    if (path[n] == '\0') return "/";
+    return path[n] == '/' ? path + n : NULL;
+}
+
+// "/a/b/<stamp>" -> version <stamp> của "/a/b" (file = "/a/b")
+static int versions_lookup(const char *vpath, char file[PATH_MAX], struct vc_version *v) {
+    const char *slash = strrchr(vpath, '/');
+    if (!slash || slash == vpath) return -ENOENT;
+    snprintf(file, PATH_MAX, "%.*s", (int)(slash - vpath), vpath);
+    return vc_find(file, slash + 1, v);
+}
+
+static int versions_getattr(const char *vpath, struct stat *st) {
+    char file[PATH_MAX];
+    struct vc_version v;
+    memset(st, 0, sizeof(*st));
+
+    if (strcmp(vpath, "/") != 0 && versions_lookup(vpath, file, &v) == 0) {
+        // Manifest không lưu owner/mode: version mang quyền đọc của file
+        // hiện tại, file đã bị xóa thì chỉ root đọc được
+        struct path_info info;
+        if (resolve_path(file, &info) == 0) {
+            st->st_mode = S_IFREG | (info.st.st_mode & 0444);
+            st->st_uid = info.st.st_uid;
+            st->st_gid = info.st.st_gid;
+        } else {
+            st->st_mode = S_IFREG | 0400;
+        }
+        st->st_nlink = 1;
+        st->st_size = v.size;
+        st->st_blocks = (v.size + 511) / 512;
+        st->st_mtime = st->st_ctime = st->st_atime = v.created;
+        return 0;
+    }
+    if (strcmp(vpath, "/") != 0 && vc_path_kind(vpath) == 0) return -ENOENT;
+
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = st->st_ctime = st->st_atime = versions_mtime;
+    return 0;
+}
+
+static int versions_fill(void *ctx, const char *name, int is_dir) {
+    return dir_listing_add(ctx, name, 0, (is_dir ? S_IFDIR : S_IFREG) >> 12) != 0;
+}
+
+// Danh sách chụp từ catalog mỗi lần opendir (không vào dir_cache)
+static int versions_opendir(const char *vpath, struct fuse_file_info *fi) {
+    struct stat st;
+    int res = versions_getattr(vpath, &st);
+    if (res != 0) return res;
+    if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+
+    struct dir_listing *l = dir_listing_new();
+    if (!l) return -ENOMEM;
+    if (dir_listing_add(l, ".", 0, S_IFDIR >> 12) != 0 || dir_listing_add(l, "..", 0, S_IFDIR >> 12) != 0 ||
+        vc_list(vpath, versions_fill, l) != 0) {
+        dir_listing_release(l);
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)l;
+    return 0;
+}
+
+static int versions_open(const char *path, const char *vpath, struct fuse_file_info *fi) {
+    char file[PATH_MAX];
+    struct vc_version v;
     struct stat st;
-    if (fstat(fileno(src), &st) == 0) {
-        fchmod(fileno(dst), st.st_mode);
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) return -EROFS;
+    int res = versions_getattr(vpath, &st);
+    if (res != 0) return res;
+    if (S_ISDIR(st.st_mode)) return -EISDIR;
+    if (!check_permissions(fi->flags, st.st_mode, st.st_uid, st.st_gid)) return -EACCES;
+    if (versions_lookup(vpath, file, &v) != 0) return -ENOENT;
+
+    struct vs_reader *r;
+    res = vs_reader_open(v.manifest, &r);
+    if (res != 0) return res;
+    res = attach_handle(fi, -1, LAYER_NONE);
+    if (res != 0) {
+        vs_reader_close(r);
+        return res;
     }
+    get_handle(fi)->version = r;
+    fi->keep_cache = 1;             // version không bao giờ đổi
 
-    fclose(src);
-    fclose(dst);
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx) log_event("OPEN", path, ctx->pid, ctx->uid, 0);
+    return 0;
+}
+
+// --- Thống kê (/.vfs_stats, metrics.h) ---
+// Nội dung được chụp lúc open và đọc với direct_io, nên kích thước 0
+// trong getattr không làm kernel cắt ngắn.
+
+#define STATS_FILE "/.vfs_stats"
+
+// Path do VFS tự sinh, không có trên đĩa: mọi thao tác sửa đổi -> EROFS
+static int virtual_path(const char *path) {
+    return versions_path(path) != NULL || strcmp(path, STATS_FILE) == 0;
+}
+
+static void stats_getattr(struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+}
+
+static int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) return -EROFS;
+    size_t len;
+    char *text = metrics_format(&len);
+    if (!text) return -ENOMEM;
+    int res = attach_handle(fi, -1, LAYER_NONE);
+    if (res != 0) {
+        free(text);
+        return res;
+    }
+    get_handle(fi)->text = text;
+    get_handle(fi)->text_len = len;
+    fi->direct_io = 1;
     return 0;
 }
 
 // --- FUSE OPERATIONS ---
 
-static int vfs_getattr(const char *path, struct stat *stbuf) {
-    char fpath[PATH_MAX];
-    int res;
+// Bộ đếm block cache trong /.vfs_stats và file dump SIGUSR1
+static void block_cache_metrics(FILE *f) {
+    struct bc_stats st;
+    bc_get_stats(&st);
+    const struct {
+        const char *name, *help;
+        uint64_t value;
+    } counters[] = {
+        { "hits", "Blocks served from memory.", st.hits },
+        { "misses", "Blocks read from the source.", st.misses },
+        { "readahead", "Blocks loaded by the readahead threads.", st.readahead },
+        { "evictions", "Blocks evicted to make room.", st.evictions },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        const char *n = counters[i].name;
+        fprintf(f, "# HELP vfs_block_cache_%s_total %s\n# TYPE vfs_block_cache_%s_total counter\n", n,
+                counters[i].help, n);
+        fprintf(f, "vfs_block_cache_%s_total %llu\n", n, (unsigned long long)counters[i].value);
+    }
+    fprintf(f, "# HELP vfs_block_cache_pages Capacity in blocks.\n# TYPE vfs_block_cache_pages gauge\n");
+    fprintf(f, "vfs_block_cache_pages %zu\n", st.pages);
+}
 
-    get_storage_path(fpath, path);
-    res = lstat(fpath, stbuf);
+// init chạy sau khi fuse đã daemonize, nên thread nền phải được tạo ở đây
+static void *vfs_init(struct fuse_conn_info *conn) {
+    // read_buf/write_buf: cho libfuse splice giữa /dev/fuse và fd khi kernel hỗ trợ
+    if (conn) conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+    if (start_logging_thread() != 0) {
+        fprintf(stderr, "[WARN] Async logging unavailable, logging synchronously\n");
+    }
+    if (wb_start(writeback_timer_flush) != 0) {
+        fprintf(stderr, "[WARN] Write-back timer unavailable, buffers flush on close/fsync only\n");
+    }
+    if (bc_init() != 0) {
+        fprintf(stderr, "[WARN] Block cache unavailable, reading Source directly\n");
+    } else if (bc_enabled()) {
+        metrics_set_extra(block_cache_metrics);
+    }
+    if (bm_start() != 0) {
+        fprintf(stderr, "[WARN] Backup maintenance thread unavailable\n");
+    }
+    if (metrics_start() != 0) {
+        fprintf(stderr, "[WARN] SIGUSR1 stats dump unavailable\n");
+    }
+    if (storage_start() != 0) {
+        fprintf(stderr, "[WARN] Cannot remove old storage in background\n");
+    }
+    if (layer_index_start() != 0) {
+        fprintf(stderr, "[WARN] Cannot index lower layers, looking them up directly\n");
+    }
+    versions_mtime = time(NULL);
+    return NULL;
+}
 
-    if (res == -1 && errno == ENOENT) {
-        get_source_path(fpath, path);
-        res = lstat(fpath, stbuf);
+static void vfs_destroy(void *private_data) {
+    metrics_stop();
+    metrics_set_extra(NULL);
+    layer_index_stop();
+    wb_stop();
+    bm_stop();
+    if (bc_enabled()) {
+        struct bc_stats st;
+        bc_get_stats(&st);
+        fprintf(stderr, "[INFO] Block cache: %llu hits, %llu misses, %llu readahead, %llu evictions\n",
+                (unsigned long long)st.hits, (unsigned long long)st.misses,
+                (unsigned long long)st.readahead, (unsigned long long)st.evictions);
+        bc_shutdown();
     }
+    // Không còn operation nào chạy: đánh dấu Storage nhất quán
+    storage_stop();
+    // Xả hết log còn trong queue trước khi unmount xong
+    close_logging();
+}
 
-    if (res == -1) return -errno;
+static int vfs_getattr(const char *path, struct stat *stbuf) {
+    struct path_info info;
+
+    const char *vpath = versions_path(path);
+    if (vpath) return versions_getattr(vpath, stbuf);
+    if (strcmp(path, STATS_FILE) == 0) {
+        stats_getattr(stbuf);
+        return 0;
+    }
+
+    int res = resolve_path(path, &info);
+    if (res != 0) return res;
+
+    *stbuf = info.st;
+    if (wb_enabled()) {
+        // Kích thước gồm cả phần đang đệm, chưa ghi xuống Storage
+        off_t end = wb_pending_end(path);
+        if (end > stbuf->st_size) stbuf->st_size = end;
+    }
     return 0;
 }
 
-static int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    char source_path[PATH_MAX];
-    char storage_path[PATH_MAX];
-    
-    struct fuse_context *ctx = fuse_get_context();
-    
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    get_source_path(source_path, path);
-    get_storage_path(storage_path, path);
+// Dựng danh sách đã merge của thư mục: tên ở Storage đọc 1 lần vào name set,
+// Source được lọc trong bộ nhớ (name set + whiteout của thư mục) thay vì
+// fstatat 2 lần cho mỗi entry. Tên dành riêng (.wh., .bm.) không hiện ra.
+static struct dir_listing *build_listing(const char *path) {
+    const char *rel = rel_path(path);
+    struct dir_listing *l = dir_listing_new();
+    if (!l) return NULL;
+
+    struct name_set hidden;
+    name_set_init(&hidden);
+    // d_type = mode >> 12 (DT_DIR không có khi chỉ bật _XOPEN_SOURCE)
+    int ok = dir_listing_add(l, ".", 0, S_IFDIR >> 12) == 0 && dir_listing_add(l, "..", 0, S_IFDIR >> 12) == 0;
+    if (ok && strcmp(path, "/") == 0) {
+        // File ảo che mọi file thật cùng tên ở gốc
+        ok = name_set_add(&hidden, STATS_FILE + 1) == 0 &&
+             dir_listing_add(l, STATS_FILE + 1, 0, S_IFREG >> 12) == 0;
+        if (ok && vc_enabled()) {
+            ok = name_set_add(&hidden, VERSIONS_DIR + 1) == 0 &&
+                 dir_listing_add(l, VERSIONS_DIR + 1, 0, S_IFDIR >> 12) == 0;
+        }
+    }
 
     // 1. STORAGE
-    DIR *dp_storage = opendir(storage_path);
+    int storage_dfd = openat(g_storage_fd, rel, O_RDONLY | O_DIRECTORY);
+    DIR *dp_storage = storage_dfd == -1 ? NULL : fdopendir(storage_dfd);
+    if (storage_dfd != -1 && dp_storage == NULL) close(storage_dfd);
     if (dp_storage != NULL) {
         struct dirent *de;
-        while ((de = readdir(dp_storage)) != NULL) {
+        while (ok && (de = readdir(dp_storage)) != NULL) {
             if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-            
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
-            filler(buf, de->d_name, &st, 0);
+            // Sidecar whiteout (whiteout.c)
+            if (strncmp(de->d_name, WO_PREFIX, sizeof(WO_PREFIX) - 1) == 0) continue;
+            // Bitmap của file copy-up một phần không phải file của người dùng
+            if (strncmp(de->d_name, LAZY_PREFIX, sizeof(LAZY_PREFIX) - 1) == 0) continue;
+
+            ok = name_set_add(&hidden, de->d_name) == 0 &&
+                 dir_listing_add(l, de->d_name, de->d_ino, de->d_type) == 0;
         }
         closedir(dp_storage);
     }
 
-    // 2. SOURCE (Deduplicate + Check Whiteout)
-    DIR *dp_source = opendir(source_path);
-    if (dp_source != NULL) {
+    // 2. LOWER LAYERS, từ trên xuống (Deduplicate + Check Whiteout, trong bộ nhớ)
+    // Chỉ các layer resolve_path đã gộp vào thư mục này: thư mục opaque hoặc
+    // bị che thì không có layer nào
+    struct path_info info;
+    uint32_t lowers = resolve_path(path, &info) == 0 ? info.lowers : 0;
+    char lower[PATH_MAX];
+    const char *lrel = lowers && wo_redirect(path, lower) ? lower : lower_rel(path, lower);
+    for (int i = 0; ok && lowers >> i; i++) {
+        if (!(lowers & (1u << i))) continue;
+        // Tên của layer cuối không cần nhớ: không còn layer nào bên dưới để che
+        int last = (lowers >> i) == 1;
+        int source_dfd = openat(layer_dirfd(i), lrel, O_RDONLY | O_DIRECTORY);
+        DIR *dp_source = source_dfd == -1 ? NULL : fdopendir(source_dfd);
+        if (source_dfd != -1 && dp_source == NULL) close(source_dfd);
+        if (dp_source == NULL) continue;
         struct dirent *de;
-        while ((de = readdir(dp_source)) != NULL) {
+        while (ok && (de = readdir(dp_source)) != NULL) {
             if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-
-            // Kiểm tra trùng tên trong Storage
-            char check_duplicate_path[PATH_MAX];
-            snprintf(check_duplicate_path, PATH_MAX, "%s/%s", storage_path, de->d_name);
-            if (access(check_duplicate_path, F_OK) == 0) continue; 
-
-            // --- ĐOẠN MỚI THÊM: KIỂM TRA WHITEOUT ---
-            // Nếu tồn tại file .wh.tên_file trong Storage -> Bỏ qua không hiện
-            char wh_path[PATH_MAX];
-            snprintf(wh_path, PATH_MAX, "%s/.wh.%s", storage_path, de->d_name);
-            if (access(wh_path, F_OK) == 0) continue; 
-            // ---------------------------------------
-
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
-            filler(buf, de->d_name, &st, 0);
+            if (name_set_contains(&hidden, de->d_name) || wo_is_whiteout(path, de->d_name)) continue;
+            ok = (last || name_set_add(&hidden, de->d_name) == 0) &&
+                 dir_listing_add(l, de->d_name, de->d_ino, de->d_type) == 0;
         }
         closedir(dp_source);
     }
 
-    if (ctx) log_event("READDIR", path, ctx->pid, ctx->uid, 0);
+    name_set_free(&hidden);
+    if (!ok) {
+        dir_listing_release(l);
+        return NULL;
+    }
+    return l;
+}
+
+static struct dir_listing *get_listing(const char *path) {
+    struct dir_listing *l = dir_cache_get(path);
+    if (l) return l;
+    // Lấy generation trước khi đọc đĩa: create/unlink chen vào giữa thì bỏ qua cache
+    uint64_t gen = dir_cache_gen();
+    l = build_listing(path);
+    if (l) dir_cache_put(path, l, gen);
+    return l;
+}
+
+// opendir chụp danh sách cho handle: offset readdir trả về là chỉ số trong
+// bản chụp này nên vẫn đúng dù thư mục đổi giữa các lần đọc trang
+static int vfs_opendir(const char *path, struct fuse_file_info *fi) {
+    struct path_info info;
+    const char *vpath = versions_path(path);
+    if (vpath) return versions_opendir(vpath, fi);
+
+    int res = resolve_path(path, &info);
+    if (res != 0) return res;
+    if (!S_ISDIR(info.st.st_mode)) return -ENOTDIR;
+
+    struct dir_listing *l = get_listing(path);
+    if (!l) return -ENOMEM;
+    fi->fh = (uint64_t)(uintptr_t)l;
     return 0;
 }
 
-static int vfs_open(const char *path, struct fuse_file_info *fi) {
-    char fpath[PATH_MAX];
-    struct stat st;
-    
-    // 1. Xác định file nằm ở đâu (Storage hay Source)
-    get_storage_path(fpath, path);
-    if (access(fpath, F_OK) == -1) {
-        get_source_path(fpath, path);
+static int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_context *ctx = fuse_get_context();
+
+    struct dir_listing *l = fi ? (struct dir_listing *)(uintptr_t)fi->fh : NULL;
+    int own = 0;
+    if (!l) {
+        l = get_listing(path);
+        if (!l) return -ENOMEM;
+        own = 1;
     }
 
+    // Trả từng trang: filler báo đầy -> kernel gọi lại với offset của entry kế tiếp
+    for (size_t i = offset; i < l->count; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = l->entries[i].ino;
+        st.st_mode = l->entries[i].type << 12;
+        if (filler(buf, dir_entry_name(l, i), &st, i + 1)) break;
+    }
+    if (own) dir_listing_release(l);
+
+    if (ctx && offset == 0) log_event("READDIR", path, ctx->pid, ctx->uid, 0);
+    return 0;
+}
+
+static int vfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    dir_listing_release((struct dir_listing *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+static int open_locked(const char *path, struct fuse_file_info *fi) {
+    struct path_info info;
+    
+    // 1. Xác định file nằm ở đâu (Storage hay Source)
     // 2. Lấy thông tin file (Owner, Mode) để kiểm tra quyền
     // Nếu file không tồn tại -> Lỗi
-    if (lstat(fpath, &st) == -1) return -errno;
+    int res = resolve_path(path, &info);
+    if (res != 0) return res;
+
+    enum vfs_layer layer = info.layer;
+    struct stat st = info.st;
+    int dfd = layer_fd(&info);
+    char lower[PATH_MAX];
+    const char *rel = info_rel(path, &info, lower);
 
     // 3. --- QUAN TRỌNG: GỌI HÀM KIỂM TRA QUYỀN TẠI ĐÂY ---
     // Kiểm tra xem user hiện tại có quyền mở file với flag này không (Read/Write)
-    if (!check_permissions(fi->flags, st.st_mode, st.st_uid, st.st_gid)) {
+    // Quyền chỉ được kiểm tra ở đây; read/write sau đó dùng thẳng fd trong handle.
+    if (!check_permissions_at(dfd, rel, fi->flags, &st)) {
         struct fuse_context *ctx = fuse_get_context();
         if (ctx) log_event("OPEN_DENIED", path, ctx->pid, ctx->uid, -EACCES);
         return -EACCES; // Trả về lỗi Permission Denied ngay lập tức
@@ -267,169 +812,399 @@ static int vfs_open(const char *path, struct fuse_file_info *fi) {
 
     // 4. Logic Copy-On-Write (Nếu mở để GHI)
     if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-        // Phải trỏ lại fpath về Storage để chuẩn bị copy
-        get_storage_path(fpath, path);
-        
         // Nếu file chưa có bên Storage -> Copy sang
-        if (access(fpath, F_OK) == -1) {
+        if (layer == LAYER_SOURCE) {
             int copy_res = copy_source_to_storage(path);
             if (copy_res != 0) return copy_res;
+            layer = LAYER_STORAGE;
+            dfd = g_storage_fd;
+            rel = rel_path(path);
         }
 
         // Xử lý O_TRUNC (Backup trước khi xóa trắng nội dung)
         if (fi->flags & O_TRUNC) {
+            writeback_flush_held(path);
             save_backup(path); 
         }
     }
 
-    // 5. Thực hiện mở file thật
-    int fd = open(fpath, fi->flags);
+    // 5. Thực hiện mở file thật và giữ fd trong handle cho tới release
+    int fd = openat(dfd, rel, fi->flags);
     if (fd == -1) return -errno;
-    close(fd);
+    if (fi->flags & O_TRUNC) {
+        // Chỉ bỏ sidecar khi O_TRUNC đã thực sự xóa trắng file Storage
+        if (layer == LAYER_STORAGE) lazy_truncate(path, 0);
+        vs_forget(path);
+        path_cache_invalidate(path);
+    }
+
+    res = attach_handle(fi, fd, layer);
+    if (res != 0) {
+        close(fd);
+        return res;
+    }
+    if (layer == LAYER_STORAGE) {
+        get_handle(fi)->lazy = lazy_open(path);
+    } else {
+        fi->keep_cache = keep_source_cache;
+        // Source không đổi dưới overlay: block đọc được dùng chung mọi handle.
+        // Sau copy-up path trỏ sang Storage, các block cũ tự bị đẩy ra.
+        if (bc_enabled() && bc_file_init(&get_handle(fi)->bc, fd) == 0) get_handle(fi)->cached = 1;
+    }
+    if (wb_enabled() && (fi->flags & O_ACCMODE) != O_RDONLY) get_handle(fi)->wb = wb_open(path, fd);
     
     struct fuse_context *ctx = fuse_get_context();
     if (ctx) log_event("OPEN", path, ctx->pid, ctx->uid, 0);
     return 0;
 }
 
+static int vfs_open(const char *path, struct fuse_file_info *fi) {
+    const char *vpath = versions_path(path);
+    if (vpath) return versions_open(path, vpath, fi);
+    if (strcmp(path, STATS_FILE) == 0) return stats_open(fi);
+
+    // Mở để ghi có thể copy-up / backup / O_TRUNC -> cần lock độc quyền
+    int exclusive = (fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC);
+    pthread_rwlock_t *lock = path_lock(path, exclusive);
+    int res = open_locked(path, fi);
+    path_unlock(lock);
+    return res;
+}
+
 static int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    char fpath[PATH_MAX];
-    struct stat st;
+    struct vfs_handle *fh = get_handle(fi);
+    struct fuse_context *ctx = fuse_get_context();
 
-    // 1. Tìm đường dẫn file
-    get_storage_path(fpath, path);
-    if (access(fpath, F_OK) == -1) {
-        get_source_path(fpath, path);
+    if (fh->version) {
+        int n = (int)vs_reader_read(fh->version, buf, size, offset);
+        if (ctx) log_event("READ", path, ctx->pid, ctx->uid, n);
+        return n;
     }
-
-    // 2. --- KIỂM TRA QUYỀN ĐỌC ---
-    // Mặc dù open đã check, nhưng check lại ở đây cho chắc chắn (vì logic open/read stateless)
-    if (lstat(fpath, &st) == -1) return -errno;
-    if (!check_permission(st.st_mode, st.st_uid, st.st_gid, 4)) { // 4 = READ permission
-        return -EACCES;
+    if (fh->text) {
+        if (offset >= (off_t)fh->text_len) return 0;
+        if (size > fh->text_len - offset) size = fh->text_len - offset;
+        memcpy(buf, fh->text + offset, size);
+        return (int)size;
     }
-    // ----------------------------
 
-    int fd = open(fpath, O_RDONLY);
-    if (fd == -1) return -errno;
-
-    int res = pread(fd, buf, size, offset);
-    if (res == -1) res = -errno;
-    
-    close(fd);
+    // fd đã được resolve + kiểm tra quyền lúc open
+    int res = writeback_flush_path(path);   // đọc phải thấy cả dữ liệu đang đệm
+    if (res != 0) return res;
+    pthread_rwlock_t *lock = path_lock(path, 0);
+    if (fh->lazy) {
+        // Block sạch đọc từ Source, block đã ghi đọc từ Storage
+        res = lazy_read(fh->lazy, buf, size, offset);
+    } else if (fh->cached) {
+        res = bc_read(&fh->bc, &fh->ra, buf, size, offset);
+    } else {
+        res = pread(fh->fd, buf, size, offset);
+        if (res == -1) res = -errno;
+    }
+    path_unlock(lock);
     
-    struct fuse_context *ctx = fuse_get_context();
     if (ctx) log_event("READ", path, ctx->pid, ctx->uid, res);
     return res;
 }
 
 static int vfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    char fpath[PATH_MAX];
-    
-    // Lưu ý: Logic check quyền cho Write hơi phức tạp vì file có thể chưa có ở Storage
-    // Ta kiểm tra quyền trên file HIỆN CÓ (dù là Source hay Storage) trước khi Copy
-    
-    // 1. Tìm file gốc hiện tại để check quyền
-    char current_path[PATH_MAX];
-    get_storage_path(current_path, path);
-    if (access(current_path, F_OK) == -1) {
-        get_source_path(current_path, path);
+    struct vfs_handle *fh = get_handle(fi);
+
+    // Handle mở để ghi luôn trỏ vào Storage (copy-up đã làm lúc open/create)
+
+    // Backup + ghi phải nguyên khối với các thao tác khác trên cùng file
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    struct fuse_context *ctx = fuse_get_context();
+
+    if (fh->wb) {
+        // Write-back: chỉ gom vào bộ nhớ; backup/ghi/log khi flush
+        int res = wb_add(fh->wb, buf, size, offset, ctx ? ctx->pid : 0, ctx ? ctx->uid : 0);
+        if (res == -ENOSPC) {
+            res = writeback_flush_locked(path, fh->wb);
+            if (res == 0) res = wb_add(fh->wb, buf, size, offset, ctx ? ctx->pid : 0, ctx ? ctx->uid : 0);
+            if (res == -ENOSPC) wb_kick();  // budget đang nằm ở file khác -> ghi thẳng
+        }
+        if (res != -ENOSPC) {
+            path_unlock(lock);
+            return res == 0 ? (int)size : res;
+        }
     }
-    
-    // 2. --- KIỂM TRA QUYỀN GHI ---
-    struct stat st;
-    if (lstat(current_path, &st) == -1) return -errno;
-    
-    // Check quyền Write (2) trên file gốc
-    if (!check_permission(st.st_mode, st.st_uid, st.st_gid, 2)) {
+
+    // 1. Backup
+    save_backup(path);
+
+    // 2. Ghi (file copy-up một phần: chỉ copy các block bị ghi đè dở)
+    int res = fh->lazy ? lazy_prepare_write(fh->lazy, offset, size) : 0;
+    if (res == 0) {
+        ssize_t n = pwrite(fh->fd, buf, size, offset);
+        res = n == -1 ? -errno : fh->lazy ? lazy_commit_write(fh->lazy, offset, n) : 0;
+        if (res == 0) {
+            vs_note_write(path, offset, n);
+            res = (int)n;
+        }
+    }
+    path_cache_invalidate(path); // size/mtime đã đổi
+    path_unlock(lock);
+
+    if (ctx) log_event("WRITE", path, ctx->pid, ctx->uid, res);
+    return res;
+}
+
+// read_buf: file thường trả về chính fd, libfuse splice thẳng từ page cache
+// sang /dev/fuse mà không qua bộ nhớ của daemon. Nội dung phải ghép hoặc sinh
+// ra trong bộ nhớ (version, /.vfs_stats, lazy copy-up, block cache) vẫn đi
+// đường read().
+static int vfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct vfs_handle *fh = get_handle(fi);
+    struct fuse_bufvec *bv = malloc(sizeof(*bv));
+    if (!bv) return -ENOMEM;
+    *bv = FUSE_BUFVEC_INIT(size);
+
+    if (fh->fd != -1 && !fh->lazy && !fh->cached) {
+        int res = writeback_flush_path(path);   // đọc phải thấy cả dữ liệu đang đệm
+        if (res != 0) {
+            free(bv);
+            return res;
+        }
+        // Cắt theo kích thước file như pread: log/stats đếm đúng số byte ở EOF
+        struct stat st;
+        if (fstat(fh->fd, &st) == -1) {
+            res = -errno;
+            free(bv);
+            return res;
+        }
+        size_t n = offset >= st.st_size ? 0 : st.st_size - offset < (off_t)size ? (size_t)(st.st_size - offset) : size;
+        bv->buf[0].size = n;
+        if (n > 0) {
+            bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            bv->buf[0].fd = fh->fd;
+            bv->buf[0].pos = offset;
+        }
+        *bufp = bv;
+
         struct fuse_context *ctx = fuse_get_context();
-        if (ctx) log_event("WRITE_DENIED", path, ctx->pid, ctx->uid, -EACCES);
-        return -EACCES;
+        if (ctx) log_event("READ", path, ctx->pid, ctx->uid, (int)n);
+        return 0;
     }
-    // ----------------------------
 
-    // 3. Logic Copy-On-Write
-    get_storage_path(fpath, path);
-    if (access(fpath, F_OK) == -1) {
-        int copy_res = copy_source_to_storage(path);
-        if (copy_res != 0) return copy_res;
+    // libfuse giải phóng cả mem lẫn bufvec sau khi trả lời
+    char *mem = malloc(size ? size : 1);
+    int res = mem ? vfs_read(path, mem, size, offset, fi) : -ENOMEM;
+    if (res < 0) {
+        free(mem);
+        free(bv);
+        return res;
+    }
+    bv->buf[0].mem = mem;
+    bv->buf[0].size = res;
+    *bufp = bv;
+    return 0;
+}
+
+// write_buf: với splice, dữ liệu còn nằm trong pipe; fuse_buf_copy đưa nó
+// thẳng vào fd Storage. Write-back cần giữ dữ liệu trong bộ nhớ nên mới copy.
+static int vfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    struct vfs_handle *fh = get_handle(fi);
+    size_t size = fuse_buf_size(buf);
+
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return vfs_write(path, buf->buf[0].mem, size, offset, fi);
+    }
+    if (fh->wb) {
+        char *mem = malloc(size ? size : 1);
+        if (!mem) return -ENOMEM;
+        struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+        tmp.buf[0].mem = mem;
+        ssize_t n = fuse_buf_copy(&tmp, buf, 0);
+        int res = n < 0 ? (int)n : vfs_write(path, mem, n, offset, fi);
+        free(mem);
+        return res;
     }
 
-    // 4. Backup
+    // Như vfs_write: backup + ghi nguyên khối với các thao tác khác trên file
+    pthread_rwlock_t *lock = path_lock(path, 1);
     save_backup(path);
+    ssize_t res = fh->lazy ? lazy_prepare_write(fh->lazy, offset, size) : 0;
+    if (res == 0) {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = fh->fd;
+        dst.buf[0].pos = offset;
+        res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+        if (res > 0 && fh->lazy) {
+            int c = lazy_commit_write(fh->lazy, offset, res);
+            if (c != 0) res = c;
+        }
+        if (res > 0) vs_note_write(path, offset, res);
+    }
+    path_cache_invalidate(path); // size/mtime đã đổi
+    path_unlock(lock);
 
-    // 5. Ghi
-    int fd = open(fpath, O_WRONLY);
-    if (fd == -1) return -errno;
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx) log_event("WRITE", path, ctx->pid, ctx->uid, (int)res);
+    return (int)res;
+}
 
-    int res = pwrite(fd, buf, size, offset);
-    if (res == -1) res = -errno;
+// flush được gọi mỗi lần close() một fd trỏ tới handle (có thể nhiều lần do dup)
+// Xả buffer write-back của handle (flush/fsync/release)
+static int flush_handle_writeback(const char *path, struct vfs_handle *fh) {
+    if (!fh->wb) return 0;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = writeback_flush_locked(path, fh->wb);
+    path_unlock(lock);
+    return res;
+}
 
-    close(fd);
+static int vfs_flush(const char *path, struct fuse_file_info *fi) {
+    struct vfs_handle *fh = get_handle(fi);
+    if (fh->fd == -1) return 0;     // file ảo
 
+    // Lỗi ghi dữ liệu đệm được trả cho close()
+    int wb_res = flush_handle_writeback(path, fh);
+
+    // Đóng một bản dup để giữ đúng ngữ nghĩa close() của file system bên dưới
+    int res = close(dup(fh->fd));
+    if (wb_res != 0) return wb_res;
+    return res == -1 ? -errno : 0;
+}
+
+static int vfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    struct vfs_handle *fh = get_handle(fi);
+    if (fh->fd == -1) return 0;     // file ảo
+
+    int wb_res = flush_handle_writeback(path, fh);
+    int res = isdatasync ? fdatasync(fh->fd) : fsync(fh->fd);
+    res = res == -1 ? -errno : wb_res;
+    
     struct fuse_context *ctx = fuse_get_context();
-    if (ctx) log_event("WRITE", path, ctx->pid, ctx->uid, res);
+    if (ctx) log_event("FSYNC", path, ctx->pid, ctx->uid, res);
     return res;
 }
 
+// release: fd cuối cùng của handle đã đóng -> trả fd thật
+static int vfs_release(const char *path, struct fuse_file_info *fi) {
+    struct vfs_handle *fh = get_handle(fi);
+
+    flush_handle_writeback(path, fh);
+    wb_release(fh->wb);
+    if (fh->fd != -1) close(fh->fd);
+    lazy_release(fh->lazy);
+    vs_reader_close(fh->version);
+    free(fh->text);
+    free(fh);
+    fi->fh = 0;
+    return 0;
+}
+
 static int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
+    if (virtual_path(path)) return -EROFS;
 
     // 1. Tạo thư mục cha nếu chưa có
-    char *tmp_path = strdup(fpath);
-    mkdir_p(dirname(tmp_path));
-    free(tmp_path);
+    make_parent_dirs(path);
 
     // 2. Lấy thông tin người dùng đang gọi lệnh (ví dụ: phuc)
     struct fuse_context *ctx = fuse_get_context();
 
-    // 3. Tạo file thật
-    int fd = creat(fpath, mode);
-    if (fd == -1) return -errno;
+    // 3. Tạo file thật (giữ fd cho handle, dùng đúng flags của caller)
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int fd = openat(g_storage_fd, rel_path(path), fi->flags | O_CREAT, mode);
+    if (fd == -1) {
+        int err = -errno;
+        path_unlock(lock);
+        return err;
+    }
     
     // --- FIX QUAN TRỌNG: CHOWN NGAY LẬP TỨC ---
     // Chuyển chủ sở hữu file từ root sang phuc (ctx->uid)
     fchown(fd, ctx->uid, ctx->gid); 
+    // File mới ở Storage thay chỗ của whiteout (nếu có)
+    wo_remove(path);
 
-    close(fd);
+    path_cache_invalidate_parents(path);
+    dir_cache_invalidate_parent(path);
+    path_unlock(lock);
+
+    int res = attach_handle(fi, fd, LAYER_STORAGE);
+    if (res != 0) {
+        close(fd);
+        return res;
+    }
+    if (wb_enabled() && (fi->flags & O_ACCMODE) != O_RDONLY) get_handle(fi)->wb = wb_open(path, fd);
 
     if (ctx) log_event("CREATE", path, ctx->pid, ctx->uid, 0);
     return 0;
 }
 
 static int vfs_mkdir(const char *path, mode_t mode) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
-    int res = mkdir_p(fpath);
+    if (virtual_path(path)) return -EROFS;
+    int res = mkdir_p(rel_path(path));
+    int err = res == -1 ? -errno : 0;
+    // Tạo lại thư mục đã bị xóa: không gộp nội dung cũ ở Source
+    if (res == 0 && wo_remove(path) == 1 && wo_set_opaque(path) != 0) {
+        fprintf(stderr, "[WARN] Cannot mark %s opaque\n", path);
+    }
+    path_cache_invalidate_parents(path);
+    dir_cache_invalidate_parent(path);
     
     struct fuse_context *ctx = fuse_get_context();
-    if (ctx) log_event("MKDIR", path, ctx->pid, ctx->uid, res == -1 ? -errno : 0);
-    return res == -1 ? -errno : 0;
+    if (ctx) log_event("MKDIR", path, ctx->pid, ctx->uid, err);
+    return err;
 }
 
 // unlink để xóa file
-static int vfs_unlink(const char *path) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
+static int unlink_locked(const char *path) {
+    struct path_info info;
     struct fuse_context *ctx = fuse_get_context();
 
-    if (access(fpath, F_OK) == 0) {
+    writeback_flush_held(path);     // backup phải có cả dữ liệu đang đệm
+
+    int lookup = resolve_path(path, &info);
+    if (lookup != 0) return lookup;
+
+    if (info.layer == LAYER_STORAGE) {
         save_backup(path); // Backup trước khi xóa
-        int res = unlink(fpath);
-        if (ctx) log_event("UNLINK (Storage)", path, ctx->pid, ctx->uid, res == -1 ? -errno : 0);
-        return res == -1 ? -errno : 0;
+        int res = unlinkat(g_storage_fd, rel_path(path), 0) == -1 ? -errno : 0;
+        if (res == 0) {
+            lazy_remove(path);
+            // Bản gốc cùng tên ở Source không được hiện lại
+            if (source_visible(path)) res = wo_add(path);
+        }
+        vs_forget(path);
+        path_cache_invalidate_parents(path);
+        dir_cache_invalidate_parent(path);
+        if (ctx) log_event("UNLINK (Storage)", path, ctx->pid, ctx->uid, res);
+        return res;
     }
 
-    if (ctx) log_event("UNLINK (Source-Protected)", path, ctx->pid, ctx->uid, -EACCES);
-    return -EACCES; 
+    // File chỉ có ở Source: Source không bị sửa, chỉ che bằng whiteout
+    if (S_ISDIR(info.st.st_mode)) return -EISDIR;
+    save_backup(path);
+    make_parent_dirs(path);
+    int res = wo_add(path);
+    vs_forget(path);
+    path_cache_invalidate_parents(path);
+    dir_cache_invalidate_parent(path);
+    if (ctx) log_event("UNLINK (Whiteout)", path, ctx->pid, ctx->uid, res);
+    return res;
 }
 
-static int vfs_truncate(const char *path, off_t size) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
+static int vfs_unlink(const char *path) {
+    if (virtual_path(path)) return -EROFS;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = unlink_locked(path);
+    path_unlock(lock);
+    return res;
+}
+
+static int truncate_locked(const char *path, off_t size) {
+    struct path_info info;
+
+    // Write đến trước truncate phải xuống đĩa trước nó
+    int wb_res = writeback_flush_held(path);
+    if (wb_res != 0) return wb_res;
 
-    if (access(fpath, F_OK) == -1) {
+    int lookup = resolve_path(path, &info);
+    if (lookup != 0) return lookup;
+    if (info.layer == LAYER_SOURCE) {
         int copy_res = copy_source_to_storage(path);
         if (copy_res != 0) return copy_res;
     }
@@ -439,47 +1214,77 @@ static int vfs_truncate(const char *path, off_t size) {
     save_backup(path); 
     // -----------------------------------------------------
 
-    int res = truncate(fpath, size);
-    return res == -1 ? -errno : 0;
+    // File copy-up một phần: block chứa điểm cắt phải được copy trước
+    int lazy_res = lazy_truncate_prepare(path, size);
+    if (lazy_res != 0) return lazy_res;
+
+    // Không có truncateat(): mở tương đối với Storage rồi ftruncate
+    int res = -1;
+    int fd = openat(g_storage_fd, rel_path(path), O_WRONLY);
+    if (fd != -1) {
+        res = ftruncate(fd, size);
+        if (res == -1) res = -errno;
+        close(fd);
+    } else {
+        res = -errno;
+    }
+    // Bitmap chỉ ghi nhận vùng 0 mới sau khi ftruncate thành công
+    if (res == 0) lazy_truncate(path, size);
+    vs_forget(path);
+    path_cache_invalidate(path);
+    return res;
 }
 
-static int vfs_chmod(const char *path, mode_t mode) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
+static int vfs_truncate(const char *path, off_t size) {
+    if (virtual_path(path)) return -EROFS;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = truncate_locked(path, size);
+    path_unlock(lock);
+    return res;
+}
 
-    if (access(fpath, F_OK) == -1) {
+static int chmod_locked(const char *path, mode_t mode) {
+    struct path_info info;
+
+    int lookup = resolve_path(path, &info);
+    if (lookup != 0) return lookup;
+    if (info.layer == LAYER_SOURCE) {
         int copy_res = copy_source_to_storage(path);
         if (copy_res != 0) return copy_res;
     }
     
-    int res = chmod(fpath, mode);
+    int res = fchmodat(g_storage_fd, rel_path(path), mode, 0);
+    path_cache_invalidate(path);
     return res == -1 ? -errno : 0;
 }
 
-static int vfs_chown(const char *path, uid_t uid, gid_t gid) {
-    char fpath[PATH_MAX];
-    
-    get_storage_path(fpath, path);
-    if (access(fpath, F_OK) == -1) get_source_path(fpath, path);
+static int vfs_chmod(const char *path, mode_t mode) {
+    if (virtual_path(path)) return -EROFS;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = chmod_locked(path, mode);
+    path_unlock(lock);
+    return res;
+}
 
-    struct stat st;
-    if (lstat(fpath, &st) == -1) return -errno;
+static int chown_locked(const char *path, uid_t uid, gid_t gid) {
+    struct path_info info;
 
-    if (!check_chown_permission(st.st_uid, uid, gid)) {
+    int lookup = resolve_path(path, &info);
+    if (lookup != 0) return lookup;
+
+    if (!check_chown_permission(info.st.st_uid, uid, gid)) {
         struct fuse_context *ctx = fuse_get_context();
         if (ctx) log_event("CHOWN_DENIED", path, ctx->pid, ctx->uid, -EPERM);
         return -EPERM;
     }
 
-    char storage_path[PATH_MAX];
-    get_storage_path(storage_path, path);
-    
-    if (access(storage_path, F_OK) == -1) {
+    if (info.layer == LAYER_SOURCE) {
         int copy_res = copy_source_to_storage(path);
         if (copy_res != 0) return copy_res;
     }
 
-    int res = lchown(storage_path, uid, gid);
+    int res = fchownat(g_storage_fd, rel_path(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+    path_cache_invalidate(path);
     struct fuse_context *ctx = fuse_get_context();
     if (ctx) log_event("CHOWN", path, ctx->pid, ctx->uid, res == -1 ? -errno : 0);
     
@@ -487,62 +1292,102 @@ static int vfs_chown(const char *path, uid_t uid, gid_t gid) {
     return 0;
 }
 
-static int vfs_rename(const char *from, const char *to) {
-    char ffrom[PATH_MAX];
-    char fto[PATH_MAX];
-    int is_source_file = 0; // Cờ đánh dấu file này nằm ở source
-
-    get_storage_path(ffrom, from);
-    get_storage_path(fto, to);
-
-    // Kiểm tra nếu file chưa có ở Storage (tức là file Source)
-    if (access(ffrom, F_OK) == -1) {
-        char fsource[PATH_MAX];
-        get_source_path(fsource, from);
-        if (access(fsource, F_OK) == 0) {
-            // Copy từ Source sang Storage
-            int cp_res = copy_source_to_storage(from);
-            if (cp_res != 0) return cp_res;
-            is_source_file = 1; // Đánh dấu đây là file gốc cần che đi
-        } else {
-            return -ENOENT;
+static int vfs_chown(const char *path, uid_t uid, gid_t gid) {
+    if (virtual_path(path)) return -EROFS;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = chown_locked(path, uid, gid);
+    path_unlock(lock);
+    return res;
+}
+
+// Rename thư mục có nội dung ở lower layer mà không copy cả cây: thư mục
+// Storage của from (tạo nếu chưa có) mang redirect về path cũ ở lower layer,
+// vẫn là chính chỗ nó đang gộp nên bên ngoài không thấy gì đổi. Sau đó
+// renameat() của Storage là bước duy nhất đổi tên, redirect đi theo thư mục
+// (và còn đó sau khi mount lại), whiteout che tên cũ ngay sau đó.
+static int prepare_dir_redirect(const char *from, const struct path_info *info) {
+    char lower[PATH_MAX];
+    if (wo_redirect(from, lower)) return 0;   // đã rename trước đó
+
+    int created = 0;
+    if (info->layer == LAYER_SOURCE) {
+        make_parent_dirs(from);
+        if (mkdirat(g_storage_fd, rel_path(from), info->st.st_mode & 07777) == 0) created = 1;
+        else if (errno != EEXIST) return -errno;
+    }
+    int res = wo_set_redirect(from, lower_rel(from, lower));
+    if (res == 0 && created) {
+        // Sau khi ghi sidecar, để mtime giống thư mục gốc
+        int fd = openat(g_storage_fd, rel_path(from), O_RDONLY | O_DIRECTORY);
+        if (fd != -1) {
+            copy_metadata(fd, &info->st);
+            close(fd);
         }
     }
+    return res;
+}
+
+static int rename_locked(const char *from, const char *to) {
+    struct path_info info;
+
+    writeback_flush_held(from);
+    writeback_flush_held(to);
+
+    int lookup = resolve_path(from, &info);
+    if (lookup != 0) return lookup;
+
+    // Bản ở Source (kể cả khi đã copy-up) phải bị che sau khi rename
+    int cover = info.layer == LAYER_SOURCE || source_visible(from);
+
+    // Thư mục gộp với lower layer: chỉ ghi redirect, O(1) dù cây lớn cỡ nào
+    if (S_ISDIR(info.st.st_mode) && info.lowers != 0) {
+        int rd_res = prepare_dir_redirect(from, &info);
+        if (rd_res != 0) return rd_res;
+    } else if (info.layer == LAYER_SOURCE) {
+        // File chưa có ở Storage (tức là file Source): copy sang Storage
+        int cp_res = copy_source_to_storage(from);
+        if (cp_res != 0) return cp_res;
+    }
 
     // Tạo thư mục cha cho đích đến
-    char *tmp_to = strdup(fto);
-    mkdir_p(dirname(tmp_to));
-    free(tmp_to);
+    make_parent_dirs(to);
 
     // Thực hiện rename trong Storage
-    int res = rename(ffrom, fto);
+    int res = renameat(g_storage_fd, rel_path(from), g_storage_fd, rel_path(to));
+    if (res == 0) {
+        vs_forget(from);
+        vs_forget(to);
+        lazy_rename(from, to);  // bitmap đi theo file
+        wb_rename(from, to);
+    }
     
-    // --- ĐOẠN MỚI THÊM: TẠO WHITEOUT ---
-    // Nếu rename thành công VÀ file gốc nằm ở source -> Tạo file .wh. để che
-    if (res == 0 && is_source_file) {
-        char wh_path[PATH_MAX];
-        char *dname = strdup(from); // Lấy tên file từ path (ví dụ /test.txt -> test.txt)
-        
-        // Xử lý lấy tên file (basename)
-        char *base = basename(dname);
-        
-        // Tạo đường dẫn file whiteout: .vfs_storage/.wh.test.txt
-        char storage_dir[PATH_MAX];
-        get_storage_path(storage_dir, ""); // Lấy root storage
-        // Cẩn thận logic path ở đây, cách đơn giản nhất là dùng dirname của ffrom
-        
-        char ffrom_dir[PATH_MAX];
-        strcpy(ffrom_dir, ffrom);
-        dirname(ffrom_dir); // Lấy thư mục chứa file cũ
-
-        snprintf(wh_path, PATH_MAX, "%s/.wh.%s", ffrom_dir, base);
-        
-        // Tạo file rỗng .wh.
-        int fd = creat(wh_path, 0600);
-        if (fd >= 0) close(fd);
-        
-        free(dname);
+    if (res == 0) {
+        // Sidecar whiteout của thư mục con đi theo thư mục
+        if (S_ISDIR(info.st.st_mode)) {
+            wo_invalidate_tree(from);
+            wo_invalidate_tree(to);
+        }
+        // Tên cũ: che bản ở Source. Tên mới: entry Storage thay chỗ whiteout,
+        // thư mục thì không gộp với thư mục cũ ở Source
+        if (cover) wo_add(from);
+        if (wo_remove(to) == 1 && S_ISDIR(info.st.st_mode)) wo_set_opaque(to);
+    }
+
+    // Tên cũ/mới và thư mục cha của chúng đều đổi; thư mục thì cả cây con.
+    // File không có cây con: không quét toàn bộ cache cho mỗi rename file
+    if (S_ISDIR(info.st.st_mode)) {
+        path_cache_invalidate_tree(from);
+        path_cache_invalidate_tree(to);
+        dir_cache_invalidate_tree(from);
+        dir_cache_invalidate_tree(to);
+    } else {
+        path_cache_invalidate(from);
+        path_cache_invalidate(to);
     }
+    path_cache_invalidate_parents(from);
+    path_cache_invalidate_parents(to);
+    dir_cache_invalidate_parent(from);
+    dir_cache_invalidate_parent(to);
 
     struct fuse_context *ctx = fuse_get_context();
     if (ctx) log_event("RENAME", from, ctx->pid, ctx->uid, res == -1 ? -errno : 0);
@@ -551,17 +1396,29 @@ static int vfs_rename(const char *from, const char *to) {
     return 0;
 }
 
-static int vfs_utimens(const char *path, const struct timespec tv[2]) {
-    char fpath[PATH_MAX];
-    get_storage_path(fpath, path);
+static int vfs_rename(const char *from, const char *to) {
+    if (virtual_path(from) || virtual_path(to)) return -EROFS;
+    pthread_rwlock_t *locks[2];
+    path_lock_pair(from, to, locks);
+    int res = rename_locked(from, to);
+    path_unlock_pair(locks);
+    return res;
+}
+
+static int utimens_locked(const char *path, const struct timespec tv[2]) {
+    struct path_info info;
+
+    int lookup = resolve_path(path, &info);
+    if (lookup != 0) return lookup;
 
     // Nếu file chưa có ở Storage -> Copy sang để update time
-    if (access(fpath, F_OK) == -1) {
+    if (info.layer == LAYER_SOURCE) {
         int cp_res = copy_source_to_storage(path);
         if (cp_res != 0) return cp_res;
     }
 
-    int res = utimensat(AT_FDCWD, fpath, tv, 0);
+    int res = utimensat(g_storage_fd, rel_path(path), tv, 0);
+    path_cache_invalidate(path);
     
     struct fuse_context *ctx = fuse_get_context();
     if (ctx) log_event("UTIMENS", path, ctx->pid, ctx->uid, res == -1 ? -errno : 0);
@@ -570,18 +1427,77 @@ static int vfs_utimens(const char *path, const struct timespec tv[2]) {
     return 0;
 }
 
+static int vfs_utimens(const char *path, const struct timespec tv[2]) {
+    if (virtual_path(path)) return -EROFS;
+    pthread_rwlock_t *lock = path_lock(path, 1);
+    int res = utimens_locked(path, tv);
+    path_unlock(lock);
+    return res;
+}
+
+// --- Đo từng operation (metrics.h) ---
+// Bọc các vfs_*: thời gian, lỗi, và byte với read/write
+
+#define TIMED(id, bytes, call) \
+    uint64_t t0 = metrics_now(); \
+    int res = call; \
+    metrics_record(id, t0, res, bytes); \
+    return res
+
+static int timed_getattr(const char *path, struct stat *st) { TIMED(METRIC_GETATTR, 0, vfs_getattr(path, st)); }
+static int timed_opendir(const char *path, struct fuse_file_info *fi) { TIMED(METRIC_OPENDIR, 0, vfs_opendir(path, fi)); }
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    TIMED(METRIC_READDIR, 0, vfs_readdir(path, buf, filler, offset, fi));
+}
+static int timed_releasedir(const char *path, struct fuse_file_info *fi) { TIMED(METRIC_RELEASEDIR, 0, vfs_releasedir(path, fi)); }
+static int timed_open(const char *path, struct fuse_file_info *fi) { TIMED(METRIC_OPEN, 0, vfs_open(path, fi)); }
+static int timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TIMED(METRIC_READ, res > 0 ? res : 0, vfs_read(path, buf, size, offset, fi));
+}
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TIMED(METRIC_WRITE, res > 0 ? res : 0, vfs_write(path, buf, size, offset, fi));
+}
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi) {
+    TIMED(METRIC_READ, res == 0 ? fuse_buf_size(*bufp) : 0, vfs_read_buf(path, bufp, size, off, fi));
+}
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+    TIMED(METRIC_WRITE, res > 0 ? res : 0, vfs_write_buf(path, buf, off, fi));
+}
+static int timed_flush(const char *path, struct fuse_file_info *fi) { TIMED(METRIC_FLUSH, 0, vfs_flush(path, fi)); }
+static int timed_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    TIMED(METRIC_FSYNC, 0, vfs_fsync(path, isdatasync, fi));
+}
+static int timed_release(const char *path, struct fuse_file_info *fi) { TIMED(METRIC_RELEASE, 0, vfs_release(path, fi)); }
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi) { TIMED(METRIC_CREATE, 0, vfs_create(path, mode, fi)); }
+static int timed_mkdir(const char *path, mode_t mode) { TIMED(METRIC_MKDIR, 0, vfs_mkdir(path, mode)); }
+static int timed_unlink(const char *path) { TIMED(METRIC_UNLINK, 0, vfs_unlink(path)); }
+static int timed_truncate(const char *path, off_t size) { TIMED(METRIC_TRUNCATE, 0, vfs_truncate(path, size)); }
+static int timed_chmod(const char *path, mode_t mode) { TIMED(METRIC_CHMOD, 0, vfs_chmod(path, mode)); }
+static int timed_chown(const char *path, uid_t uid, gid_t gid) { TIMED(METRIC_CHOWN, 0, vfs_chown(path, uid, gid)); }
+static int timed_rename(const char *from, const char *to) { TIMED(METRIC_RENAME, 0, vfs_rename(from, to)); }
+static int timed_utimens(const char *path, const struct timespec tv[2]) { TIMED(METRIC_UTIMENS, 0, vfs_utimens(path, tv)); }
+
 struct fuse_operations vfs_operations = {
-    .getattr = vfs_getattr,
-    .open = vfs_open,
-    .read = vfs_read,
-    .write = vfs_write,
-    .readdir = vfs_readdir,
-    .truncate = vfs_truncate,
-    .chmod = vfs_chmod,
-    .chown = vfs_chown,
-    .unlink = vfs_unlink,
-    .mkdir = vfs_mkdir,
-    .create = vfs_create,
-    .rename = vfs_rename,
-    .utimens = vfs_utimens,
-};
\ No newline at end of file
+    .init = vfs_init,
+    .destroy = vfs_destroy,
+    .getattr = timed_getattr,
+    .open = timed_open,
+    .read = timed_read,
+    .write = timed_write,
+    .read_buf = timed_read_buf,
+    .write_buf = timed_write_buf,
+    .flush = timed_flush,
+    .fsync = timed_fsync,
+    .release = timed_release,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .truncate = timed_truncate,
+    .chmod = timed_chmod,
+    .chown = timed_chown,
+    .unlink = timed_unlink,
+    .mkdir = timed_mkdir,
+    .create = timed_create,
+    .rename = timed_rename,
+    .utimens = timed_utimens,
+};
@@ -3,6 +3,12 @@
 
 #include <fuse.h>
 
+#define STORAGE_DIR ".vfs_storage"
+
 extern struct fuse_operations vfs_operations;
 
+// 1: file mở từ Source giữ page cache của kernel giữa các lần open (mặc định).
+// 0: để -o auto_cache của libfuse so mtime/size quyết định.
+void vfs_set_keep_source_cache(int on);
+
 #endif
\ No newline at end of file
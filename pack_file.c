@@ -0,0 +1,526 @@
+/*
+ * pack_file.c
+ * Append-only pack files for the backup store, see pack_file.h.
+ *
+ * The indexes of all published packs are kept in memory (one sorted array
+ * per pack, binary searched). Readers open the pack file per read, so a
+ * pack dropped by compaction while a restore is running only costs a
+ * retry on the newer pack that holds the copied record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pack_file.h"
+#include "lz.h"
+
+#define PACK_MIN_COMPRESS 64            // nhỏ hơn thì không đáng nén
+
+struct pack {
+    uint32_t id;
+    uint64_t size;
+    uint32_t count;
+    struct pack_entry *entries;         // sắp theo (key, type)
+    struct pack *next;
+};
+
+struct pack_writer {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    struct pack_entry *entries;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t src_id;                    // pack nguồn đang mở cho pack_writer_copy
+    int src_fd;
+};
+
+static int pack_dirfd = -1;
+static struct pack *packs = NULL;
+static pthread_rwlock_t pack_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t next_id = 1;            // atomic
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int key_cmp(const uint8_t *key, int type, const struct pack_entry *e) {
+    int c = memcmp(key, e->key, SHA256_DIGEST_LEN);
+    return c ? c : type - (int)e->type;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct pack_entry *x = a;
+    return key_cmp(x->key, x->type, b);
+}
+
+static const struct pack_entry *find_in(const struct pack *p, const uint8_t *key, int type) {
+    uint32_t lo = 0, hi = p->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = key_cmp(key, type, &p->entries[mid]);
+        if (c == 0) return &p->entries[mid];
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return NULL;
+}
+
+static void publish(struct pack *p) {
+    pthread_rwlock_wrlock(&pack_lock);
+    // Pack mới lên đầu: bản sao mới nhất của một record được tìm thấy trước
+    p->next = packs;
+    packs = p;
+    pthread_rwlock_unlock(&pack_lock);
+}
+
+static int load_pack(uint32_t id) {
+    char name[64];
+    snprintf(name, sizeof(name), "pack-%u.idx", id);
+    int fd = openat(pack_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+
+    struct pack_idx_header hdr;
+    struct stat st;
+    snprintf(name, sizeof(name), "pack-%u.pack", id);
+    if (read_full(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, PACK_IDX_MAGIC, sizeof(hdr.magic)) != 0 ||
+        fstatat(pack_dirfd, name, &st, 0) == -1) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    struct pack *p = calloc(1, sizeof(*p));
+    size_t bytes = (size_t)hdr.count * sizeof(struct pack_entry);
+    if (p) p->entries = malloc(bytes ? bytes : 1);
+    if (!p || !p->entries) {
+        if (p) free(p);
+        close(fd);
+        return -ENOMEM;
+    }
+    ssize_t n = read_full(fd, p->entries, bytes, sizeof(hdr));
+    close(fd);
+    if (n != (ssize_t)bytes) {
+        free(p->entries);
+        free(p);
+        return -EINVAL;
+    }
+    p->id = id;
+    p->count = hdr.count;
+    p->size = st.st_size;
+    publish(p);
+
+    uint32_t cur = __atomic_load_n(&next_id, __ATOMIC_RELAXED);
+    while (id >= cur && !__atomic_compare_exchange_n(&next_id, &cur, id + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+int pack_init(int backup_dirfd) {
+    if (mkdirat(backup_dirfd, PACK_DIR, 0755) == -1 && errno != EEXIST) return -errno;
+    int fd = openat(backup_dirfd, PACK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    pack_dirfd = fd;
+
+    DIR *d = fdopendir(dup(fd));
+    if (!d) return -errno;
+    rewinddir(d);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned id;
+        char tail[8];
+        if (sscanf(de->d_name, "pack-%u.%7s", &id, tail) == 2 && strcmp(tail, "idx") == 0) {
+            if (load_pack(id) != 0) fprintf(stderr, "[WARN] Ignoring damaged pack index %s\n", de->d_name);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+static int is_loaded(uint32_t id) {
+    int found = 0;
+    pthread_rwlock_rdlock(&pack_lock);
+    for (struct pack *p = packs; p && !found; p = p->next) found = p->id == id;
+    pthread_rwlock_unlock(&pack_lock);
+    return found;
+}
+
+void pack_cleanup(void) {
+    if (pack_dirfd == -1) return;
+    DIR *d = fdopendir(dup(pack_dirfd));
+    if (!d) return;
+    rewinddir(d);           // fd dup dùng chung vị trí đọc với pack_dirfd
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned id;
+        char tail[8];
+        int stale = strncmp(de->d_name, "tmp-", 4) == 0;
+        // .pack không có .idx: lần ghi bị ngắt giữa chừng
+        if (!stale && sscanf(de->d_name, "pack-%u.%7s", &id, tail) == 2) stale = !is_loaded(id);
+        if (stale) unlinkat(pack_dirfd, de->d_name, 0);
+    }
+    closedir(d);
+}
+
+// Tìm object; trả id pack + bản sao entry
+static int lookup(const uint8_t key[SHA256_DIGEST_LEN], int type, uint32_t *id, struct pack_entry *out) {
+    int res = -ENOENT;
+    pthread_rwlock_rdlock(&pack_lock);
+    for (struct pack *p = packs; p; p = p->next) {
+        const struct pack_entry *e = find_in(p, key, type);
+        if (e) {
+            *id = p->id;
+            *out = *e;
+            res = 0;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    return res;
+}
+
+int pack_has(const uint8_t key[SHA256_DIGEST_LEN], int type) {
+    uint32_t id;
+    struct pack_entry e;
+    return lookup(key, type, &id, &e) == 0;
+}
+
+static int open_pack(uint32_t id) {
+    char name[64];
+    snprintf(name, sizeof(name), "pack-%u.pack", id);
+    int fd = openat(pack_dirfd, name, O_RDONLY | O_CLOEXEC);
+    return fd == -1 ? -errno : fd;
+}
+
+// Header + phần dữ liệu đã lưu (chưa giải nén) của một record
+static int read_record(int fd, const struct pack_entry *e, void **stored) {
+    struct pack_record rec;
+    if (read_full(fd, &rec, sizeof(rec), (off_t)e->offset) != sizeof(rec) ||
+        memcmp(rec.magic, PACK_RECORD_MAGIC, sizeof(rec.magic)) != 0 ||
+        memcmp(rec.key, e->key, SHA256_DIGEST_LEN) != 0 || rec.type != e->type ||
+        rec.stored_len != e->stored_len || rec.raw_len != e->raw_len) {
+        return -EIO;
+    }
+    void *buf = malloc(e->stored_len ? e->stored_len : 1);
+    if (!buf) return -ENOMEM;
+    off_t off = (off_t)e->offset + sizeof(rec) + e->name_len;
+    if (read_full(fd, buf, e->stored_len, off) != (ssize_t)e->stored_len) {
+        free(buf);
+        return -EIO;
+    }
+    *stored = buf;
+    return 0;
+}
+
+ssize_t pack_read_entry(uint32_t id, const struct pack_entry *e, void **data) {
+    int fd = open_pack(id);
+    if (fd < 0) return fd;
+    void *stored;
+    int res = read_record(fd, e, &stored);
+    close(fd);
+    if (res != 0) return res;
+
+    if (e->codec == PACK_RAW) {
+        *data = stored;
+        return e->raw_len;
+    }
+    void *raw = malloc(e->raw_len ? e->raw_len : 1);
+    if (!raw) {
+        free(stored);
+        return -ENOMEM;
+    }
+    res = e->codec == PACK_LZ ? lz_decompress(stored, e->stored_len, raw, e->raw_len) : -1;
+    free(stored);
+    if (res != 0) {
+        free(raw);
+        return -EIO;
+    }
+    *data = raw;
+    return e->raw_len;
+}
+
+ssize_t pack_read(const uint8_t key[SHA256_DIGEST_LEN], int type, void **data) {
+    // Pack có thể bị compaction xóa giữa lookup và open: record đã được
+    // chép sang pack mới, tìm lại một lần
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint32_t id;
+        struct pack_entry e;
+        int res = lookup(key, type, &id, &e);
+        if (res != 0) return res;
+        ssize_t n = pack_read_entry(id, &e, data);
+        if (n != -ENOENT) return n;
+    }
+    return -ENOENT;
+}
+
+int pack_read_name(uint32_t id, const struct pack_entry *e, char *name, size_t cap) {
+    if (e->name_len >= cap) return -ENAMETOOLONG;
+    int fd = open_pack(id);
+    if (fd < 0) return fd;
+    ssize_t n = read_full(fd, name, e->name_len, (off_t)e->offset + sizeof(struct pack_record));
+    close(fd);
+    if (n != e->name_len) return -EIO;
+    name[n] = '\0';
+    return 0;
+}
+
+int pack_snapshot(struct pack_info **out, size_t *count) {
+    pthread_rwlock_rdlock(&pack_lock);
+    size_t n = 0;
+    for (struct pack *p = packs; p; p = p->next) n++;
+    struct pack_info *info = calloc(n ? n : 1, sizeof(*info));
+    size_t i = 0;
+    for (struct pack *p = packs; p && info; p = p->next, i++) {
+        info[i].id = p->id;
+        info[i].size = p->size;
+        info[i].count = p->count;
+        info[i].entries = malloc(p->count ? (size_t)p->count * sizeof(struct pack_entry) : 1);
+        if (!info[i].entries) {
+            pack_snapshot_free(info, i);
+            info = NULL;
+            break;
+        }
+        memcpy(info[i].entries, p->entries, (size_t)p->count * sizeof(struct pack_entry));
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    if (!info) return -ENOMEM;
+    *out = info;
+    *count = n;
+    return 0;
+}
+
+void pack_snapshot_free(struct pack_info *packs_copy, size_t count) {
+    for (size_t i = 0; i < count; i++) free(packs_copy[i].entries);
+    free(packs_copy);
+}
+
+// ---- writer ----
+
+struct pack_writer *pack_writer_new(void) {
+    if (pack_dirfd == -1) return NULL;
+    struct pack_writer *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    w->src_fd = -1;
+
+    char name[64];
+    snprintf(name, sizeof(name), "tmp-%u.pack", w->id);
+    w->fd = openat(pack_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd == -1) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static int append_record(struct pack_writer *w, const uint8_t *key, int type, int codec,
+                         const char *name, size_t name_len, const void *data,
+                         uint32_t stored_len, uint32_t raw_len) {
+    if (w->count == w->cap) {
+        uint32_t cap = w->cap ? w->cap * 2 : 256;
+        struct pack_entry *e = realloc(w->entries, (size_t)cap * sizeof(*e));
+        if (!e) return -ENOMEM;
+        w->entries = e;
+        w->cap = cap;
+    }
+
+    struct pack_record rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.magic, PACK_RECORD_MAGIC, sizeof(rec.magic));
+    rec.type = (uint8_t)type;
+    rec.codec = (uint8_t)codec;
+    rec.name_len = (uint16_t)name_len;
+    rec.raw_len = raw_len;
+    rec.stored_len = stored_len;
+    memcpy(rec.key, key, SHA256_DIGEST_LEN);
+
+    int res = write_all(w->fd, &rec, sizeof(rec));
+    if (res == 0 && name_len) res = write_all(w->fd, name, name_len);
+    if (res == 0) res = write_all(w->fd, data, stored_len);
+    if (res != 0) return res;
+
+    struct pack_entry *e = &w->entries[w->count++];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->key, key, SHA256_DIGEST_LEN);
+    e->offset = w->size;
+    e->raw_len = raw_len;
+    e->stored_len = stored_len;
+    e->type = (uint8_t)type;
+    e->codec = (uint8_t)codec;
+    e->name_len = (uint16_t)name_len;
+    w->size += sizeof(rec) + name_len + stored_len;
+    return 0;
+}
+
+int pack_writer_add(struct pack_writer *w, const uint8_t key[SHA256_DIGEST_LEN], int type,
+                    const char *name, const void *data, size_t len) {
+    size_t name_len = name ? strlen(name) : 0;
+    if (name_len > UINT16_MAX || len > UINT32_MAX) return -EINVAL;
+
+    void *packed = NULL;
+    size_t packed_len = 0;
+    if (len >= PACK_MIN_COMPRESS) {
+        packed = malloc(LZ_BOUND(len));
+        if (packed) packed_len = lz_compress(data, len, packed, LZ_BOUND(len));
+    }
+    int res;
+    if (packed_len > 0) {
+        res = append_record(w, key, type, PACK_LZ, name, name_len, packed, (uint32_t)packed_len, (uint32_t)len);
+    } else {
+        res = append_record(w, key, type, PACK_RAW, name, name_len, data, (uint32_t)len, (uint32_t)len);
+    }
+    free(packed);
+    return res;
+}
+
+int pack_writer_copy(struct pack_writer *w, uint32_t id, const struct pack_entry *e) {
+    if (w->src_fd == -1 || w->src_id != id) {
+        if (w->src_fd != -1) close(w->src_fd);
+        w->src_fd = open_pack(id);
+        if (w->src_fd < 0) {
+            int err = w->src_fd;
+            w->src_fd = -1;
+            return err;
+        }
+        w->src_id = id;
+    }
+
+    char name[UINT16_MAX + 1];
+    if (e->name_len &&
+        read_full(w->src_fd, name, e->name_len, (off_t)e->offset + sizeof(struct pack_record)) != e->name_len) {
+        return -EIO;
+    }
+    void *stored;
+    int res = read_record(w->src_fd, e, &stored);
+    if (res != 0) return res;
+    res = append_record(w, e->key, e->type, e->codec, name, e->name_len, stored, e->stored_len, e->raw_len);
+    free(stored);
+    return res;
+}
+
+uint64_t pack_writer_size(const struct pack_writer *w) {
+    return w->size;
+}
+
+uint32_t pack_writer_count(const struct pack_writer *w) {
+    return w->count;
+}
+
+static void writer_free(struct pack_writer *w) {
+    if (w->fd != -1) close(w->fd);
+    if (w->src_fd != -1) close(w->src_fd);
+    free(w->entries);
+    free(w);
+}
+
+void pack_writer_abort(struct pack_writer *w) {
+    if (!w) return;
+    char name[64];
+    snprintf(name, sizeof(name), "tmp-%u.pack", w->id);
+    unlinkat(pack_dirfd, name, 0);
+    writer_free(w);
+}
+
+int pack_writer_commit(struct pack_writer *w) {
+    char tmp[64], final[64];
+    int res = 0;
+
+    qsort(w->entries, w->count, sizeof(*w->entries), entry_cmp);
+
+    // Dữ liệu phải xuống đĩa trước khi index (và việc xóa object rời) dựa vào nó
+    if (fsync(w->fd) == -1) res = -errno;
+    snprintf(tmp, sizeof(tmp), "tmp-%u.pack", w->id);
+    snprintf(final, sizeof(final), "pack-%u.pack", w->id);
+    if (res == 0 && renameat(pack_dirfd, tmp, pack_dirfd, final) == -1) res = -errno;
+    if (res != 0) {
+        pack_writer_abort(w);
+        return res;
+    }
+
+    struct pack_idx_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_IDX_MAGIC, sizeof(hdr.magic));
+    hdr.count = w->count;
+    snprintf(tmp, sizeof(tmp), "tmp-%u.idx", w->id);
+    int fd = openat(pack_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) res = -errno;
+    if (res == 0) res = write_all(fd, &hdr, sizeof(hdr));
+    if (res == 0) res = write_all(fd, w->entries, (size_t)w->count * sizeof(*w->entries));
+    if (res == 0 && fsync(fd) == -1) res = -errno;
+    if (fd != -1) close(fd);
+    snprintf(final, sizeof(final), "pack-%u.idx", w->id);
+    if (res == 0 && renameat(pack_dirfd, tmp, pack_dirfd, final) == -1) res = -errno;
+    if (res == 0) fsync(pack_dirfd);
+
+    struct pack *p = res == 0 ? calloc(1, sizeof(*p)) : NULL;
+    if (!p) {
+        if (res == 0) res = -ENOMEM;
+        unlinkat(pack_dirfd, tmp, 0);
+        unlinkat(pack_dirfd, final, 0);
+        snprintf(final, sizeof(final), "pack-%u.pack", w->id);
+        unlinkat(pack_dirfd, final, 0);
+        writer_free(w);
+        return res;
+    }
+    p->id = w->id;
+    p->size = w->size;
+    p->count = w->count;
+    p->entries = w->entries;
+    w->entries = NULL;
+    writer_free(w);
+    publish(p);
+    return 0;
+}
+
+int pack_drop(uint32_t id) {
+    struct pack *victim = NULL;
+    pthread_rwlock_wrlock(&pack_lock);
+    for (struct pack **pp = &packs; *pp; pp = &(*pp)->next) {
+        if ((*pp)->id == id) {
+            victim = *pp;
+            *pp = victim->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    if (!victim) return -ENOENT;
+
+    char name[64];
+    // Xóa index trước: pack còn sót lại không có index sẽ bị pack_cleanup dọn
+    snprintf(name, sizeof(name), "pack-%u.idx", id);
+    unlinkat(pack_dirfd, name, 0);
+    snprintf(name, sizeof(name), "pack-%u.pack", id);
+    unlinkat(pack_dirfd, name, 0);
+    free(victim->entries);
+    free(victim);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef PACK_FILE_H
+#define PACK_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+// Append-only pack files for the backup store (.backup/packs).
+//
+// pack-<id>.pack is a sequence of records (header, optional name, stored
+// bytes); pack-<id>.idx lists the records sorted by (key, type) and is
+// written last, so a pack without its index is an interrupted write and
+// is ignored (the loose objects it was built from still exist). Packs are
+// never modified: compaction writes a new pack and drops the old one.
+
+#define PACK_DIR "packs"
+#define PACK_TARGET_SIZE (64 * 1024 * 1024)
+
+#define PACK_RECORD_MAGIC "VPR1"
+#define PACK_IDX_MAGIC "VFSPIDX1"
+
+enum { PACK_CHUNK = 1, PACK_MANIFEST = 2 };
+enum { PACK_RAW = 0, PACK_LZ = 1 };
+
+// Record header in .pack, followed by name_len bytes of name (manifests)
+// and stored_len bytes of data
+struct pack_record {
+    char magic[4];
+    uint8_t type;
+    uint8_t codec;
+    uint16_t name_len;
+    uint32_t raw_len;
+    uint32_t stored_len;
+    uint8_t key[SHA256_DIGEST_LEN];     // chunk: digest, manifest: sha256(name)
+};
+
+// Index entry in .idx (after a struct pack_idx_header)
+struct pack_entry {
+    uint8_t key[SHA256_DIGEST_LEN];
+    uint64_t offset;                    // of the record header
+    uint32_t raw_len;
+    uint32_t stored_len;
+    uint8_t type;
+    uint8_t codec;
+    uint16_t name_len;
+    uint32_t reserved;
+};
+
+struct pack_idx_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+};
+
+// Copy of one published pack (pack_snapshot)
+struct pack_info {
+    uint32_t id;
+    uint64_t size;
+    uint32_t count;
+    struct pack_entry *entries;
+};
+
+struct pack_writer;
+
+// Load every sealed pack under <backup>/packs
+int pack_init(int backup_dirfd);
+// Remove leftovers of interrupted writes (only the process that writes packs)
+void pack_cleanup(void);
+
+int pack_has(const uint8_t key[SHA256_DIGEST_LEN], int type);
+// Content of an object as a malloc'ed buffer; returns its length or -errno
+ssize_t pack_read(const uint8_t key[SHA256_DIGEST_LEN], int type, void **data);
+ssize_t pack_read_entry(uint32_t id, const struct pack_entry *e, void **data);
+int pack_read_name(uint32_t id, const struct pack_entry *e, char *name, size_t cap);
+
+int pack_snapshot(struct pack_info **packs, size_t *count);
+void pack_snapshot_free(struct pack_info *packs, size_t count);
+
+// New pack; objects become visible to readers only after commit
+struct pack_writer *pack_writer_new(void);
+// Add an object, compressed when that saves space
+int pack_writer_add(struct pack_writer *w, const uint8_t key[SHA256_DIGEST_LEN], int type,
+                    const char *name, const void *data, size_t len);
+// Copy a record of another pack as stored (no recompression)
+int pack_writer_copy(struct pack_writer *w, uint32_t id, const struct pack_entry *e);
+uint64_t pack_writer_size(const struct pack_writer *w);
+uint32_t pack_writer_count(const struct pack_writer *w);
+int pack_writer_commit(struct pack_writer *w);
+void pack_writer_abort(struct pack_writer *w);
+
+// Unpublish and delete a pack
+int pack_drop(uint32_t id);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * path_cache.c
+ * Concurrent path -> {layer, stat, whiteout} map for the storage/source
+ * overlay. Lookups that hit never touch the disk; operations in
+ * operations.c that change a path (or its parents) invalidate it.
+ *
+ * The map is split into shards, each with its own rwlock, so concurrent
+ * FUSE threads looking up different paths rarely contend. Each shard holds
+ * a bounded number of entries and evicts one chain head round-robin once
+ * full, which keeps memory flat during find/stat storms over huge trees.
+ *
+ * Every invalidation bumps the generation of its shard. A caller takes the
+ * generation before resolving a path on disk and hands it to store, which
+ * drops the result if an invalidation ran in between: otherwise a lookup
+ * racing with unlink/rename/copy-up could put back the state from before
+ * the change, and nothing would ever remove it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "path_cache.h"
+
+#define PC_SHARDS 64
+#define PC_BUCKETS 1024             // per shard
+#define PC_MAX_PER_SHARD 4096
+
+struct pc_entry {
+    struct pc_entry *next;
+    uint32_t hash;
+    struct path_info info;
+    char path[];
+};
+
+struct pc_shard {
+    pthread_rwlock_t lock;
+    struct pc_entry *buckets[PC_BUCKETS];
+    unsigned int count;
+    unsigned int evict_cursor;
+    uint64_t gen;                   // tăng mỗi lần invalidate trong shard
+};
+
+static struct pc_shard shards[PC_SHARDS];
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct pc_shard *shard_of(uint32_t h) {
+    return &shards[h % PC_SHARDS];
+}
+
+static struct pc_entry **bucket_of(struct pc_shard *s, uint32_t h) {
+    return &s->buckets[(h / PC_SHARDS) % PC_BUCKETS];
+}
+
+void path_cache_init(void) {
+    for (int i = 0; i < PC_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+}
+
+int path_cache_lookup(const char *path, struct path_info *info) {
+    uint32_t h = hash_path(path);
+    struct pc_shard *s = shard_of(h);
+    int hit = 0;
+
+    pthread_rwlock_rdlock(&s->lock);
+    for (struct pc_entry *e = *bucket_of(s, h); e; e = e->next) {
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            *info = e->info;
+            hit = 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return hit;
+}
+
+uint64_t path_cache_gen(const char *path) {
+    return __atomic_load_n(&shard_of(hash_path(path))->gen, __ATOMIC_ACQUIRE);
+}
+
+// Caller holds the shard write lock
+static void bump_gen(struct pc_shard *s) {
+    __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+}
+
+// Caller holds the shard write lock
+static void evict_one(struct pc_shard *s) {
+    for (unsigned int n = 0; n < PC_BUCKETS; n++) {
+        struct pc_entry **b = &s->buckets[s->evict_cursor++ % PC_BUCKETS];
+        if (*b) {
+            struct pc_entry *victim = *b;
+            *b = victim->next;
+            free(victim);
+            s->count--;
+            return;
+        }
+    }
+}
+
+void path_cache_store(const char *path, const struct path_info *info, uint64_t gen) {
+    uint32_t h = hash_path(path);
+    struct pc_shard *s = shard_of(h);
+    struct pc_entry **b = bucket_of(s, h);
+
+    pthread_rwlock_wrlock(&s->lock);
+    // Có invalidate chạy giữa lúc resolve: kết quả có thể đã cũ
+    if (s->gen != gen) {
+        pthread_rwlock_unlock(&s->lock);
+        return;
+    }
+    for (struct pc_entry *e = *b; e; e = e->next) {
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            e->info = *info;
+            pthread_rwlock_unlock(&s->lock);
+            return;
+        }
+    }
+
+    size_t len = strlen(path) + 1;
+    struct pc_entry *e = malloc(sizeof(*e) + len);
+    if (e) {
+        if (s->count >= PC_MAX_PER_SHARD) evict_one(s);
+        e->hash = h;
+        e->info = *info;
+        memcpy(e->path, path, len);
+        e->next = *b;
+        *b = e;
+        s->count++;
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+void path_cache_invalidate(const char *path) {
+    uint32_t h = hash_path(path);
+    struct pc_shard *s = shard_of(h);
+
+    pthread_rwlock_wrlock(&s->lock);
+    bump_gen(s);                    // kể cả khi chưa có entry: có thể đang được resolve
+    for (struct pc_entry **pp = bucket_of(s, h); *pp; pp = &(*pp)->next) {
+        struct pc_entry *e = *pp;
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            *pp = e->next;
+            free(e);
+            s->count--;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+void path_cache_invalidate_parents(const char *path) {
+    char tmp[4096];
+    size_t len = strlen(path);
+    if (len >= sizeof(tmp)) len = sizeof(tmp) - 1;
+    memcpy(tmp, path, len);
+    tmp[len] = '\0';
+
+    path_cache_invalidate(tmp);
+    while (len > 1) {
+        char *slash = strrchr(tmp, '/');
+        if (!slash || slash == tmp) {
+            path_cache_invalidate("/");
+            break;
+        }
+        *slash = '\0';
+        len = slash - tmp;
+        path_cache_invalidate(tmp);
+    }
+}
+
+void path_cache_invalidate_tree(const char *path) {
+    size_t len = strlen(path);
+
+    path_cache_invalidate(path);
+    for (int i = 0; i < PC_SHARDS; i++) {
+        struct pc_shard *s = &shards[i];
+        pthread_rwlock_wrlock(&s->lock);
+        bump_gen(s);
+        for (int b = 0; b < PC_BUCKETS; b++) {
+            struct pc_entry **pp = &s->buckets[b];
+            while (*pp) {
+                struct pc_entry *e = *pp;
+                if (strncmp(e->path, path, len) == 0 && e->path[len] == '/') {
+                    *pp = e->next;
+                    free(e);
+                    s->count--;
+                } else {
+                    pp = &e->next;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
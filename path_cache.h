@@ -0,0 +1,38 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Layer mà một path được resolve tới
+enum vfs_layer {
+    LAYER_NONE = -1,    // path không tồn tại (negative entry)
+    LAYER_SOURCE = 0,
+    LAYER_STORAGE = 1,
+};
+
+struct path_info {
+    enum vfs_layer layer;
+    int whiteout;       // path bị che bởi whiteout trong Storage
+    int lower;          // LAYER_SOURCE: lower layer chứa path (layers.h)
+    uint32_t lowers;    // thư mục: mask các lower layer được gộp vào
+    struct stat st;     // chỉ hợp lệ khi layer != LAYER_NONE
+};
+
+void path_cache_init(void);
+
+// Return 1 and fill info on a hit, 0 on a miss
+int path_cache_lookup(const char *path, struct path_info *info);
+// Take before resolving path on disk; store drops the result if path was
+// invalidated since
+uint64_t path_cache_gen(const char *path);
+void path_cache_store(const char *path, const struct path_info *info, uint64_t gen);
+
+// Drop path itself
+void path_cache_invalidate(const char *path);
+// Drop path and every ancestor directory (copy-up/create change parents too)
+void path_cache_invalidate_parents(const char *path);
+// Drop path and everything below it (rename of a directory)
+void path_cache_invalidate_tree(const char *path);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * path_lock.c
+ * Striped reader-writer locks for operations.c. A fixed table of rwlocks
+ * indexed by the path hash: no allocation and no per-file state, at the
+ * cost of two unrelated files occasionally sharing a stripe.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <pthread.h>
+#include "path_lock.h"
+
+#define PL_STRIPES 1024
+
+static pthread_rwlock_t stripes[PL_STRIPES];
+
+static uint32_t stripe_of(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 16777619u;
+    }
+    return h % PL_STRIPES;
+}
+
+void path_lock_init(void) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // glibc mặc định ưu tiên reader: một loạt read liên tục sẽ bỏ đói write
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < PL_STRIPES; i++) {
+        pthread_rwlock_init(&stripes[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+pthread_rwlock_t *path_lock(const char *path, int exclusive) {
+    pthread_rwlock_t *l = &stripes[stripe_of(path)];
+    if (exclusive) pthread_rwlock_wrlock(l);
+    else pthread_rwlock_rdlock(l);
+    return l;
+}
+
+void path_unlock(pthread_rwlock_t *lock) {
+    pthread_rwlock_unlock(lock);
+}
+
+void path_lock_pair(const char *a, const char *b, pthread_rwlock_t *locks[2]) {
+    uint32_t sa = stripe_of(a), sb = stripe_of(b);
+    if (sa > sb) {
+        uint32_t t = sa;
+        sa = sb;
+        sb = t;
+    }
+    locks[0] = &stripes[sa];
+    locks[1] = sa == sb ? NULL : &stripes[sb];
+    pthread_rwlock_wrlock(locks[0]);
+    if (locks[1]) pthread_rwlock_wrlock(locks[1]);
+}
+
+void path_unlock_pair(pthread_rwlock_t *locks[2]) {
+    if (locks[1]) pthread_rwlock_unlock(locks[1]);
+    pthread_rwlock_unlock(locks[0]);
+}
@@ -0,0 +1,23 @@
+#ifndef PATH_LOCK_H
+#define PATH_LOCK_H
+
+#include <pthread.h>
+
+// Striped reader-writer locks keyed by path hash. Readers (read) share a
+// stripe, anything that changes a file (write, copy-up, truncate, chmod,
+// unlink, rename...) takes it exclusively, so ops on the same file are
+// ordered while ops on different files almost never contend.
+
+void path_lock_init(void);
+
+// Lock the stripe of path; pass the result to path_unlock
+pthread_rwlock_t *path_lock(const char *path, int exclusive);
+void path_unlock(pthread_rwlock_t *lock);
+
+// Exclusive lock on two paths (rename), taken in stripe order so two
+// renames in opposite directions cannot deadlock. locks[1] is NULL when
+// both paths share a stripe.
+void path_lock_pair(const char *a, const char *b, pthread_rwlock_t *locks[2]);
+void path_unlock_pair(pthread_rwlock_t *locks[2]);
+
+#endif
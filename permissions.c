@@ -1,74 +1,263 @@
+/*
+ * permissions.c
+ * Permission checks for the high-level backend (operations.c).
+ *
+ * FUSE only hands us the caller's uid/gid/pid, not its supplementary
+ * groups, so the group set is read from /proc/<pid>/status and cached per
+ * (pid, uid) for PERM_GROUP_TTL_NS. The evaluation itself (owner/group/
+ * other bits, or the file's POSIX ACL when it has one) works on values
+ * already in memory: no allocation, no I/O, no output.
+ *
+ * Build with -DVFS_PERM_DEBUG to get the old per-check trace on stderr.
+ */
+
 #define _XOPEN_SOURCE 700
 #define FUSE_USE_VERSION 26
 #include <fuse.h>         // <--- Bắt buộc phải có để dùng fuse_get_context
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include "permissions.h"
 
+#ifdef VFS_PERM_DEBUG
+#define PERM_TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define PERM_TRACE(...) ((void)0)
+#endif
+
+#define PERM_SLOTS 256
+#define PERM_GROUP_TTL_NS (2ULL * 1000000000ULL)
+
 // Biến toàn cục lưu UID/GID mặc định (khi khởi tạo)
 static uid_t virtual_file_uid = 0;
 static gid_t virtual_file_gid = 0;
 static int initialized = 0;
 
-// Helper: Tách bit permission (như cũ)
-static int get_permission_bits(int mode, int is_user, int is_group) {
-    if (is_user) return (mode >> 6) & 0x7;
-    if (is_group) return (mode >> 3) & 0x7;
-    return mode & 0x7;
+// --- Cache group set theo (pid, uid) ---
+
+struct perm_slot {
+    pthread_mutex_t lock;
+    pid_t pid;
+    uid_t uid;
+    uint64_t expires;           // CLOCK_MONOTONIC ns, 0 = trống
+    struct perm_cred cred;
+};
+
+static struct perm_slot slots[PERM_SLOTS];
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+static void slots_init(void) {
+    for (int i = 0; i < PERM_SLOTS; i++) pthread_mutex_init(&slots[i].lock, NULL);
 }
 
-// --- HÀM QUAN TRỌNG ĐÃ SỬA ---
-// Helper: check if the CALLING PROCESS has the requested permission
-// perm: 4=read, 2=write, 1=exec
-int check_permission(int mode, uid_t file_uid, gid_t file_gid, int perm) {
-    struct fuse_context *ctx = fuse_get_context();
-    if (!ctx) return 0;
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-    uid_t caller_uid = ctx->uid;
-    gid_t caller_gid = ctx->gid;
-    int bits = 0;
+// Đọc dòng "Groups:" trong /proc/<pid>/status vào cred. Trả -1 nếu process đã thoát.
+static int read_proc_groups(pid_t pid, struct perm_cred *cred) {
+    char path[64], buf[8192];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
 
-    // --- THÊM LOG DEBUG TẠI ĐÂY ---
-    // In ra dạng Octal (%o) để xem quyền (VD: 755, 644)
-    printf("[DEBUG-PERM] Caller=%d, FileUID=%d, Mode=%o, Request=%d\n", 
-            caller_uid, file_uid, mode, perm);
-    // -----------------------------
+    char *line = strstr(buf, "\nGroups:");
+    if (!line) return -1;
+    char *p = line + 8;
+    while (cred->ngroups < PERM_MAX_GROUPS) {
+        char *end;
+        unsigned long g = strtoul(p, &end, 10);
+        if (end == p) break;                // hết dòng (strtoul dừng ở '\n')
+        cred->groups[cred->ngroups++] = (gid_t)g;
+        p = end;
+    }
+    return 0;
+}
 
-    if (caller_uid == 0) return 1; 
+int perm_get_cred(pid_t pid, uid_t uid, gid_t gid, struct perm_cred *out) {
+    pthread_once(&slots_once, slots_init);
+    struct perm_slot *s = &slots[((uint32_t)pid * 2654435761u ^ (uint32_t)uid) % PERM_SLOTS];
+    uint64_t now = now_ns();
 
-    if (caller_uid == file_uid) 
-        bits = get_permission_bits(mode, 1, 0);
-    else if (caller_gid == file_gid) 
-        bits = get_permission_bits(mode, 0, 1);
-    else 
-        bits = get_permission_bits(mode, 0, 0);
+    pthread_mutex_lock(&s->lock);
+    // pid có thể bị tái sử dụng: so cả uid/gid và hết hạn theo TTL
+    if (s->expires > now && s->pid == pid && s->uid == uid && s->cred.gid == gid) {
+        *out = s->cred;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&s->lock);
 
-    int result = (bits & perm) ? 1 : 0;
-    
-    // In kết quả quyết định
-    if (result == 0) printf(" -> [DENIED]\n");
-    else printf(" -> [ALLOWED]\n");
+    // Đọc /proc ngoài lock để các caller khác trên cùng slot không phải chờ
+    out->uid = uid;
+    out->gid = gid;
+    out->ngroups = 0;
+    if (pid <= 0 || read_proc_groups(pid, out) != 0) {
+        out->ngroups = 0;                   // chỉ còn primary gid
+        return 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->pid = pid;
+    s->uid = uid;
+    s->cred = *out;
+    s->expires = now + PERM_GROUP_TTL_NS;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int in_groups(const struct perm_cred *c, gid_t gid) {
+    if (c->gid == gid) return 1;
+    for (int i = 0; i < c->ngroups; i++) {
+        if (c->groups[i] == gid) return 1;
+    }
+    return 0;
+}
+
+// --- POSIX ACL ---
+
+// Định dạng xattr system.posix_acl_access của kernel
+#define ACL_XATTR_VERSION 0x0002
+#define ACL_USER_OBJ  0x01
+#define ACL_USER      0x02
+#define ACL_GROUP_OBJ 0x04
+#define ACL_GROUP     0x08
+#define ACL_MASK      0x10
+#define ACL_OTHER     0x20
+
+int perm_acl_parse(const void *buf, size_t len, struct perm_acl *acl) {
+    const unsigned char *p = buf;
+    acl->count = 0;
+    if (len < 4 || (len - 4) % 8 != 0) return -1;
+
+    uint32_t version;
+    memcpy(&version, p, 4);
+    if (version != ACL_XATTR_VERSION) return -1;
+
+    size_t n = (len - 4) / 8;
+    if (n > PERM_MAX_ACL) return -1;
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char *e = p + 4 + i * 8;
+        memcpy(&acl->e[i].tag, e, 2);
+        memcpy(&acl->e[i].perm, e + 2, 2);
+        memcpy(&acl->e[i].id, e + 4, 4);
+    }
+    acl->count = (int)n;
+    return 0;
+}
+
+int perm_acl_load(int dirfd, const char *rel, struct perm_acl *acl) {
+    char path[PATH_MAX + 32];
+    unsigned char buf[4 + 8 * PERM_MAX_ACL];
+    acl->count = 0;
+
+    // Không có *xattrat(): đi qua /proc/self/fd/<dirfd>/rel
+    snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dirfd, rel);
+    ssize_t n = lgetxattr(path, "system.posix_acl_access", buf, sizeof(buf));
+    if (n <= 0) return 0;                   // ENODATA/ENOTSUP: chỉ có mode bits
+    if (perm_acl_parse(buf, (size_t)n, acl) != 0) acl->count = 0;
+    return 0;
+}
+
+// Thuật toán giống posix_acl_permission() của kernel
+static int acl_eval(const struct perm_cred *c, uid_t file_uid, gid_t file_gid,
+                    const struct perm_acl *acl, int perm) {
+    int mask = 7, other = 0, owner = -1;
+    for (int i = 0; i < acl->count; i++) {
+        if (acl->e[i].tag == ACL_MASK) mask = acl->e[i].perm;
+        else if (acl->e[i].tag == ACL_OTHER) other = acl->e[i].perm;
+        else if (acl->e[i].tag == ACL_USER_OBJ) owner = acl->e[i].perm;
+    }
+
+    if (c->uid == file_uid && owner >= 0) return (owner & perm) == perm;
+    for (int i = 0; i < acl->count; i++) {
+        if (acl->e[i].tag == ACL_USER && acl->e[i].id == c->uid) {
+            return (acl->e[i].perm & mask & perm) == perm;
+        }
+    }
 
+    // Có khớp group nào không; chỉ cần một entry khớp đủ quyền
+    int matched = 0;
+    for (int i = 0; i < acl->count; i++) {
+        gid_t g;
+        if (acl->e[i].tag == ACL_GROUP_OBJ) g = file_gid;
+        else if (acl->e[i].tag == ACL_GROUP) g = (gid_t)acl->e[i].id;
+        else continue;
+        if (!in_groups(c, g)) continue;
+        if ((acl->e[i].perm & mask & perm) == perm) return 1;
+        matched = 1;
+    }
+    if (matched) return 0;
+    return (other & perm) == perm;
+}
+
+int perm_eval(const struct perm_cred *c, int mode, uid_t file_uid, gid_t file_gid,
+              const struct perm_acl *acl, int perm) {
+    if (c->uid == 0) return 1;
+    if (acl && acl->count > 0) return acl_eval(c, file_uid, file_gid, acl, perm);
+
+    int bits;
+    if (c->uid == file_uid) bits = (mode >> 6) & 0x7;
+    else if (in_groups(c, file_gid)) bits = (mode >> 3) & 0x7;
+    else bits = mode & 0x7;
+    return (bits & perm) == perm;
+}
+
+// --- API cho operations.c ---
+
+static int check_cred_permission(int mode, uid_t file_uid, gid_t file_gid,
+                                 const struct perm_acl *acl, int perm) {
+    struct fuse_context *ctx = fuse_get_context();
+    if (!ctx) return 0;
+
+    struct perm_cred cred;
+    perm_get_cred(ctx->pid, ctx->uid, ctx->gid, &cred);
+    int result = perm_eval(&cred, mode, file_uid, file_gid, acl, perm);
+
+    PERM_TRACE("[DEBUG-PERM] Caller=%d, FileUID=%d, Mode=%o, Request=%d -> %s\n",
+               (int)ctx->uid, (int)file_uid, mode, perm, result ? "ALLOWED" : "DENIED");
     return result;
 }
 
+// Helper: check if the CALLING PROCESS has the requested permission
+// perm: 4=read, 2=write, 1=exec
+int check_permission(int mode, uid_t file_uid, gid_t file_gid, int perm) {
+    return check_cred_permission(mode, file_uid, file_gid, NULL, perm);
+}
+
+static int open_perm(int flags) {
+    if ((flags & O_ACCMODE) == O_WRONLY) return 2;
+    if ((flags & O_ACCMODE) == O_RDWR) return 6;
+    return 4;
+}
+
 // FUSE-style: check open flags against permissions
 int check_permissions(int flags, int mode, uid_t file_uid, gid_t file_gid) {
     // Nếu tạo file mới (O_CREAT), ta thường bỏ qua check permission lúc open
     if (flags & O_CREAT) return 1;
+    return check_permission(mode, file_uid, file_gid, open_perm(flags));
+}
 
-    int r = 1;
-    // Kiểm tra quyền truy cập dựa trên flags
-    if ((flags & O_ACCMODE) == O_RDONLY)
-        r = check_permission(mode, file_uid, file_gid, 4); // Check Read
-    else if ((flags & O_ACCMODE) == O_WRONLY)
-        r = check_permission(mode, file_uid, file_gid, 2); // Check Write
-    else if ((flags & O_ACCMODE) == O_RDWR)
-        r = check_permission(mode, file_uid, file_gid, 6); // Check Read + Write
-    
-    return r;
+int check_permissions_at(int dirfd, const char *rel, int flags, const struct stat *st) {
+    if (flags & O_CREAT) return 1;
+
+    struct perm_acl acl;
+    perm_acl_load(dirfd, rel, &acl);
+    return check_cred_permission(st->st_mode, st->st_uid, st->st_gid, &acl, open_perm(flags));
 }
 
 int check_chown_permission(uid_t file_uid, uid_t new_uid, gid_t new_gid) {
@@ -82,7 +271,7 @@ int check_chown_permission(uid_t file_uid, uid_t new_uid, gid_t new_gid) {
 
     // 2. Nếu người gọi KHÔNG PHẢI là chủ sở hữu file -> Cấm tiệt
     if (caller_uid != file_uid) {
-        printf("[DEBUG-CHOWN] Denied: Caller %d is not owner %d\n", caller_uid, file_uid);
+        PERM_TRACE("[DEBUG-CHOWN] Denied: Caller %d is not owner %d\n", (int)caller_uid, (int)file_uid);
         return 0;
     }
 
@@ -92,8 +281,8 @@ int check_chown_permission(uid_t file_uid, uid_t new_uid, gid_t new_gid) {
     // -> Cho phép Owner đổi quyền sở hữu (nếu bạn muốn).
     
     // Nếu muốn làm CHUẨN LINUX (Khắt khe):
-    if (new_uid != -1 && new_uid != file_uid) {
-        printf("[DEBUG-CHOWN] Denied: Non-root user cannot change UID\n");
+    if (new_uid != (uid_t)-1 && new_uid != file_uid) {
+        PERM_TRACE("[DEBUG-CHOWN] Denied: Non-root user cannot change UID\n");
         return 0; // Cấm user thường chuyển file cho người khác
     }
 
@@ -115,7 +304,7 @@ void update_virtual_file_owner(uid_t *file_uid, gid_t *file_gid, uid_t new_uid,
 uid_t get_virtual_file_uid() {
     if (!initialized) {
         // Mặc định lấy UID của người chạy ./vfs
-        virtual_file_uid = getuid(); 
+        virtual_file_uid = getuid();
         virtual_file_gid = getgid();
         initialized = 1;
     }
@@ -132,4 +321,4 @@ gid_t get_virtual_file_gid() {
 }
 
 void set_virtual_file_uid(uid_t uid) { virtual_file_uid = uid; }
-void set_virtual_file_gid(gid_t gid) { virtual_file_gid = gid; }
\ No newline at end of file
+void set_virtual_file_gid(gid_t gid) { virtual_file_gid = gid; }
@@ -2,11 +2,48 @@
 #define PERMISSIONS_H
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#define PERM_MAX_GROUPS 64          // group phụ giữ lại cho mỗi caller
+#define PERM_MAX_ACL 32             // số entry ACL tối đa được đánh giá
+
+// uid/gid + supplementary groups của process gọi vào FUSE
+struct perm_cred {
+    uid_t uid;
+    gid_t gid;
+    int ngroups;
+    gid_t groups[PERM_MAX_GROUPS];
+};
+
+// system.posix_acl_access đã parse (count == 0: file không có ACL)
+struct perm_acl {
+    int count;
+    struct {
+        uint16_t tag;
+        uint16_t perm;
+        uint32_t id;
+    } e[PERM_MAX_ACL];
+};
+
+// Credentials of pid (groups cached per pid/uid with a short TTL)
+int perm_get_cred(pid_t pid, uid_t uid, gid_t gid, struct perm_cred *out);
+// Parse the raw xattr value; -1 if malformed or too many entries
+int perm_acl_parse(const void *buf, size_t len, struct perm_acl *acl);
+// Read the access ACL of dirfd/rel (acl->count = 0 when there is none)
+int perm_acl_load(int dirfd, const char *rel, struct perm_acl *acl);
+// Pure check, no I/O: 1 if cred has all bits of perm (4=r, 2=w, 1=x).
+// acl may be NULL or empty, then only the mode bits are used.
+int perm_eval(const struct perm_cred *c, int mode, uid_t file_uid, gid_t file_gid,
+              const struct perm_acl *acl, int perm);
 
 int check_permission(int mode, uid_t file_uid, gid_t file_gid, int perm);
 
 int check_permissions(int flags, int mode, uid_t file_uid, gid_t file_gid);
 
+// check_permissions + the file's POSIX ACL, file given as dirfd/rel
+int check_permissions_at(int dirfd, const char *rel, int flags, const struct stat *st);
+
 int check_chown_permission(uid_t file_uid, uid_t new_uid, gid_t new_gid);
 
 void update_virtual_file_permissions(int *virtual_file_permissions, int new_mode);
@@ -18,4 +55,4 @@ gid_t get_virtual_file_gid();
 void set_virtual_file_uid(uid_t uid);
 void set_virtual_file_gid(gid_t gid);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,391 @@
+/*
+ * storage.c
+ * Storage (upper layer) lifecycle, see storage.h.
+ *
+ * The journal is a fixed header (identity of the Source, clean flag) and
+ * the Source path, followed by append-only BEGIN/END records of copy-ups.
+ * A BEGIN without its END after an unclean unmount is a file that may be
+ * only partly copied; it is deleted so the Source version shows again.
+ * Records are not fsync'ed: they cover the daemon dying mid copy-up, not
+ * a power loss (the copied data is not fsync'ed either). Whenever no
+ * copy-up is in flight and the records pass SJ_TRUNCATE_BYTES they are
+ * cut back to the header, so the replay at startup stays small.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "storage.h"
+#include "lazy_copy.h"
+
+#define SJ_MAGIC "VSJ1"
+#define SJ_RECORD_MAGIC "VSR1"
+#define SJ_TRUNCATE_BYTES (1 << 20)
+#define JOURNAL_SUFFIX ".journal"
+#define TRASH_SUFFIX ".old."
+#define DIR_NAME_MAX 200                // chừa chỗ cho hậu tố .journal / .old.<pid>.<n>
+
+struct sj_header {
+    char magic[4];
+    uint32_t clean;                     // 1 = unmount xong, không còn copy-up dở
+    uint64_t src_dev;
+    uint64_t src_ino;
+    uint32_t path_len;                  // path của Source theo sau header
+    uint32_t reserved;
+};
+
+struct sj_record {
+    char magic[4];
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t path_len;                  // path ("/a/b") theo sau record
+};
+
+enum { SJ_BEGIN = 1, SJ_END = 2 };
+
+static enum storage_mode st_mode = STORAGE_RESET;
+static char st_dir[DIR_NAME_MAX + 1];
+static char st_journal_name[NAME_MAX + 1];
+static int st_base_fd = -1;             // thư mục chứa Storage (cwd lúc khởi động)
+static int st_fd = -1;
+static int st_journal = -1;
+static int st_reused = 0;
+static off_t st_records = 0;            // record đầu tiên
+static off_t st_end = 0;                // chỗ ghi record tiếp theo
+static unsigned st_inflight = 0;
+static pthread_mutex_t st_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t trash_thread;
+static int trash_running = 0;
+static int trash_stop = 0;
+
+void storage_set_mode(enum storage_mode mode) {
+    st_mode = mode;
+}
+
+int storage_reused(void) {
+    return st_reused;
+}
+
+// --- Journal ---
+
+static int set_clean(uint32_t clean) {
+    if (pwrite(st_journal, &clean, sizeof(clean), offsetof(struct sj_header, clean)) != sizeof(clean))
+        return -errno;
+    return 0;
+}
+
+static int journal_create(const struct stat *src, const char *src_path) {
+    size_t len = strlen(src_path);
+    struct sj_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SJ_MAGIC, 4);
+    h.src_dev = (uint64_t)src->st_dev;
+    h.src_ino = (uint64_t)src->st_ino;
+    h.path_len = (uint32_t)len;
+
+    int fd = openat(st_base_fd, st_journal_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -errno;
+    if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, src_path, len) != (ssize_t)len) {
+        int err = errno ? -errno : -EIO;
+        close(fd);
+        return err;
+    }
+    st_journal = fd;
+    st_records = st_end = (off_t)(sizeof(h) + len);
+    return 0;
+}
+
+// Mở journal của Storage cũ; 0 nếu dùng lại được, *clean = phiên trước unmount đàng hoàng
+static int journal_reopen(const struct stat *src, const char *src_path, int *clean) {
+    int fd = openat(st_base_fd, st_journal_name, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return -errno;
+
+    struct sj_header h;
+    char old[PATH_MAX];
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SJ_MAGIC, 4) != 0 ||
+        h.path_len >= sizeof(old) || pread(fd, old, h.path_len, sizeof(h)) != (ssize_t)h.path_len) {
+        fprintf(stderr, "[WARN] Storage journal %s is damaged, resetting storage\n", st_journal_name);
+        close(fd);
+        return -EINVAL;
+    }
+    old[h.path_len] = '\0';
+    if (h.src_dev != (uint64_t)src->st_dev || h.src_ino != (uint64_t)src->st_ino) {
+        fprintf(stderr, "[WARN] Storage belongs to source %s, not %s; resetting storage\n", old, src_path);
+        close(fd);
+        return -ESTALE;
+    }
+
+    st_journal = fd;
+    st_records = (off_t)(sizeof(h) + h.path_len);
+    *clean = h.clean == 1;
+    return 0;
+}
+
+static void remove_pending(const char *path) {
+    const char *rel = path + 1;
+    if (*rel == '\0') return;
+    unlinkat(st_fd, rel, 0);
+
+    // Bitmap của lazy copy-up (lazy_copy.c: ".bm.<tên>" cạnh file)
+    char bm[PATH_MAX];
+    const char *slash = strrchr(rel, '/');
+    if (slash) snprintf(bm, sizeof(bm), "%.*s/" LAZY_PREFIX "%s", (int)(slash - rel), rel, slash + 1);
+    else snprintf(bm, sizeof(bm), LAZY_PREFIX "%s", rel);
+    unlinkat(st_fd, bm, 0);
+}
+
+// Xóa các file copy-up dở (BEGIN không có END) của phiên bị dừng đột ngột
+static int journal_replay(void) {
+    struct stat st;
+    if (fstat(st_journal, &st) == -1) return -errno;
+    if (st.st_size <= st_records) return 0;
+
+    size_t size = (size_t)(st.st_size - st_records);
+    char *buf = malloc(size);
+    if (!buf) return -ENOMEM;
+    if (pread(st_journal, buf, size, st_records) != (ssize_t)size) {
+        int err = errno ? -errno : -EIO;
+        free(buf);
+        return err;
+    }
+
+    // Chỉ vài copy-up chạy cùng lúc nên danh sách dở dang luôn ngắn
+    char **pending = NULL;
+    size_t npending = 0, cap = 0;
+    int res = 0;
+    size_t off = 0;
+    while (off + sizeof(struct sj_record) <= size) {
+        struct sj_record r;
+        memcpy(&r, buf + off, sizeof(r));
+        // record cuối bị cắt giữa chừng thì bỏ
+        if (memcmp(r.magic, SJ_RECORD_MAGIC, 4) != 0 || off + sizeof(r) + r.path_len > size) break;
+        char *path = strndup(buf + off + sizeof(r), r.path_len);
+        if (!path) {
+            res = -ENOMEM;
+            break;
+        }
+        off += sizeof(r) + r.path_len;
+
+        if (r.op == SJ_BEGIN) {
+            if (npending == cap) {
+                size_t ncap = cap ? cap * 2 : 16;
+                char **p = realloc(pending, ncap * sizeof(*p));
+                if (!p) {
+                    free(path);
+                    res = -ENOMEM;
+                    break;
+                }
+                pending = p;
+                cap = ncap;
+            }
+            pending[npending++] = path;
+            continue;
+        }
+        for (size_t i = npending; i-- > 0;) {
+            if (strcmp(pending[i], path) == 0) {
+                free(pending[i]);
+                pending[i] = pending[--npending];
+                break;
+            }
+        }
+        free(path);
+    }
+    free(buf);
+
+    if (res == 0 && npending > 0) {
+        for (size_t i = 0; i < npending; i++) remove_pending(pending[i]);
+        fprintf(stderr, "[INFO] Removed %zu unfinished copy-up(s) from storage\n", npending);
+    }
+    for (size_t i = 0; i < npending; i++) free(pending[i]);
+    free(pending);
+    return res;
+}
+
+static void journal_append(uint8_t op, const char *path) {
+    size_t len = strlen(path);
+    char buf[sizeof(struct sj_record) + PATH_MAX];
+    if (st_journal == -1 || len >= PATH_MAX) return;
+
+    struct sj_record r;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.magic, SJ_RECORD_MAGIC, 4);
+    r.op = op;
+    r.path_len = (uint16_t)len;
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), path, len);
+
+    ssize_t n = pwrite(st_journal, buf, sizeof(r) + len, st_end);
+    if (n == (ssize_t)(sizeof(r) + len)) st_end += n;   // ghi thiếu thì record sau ghi đè lên
+}
+
+void storage_copyup_begin(const char *path) {
+    pthread_mutex_lock(&st_lock);
+    journal_append(SJ_BEGIN, path);
+    st_inflight++;
+    pthread_mutex_unlock(&st_lock);
+}
+
+void storage_copyup_end(const char *path) {
+    pthread_mutex_lock(&st_lock);
+    journal_append(SJ_END, path);
+    if (--st_inflight == 0 && st_end - st_records > SJ_TRUNCATE_BYTES && st_journal != -1) {
+        // Không còn copy-up nào dở: các record không còn ý nghĩa
+        if (ftruncate(st_journal, st_records) == 0) st_end = st_records;
+    }
+    pthread_mutex_unlock(&st_lock);
+}
+
+// --- Storage directory ---
+
+// Đổi tên Storage cũ sang <dir>.old.<pid>.<n>, thread nền xóa sau
+static int move_aside(void) {
+    char name[NAME_MAX + 1];
+    for (unsigned n = 0; n < 1000; n++) {
+        snprintf(name, sizeof(name), "%s" TRASH_SUFFIX "%ld.%u", st_dir, (long)getpid(), n);
+        if (renameat(st_base_fd, st_dir, st_base_fd, name) == 0) return 0;
+        if (errno == ENOENT) return 0;          // chưa có Storage
+        if (errno != EEXIST && errno != ENOTEMPTY) return -errno;
+    }
+    return -EEXIST;
+}
+
+int storage_open(const char *dir, int source_fd) {
+    struct stat src;
+    char src_path[PATH_MAX], proc[64];
+    if (fstat(source_fd, &src) == -1) return -errno;
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", source_fd);
+    ssize_t n = readlink(proc, src_path, sizeof(src_path) - 1);
+    src_path[n > 0 ? n : 0] = '\0';
+
+    if (strlen(dir) > DIR_NAME_MAX || strchr(dir, '/')) return -EINVAL;
+    snprintf(st_dir, sizeof(st_dir), "%s", dir);
+    snprintf(st_journal_name, sizeof(st_journal_name), "%s" JOURNAL_SUFFIX, dir);
+    st_base_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (st_base_fd == -1) return -errno;
+
+    int reuse = 0, clean = 0;
+    if (st_mode == STORAGE_PERSIST) {
+        int res = journal_reopen(&src, src_path, &clean);
+        if (res == 0) {
+            reuse = 1;
+        } else if (res == -ENOENT && faccessat(st_base_fd, st_dir, F_OK, 0) == 0) {
+            // Storage không có journal (phiên cũ chạy bản trước): không biết nó có nhất quán không
+            fprintf(stderr, "[WARN] Storage has no journal, resetting storage\n");
+        }
+    }
+
+    if (!reuse) {
+        int res = move_aside();
+        if (res != 0) return res;
+    }
+    if (mkdirat(st_base_fd, st_dir, 0755) == -1 && errno != EEXIST) return -errno;
+    st_fd = openat(st_base_fd, st_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (st_fd == -1) return -errno;
+
+    int res;
+    if (reuse) {
+        res = clean ? 0 : journal_replay();
+        if (res == 0 && ftruncate(st_journal, st_records) == -1) res = -errno;
+        st_end = st_records;
+    } else {
+        res = journal_create(&src, src_path);
+    }
+    // Chỉ đánh dấu sạch lại khi unmount (storage_stop)
+    if (res == 0) res = set_clean(0);
+    if (res != 0) {
+        close(st_fd);
+        st_fd = -1;
+        return res;
+    }
+    st_reused = reuse;
+    return st_fd;
+}
+
+// --- Background deletion ---
+
+static int stopping(void) {
+    return __atomic_load_n(&trash_stop, __ATOMIC_ACQUIRE);
+}
+
+// Như rm -rf nhưng không qua shell; dừng giữa chừng khi storage_stop
+static int remove_tree(int parent, const char *name) {
+    if (unlinkat(parent, name, 0) == 0 || errno == ENOENT) return 0;
+    if (errno != EISDIR) return -errno;
+
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    fchmod(fd, 0700);                   // thư mục copy từ Source có thể là read-only
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return -errno;
+    }
+
+    int res = 0;
+    struct dirent *de;
+    while (res == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (stopping()) res = -EINTR;
+        else res = remove_tree(fd, de->d_name);
+    }
+    closedir(d);
+    if (res == 0 && unlinkat(parent, name, AT_REMOVEDIR) == -1) res = -errno;
+    return res;
+}
+
+static void *trash_main(void *arg) {
+    (void)arg;
+    int fd = dup(st_base_fd);
+    DIR *d = fd == -1 ? NULL : fdopendir(fd);
+    if (!d) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    char prefix[NAME_MAX + 1];
+    snprintf(prefix, sizeof(prefix), "%s" TRASH_SUFFIX, st_dir);
+    size_t plen = strlen(prefix);
+    struct dirent *de;
+    while (!stopping() && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, prefix, plen) != 0) continue;
+        int res = remove_tree(st_base_fd, de->d_name);
+        if (res != 0 && res != -EINTR)
+            fprintf(stderr, "[WARN] Cannot remove old storage %s: %s\n", de->d_name, strerror(-res));
+    }
+    closedir(d);
+    return NULL;
+}
+
+int storage_start(void) {
+    if (st_base_fd == -1 || trash_running) return 0;
+    __atomic_store_n(&trash_stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&trash_thread, NULL, trash_main, NULL) != 0) return -1;
+    trash_running = 1;
+    return 0;
+}
+
+void storage_stop(void) {
+    if (trash_running) {
+        // Phần chưa xóa xong được xóa tiếp ở lần mount sau
+        __atomic_store_n(&trash_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(trash_thread, NULL);
+        trash_running = 0;
+    }
+
+    pthread_mutex_lock(&st_lock);
+    if (st_journal != -1 && st_inflight == 0) {
+        if (ftruncate(st_journal, st_records) == 0) st_end = st_records;
+        set_clean(1);
+    }
+    pthread_mutex_unlock(&st_lock);
+}
@@ -0,0 +1,42 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// Lifecycle of the Storage (upper) layer across mounts.
+//
+// reset (default): the previous Storage is renamed aside in one rename()
+// and a fresh directory is created; the old tree is deleted by a
+// background thread while the new mount already serves requests.
+//
+// persist: the previous Storage is reused. A small journal next to it
+// (<dir>.journal) records which Source it belongs to, whether the last
+// session unmounted cleanly, and the copy-ups in flight; after a crash
+// the half-copied files are removed before mounting. A Storage for a
+// different Source, or one without a journal, is reset instead.
+//
+// Either way startup does a bounded amount of work, independent of the
+// size of Storage.
+
+enum storage_mode {
+    STORAGE_RESET,
+    STORAGE_PERSIST,
+};
+
+void storage_set_mode(enum storage_mode mode);
+
+// Prepare dir (relative to the current directory) for the Source opened
+// as source_fd; returns an fd of the Storage directory or -errno
+int storage_open(const char *dir, int source_fd);
+// 1 if storage_open kept the previous Storage (it may hold state written
+// with other options, e.g. lazy copy-up sidecars)
+int storage_reused(void);
+
+// Background deletion of the renamed-aside trees; stop marks the journal
+// clean, so it must run after the last filesystem operation
+int storage_start(void);
+void storage_stop(void);
+
+// Around copying path ("/a/b") from Source into Storage
+void storage_copyup_begin(const char *path);
+void storage_copyup_end(const char *path);
+
+#endif
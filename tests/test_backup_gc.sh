@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Backups moved into packs can still be listed and restored; retention and
+# garbage collection keep the newest version of every file
+source "$(dirname "$0")/vfs_test_lib.sh"
+
+RESTORE="$BIN_DIR/vfs_restore"
+NFILES=150
+
+# versions <path>: backup names of path, one per line
+versions() {
+    "$RESTORE" --list .backup | awk -v p="$1" '$5 == p { print $1 }'
+}
+
+# kept_versions_ok: the one version left of every other file is its newest
+kept_versions_ok() {
+    for i in $(seq 3 $NFILES); do
+        [ "$("$RESTORE" ".backup/$(versions "/f$i")")" == "v2-$i" ] || return 1
+    done
+}
+
+mount_vfs --maint-interval=1
+
+echo "Running tests..."
+
+# Each overwrite backs up the previous content: 2 versions per file,
+# 2 * NFILES manifests and as many distinct chunks (enough to be packed)
+for i in $(seq $NFILES); do
+    echo "v1-$i" > "$MOUNT_POINT/f$i"
+    echo "v2-$i" > "$MOUNT_POINT/f$i"
+    echo "v3-$i" > "$MOUNT_POINT/f$i"
+done
+sleep 3
+
+# Test 1: the maintenance thread packed the loose objects
+check "Packs written" [ -n "$(ls -A .backup/packs 2>/dev/null)" ]
+check "Packed versions listed" bash -c "'$RESTORE' --list .backup | grep -q '(packed)'"
+
+# Test 2: a packed version restores by its .bak name
+restored=""
+for name in $(versions /f1); do
+    restored="$restored$("$RESTORE" ".backup/$name") "
+done
+check "Two versions of /f1" [ "$(versions /f1 | wc -l)" == 2 ]
+check "Packed versions restore" [ "$(echo $restored | tr ' ' '\n' | sort | tr '\n' ' ')" == "v1-1 v2-1 " ]
+"$RESTORE" ".backup/$(versions /f1 | head -n 1)" "$MOUNT_POINT/f1"
+check "Restore through the mount" grep -q '^v[12]-1$' "$MOUNT_POINT/f1"
+check "Versions visible in the mount" [ "$(ls "$MOUNT_POINT/.versions/f2" | wc -l)" == 2 ]
+unmount_vfs
+
+# Test 3: retention keeps only the newest version, GC drops the rest
+mount_vfs --maint-interval=1 --keep-last=1
+sleep 3
+check "Retention keeps one version" [ "$(versions /f2 | wc -l)" == 1 ]
+check "Newest version kept" [ "$("$RESTORE" ".backup/$(versions /f2)")" == "v2-2" ]
+check "Every kept version restores" kept_versions_ok
+unmount_vfs
+
+finish
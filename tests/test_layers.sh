@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Whiteouts, opaque directories and directory redirects across --lower layers
+source "$(dirname "$0")/vfs_test_lib.sh"
+
+mkdir -p src/d mid/d mid/r bot/d bot/r/sub
+echo "top" > src/d/t.txt
+echo "mid" > mid/d/m.txt
+echo "mid" > mid/same
+echo "bot" > bot/same
+echo "bot" > bot/d/b.txt
+echo "x" > bot/r/x.txt
+echo "y" > mid/r/y.txt
+echo "z" > bot/r/sub/z.txt
+
+mount_vfs --lower="$WORK_DIR/mid" --lower="$WORK_DIR/bot" --storage-mode=persist
+
+echo "Running tests..."
+
+# Test 1: directories of all layers are merged, the topmost file wins
+check "Merged directory" [ "$(ls "$MOUNT_POINT/d" | tr '\n' ' ')" == "b.txt m.txt t.txt " ]
+check "Topmost layer wins" [ "$(cat "$MOUNT_POINT/same")" == "mid" ]
+
+# Test 2: unlink hides the file in every lower layer, lowers stay untouched
+rm "$MOUNT_POINT/same"
+check "Whiteout hides all layers" [ ! -e "$MOUNT_POINT/same" ]
+check "Whiteout not listed" bash -c "! ls '$MOUNT_POINT' | grep -qx same"
+check "Lower layers untouched" [ -f mid/same -a -f bot/same ]
+
+# Test 3: rename of a merged directory keeps the content of every layer
+mv "$MOUNT_POINT/r" "$MOUNT_POINT/r2"
+check "Redirect hides old name" [ ! -e "$MOUNT_POINT/r" ]
+check "Redirect keeps merged content" [ "$(ls "$MOUNT_POINT/r2" | tr '\n' ' ')" == "sub x.txt y.txt " ]
+check "Redirect reads nested lower file" [ "$(cat "$MOUNT_POINT/r2/sub/z.txt")" == "z" ]
+check "Redirect does not copy lower files" [ ! -e .vfs_storage/r2/x.txt ]
+
+# Test 4: a directory created over a removed one starts empty (opaque)
+mkdir "$MOUNT_POINT/r"
+check "Opaque directory is empty" [ -z "$(ls -A "$MOUNT_POINT/r")" ]
+echo "new" > "$MOUNT_POINT/r/new.txt"
+check "Opaque directory shows new files" [ "$(ls "$MOUNT_POINT/r")" == "new.txt" ]
+
+# Test 5: whiteout, opaque and redirect records survive a remount
+unmount_vfs
+mount_vfs --lower="$WORK_DIR/mid" --lower="$WORK_DIR/bot" --storage-mode=persist
+check "Whiteout after remount" [ ! -e "$MOUNT_POINT/same" ]
+check "Opaque after remount" [ "$(ls "$MOUNT_POINT/r")" == "new.txt" ]
+check "Redirect after remount" [ "$(ls "$MOUNT_POINT/r2" | tr '\n' ' ')" == "sub x.txt y.txt " ]
+
+finish
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Lazy copy-up: partial reads of a half-copied file, before and after truncate
+source "$(dirname "$0")/vfs_test_lib.sh"
+
+head -c 4194304 /dev/urandom > src/big
+cp src/big ref
+
+# bytes <file> <offset> <count>: count bytes of file starting at offset
+bytes() {
+    tail -c +$(($2 + 1)) "$1" | head -c "$3"
+}
+
+mount_vfs --lazy-copyup=1M
+
+echo "Running tests..."
+
+# Test 1: a small write copies up only the blocks it touches
+printf 'Z' | dd of="$MOUNT_POINT/big" bs=1 seek=70000 conv=notrunc status=none
+check "Bitmap sidecar created" [ -f .vfs_storage/.bm.big ]
+check "Sidecar hidden from listing" bash -c "! ls -A '$MOUNT_POINT' | grep -q '^\.bm\.'"
+check "Written byte visible" [ "$(bytes "$MOUNT_POINT/big" 70000 1)" == "Z" ]
+check "Untouched block read from Source" cmp -s <(bytes "$MOUNT_POINT/big" 2097152 65536) <(bytes ref 2097152 65536)
+check "Rest of written block kept" cmp -s <(bytes "$MOUNT_POINT/big" 65536 4464) <(bytes ref 65536 4464)
+
+# Test 2: truncate in the middle of an uncopied block keeps the data before the cut
+truncate -s 200000 "$MOUNT_POINT/big"
+check "Size after truncate" [ "$(stat -c %s "$MOUNT_POINT/big")" == 200000 ]
+check "Data before the cut" cmp -s <(bytes "$MOUNT_POINT/big" 131072 68928) <(bytes ref 131072 68928)
+check "Data of first block" cmp -s <(bytes "$MOUNT_POINT/big" 0 65536) <(bytes ref 0 65536)
+
+# Test 3: growing again reads zeros past the old cut, not Source data
+truncate -s 3000000 "$MOUNT_POINT/big"
+check "Zeros after extend" cmp -s <(bytes "$MOUNT_POINT/big" 200000 2800000) <(head -c 2800000 /dev/zero)
+check "Data before the cut after extend" cmp -s <(bytes "$MOUNT_POINT/big" 131072 68928) <(bytes ref 131072 68928)
+
+# Test 4: truncate to 0 leaves a plain Storage file
+truncate -s 0 "$MOUNT_POINT/big"
+check "Empty after truncate" [ "$(stat -c %s "$MOUNT_POINT/big")" == 0 ]
+check "Sidecar removed" [ ! -e .vfs_storage/.bm.big ]
+check "Source untouched" cmp -s src/big ref
+
+finish
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# cli_query over binary log segments returns the same events as over the text log
+source "$(dirname "$0")/vfs_test_lib.sh"
+
+QUERY="$BIN_DIR/cli_query"
+
+# same_result <filters...>: both queries give the same events (in any order)
+same_result() {
+    cmp -s <("$QUERY" --log virtual_fs.log "$@" | sort) \
+           <("$QUERY" --segments virtual_fs.segments "$@" | sort)
+}
+
+mount_vfs --log-format=both
+
+echo "Running tests..."
+
+mkdir "$MOUNT_POINT/docs"
+for i in $(seq 50); do echo "line $i" >> "$MOUNT_POINT/docs/report.txt"; done
+echo "draft" > "$MOUNT_POINT/docs/draft.txt"
+chmod 600 "$MOUNT_POINT/docs/draft.txt"
+mv "$MOUNT_POINT/docs/draft.txt" "$MOUNT_POINT/docs/final.txt"
+cat "$MOUNT_POINT/docs/final.txt" > /dev/null
+rm "$MOUNT_POINT/docs/final.txt"
+cat "$MOUNT_POINT/missing.txt" 2>/dev/null
+
+# Segments are sealed on unmount
+unmount_vfs
+
+check "Segments written" [ -n "$(ls virtual_fs.segments/*.seg 2>/dev/null)" ]
+check "Text log written" [ -s virtual_fs.log ]
+check "Query without filter" same_result
+check "Query by operation (WRITE)" same_result --op WRITE
+check "Query by operation (RENAME)" same_result --op RENAME
+check "Query by file" same_result --file report.txt
+check "Query by uid" same_result --user "$(id -u)"
+check "Query by user name" same_result --user "$(id -un)"
+check "Query by user and operation" same_result --user "$(id -u)" --op UNLINK
+check "Query matches events" [ "$("$QUERY" --segments virtual_fs.segments --op RENAME | wc -l)" -ge 1 ]
+
+finish
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Write-back buffers are flushed before a read or a truncate of the file
+source "$(dirname "$0")/vfs_test_lib.sh"
+
+mount_vfs --writeback=8M
+
+echo "Running tests..."
+
+# Test 1: small writes still held in the buffer are seen by a reader
+exec 3>"$MOUNT_POINT/records.csv"
+for i in $(seq 100); do echo "record,$i" >&3; done
+check "Read sees buffered writes" [ "$(wc -l < "$MOUNT_POINT/records.csv")" == 100 ]
+check "Last buffered record" [ "$(tail -n 1 "$MOUNT_POINT/records.csv")" == "record,100" ]
+
+# Test 2: truncate applies after the buffered writes, not before them
+printf 'abcdefghij' >&3
+truncate -s 5 "$MOUNT_POINT/records.csv"
+check "Truncate after buffered writes" [ "$(cat "$MOUNT_POINT/records.csv")" == "recor" ]
+
+# Test 3: writes after the truncate land at the fd offset, the gap reads as zeros
+printf 'XY' >&3
+exec 3>&-
+size=$(stat -c %s "$MOUNT_POINT/records.csv")
+expected=$(( $(seq 100 | sed 's/^/record,/' | wc -c) + 10 + 2 ))     # fd offset + "XY"
+check "Size after close" [ "$size" == "$expected" ]
+check "Gap reads as zeros" cmp -s <(tail -c +6 "$MOUNT_POINT/records.csv" | head -c $((expected - 7))) <(head -c $((expected - 7)) /dev/zero)
+check "Tail written after truncate" [ "$(tail -c 2 "$MOUNT_POINT/records.csv")" == "XY" ]
+
+# Test 4: data is in Storage after unmount
+unmount_vfs
+check "Flushed to Storage" [ "$(tail -c 2 .vfs_storage/records.csv)" == "XY" ]
+
+finish
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Shared helpers for the tests/test_*.sh scripts (source it, do not run it).
+# Binaries are taken from the repository root (build them as in README2.md);
+# each test runs in its own temporary directory, so .vfs_storage, .backup
+# and the logs of the mount land there.
+
+BIN_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+WORK_DIR="$(mktemp -d /tmp/vfs_test.XXXXXX)"
+MOUNT_POINT="$WORK_DIR/mnt"
+VFS_PID=""
+FAILED=0
+export LC_ALL=C                 # stable ls order
+
+mkdir -p "$MOUNT_POINT" "$WORK_DIR/src"
+cd "$WORK_DIR" || exit 1
+
+# mount_vfs [vfs options...]: mounts $WORK_DIR/src on $MOUNT_POINT
+mount_vfs() {
+    "$BIN_DIR/vfs" "$@" -f "$WORK_DIR/src" "$MOUNT_POINT" 2>>"$WORK_DIR/vfs.stderr" &
+    VFS_PID=$!
+    for _ in $(seq 50); do
+        mountpoint -q "$MOUNT_POINT" && return 0
+        sleep 0.1
+    done
+    echo "Mount: FAILED (see $WORK_DIR/vfs.stderr)"
+    exit 1
+}
+
+unmount_vfs() {
+    fusermount -u "$MOUNT_POINT"
+    wait "$VFS_PID"
+    VFS_PID=""
+}
+
+# check "<description>" <command...>: prints SUCCESS/FAILED like test_virtual_fs.sh
+check() {
+    local what="$1"
+    shift
+    if "$@"; then
+        echo "$what: SUCCESS"
+    else
+        echo "$what: FAILED"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# finish: unmounts if needed, removes the work directory on success
+finish() {
+    [ -n "$VFS_PID" ] && unmount_vfs
+    cd / || exit 1
+    if [ "$FAILED" -eq 0 ]; then
+        rm -rf "$WORK_DIR"
+        echo "Tests completed."
+        exit 0
+    fi
+    echo "Tests completed: $FAILED FAILED (work directory kept: $WORK_DIR)"
+    exit 1
+}
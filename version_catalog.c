@@ -0,0 +1,466 @@
+/*
+ * version_catalog.c
+ * Per-path index of backup versions, see version_catalog.h.
+ *
+ * On disk the catalog is an append-only log of fixed headers followed by
+ * the manifest name and the path; a torn record at the end (crash during
+ * an append) is cut off when it is replayed. Removed versions stay in the
+ * log until they outnumber the live ones, then the log is rewritten.
+ *
+ * In memory every path of the version tree is a node: a file that has
+ * versions (sorted by stamp), and/or a directory with versioned
+ * descendants. Lookups are a hash probe plus a binary search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "version_catalog.h"
+#include "version_store.h"
+
+#define VC_BUCKETS 4096
+#define VC_RECORD_MAGIC "VCR1"
+#define VC_COMPACT_MIN 1024             // số record chết tối thiểu trước khi viết lại log
+
+enum { VC_ADD = 1, VC_DEL = 2 };
+
+struct vc_record {
+    char magic[4];
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t name_len;
+    uint32_t path_len;
+    uint32_t reserved2;
+    int64_t created;
+    uint64_t size;
+};
+
+struct vc_node {
+    char *path;                         // "/a/b", gốc là "/"
+    struct vc_node *next;               // chuỗi hash
+    struct vc_node *parent;
+    struct vc_node **kids;
+    size_t nkids, kcap;
+    size_t descendants;                 // số version trong cây con, không kể chính nó
+    struct vc_version *v;               // sắp theo stamp
+    size_t count, cap;
+};
+
+static int vc_dirfd = -1;
+static int vc_fd = -1;                  // log, O_APPEND
+static struct vc_node *vc_table[VC_BUCKETS];
+static pthread_rwlock_t vc_lock = PTHREAD_RWLOCK_INITIALIZER;
+static size_t vc_live = 0;
+static size_t vc_dead = 0;              // record ADD đã bị xóa + record DEL trong log
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// "<path>_YYYYmmdd_HHMMSS_NNN.bak" -> "YYYYmmdd_HHMMSS_NNN"
+static int stamp_of(const char *manifest, char stamp[VC_STAMP_MAX]) {
+    size_t len = strlen(manifest);
+    if (len < 4 || strcmp(manifest + len - 4, ".bak") != 0) return -1;
+    len -= 4;
+    size_t start = len, seps = 0;
+    while (start > 0 && seps < 3) {
+        if (manifest[start - 1] == '_' && ++seps == 3) break;
+        start--;
+    }
+    if (seps != 3 || len - start >= VC_STAMP_MAX || len - start < 17) return -1;
+    memcpy(stamp, manifest + start, len - start);
+    stamp[len - start] = '\0';
+    return 0;
+}
+
+// Ngày giờ so như chuỗi, số thứ tự so như số (có thể vượt 3 chữ số)
+static int stamp_cmp(const char *a, const char *b) {
+    int c = strncmp(a, b, 15);
+    if (c) return c;
+    unsigned long x = strtoul(a + 16, NULL, 10), y = strtoul(b + 16, NULL, 10);
+    return x < y ? -1 : x > y;
+}
+
+static struct vc_node *find_node(const char *path) {
+    for (struct vc_node *n = vc_table[hash_path(path) % VC_BUCKETS]; n; n = n->next)
+        if (strcmp(n->path, path) == 0) return n;
+    return NULL;
+}
+
+static int add_kid(struct vc_node *parent, struct vc_node *kid) {
+    if (parent->nkids == parent->kcap) {
+        size_t cap = parent->kcap ? parent->kcap * 2 : 4;
+        struct vc_node **k = realloc(parent->kids, cap * sizeof(*k));
+        if (!k) return -ENOMEM;
+        parent->kids = k;
+        parent->kcap = cap;
+    }
+    parent->kids[parent->nkids++] = kid;
+    kid->parent = parent;
+    return 0;
+}
+
+static void prune_node(struct vc_node *n);
+
+// Node của path, tạo cả các node cha còn thiếu
+static struct vc_node *get_node(const char *path) {
+    struct vc_node *n = find_node(path);
+    if (n) return n;
+
+    struct vc_node *parent = NULL;
+    if (strcmp(path, "/") != 0) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        char *slash = strrchr(dir, '/');
+        if (!slash) return NULL;
+        if (slash == dir) slash[1] = '\0';
+        else *slash = '\0';
+        parent = get_node(dir);
+        if (!parent) return NULL;
+    }
+
+    n = calloc(1, sizeof(*n));
+    if (!n || !(n->path = strdup(path)) || (parent && add_kid(parent, n) != 0)) {
+        if (n) free(n->path);
+        free(n);
+        prune_node(parent);     // cha vừa tạo cho node này
+        return NULL;
+    }
+    uint32_t b = hash_path(path) % VC_BUCKETS;
+    n->next = vc_table[b];
+    vc_table[b] = n;
+    return n;
+}
+
+// Bỏ node rỗng (không version, không con) khỏi cây, lan dần lên gốc
+static void prune_node(struct vc_node *n) {
+    while (n && n->parent && n->count == 0 && n->descendants == 0) {
+        struct vc_node *parent = n->parent;
+        for (size_t i = 0; i < parent->nkids; i++) {
+            if (parent->kids[i] == n) {
+                parent->kids[i] = parent->kids[--parent->nkids];
+                break;
+            }
+        }
+        struct vc_node **pp = &vc_table[hash_path(n->path) % VC_BUCKETS];
+        while (*pp != n) pp = &(*pp)->next;
+        *pp = n->next;
+        free(n->kids);
+        free(n->v);
+        free(n->path);
+        free(n);
+        n = parent;
+    }
+}
+
+// Vị trí đầu tiên có stamp >= stamp
+static size_t lower_bound(const struct vc_node *n, const char *stamp) {
+    size_t lo = 0, hi = n->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (stamp_cmp(n->v[mid].stamp, stamp) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// 1: đã thêm, 0: đã có, <0: lỗi
+static int insert_version(const char *path, const char *manifest, int64_t created, uint64_t size) {
+    struct vc_version ver;
+    if (path[0] != '/' || stamp_of(manifest, ver.stamp) != 0) return -EINVAL;
+    if (strlen(manifest) >= sizeof(ver.manifest)) return -ENAMETOOLONG;
+    snprintf(ver.manifest, sizeof(ver.manifest), "%s", manifest);
+    ver.created = created;
+    ver.size = size;
+
+    struct vc_node *n = get_node(path);
+    if (!n) return -ENOMEM;
+    size_t pos = lower_bound(n, ver.stamp);
+    if (pos < n->count && strcmp(n->v[pos].stamp, ver.stamp) == 0) return 0;
+    if (n->count == n->cap) {
+        size_t cap = n->cap ? n->cap * 2 : 4;
+        struct vc_version *v = realloc(n->v, cap * sizeof(*v));
+        if (!v) {
+            prune_node(n);
+            return -ENOMEM;
+        }
+        n->v = v;
+        n->cap = cap;
+    }
+    memmove(&n->v[pos + 1], &n->v[pos], (n->count - pos) * sizeof(*n->v));
+    n->v[pos] = ver;
+    n->count++;
+    for (struct vc_node *p = n->parent; p; p = p->parent) p->descendants++;
+    vc_live++;
+    return 1;
+}
+
+static int remove_version(const char *path, const char *manifest) {
+    char stamp[VC_STAMP_MAX];
+    struct vc_node *n = find_node(path);
+    if (!n || stamp_of(manifest, stamp) != 0) return 0;
+    size_t pos = lower_bound(n, stamp);
+    if (pos == n->count || strcmp(n->v[pos].manifest, manifest) != 0) return 0;
+    memmove(&n->v[pos], &n->v[pos + 1], (n->count - pos - 1) * sizeof(*n->v));
+    n->count--;
+    for (struct vc_node *p = n->parent; p; p = p->parent) p->descendants--;
+    prune_node(n);
+    vc_live--;
+    return 1;
+}
+
+// ---- log ----
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Một record = một write(): O_APPEND không bao giờ xen giữa hai record
+static int append_record(int fd, int op, const char *path, const char *manifest,
+                         int64_t created, uint64_t size) {
+    struct vc_record r;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.magic, VC_RECORD_MAGIC, sizeof(r.magic));
+    r.op = op;
+    r.name_len = strlen(manifest);
+    r.path_len = strlen(path);
+    r.created = created;
+    r.size = size;
+
+    char buf[sizeof(r) + 2 * PATH_MAX];
+    if ((size_t)r.name_len + r.path_len > sizeof(buf) - sizeof(r)) return -ENAMETOOLONG;
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), manifest, r.name_len);
+    memcpy(buf + sizeof(r) + r.name_len, path, r.path_len);
+    return write_all(fd, buf, sizeof(r) + r.name_len + r.path_len);
+}
+
+// Áp dụng log lên bộ nhớ; trả về số byte hợp lệ ở đầu file
+static off_t replay(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) return 0;
+    char *buf = malloc(st.st_size);
+    if (!buf) return -ENOMEM;
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = pread(fd, buf + len, st.st_size - len, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+
+    size_t off = 0;
+    while (len - off >= sizeof(struct vc_record)) {
+        struct vc_record r;
+        memcpy(&r, buf + off, sizeof(r));
+        if (memcmp(r.magic, VC_RECORD_MAGIC, sizeof(r.magic)) != 0) break;
+        if ((r.op != VC_ADD && r.op != VC_DEL) || r.name_len == 0 || r.path_len == 0 ||
+            r.name_len >= PATH_MAX || r.path_len >= PATH_MAX) break;
+        size_t rec_len = sizeof(r) + r.name_len + r.path_len;
+        if (len - off < rec_len) break;
+
+        char name[PATH_MAX], path[PATH_MAX];
+        memcpy(name, buf + off + sizeof(r), r.name_len);
+        name[r.name_len] = '\0';
+        memcpy(path, buf + off + sizeof(r) + r.name_len, r.path_len);
+        path[r.path_len] = '\0';
+        if (r.op == VC_ADD) {
+            if (insert_version(path, name, r.created, r.size) != 1) vc_dead++;
+        } else {
+            vc_dead += remove_version(path, name) ? 2 : 1;
+        }
+        off += rec_len;
+    }
+    free(buf);
+    return off;
+}
+
+static int write_node(int fd, const struct vc_node *n) {
+    int res = 0;
+    for (size_t i = 0; i < n->count && res == 0; i++)
+        res = append_record(fd, VC_ADD, n->path, n->v[i].manifest, n->v[i].created, n->v[i].size);
+    for (size_t i = 0; i < n->nkids && res == 0; i++) res = write_node(fd, n->kids[i]);
+    return res;
+}
+
+// Viết lại log chỉ với version còn sống (tmp + rename), caller giữ write lock
+static int rewrite_log(void) {
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", VC_FILE);
+    int fd = openat(vc_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return -errno;
+    struct vc_node *root = find_node("/");
+    int res = root ? write_node(fd, root) : 0;
+    if (res == 0 && fsync(fd) == -1) res = -errno;
+    if (res == 0 && renameat(vc_dirfd, tmp, vc_dirfd, VC_FILE) == -1) res = -errno;
+    if (res != 0) {
+        close(fd);
+        unlinkat(vc_dirfd, tmp, 0);
+        return res;
+    }
+    if (vc_fd != -1) close(vc_fd);
+    vc_fd = fd;
+    vc_dead = 0;
+    return 0;
+}
+
+static int rebuild_version(void *ctx, const char *name, const struct vs_manifest *m, int packed) {
+    (void)packed;
+    int *res = ctx;
+    int r = insert_version(m->path, name, m->hdr.created, m->hdr.file_size);
+    if (r == -ENOMEM) {
+        *res = r;
+        return 1;
+    }
+    return 0;
+}
+
+int vc_init(int backup_dirfd) {
+    if (backup_dirfd == -1) return -EINVAL;
+    vc_dirfd = backup_dirfd;
+
+    pthread_rwlock_wrlock(&vc_lock);
+    int res = 0;
+    int fd = openat(vc_dirfd, VC_FILE, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd != -1) {
+        off_t valid = replay(fd);
+        if (valid < 0) {
+            res = (int)valid;
+            close(fd);
+        } else {
+            struct stat st;
+            // Record dở dang cuối log (crash giữa lúc append)
+            if (fstat(fd, &st) == 0 && st.st_size > valid && ftruncate(fd, valid) == -1) res = -errno;
+            vc_fd = fd;
+        }
+    } else if (errno == ENOENT) {
+        // Lần đầu (hoặc store cũ chưa có catalog): dựng lại từ các manifest
+        int list_res = vs_list(rebuild_version, &res);
+        if (res == 0) res = list_res;
+        if (res == 0) res = rewrite_log();
+    } else {
+        res = -errno;
+    }
+    if (res != 0 && vc_fd == -1) vc_dirfd = -1;
+    pthread_rwlock_unlock(&vc_lock);
+    return res;
+}
+
+int vc_enabled(void) {
+    return vc_dirfd != -1;
+}
+
+void vc_add(const char *path, const char *manifest, int64_t created, uint64_t size) {
+    if (vc_dirfd == -1) return;
+    pthread_rwlock_wrlock(&vc_lock);
+    // Trùng (backup_maint đối chiếu lại) -> không ghi gì
+    if (insert_version(path, manifest, created, size) == 1 && vc_fd != -1 &&
+        append_record(vc_fd, VC_ADD, path, manifest, created, size) != 0) {
+        fprintf(stderr, "[WARN] Cannot append to version catalog\n");
+    }
+    pthread_rwlock_unlock(&vc_lock);
+}
+
+void vc_remove(const char *path, const char *manifest) {
+    if (vc_dirfd == -1) return;
+    pthread_rwlock_wrlock(&vc_lock);
+    if (remove_version(path, manifest) && vc_fd != -1) {
+        if (append_record(vc_fd, VC_DEL, path, manifest, 0, 0) != 0)
+            fprintf(stderr, "[WARN] Cannot append to version catalog\n");
+        vc_dead += 2;
+    }
+    pthread_rwlock_unlock(&vc_lock);
+}
+
+void vc_compact(void) {
+    if (vc_dirfd == -1) return;
+    pthread_rwlock_wrlock(&vc_lock);
+    if (vc_dead >= VC_COMPACT_MIN && vc_dead > vc_live) {
+        int res = rewrite_log();
+        if (res != 0) fprintf(stderr, "[WARN] Cannot compact version catalog: %s\n", strerror(-res));
+    }
+    pthread_rwlock_unlock(&vc_lock);
+}
+
+int vc_find(const char *path, const char *stamp, struct vc_version *out) {
+    int res = -ENOENT;
+    pthread_rwlock_rdlock(&vc_lock);
+    struct vc_node *n = find_node(path);
+    if (n) {
+        size_t pos = lower_bound(n, stamp);
+        if (pos < n->count && strcmp(n->v[pos].stamp, stamp) == 0) {
+            *out = n->v[pos];
+            res = 0;
+        }
+    }
+    pthread_rwlock_unlock(&vc_lock);
+    return res;
+}
+
+int vc_find_at(const char *path, time_t t, struct vc_version *out) {
+    int res = -ENOENT;
+    pthread_rwlock_rdlock(&vc_lock);
+    struct vc_node *n = find_node(path);
+    if (n) {
+        // Thứ tự stamp cũng là thứ tự thời gian tạo
+        size_t lo = 0, hi = n->count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (n->v[mid].created <= (int64_t)t) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0) {
+            *out = n->v[lo - 1];
+            res = 0;
+        }
+    }
+    pthread_rwlock_unlock(&vc_lock);
+    return res;
+}
+
+int vc_path_kind(const char *path) {
+    int kind = 0;
+    pthread_rwlock_rdlock(&vc_lock);
+    struct vc_node *n = find_node(path);
+    if (n) kind = (n->count ? VC_HAS_VERSIONS : 0) | (n->descendants ? VC_HAS_CHILDREN : 0);
+    pthread_rwlock_unlock(&vc_lock);
+    return kind;
+}
+
+int vc_list(const char *path, vc_fill_fn fn, void *ctx) {
+    pthread_rwlock_rdlock(&vc_lock);
+    struct vc_node *n = find_node(path);
+    if (!n) {
+        pthread_rwlock_unlock(&vc_lock);
+        return strcmp(path, "/") == 0 ? 0 : -ENOENT;
+    }
+    int stop = 0;
+    for (size_t i = 0; i < n->nkids && !stop; i++) {
+        const char *name = strrchr(n->kids[i]->path, '/') + 1;
+        stop = fn(ctx, name, 1);
+    }
+    for (size_t i = 0; i < n->count && !stop; i++) stop = fn(ctx, n->v[i].stamp, 0);
+    pthread_rwlock_unlock(&vc_lock);
+    return stop;
+}
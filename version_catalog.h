@@ -0,0 +1,54 @@
+#ifndef VERSION_CATALOG_H
+#define VERSION_CATALOG_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Persistent per-path index of the versions in the backup store.
+//
+// Every saved version is appended to <backup>/catalog as it is created
+// (and a removal record when retention deletes it), and the whole catalog
+// is kept in memory: a hash of paths, each with its versions sorted by
+// time, plus the directory structure of the versioned paths. A version is
+// named by its stamp, the "YYYYmmdd_HHMMSS_NNN" part of its manifest name,
+// which sorts chronologically.
+//
+// operations.c serves it as the read-only tree /.versions/<path>/<stamp>.
+
+#define VC_FILE "catalog"
+#define VC_STAMP_MAX 32
+
+struct vc_version {
+    char stamp[VC_STAMP_MAX];
+    int64_t created;
+    uint64_t size;
+    char manifest[256];
+};
+
+// Load <backup>/catalog, or rebuild it from the store when missing
+int vc_init(int backup_dirfd);
+int vc_enabled(void);
+
+void vc_add(const char *path, const char *manifest, int64_t created, uint64_t size);
+void vc_remove(const char *path, const char *manifest);
+// Rewrite the log without removed entries when they dominate
+void vc_compact(void);
+
+// Version of path by stamp; 0 or -ENOENT
+int vc_find(const char *path, const char *stamp, struct vc_version *out);
+// Newest version of path created at or before t
+int vc_find_at(const char *path, time_t t, struct vc_version *out);
+
+// VC_HAS_VERSIONS if path has versions, VC_HAS_CHILDREN if paths below
+// it do; 0 if path is not in the version tree.
+#define VC_HAS_VERSIONS 1
+#define VC_HAS_CHILDREN 2
+int vc_path_kind(const char *path);
+
+// Entries of the virtual directory path: versioned children (is_dir = 1)
+// then the stamps of path's own versions (is_dir = 0). Returns the
+// non-zero value fn stopped with, -ENOENT for an unknown path, else 0.
+typedef int (*vc_fill_fn)(void *ctx, const char *name, int is_dir);
+int vc_list(const char *path, vc_fill_fn fn, void *ctx);
+
+#endif
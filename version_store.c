@@ -0,0 +1,774 @@
+/*
+ * version_store.c
+ * Content-addressed, deduplicating store for backups.
+ *
+ * Files are split into fixed-size chunks addressed by their SHA-256 digest
+ * and stored once under <backup_dir>/chunks/xx/<digest>. Every backup is a
+ * small manifest listing the chunk digests of that version, so identical
+ * chunks across versions and files cost nothing.
+ *
+ * The store also remembers, per path, the digests of the last saved version
+ * and which chunks were written since. A backup taken before each write then
+ * only re-reads and hashes the chunks that actually changed. That table
+ * keeps at most VS_MAX_ENTRIES paths and evicts idle ones clock-style; the
+ * next save of an evicted path just hashes the whole file again, and its
+ * chunks dedup against what is already on disk.
+ *
+ * backup_maint.c later moves loose chunks and manifests into pack files
+ * and deletes what retention no longer needs; lookups here fall back to
+ * the packs, and saves cooperate with its garbage collection through the
+ * vs_gc_* hooks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "version_store.h"
+#include "copy_engine.h"
+#include "pack_file.h"
+#include "version_catalog.h"
+
+#define VS_BUCKETS 1024
+#define VS_MAX_ENTRIES 4096
+
+struct vs_entry {
+    char *path;
+    struct vs_entry *next;
+    pthread_mutex_t lock;
+    int valid;
+    uint64_t file_size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint8_t (*digests)[SHA256_DIGEST_LEN];
+    uint8_t *dirty;
+    unsigned gc_epoch;          // digest cũ chỉ dùng lại được nếu GC chưa xóa chunk nào
+    int refs;                   // caller đang dùng, không được evict (giữ vs_table_lock)
+    int referenced;             // bit clock: được dùng từ lần quét trước
+};
+
+static int vs_dirfd = -1;          // fd thư mục backup, mọi path đều tương đối với nó
+static struct vs_entry *vs_table[VS_BUCKETS];
+static pthread_mutex_t vs_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int vs_entry_count = 0;
+static unsigned int vs_evict_cursor = 0;
+static unsigned int vs_tmp_counter = 0;
+static unsigned int vs_backup_counter = 0;  // Biến đếm để tránh trùng tên file backup (atomic)
+
+// Save giữ shared, GC giữ exclusive khi xóa chunk (xem vs_gc_*)
+static pthread_rwlock_t vs_gc_rw;
+static int vs_gc_active = 0;
+static unsigned vs_gc_epoch = 0;
+static struct vs_digest_set vs_pins;
+static pthread_mutex_t vs_pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (uint8_t)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t chunk_size_for(uint64_t size) {
+    uint32_t cs = VS_MIN_CHUNK_SIZE;
+    while (cs < VS_MAX_CHUNK_SIZE && size > (uint64_t)cs * VS_MAX_CHUNKS) cs <<= 1;
+    return cs;
+}
+
+static void digest_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_DIGEST_LEN * 2 + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LEN; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA256_DIGEST_LEN * 2] = '\0';
+}
+
+static void chunk_path(char out[PATH_MAX], const uint8_t digest[SHA256_DIGEST_LEN]) {
+    char hex[SHA256_DIGEST_LEN * 2 + 1];
+    digest_hex(digest, hex);
+    snprintf(out, PATH_MAX, "chunks/%.2s/%s", hex, hex);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Write buf to final_path via a temp file + rename so readers never see
+// a half-written chunk or manifest.
+static int write_file_atomic(const char *final_path, const void *buf, size_t len,
+                             const void *buf2, size_t len2) {
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "tmp.%d.%u", (int)getpid(),
+             __atomic_fetch_add(&vs_tmp_counter, 1, __ATOMIC_RELAXED));
+
+    int fd = openat(vs_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -errno;
+    int res = write_all(fd, buf, len);
+    if (res == 0 && len2) res = write_all(fd, buf2, len2);
+    close(fd);
+    if (res == 0 && renameat(vs_dirfd, tmp, vs_dirfd, final_path) == -1) res = -errno;
+    if (res != 0) unlinkat(vs_dirfd, tmp, 0);
+    return res;
+}
+
+static int store_chunk(const uint8_t digest[SHA256_DIGEST_LEN], const void *data, size_t len) {
+    char path[PATH_MAX];
+    chunk_path(path, digest);
+
+    // Chunk đã có -> dedup, không ghi lại
+    struct stat st;
+    if (fstatat(vs_dirfd, path, &st, 0) == 0) return 0;
+    if (pack_has(digest, PACK_CHUNK)) return 0;
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    if (mkdirat(vs_dirfd, dir, 0755) == -1 && errno != EEXIST) return -errno;
+
+    return write_file_atomic(path, data, len, NULL, 0);
+}
+
+static void free_entry(struct vs_entry *e) {
+    pthread_mutex_destroy(&e->lock);
+    free(e->digests);
+    free(e->dirty);
+    free(e->path);
+    free(e);
+}
+
+// Caller giữ vs_table_lock. Clock: entry vừa được dùng có thêm một vòng,
+// entry đang có caller giữ thì bỏ qua
+static void evict_one(void) {
+    for (unsigned int n = 0; n < 2 * VS_BUCKETS; n++) {
+        struct vs_entry **pp = &vs_table[vs_evict_cursor % VS_BUCKETS];
+        while (*pp) {
+            struct vs_entry *e = *pp;
+            if (e->refs == 0 && !e->referenced) {
+                *pp = e->next;
+                free_entry(e);
+                vs_entry_count--;
+                return;
+            }
+            e->referenced = 0;
+            pp = &e->next;
+        }
+        vs_evict_cursor++;
+    }
+}
+
+// Entry của path với một tham chiếu, trả lại bằng release_entry
+static struct vs_entry *lookup_entry(const char *path, int create) {
+    uint32_t b = hash_path(path) % VS_BUCKETS;
+
+    pthread_mutex_lock(&vs_table_lock);
+    struct vs_entry *e;
+    for (e = vs_table[b]; e; e = e->next) {
+        if (strcmp(e->path, path) == 0) break;
+    }
+    if (!e && create) {
+        if (vs_entry_count >= VS_MAX_ENTRIES) evict_one();
+        e = calloc(1, sizeof(*e));
+        if (e && !(e->path = strdup(path))) {
+            free(e);
+            e = NULL;
+        }
+        if (e) {
+            pthread_mutex_init(&e->lock, NULL);
+            e->next = vs_table[b];
+            vs_table[b] = e;
+            vs_entry_count++;
+        }
+    }
+    if (e) {
+        e->refs++;
+        e->referenced = 1;
+    }
+    pthread_mutex_unlock(&vs_table_lock);
+    return e;
+}
+
+static void release_entry(struct vs_entry *e) {
+    pthread_mutex_lock(&vs_table_lock);
+    e->refs--;
+    pthread_mutex_unlock(&vs_table_lock);
+}
+
+static void reset_entry(struct vs_entry *e) {
+    free(e->digests);
+    free(e->dirty);
+    e->digests = NULL;
+    e->dirty = NULL;
+    e->valid = 0;
+    e->chunk_count = 0;
+}
+
+int vs_init(const char *backup_dir) {
+    if (mkdir(backup_dir, 0755) == -1 && errno != EEXIST) return -errno;
+
+    int fd = open(backup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    if (mkdirat(fd, "chunks", 0755) == -1 && errno != EEXIST) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    vs_dirfd = fd;
+
+    // Writer-preferring: save liên tục không được bỏ đói GC
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&vs_gc_rw, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    int res = pack_init(fd);
+    if (res != 0) fprintf(stderr, "[WARN] Backup packs unavailable: %s\n", strerror(-res));
+    return 0;
+}
+
+void vs_manifest_name(const char *path, char out[PATH_MAX]) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y%m%d_%H%M%S", &tm);
+
+    const char *fname = path;
+    if (fname[0] == '/') fname++;
+    if (fname[0] == '\0') fname = "root";
+
+    // Chừa chỗ cho "_<ts>_<n>.bak": tên backup không bao giờ bị cắt mất đuôi
+    char safe_fname[PATH_MAX - 64];
+    snprintf(safe_fname, sizeof(safe_fname), "%s", fname);
+    for(int i=0; safe_fname[i]; i++) {
+        if(safe_fname[i] == '/') safe_fname[i] = '_';
+    }
+
+    snprintf(out, PATH_MAX, "%s_%s_%03u.bak",
+             safe_fname, ts, __atomic_fetch_add(&vs_backup_counter, 1, __ATOMIC_RELAXED));
+}
+
+static ssize_t fd_reader(void *ctx, void *buf, size_t len, off_t offset) {
+    return read_full(*(int *)ctx, buf, len, offset);
+}
+
+int vs_save(const char *path, int fd, const char *manifest_name) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return -errno;
+    return vs_save_reader(path, fd_reader, &fd, st.st_size, manifest_name);
+}
+
+int vs_save_reader(const char *path, vs_read_fn reader, void *ctx, off_t file_size,
+                   const char *manifest_name) {
+    struct vs_entry *e = lookup_entry(path, 1);
+    if (!e) return -ENOMEM;
+
+    uint64_t size = file_size;
+    uint32_t cs = chunk_size_for(size);
+    uint32_t count = (uint32_t)((size + cs - 1) / cs);
+
+    pthread_rwlock_rdlock(&vs_gc_rw);
+    pthread_mutex_lock(&e->lock);
+
+    // Không dùng lại được digest cũ nếu chưa từng lưu, chunk size đổi,
+    // hoặc GC đã xóa chunk kể từ lần lưu trước
+    int full = !e->valid || e->chunk_size != cs || e->gc_epoch != vs_gc_epoch;
+    uint64_t old_size = full ? 0 : e->file_size;
+    uint32_t old_count = full ? 0 : e->chunk_count;
+    // Chunk chứa ranh giới kích thước cũ/mới luôn phải hash lại
+    uint64_t boundary = size < old_size ? size : old_size;
+    uint32_t first_resized = (size != old_size) ? (uint32_t)(boundary / cs) : count;
+
+    uint8_t (*digests)[SHA256_DIGEST_LEN] = realloc(e->digests, (count ? count : 1) * SHA256_DIGEST_LEN);
+    uint8_t *dirty = realloc(e->dirty, count ? count : 1);
+    if (!digests || !dirty) {
+        // realloc thất bại giữ nguyên con trỏ cũ
+        if (digests) e->digests = digests;
+        if (dirty) e->dirty = dirty;
+        reset_entry(e);
+        pthread_mutex_unlock(&e->lock);
+        pthread_rwlock_unlock(&vs_gc_rw);
+        release_entry(e);
+        return -ENOMEM;
+    }
+    e->digests = digests;
+    e->dirty = dirty;
+
+    char *buf = count ? malloc(cs) : NULL;
+    if (count && !buf) {
+        reset_entry(e);
+        pthread_mutex_unlock(&e->lock);
+        pthread_rwlock_unlock(&vs_gc_rw);
+        release_entry(e);
+        return -ENOMEM;
+    }
+
+    int res = 0;
+    int64_t created = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!full && i < old_count && i < first_resized && !dirty[i]) continue;
+
+        uint64_t off = (uint64_t)i * cs;
+        size_t want = (size - off) < cs ? (size_t)(size - off) : cs;
+        ssize_t n = reader(ctx, buf, want, off);
+        if (n < 0) { res = (int)n; break; }
+        // File bị cắt ngắn trong lúc đọc -> phần còn lại coi như rỗng
+        if ((size_t)n < want) memset(buf + n, 0, want - n);
+
+        sha256(buf, want, digests[i]);
+        res = store_chunk(digests[i], buf, want);
+        if (res != 0) break;
+    }
+    free(buf);
+
+    if (res == 0 && vs_gc_active) {
+        // GC đang chạy: mọi chunk manifest này trỏ tới (kể cả chunk không
+        // đổi, không được lưu lại) phải sống sót qua lần dọn
+        pthread_mutex_lock(&vs_pin_lock);
+        for (uint32_t i = 0; i < count && res == 0; i++) res = vs_set_add(&vs_pins, digests[i]);
+        pthread_mutex_unlock(&vs_pin_lock);
+    }
+
+    if (res == 0) {
+        struct vs_manifest_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, VS_MANIFEST_MAGIC, sizeof(VS_MANIFEST_MAGIC));
+        hdr.file_size = size;
+        hdr.chunk_size = cs;
+        hdr.chunk_count = count;
+        hdr.created = created = time(NULL);
+        hdr.path_len = strlen(path);
+
+        size_t body_len = hdr.path_len + (size_t)count * SHA256_DIGEST_LEN;
+        char *body = malloc(body_len ? body_len : 1);
+        if (!body) {
+            res = -ENOMEM;
+        } else {
+            memcpy(body, path, hdr.path_len);
+            if (count) memcpy(body + hdr.path_len, digests, (size_t)count * SHA256_DIGEST_LEN);
+
+            res = write_file_atomic(manifest_name, &hdr, sizeof(hdr), body, body_len);
+            free(body);
+        }
+    }
+
+    if (res == 0) {
+        // Catalog (/.versions) thấy version ngay khi manifest đã nằm trên đĩa
+        vc_add(path, manifest_name, created, size);
+        memset(dirty, 0, count ? count : 1);
+        e->valid = 1;
+        e->file_size = size;
+        e->chunk_size = cs;
+        e->chunk_count = count;
+        e->gc_epoch = vs_gc_epoch;
+    } else {
+        reset_entry(e);
+    }
+    pthread_mutex_unlock(&e->lock);
+    pthread_rwlock_unlock(&vs_gc_rw);
+    release_entry(e);
+    return res;
+}
+
+void vs_note_write(const char *path, off_t offset, size_t size) {
+    if (size == 0) return;
+    struct vs_entry *e = lookup_entry(path, 0);
+    if (!e) return;
+
+    pthread_mutex_lock(&e->lock);
+    if (e->valid) {
+        uint64_t first = (uint64_t)offset / e->chunk_size;
+        uint64_t last = ((uint64_t)offset + size - 1) / e->chunk_size;
+        // Chunk vượt quá kích thước cũ được vs_save xử lý qua file_size
+        for (uint64_t i = first; i <= last && i < e->chunk_count; i++) e->dirty[i] = 1;
+    }
+    pthread_mutex_unlock(&e->lock);
+    release_entry(e);
+}
+
+void vs_forget(const char *path) {
+    struct vs_entry *e = lookup_entry(path, 0);
+    if (!e) return;
+
+    pthread_mutex_lock(&e->lock);
+    reset_entry(e);
+    pthread_mutex_unlock(&e->lock);
+    release_entry(e);
+}
+
+// ---- manifest ----
+
+int vs_manifest_parse(const void *buf, size_t len, struct vs_manifest *m) {
+    memset(m, 0, sizeof(*m));
+    if (len < sizeof(m->hdr)) return -EINVAL;
+    memcpy(&m->hdr, buf, sizeof(m->hdr));
+    if (memcmp(m->hdr.magic, VS_MANIFEST_MAGIC, sizeof(VS_MANIFEST_MAGIC)) != 0) return -EINVAL;
+
+    size_t digests_len = (size_t)m->hdr.chunk_count * SHA256_DIGEST_LEN;
+    if (len - sizeof(m->hdr) < (size_t)m->hdr.path_len ||
+        len - sizeof(m->hdr) - m->hdr.path_len < digests_len) {
+        return -EINVAL;
+    }
+    const char *p = (const char *)buf + sizeof(m->hdr);
+    m->path = malloc((size_t)m->hdr.path_len + 1);
+    m->digests = malloc(digests_len ? digests_len : 1);
+    if (!m->path || !m->digests) {
+        vs_manifest_free(m);
+        return -ENOMEM;
+    }
+    memcpy(m->path, p, m->hdr.path_len);
+    m->path[m->hdr.path_len] = '\0';
+    memcpy(m->digests, p + m->hdr.path_len, digests_len);
+    return 0;
+}
+
+void vs_manifest_free(struct vs_manifest *m) {
+    free(m->path);
+    free(m->digests);
+    m->path = NULL;
+    m->digests = NULL;
+}
+
+static int load_loose_manifest(const char *manifest_name, struct vs_manifest *m) {
+    int fd = openat(vs_dirfd, manifest_name, O_RDONLY);
+    if (fd == -1) return -errno;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf) {
+        close(fd);
+        return -ENOMEM;
+    }
+    ssize_t n = read_full(fd, buf, st.st_size, 0);
+    close(fd);
+    int res = n < 0 ? (int)n : vs_manifest_parse(buf, n, m);
+    free(buf);
+    return res;
+}
+
+int vs_manifest_load(const char *manifest_name, struct vs_manifest *m) {
+    int res = load_loose_manifest(manifest_name, m);
+    if (res != -ENOENT) return res;
+
+    uint8_t key[SHA256_DIGEST_LEN];
+    void *buf;
+    sha256(manifest_name, strlen(manifest_name), key);
+    ssize_t n = pack_read(key, PACK_MANIFEST, &buf);
+    if (n < 0) return (int)n;
+    res = vs_manifest_parse(buf, n, m);
+    free(buf);
+    return res;
+}
+
+int vs_list(vs_list_fn fn, void *ctx) {
+    struct vs_manifest m;
+    int stop = 0;
+
+    DIR *d = fdopendir(dup(vs_dirfd));
+    if (!d) return -errno;
+    rewinddir(d);           // fd dup dùng chung vị trí đọc với vs_dirfd
+    struct dirent *de;
+    while (!stop && (de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len < 5 || strcmp(de->d_name + len - 4, ".bak") != 0) continue;
+        // Manifest có thể vừa được đóng gói và xóa
+        if (load_loose_manifest(de->d_name, &m) != 0) continue;
+        stop = fn(ctx, de->d_name, &m, 0);
+        vs_manifest_free(&m);
+    }
+    closedir(d);
+
+    struct pack_info *packs;
+    size_t npacks;
+    if (stop || pack_snapshot(&packs, &npacks) != 0) return 0;
+    // Một manifest có thể vừa rời vừa trong pack, hoặc trong hai pack
+    // (compaction chưa xóa pack cũ): chỉ báo một lần
+    struct vs_digest_set seen = {0};
+    for (size_t i = 0; i < npacks && !stop; i++) {
+        for (uint32_t j = 0; j < packs[i].count && !stop; j++) {
+            const struct pack_entry *e = &packs[i].entries[j];
+            char name[PATH_MAX];
+            struct stat st;
+            void *buf;
+            if (e->type != PACK_MANIFEST || vs_set_has(&seen, e->key)) continue;
+            if (pack_read_name(packs[i].id, e, name, sizeof(name)) != 0) continue;
+            if (fstatat(vs_dirfd, name, &st, 0) == 0) continue;
+            ssize_t n = pack_read_entry(packs[i].id, e, &buf);
+            if (n < 0) continue;
+            int res = vs_manifest_parse(buf, n, &m);
+            free(buf);
+            if (res != 0) continue;
+            vs_set_add(&seen, e->key);
+            stop = fn(ctx, name, &m, 1);
+            vs_manifest_free(&m);
+        }
+    }
+    vs_set_free(&seen);
+    pack_snapshot_free(packs, npacks);
+    return 0;
+}
+
+int vs_restore(const char *manifest_name, int out_fd) {
+    struct vs_manifest m;
+    int res = vs_manifest_load(manifest_name, &m);
+    if (res != 0) return res == -ENOENT ? res : -EINVAL;
+
+    uint64_t remaining = m.hdr.file_size;
+    for (uint32_t i = 0; i < m.hdr.chunk_count && res == 0; i++) {
+        size_t want = remaining < m.hdr.chunk_size ? (size_t)remaining : m.hdr.chunk_size;
+        char cpath[PATH_MAX];
+        chunk_path(cpath, m.digests[i]);
+        int cfd = openat(vs_dirfd, cpath, O_RDONLY);
+        if (cfd != -1) {
+            struct stat st;
+            if (fstat(cfd, &st) == -1 || st.st_size < (off_t)want) {
+                res = -EIO;
+            } else {
+                // Chunk -> output trong kernel (out_fd có thể là stdout)
+                res = copy_range(cfd, 0, out_fd, -1, want);
+            }
+            close(cfd);
+        } else if (errno == ENOENT) {
+            // Chunk đã được đóng gói (có thể nén)
+            void *data;
+            ssize_t n = pack_read(m.digests[i], PACK_CHUNK, &data);
+            if (n < 0) {
+                res = (int)n;
+            } else {
+                res = (size_t)n < want ? -EIO : write_all(out_fd, data, want);
+                free(data);
+            }
+        } else {
+            res = -errno;
+        }
+        remaining -= want;
+    }
+
+    vs_manifest_free(&m);
+    return res;
+}
+
+// ---- đọc version tại chỗ ----
+
+struct vs_reader {
+    struct vs_manifest m;
+    pthread_mutex_t lock;
+    int64_t cached;             // chunk đang nằm trong data (-1: không có)
+    void *data;
+    size_t len;
+};
+
+int vs_reader_open(const char *manifest_name, struct vs_reader **out) {
+    struct vs_reader *r = calloc(1, sizeof(*r));
+    if (!r) return -ENOMEM;
+    int res = vs_manifest_load(manifest_name, &r->m);
+    if (res != 0) {
+        free(r);
+        return res;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->cached = -1;
+    *out = r;
+    return 0;
+}
+
+uint64_t vs_reader_size(const struct vs_reader *r) {
+    return r->m.hdr.file_size;
+}
+
+// Đọc [off, off+len) của chunk i vào buf
+static ssize_t reader_chunk(struct vs_reader *r, uint32_t i, char *buf, size_t len, size_t off) {
+    ssize_t n;
+    pthread_mutex_lock(&r->lock);
+    if (r->cached != i) {
+        char cpath[PATH_MAX];
+        chunk_path(cpath, r->m.digests[i]);
+        int cfd = openat(vs_dirfd, cpath, O_RDONLY);
+        if (cfd != -1) {
+            pthread_mutex_unlock(&r->lock);
+            n = read_full(cfd, buf, len, off);
+            close(cfd);
+            return n < 0 ? n : ((size_t)n < len ? -EIO : n);
+        }
+        if (errno != ENOENT) {
+            pthread_mutex_unlock(&r->lock);
+            return -errno;
+        }
+        // Chunk đã được đóng gói: giải nén một lần, đọc tuần tự dùng lại
+        void *data;
+        n = pack_read(r->m.digests[i], PACK_CHUNK, &data);
+        if (n < 0) {
+            pthread_mutex_unlock(&r->lock);
+            return n;
+        }
+        free(r->data);
+        r->data = data;
+        r->len = n;
+        r->cached = i;
+    }
+    if (off + len > r->len) {
+        n = -EIO;
+    } else {
+        memcpy(buf, (char *)r->data + off, len);
+        n = len;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+ssize_t vs_reader_read(struct vs_reader *r, void *buf, size_t size, off_t offset) {
+    uint64_t file_size = r->m.hdr.file_size;
+    if (offset < 0) return -EINVAL;
+    if ((uint64_t)offset >= file_size) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    size_t done = 0;
+    uint32_t cs = r->m.hdr.chunk_size;
+    while (done < size) {
+        uint64_t pos = (uint64_t)offset + done;
+        uint32_t i = (uint32_t)(pos / cs);
+        size_t in = pos % cs;
+        size_t want = cs - in < size - done ? cs - in : size - done;
+        if (i >= r->m.hdr.chunk_count) return -EIO;
+        ssize_t n = reader_chunk(r, i, (char *)buf + done, want, in);
+        if (n < 0) return done ? (ssize_t)done : n;
+        done += n;
+    }
+    return done;
+}
+
+void vs_reader_close(struct vs_reader *r) {
+    if (!r) return;
+    pthread_mutex_destroy(&r->lock);
+    vs_manifest_free(&r->m);
+    free(r->data);
+    free(r);
+}
+
+// ---- tập digest ----
+
+static size_t set_slot(const struct vs_digest_set *s, const uint8_t digest[SHA256_DIGEST_LEN]) {
+    // Digest đã là ngẫu nhiên đều: 8 byte đầu làm hash
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    size_t i = (size_t)(h & (s->cap - 1));
+    while (s->used[i] && memcmp(s->slots[i], digest, SHA256_DIGEST_LEN) != 0) i = (i + 1) & (s->cap - 1);
+    return i;
+}
+
+static int set_grow(struct vs_digest_set *s) {
+    size_t cap = s->cap ? s->cap * 2 : 1024;
+    struct vs_digest_set n = { malloc(cap * SHA256_DIGEST_LEN), calloc(cap, 1), cap, 0 };
+    if (!n.slots || !n.used) {
+        vs_set_free(&n);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < s->cap; i++) {
+        if (!s->used[i]) continue;
+        size_t j = set_slot(&n, s->slots[i]);
+        memcpy(n.slots[j], s->slots[i], SHA256_DIGEST_LEN);
+        n.used[j] = 1;
+        n.count++;
+    }
+    vs_set_free(s);
+    *s = n;
+    return 0;
+}
+
+int vs_set_add(struct vs_digest_set *s, const uint8_t digest[SHA256_DIGEST_LEN]) {
+    if ((s->count + 1) * 4 > s->cap * 3 && set_grow(s) != 0) return -ENOMEM;
+    size_t i = set_slot(s, digest);
+    if (!s->used[i]) {
+        memcpy(s->slots[i], digest, SHA256_DIGEST_LEN);
+        s->used[i] = 1;
+        s->count++;
+    }
+    return 0;
+}
+
+int vs_set_has(const struct vs_digest_set *s, const uint8_t digest[SHA256_DIGEST_LEN]) {
+    return s->cap && s->used[set_slot(s, digest)];
+}
+
+void vs_set_free(struct vs_digest_set *s) {
+    free(s->slots);
+    free(s->used);
+    memset(s, 0, sizeof(*s));
+}
+
+// ---- hook cho backup_maint.c ----
+
+int vs_backup_fd(void) {
+    return vs_dirfd;
+}
+
+void vs_gc_begin(void) {
+    // Chờ các save đang chạy xong: manifest của chúng đã nằm trên đĩa khi
+    // GC liệt kê, còn save bắt đầu sau đây đều pin digest
+    pthread_rwlock_wrlock(&vs_gc_rw);
+    vs_gc_active = 1;
+    vs_set_free(&vs_pins);
+    pthread_rwlock_unlock(&vs_gc_rw);
+}
+
+void vs_gc_end(void) {
+    pthread_rwlock_wrlock(&vs_gc_rw);
+    vs_gc_active = 0;
+    vs_set_free(&vs_pins);
+    pthread_rwlock_unlock(&vs_gc_rw);
+}
+
+int vs_gc_pinned(const uint8_t digest[SHA256_DIGEST_LEN]) {
+    pthread_mutex_lock(&vs_pin_lock);
+    int res = vs_set_has(&vs_pins, digest);
+    pthread_mutex_unlock(&vs_pin_lock);
+    return res;
+}
+
+void vs_gc_lock(void) {
+    pthread_rwlock_wrlock(&vs_gc_rw);
+    // Digest các entry nhớ có thể trỏ tới chunk sắp bị xóa -> lần save sau hash lại đủ
+    vs_gc_epoch++;
+}
+
+void vs_gc_unlock(void) {
+    pthread_rwlock_unlock(&vs_gc_rw);
+}
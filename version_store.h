@@ -0,0 +1,111 @@
+#ifndef VERSION_STORE_H
+#define VERSION_STORE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include "sha256.h"
+
+#define BACKUP_DIR ".backup"
+
+// Chunk size grows with the file so a manifest never lists more than
+// VS_MAX_CHUNKS digests (until VS_MAX_CHUNK_SIZE is reached).
+#define VS_MIN_CHUNK_SIZE (64 * 1024)
+#define VS_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+#define VS_MAX_CHUNKS 1024
+
+#define VS_MANIFEST_MAGIC "VFSMAN1"
+
+// On-disk manifest header; followed by path_len bytes of the original
+// virtual path and chunk_count SHA-256 digests.
+struct vs_manifest_header {
+    char magic[8];
+    uint64_t file_size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    int64_t created;
+    uint32_t path_len;
+    uint32_t reserved;
+};
+
+int vs_init(const char *backup_dir);
+
+// Manifest name for a new version of path: <path_with_underscores>_<YYYYmmdd_HHMMSS>_<n>.bak
+void vs_manifest_name(const char *path, char out[PATH_MAX]);
+
+// Save the current content of fd (opened readable) as a new version of path,
+// described by the manifest manifest_name (relative to the backup dir).
+// Only chunks marked dirty since the previous save of path are re-read.
+int vs_save(const char *path, int fd, const char *manifest_name);
+
+// Same, reading through a callback (files whose content is not one fd,
+// e.g. partially copied-up files). reader returns bytes read (short only
+// at EOF) or -errno.
+typedef ssize_t (*vs_read_fn)(void *ctx, void *buf, size_t len, off_t offset);
+int vs_save_reader(const char *path, vs_read_fn reader, void *ctx, off_t file_size,
+                   const char *manifest_name);
+
+// Record that [offset, offset+size) of path changed after the last save
+void vs_note_write(const char *path, off_t offset, size_t size);
+
+// Drop cached chunk state for path (truncate/unlink/rename/O_TRUNC)
+void vs_forget(const char *path);
+
+// Rebuild a version from its manifest (relative to the backup dir) into out_fd.
+// Manifests and chunks moved into pack files by backup_maint.c are found
+// by the same name.
+int vs_restore(const char *manifest_name, int out_fd);
+
+// Parsed manifest
+struct vs_manifest {
+    struct vs_manifest_header hdr;
+    char *path;
+    uint8_t (*digests)[SHA256_DIGEST_LEN];
+};
+
+int vs_manifest_parse(const void *buf, size_t len, struct vs_manifest *m);
+// Load by name, loose file first, then the packs
+int vs_manifest_load(const char *manifest_name, struct vs_manifest *m);
+void vs_manifest_free(struct vs_manifest *m);
+
+// Random access to the content of one version, chunk by chunk, without
+// restoring it first: loose chunks are read in place, a packed chunk is
+// decoded once and kept until the reader moves to another chunk.
+struct vs_reader;
+int vs_reader_open(const char *manifest_name, struct vs_reader **out);
+uint64_t vs_reader_size(const struct vs_reader *r);
+// Bytes read (short only at the end of the version) or -errno
+ssize_t vs_reader_read(struct vs_reader *r, void *buf, size_t size, off_t offset);
+void vs_reader_close(struct vs_reader *r);
+
+// Visit every version (loose and packed) once; fn returns non-zero to stop
+typedef int (*vs_list_fn)(void *ctx, const char *manifest_name, const struct vs_manifest *m, int packed);
+int vs_list(vs_list_fn fn, void *ctx);
+
+// Set of SHA-256 digests (open addressing)
+struct vs_digest_set {
+    uint8_t (*slots)[SHA256_DIGEST_LEN];
+    uint8_t *used;
+    size_t cap;
+    size_t count;
+};
+
+int vs_set_add(struct vs_digest_set *s, const uint8_t digest[SHA256_DIGEST_LEN]);
+int vs_set_has(const struct vs_digest_set *s, const uint8_t digest[SHA256_DIGEST_LEN]);
+void vs_set_free(struct vs_digest_set *s);
+
+// --- Maintenance hooks (backup_maint.c) ---
+// Loose chunks live in <backup>/chunks/xx/<hex digest>, loose manifests
+// directly in <backup>.
+int vs_backup_fd(void);
+// From begin to end, every save records ("pins") the digests its manifest
+// references; begin waits for saves already in progress.
+void vs_gc_begin(void);
+void vs_gc_end(void);
+int vs_gc_pinned(const uint8_t digest[SHA256_DIGEST_LEN]);
+// Exclude saves while deleting chunks; cached digests are re-verified after
+void vs_gc_lock(void);
+void vs_gc_unlock(void);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * vfs_restore.c
+ * Rebuild a backed-up version from its manifest in the backup store.
+ * Usage: ./vfs_restore <manifest.bak> [output_file]
+ *        ./vfs_restore --list [backup_dir]
+ * Without output_file the content is written to stdout. Versions moved
+ * into pack files by the maintenance thread no longer appear as .bak
+ * files; --list shows them all and they restore by the same name.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
+#include "version_store.h"
+
+static int print_version(void *ctx, const char *name, const struct vs_manifest *m, int packed) {
+    (void)ctx;
+    char ts[32];
+    time_t t = (time_t)m->hdr.created;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s  %s  %10llu  %s%s\n", name, ts, (unsigned long long)m->hdr.file_size, m->path,
+           packed ? "  (packed)" : "");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        printf("Usage: %s <manifest.bak> [output_file]\n", argv[0]);
+        printf("       %s --list [backup_dir]\n", argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+
+    if (strcmp(argv[1], "--list") == 0) {
+        const char *dir = argc > 2 ? argv[2] : BACKUP_DIR;
+        if (vs_init(dir) != 0) {
+            fprintf(stderr, "Cannot open backup store %s\n", dir);
+            return 2;
+        }
+        return vs_list(print_version, NULL) == 0 ? 0 : 1;
+    }
+
+    // Chunk store nằm cạnh manifest (.backup/chunks)
+    char dir[PATH_MAX];
+    char name[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", argv[1]);
+    snprintf(name, sizeof(name), "%s", argv[1]);
+    if (vs_init(dirname(dir)) != 0) {
+        fprintf(stderr, "Cannot open backup store for %s\n", argv[1]);
+        return 2;
+    }
+
+    int out = STDOUT_FILENO;
+    if (argc > 2) {
+        out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1) {
+            perror("Failed to open output file");
+            return 2;
+        }
+    }
+
+    int res = vs_restore(basename(name), out);
+    if (out != STDOUT_FILENO) close(out);
+    if (res != 0) {
+        fprintf(stderr, "Failed to restore %s: %s\n", argv[1], strerror(-res));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,668 @@
+/*
+ * whiteout.c
+ * Whiteout and opaque-directory metadata of Storage, see whiteout.h.
+ *
+ * A sidecar is a small header followed by {op, name} records (for a
+ * redirect the "name" is the lower path); a torn
+ * record at the end (crash during an append) is cut off when the sidecar
+ * is loaded. Removed whiteouts stay in the log until they outnumber the
+ * live ones, then the sidecar is rewritten through a temp file + rename.
+ *
+ * In memory, directories are hashed into shards with their own rwlock
+ * (like path_cache.c), so lookups from many FUSE threads rarely contend.
+ * Changes are rare (unlink, rename, mkdir) and go through one mutex, so
+ * two writers never append to the same sidecar out of order.
+ *
+ * Each shard keeps at most WO_MAX_PER_SHARD directories and evicts one
+ * chain head round-robin once full, like path_cache.c. The sidecar is
+ * authoritative, so an evicted directory is just read again. A shard
+ * generation, bumped by every change, keeps a sidecar read that raced
+ * with an append from being inserted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "whiteout.h"
+
+extern int g_storage_fd;            // fd thư mục .vfs_storage, mở 1 lần bên main.c
+
+#define WO_SHARDS 64
+#define WO_BUCKETS 256              // per shard
+#define WO_MAX_PER_SHARD 1024
+#define WO_MAGIC "VWH1"
+#define WO_TMP WO_FILE ".tmp"
+#define WO_COMPACT_MIN 64           // số record chết tối thiểu trước khi viết lại sidecar
+
+enum { WO_ADD = 1, WO_DEL = 2, WO_OPAQUE = 3, WO_REDIRECT = 4 };
+#define WO_RECORD_MAX PATH_MAX
+
+struct wo_header {
+    char magic[4];
+    uint32_t reserved;
+};
+
+struct wo_record {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t name_len;              // tên theo sau record
+};
+
+struct wo_name {
+    struct wo_name *next;
+    uint32_t hash;
+    char name[];
+};
+
+struct wo_dir {
+    struct wo_dir *next;            // chuỗi hash của shard
+    uint32_t hash;
+    int absent;                     // không có thư mục Storage: cả cây con không có metadata
+    int opaque;
+    char *redirect;                 // != NULL: path thư mục ở lower layer được gộp vào
+    struct wo_name **names;         // whiteout, nbuckets là lũy thừa của 2
+    uint32_t nbuckets, count;
+    uint32_t dead;                  // record thừa trong sidecar
+    char path[];
+};
+
+struct wo_shard {
+    pthread_rwlock_t lock;
+    struct wo_dir *buckets[WO_BUCKETS];
+    unsigned int count;
+    unsigned int evict_cursor;
+    uint64_t gen;                   // tăng mỗi lần bảng/sidecar trong shard đổi
+};
+
+static struct wo_shard shards[WO_SHARDS];
+static pthread_mutex_t wo_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_mem(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct wo_shard *shard_of(uint32_t h) {
+    return &shards[h % WO_SHARDS];
+}
+
+static struct wo_dir **bucket_of(struct wo_shard *s, uint32_t h) {
+    return &s->buckets[(h / WO_SHARDS) % WO_BUCKETS];
+}
+
+void wo_init(void) {
+    for (int i = 0; i < WO_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+}
+
+// "/a/b" -> "/a" + "b", "/b" -> "/" + "b"
+static int split_path(const char *path, char dir[PATH_MAX], const char **name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0' || strlen(path) >= PATH_MAX) return -EINVAL;
+    if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    *name = slash + 1;
+    return 0;
+}
+
+// Sidecar của dir, tương đối với Storage
+static void sidecar_path(const char *dir, const char *file, char out[PATH_MAX]) {
+    if (strcmp(dir, "/") == 0) snprintf(out, PATH_MAX, "%s", file);
+    else snprintf(out, PATH_MAX, "%s/%s", dir + 1, file);
+}
+
+// --- Tập tên của một thư mục ---
+
+static struct wo_name *find_name(const struct wo_dir *d, const char *name, size_t len) {
+    if (d->count == 0) return NULL;
+    uint32_t h = hash_mem(name, len);
+    for (struct wo_name *n = d->names[h & (d->nbuckets - 1)]; n; n = n->next) {
+        if (n->hash == h && strncmp(n->name, name, len) == 0 && n->name[len] == '\0') return n;
+    }
+    return NULL;
+}
+
+// 1: đã thêm, 0: đã có, <0: lỗi
+static int add_name(struct wo_dir *d, const char *name, size_t len) {
+    if (find_name(d, name, len)) return 0;
+    if (d->count >= d->nbuckets) {
+        uint32_t nb = d->nbuckets ? d->nbuckets * 2 : 8;
+        struct wo_name **b = calloc(nb, sizeof(*b));
+        if (!b) return -ENOMEM;
+        for (uint32_t i = 0; i < d->nbuckets; i++) {
+            while (d->names[i]) {
+                struct wo_name *n = d->names[i];
+                d->names[i] = n->next;
+                n->next = b[n->hash & (nb - 1)];
+                b[n->hash & (nb - 1)] = n;
+            }
+        }
+        free(d->names);
+        d->names = b;
+        d->nbuckets = nb;
+    }
+    struct wo_name *n = malloc(sizeof(*n) + len + 1);
+    if (!n) return -ENOMEM;
+    n->hash = hash_mem(name, len);
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->next = d->names[n->hash & (d->nbuckets - 1)];
+    d->names[n->hash & (d->nbuckets - 1)] = n;
+    d->count++;
+    return 1;
+}
+
+static int del_name(struct wo_dir *d, const char *name, size_t len) {
+    struct wo_name *n = find_name(d, name, len);
+    if (!n) return 0;
+    struct wo_name **pp = &d->names[n->hash & (d->nbuckets - 1)];
+    while (*pp != n) pp = &(*pp)->next;
+    *pp = n->next;
+    free(n);
+    d->count--;
+    return 1;
+}
+
+static int apply(struct wo_dir *d, int op, const char *name, size_t len) {
+    switch (op) {
+    case WO_ADD:
+        return add_name(d, name, len) < 0 ? -ENOMEM : 0;
+    case WO_DEL:
+        if (del_name(d, name, len)) d->dead += 2;  // ADD và DEL đều thừa
+        return 0;
+    case WO_OPAQUE:
+        d->opaque = 1;
+        return 0;
+    case WO_REDIRECT: {
+        if (len == 0) return 0;
+        char *target = strndup(name, len);
+        if (!target) return -ENOMEM;
+        if (d->redirect) d->dead++;
+        free(d->redirect);
+        d->redirect = target;
+        return 0;
+    }
+    }
+    return 0;
+}
+
+static void free_dir(struct wo_dir *d) {
+    if (!d) return;
+    for (uint32_t i = 0; i < d->nbuckets; i++) {
+        while (d->names[i]) {
+            struct wo_name *n = d->names[i];
+            d->names[i] = n->next;
+            free(n);
+        }
+    }
+    free(d->names);
+    free(d->redirect);
+    free(d);
+}
+
+// --- Sidecar ---
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Đọc sidecar của dir (không giữ lock nào); NULL khi hết bộ nhớ
+static struct wo_dir *load_dir(const char *dir, uint32_t h) {
+    size_t plen = strlen(dir);
+    struct wo_dir *d = calloc(1, sizeof(*d) + plen + 1);
+    if (!d) return NULL;
+    d->hash = h;
+    memcpy(d->path, dir, plen + 1);
+
+    char side[PATH_MAX];
+    sidecar_path(dir, WO_FILE, side);
+    int fd = openat(g_storage_fd, side, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        // Không có sidecar; không có cả thư mục thì cây con cũng không có
+        struct stat st;
+        const char *rel = strcmp(dir, "/") == 0 ? "." : dir + 1;
+        if (errno == ENOENT || errno == ENOTDIR)
+            d->absent = fstatat(g_storage_fd, rel, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode);
+        return d;
+    }
+
+    struct stat st;
+    char *buf = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = (size_t)st.st_size;
+        buf = malloc(size);
+        if (!buf || pread(fd, buf, size, 0) != (ssize_t)size) {
+            free(buf);
+            close(fd);
+            free_dir(d);
+            return NULL;
+        }
+    }
+
+    size_t off = 0, valid = 0, records = 0;
+    struct wo_header hdr;
+    if (size >= sizeof(hdr)) {
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (memcmp(hdr.magic, WO_MAGIC, 4) == 0) off = valid = sizeof(hdr);
+    }
+    if (valid == 0 && size > 0) fprintf(stderr, "[WARN] %s is damaged, its whiteouts are lost\n", side);
+    while (valid > 0 && off + sizeof(struct wo_record) <= size) {
+        struct wo_record r;
+        memcpy(&r, buf + off, sizeof(r));
+        // record cuối bị cắt giữa chừng thì bỏ
+        if (off + sizeof(r) + r.name_len > size) break;
+        if (apply(d, r.op, buf + off + sizeof(r), r.name_len) != 0) {
+            free(buf);
+            close(fd);
+            free_dir(d);
+            return NULL;
+        }
+        off += sizeof(r) + r.name_len;
+        valid = off;
+        records++;
+    }
+    free(buf);
+
+    if (valid < size && ftruncate(fd, valid) == -1) {
+        fprintf(stderr, "[WARN] Cannot repair %s: %s\n", side, strerror(errno));
+    }
+    close(fd);
+    d->dead = records - d->count - d->opaque - (d->redirect != NULL);
+    return d;
+}
+
+static int append_record(const char *dir, int op, const char *name, size_t len) {
+    if (len > (op == WO_REDIRECT ? WO_RECORD_MAX : NAME_MAX)) return -ENAMETOOLONG;
+    char side[PATH_MAX];
+    sidecar_path(dir, WO_FILE, side);
+    int fd = openat(g_storage_fd, side, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return -errno;
+
+    // Một record = một write(): sidecar không bao giờ có nửa record ở giữa
+    char buf[sizeof(struct wo_header) + sizeof(struct wo_record) + WO_RECORD_MAX];
+    size_t n = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        struct wo_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, WO_MAGIC, 4);
+        memcpy(buf, &hdr, sizeof(hdr));
+        n = sizeof(hdr);
+    }
+    struct wo_record r;
+    memset(&r, 0, sizeof(r));
+    r.op = op;
+    r.name_len = (uint16_t)len;
+    memcpy(buf + n, &r, sizeof(r));
+    memcpy(buf + n + sizeof(r), name, len);
+    n += sizeof(r) + len;
+
+    int res = write_all(fd, buf, n);
+    close(fd);
+    return res;
+}
+
+// --- Bảng thư mục ---
+
+static struct wo_dir *find_dir(struct wo_shard *s, const char *dir, uint32_t h) {
+    for (struct wo_dir *d = *bucket_of(s, h); d; d = d->next) {
+        if (d->hash == h && strcmp(d->path, dir) == 0) return d;
+    }
+    return NULL;
+}
+
+// Caller holds the shard write lock
+static void evict_one(struct wo_shard *s) {
+    for (unsigned int n = 0; n < WO_BUCKETS; n++) {
+        struct wo_dir **b = &s->buckets[s->evict_cursor++ % WO_BUCKETS];
+        if (*b) {
+            struct wo_dir *victim = *b;
+            *b = victim->next;
+            free_dir(victim);
+            s->count--;
+            return;
+        }
+    }
+}
+
+// Entry của dir, nạp sidecar khi chưa có. Trả về khi đang giữ lock của
+// shard *sp (read hoặc write), caller unlock; NULL khi hết bộ nhớ.
+static struct wo_dir *get_dir(const char *dir, struct wo_shard **sp) {
+    uint32_t h = hash_mem(dir, strlen(dir));
+    struct wo_shard *s = shard_of(h);
+    *sp = s;
+
+    for (;;) {
+        pthread_rwlock_rdlock(&s->lock);
+        struct wo_dir *d = find_dir(s, dir, h);
+        if (d) return d;
+        uint64_t gen = s->gen;
+        pthread_rwlock_unlock(&s->lock);
+
+        struct wo_dir *fresh = load_dir(dir, h);
+        pthread_rwlock_wrlock(&s->lock);
+        d = find_dir(s, dir, h);        // thread khác có thể đã nạp trước
+        if (d || !fresh) {
+            free_dir(fresh);
+            return d;
+        }
+        if (s->gen == gen) {
+            if (s->count >= WO_MAX_PER_SHARD) evict_one(s);
+            struct wo_dir **b = bucket_of(s, h);
+            fresh->next = *b;
+            *b = fresh;
+            s->count++;
+            return fresh;
+        }
+        // Có thay đổi trong lúc đọc sidecar: bản vừa đọc có thể đã cũ
+        pthread_rwlock_unlock(&s->lock);
+        free_dir(fresh);
+    }
+}
+
+int wo_hidden(const char *path) {
+    char dir[PATH_MAX] = "/";
+    size_t dlen = 1;
+    if (path[0] != '/') return 0;
+
+    const char *p = path + 1;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        if (!end) end = p + strlen(p);
+        size_t len = end - p;
+
+        struct wo_shard *s;
+        struct wo_dir *d = get_dir(dir, &s);
+        int absent = !d || d->absent;
+        // Thư mục redirect gộp với path khác: cờ opaque chỉ che path của chính nó
+        int hidden = !absent && ((d->opaque && !d->redirect) || find_name(d, p, len));
+        pthread_rwlock_unlock(&s->lock);
+        if (hidden) return 1;
+        if (absent || *end == '\0') return 0;
+
+        if (dlen + 1 + len >= PATH_MAX) return 0;
+        if (dlen > 1) dir[dlen++] = '/';
+        memcpy(dir + dlen, p, len);
+        dlen += len;
+        dir[dlen] = '\0';
+        p = end + 1;
+    }
+    return 0;
+}
+
+int wo_is_whiteout(const char *dir, const char *name) {
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int res = d && find_name(d, name, strlen(name)) != NULL;
+    pthread_rwlock_unlock(&s->lock);
+    return res;
+}
+
+int wo_is_opaque(const char *dir) {
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int res = d && d->opaque;
+    pthread_rwlock_unlock(&s->lock);
+    return res;
+}
+
+// Viết lại sidecar chỉ với các entry còn sống. Caller giữ wo_write_lock.
+static void compact(const char *dir) {
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    if (!d || d->dead < WO_COMPACT_MIN || d->dead <= d->count) {
+        pthread_rwlock_unlock(&s->lock);
+        return;
+    }
+
+    size_t cap = sizeof(struct wo_header) + (size_t)(d->count + 1) * (sizeof(struct wo_record) + NAME_MAX) +
+                 sizeof(struct wo_record) + WO_RECORD_MAX;
+    char *buf = malloc(cap);
+    size_t n = 0;
+    if (buf) {
+        struct wo_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, WO_MAGIC, 4);
+        memcpy(buf, &hdr, sizeof(hdr));
+        n = sizeof(hdr);
+
+        struct wo_record r;
+        memset(&r, 0, sizeof(r));
+        if (d->opaque) {
+            r.op = WO_OPAQUE;
+            memcpy(buf + n, &r, sizeof(r));
+            n += sizeof(r);
+        }
+        if (d->redirect) {
+            size_t len = strlen(d->redirect);
+            r.op = WO_REDIRECT;
+            r.name_len = (uint16_t)len;
+            memcpy(buf + n, &r, sizeof(r));
+            memcpy(buf + n + sizeof(r), d->redirect, len);
+            n += sizeof(r) + len;
+        }
+        r.op = WO_ADD;
+        for (uint32_t i = 0; i < d->nbuckets; i++) {
+            for (struct wo_name *e = d->names[i]; e; e = e->next) {
+                r.name_len = (uint16_t)strlen(e->name);
+                memcpy(buf + n, &r, sizeof(r));
+                memcpy(buf + n + sizeof(r), e->name, r.name_len);
+                n += sizeof(r) + r.name_len;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+    if (!buf) return;
+
+    char tmp[PATH_MAX], side[PATH_MAX];
+    sidecar_path(dir, WO_TMP, tmp);
+    sidecar_path(dir, WO_FILE, side);
+    int fd = openat(g_storage_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int res = fd == -1 ? -errno : write_all(fd, buf, n);
+    if (fd != -1) close(fd);
+    free(buf);
+    if (res == 0 && renameat(g_storage_fd, tmp, g_storage_fd, side) == -1) res = -errno;
+    if (res != 0) {
+        unlinkat(g_storage_fd, tmp, 0);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&s->lock);
+    d = find_dir(s, dir, hash_mem(dir, strlen(dir)));
+    if (d) d->dead = 0;
+    pthread_rwlock_unlock(&s->lock);
+}
+
+// Ghi op vào sidecar rồi vào bộ nhớ. Caller giữ wo_write_lock.
+static int update(const char *dir, int op, const char *name, size_t len) {
+    int res = append_record(dir, op, name, len);
+    if (res != 0) return res;
+
+    // Thư mục và mọi thư mục cha giờ có trong Storage
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s", dir);
+    for (int self = 1;; self = 0) {
+        uint32_t h = hash_mem(prefix, strlen(prefix));
+        struct wo_shard *s = shard_of(h);
+        pthread_rwlock_wrlock(&s->lock);
+        s->gen++;
+        struct wo_dir *d = find_dir(s, prefix, h);
+        if (d) {
+            d->absent = 0;
+            if (self) res = apply(d, op, name, len);
+        }
+        pthread_rwlock_unlock(&s->lock);
+
+        char *slash = strrchr(prefix, '/');
+        if (!slash || strcmp(prefix, "/") == 0) break;
+        if (slash == prefix) slash[1] = '\0';
+        else *slash = '\0';
+    }
+    if (res == 0 && op == WO_DEL) compact(dir);
+    return res;
+}
+
+int wo_add(const char *path) {
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, &name) != 0) return -EINVAL;
+
+    pthread_mutex_lock(&wo_write_lock);
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int exists = d && !d->absent && find_name(d, name, strlen(name));
+    pthread_rwlock_unlock(&s->lock);
+    int res = exists ? 0 : update(dir, WO_ADD, name, strlen(name));
+    pthread_mutex_unlock(&wo_write_lock);
+    return res;
+}
+
+int wo_remove(const char *path) {
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, &name) != 0) return -EINVAL;
+
+    pthread_mutex_lock(&wo_write_lock);
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int exists = d && !d->absent && find_name(d, name, strlen(name));
+    pthread_rwlock_unlock(&s->lock);
+    int res = 0;
+    if (exists) {
+        res = update(dir, WO_DEL, name, strlen(name));
+        if (res == 0) res = 1;
+    }
+    pthread_mutex_unlock(&wo_write_lock);
+    return res;
+}
+
+int wo_set_opaque(const char *dir) {
+    pthread_mutex_lock(&wo_write_lock);
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int opaque = d && d->opaque;
+    pthread_rwlock_unlock(&s->lock);
+    int res = opaque ? 0 : update(dir, WO_OPAQUE, "", 0);
+    pthread_mutex_unlock(&wo_write_lock);
+    return res;
+}
+
+int wo_set_redirect(const char *dir, const char *lower) {
+    size_t len = strlen(lower);
+    if (len >= PATH_MAX) return -ENAMETOOLONG;
+
+    pthread_mutex_lock(&wo_write_lock);
+    int res = update(dir, WO_REDIRECT, lower, len);
+    pthread_mutex_unlock(&wo_write_lock);
+    return res;
+}
+
+int wo_redirect(const char *dir, char lower[PATH_MAX]) {
+    struct wo_shard *s;
+    struct wo_dir *d = get_dir(dir, &s);
+    int res = d && d->redirect != NULL;
+    if (res) snprintf(lower, PATH_MAX, "%s", d->redirect);
+    pthread_rwlock_unlock(&s->lock);
+    return res;
+}
+
+int wo_lower_path(const char *path, char lower[PATH_MAX]) {
+    char dir[PATH_MAX] = "/";
+    size_t dlen = 1, llen = 0;
+    int check = 1;                  // còn có thể có redirect (thư mục có trong Storage)
+    lower[0] = '\0';
+
+    const char *p = path[0] == '/' ? path + 1 : path;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        if (!end) end = p + strlen(p);
+        size_t len = end - p;
+
+        if (check) {
+            struct wo_shard *s;
+            struct wo_dir *d = get_dir(dir, &s);
+            check = d && !d->absent;
+            if (check && d->redirect) {
+                llen = strlen(d->redirect);
+                memcpy(lower, d->redirect, llen + 1);
+            }
+            pthread_rwlock_unlock(&s->lock);
+        }
+
+        if (llen + 1 + len >= PATH_MAX) return -ENAMETOOLONG;
+        if (llen > 0) lower[llen++] = '/';
+        memcpy(lower + llen, p, len);
+        llen += len;
+        lower[llen] = '\0';
+        if (*end == '\0') break;
+
+        if (check) {
+            if (dlen + 1 + len >= PATH_MAX) return -ENAMETOOLONG;
+            if (dlen > 1) dir[dlen++] = '/';
+            memcpy(dir + dlen, p, len);
+            dlen += len;
+            dir[dlen] = '\0';
+        }
+        p = end + 1;
+    }
+    if (llen == 0) strcpy(lower, ".");
+    return 0;
+}
+
+void wo_invalidate_tree(const char *path) {
+    size_t len = strlen(path);
+    int root = strcmp(path, "/") == 0;
+
+    for (int i = 0; i < WO_SHARDS; i++) {
+        struct wo_shard *s = &shards[i];
+        pthread_rwlock_wrlock(&s->lock);
+        s->gen++;
+        for (int b = 0; b < WO_BUCKETS; b++) {
+            struct wo_dir **pp = &s->buckets[b];
+            while (*pp) {
+                struct wo_dir *d = *pp;
+                size_t dl = strlen(d->path);
+                int below = root || (strncmp(d->path, path, len) == 0 &&
+                                     (d->path[len] == '\0' || d->path[len] == '/'));
+                // Thư mục cha từng "không có trong Storage" giờ có thể có
+                int absent_parent = d->absent && (strcmp(d->path, "/") == 0 ||
+                                    (strncmp(path, d->path, dl) == 0 && path[dl] == '/'));
+                if (below || absent_parent) {
+                    *pp = d->next;
+                    free_dir(d);
+                    s->count--;
+                } else {
+                    pp = &d->next;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef WHITEOUT_H
+#define WHITEOUT_H
+
+// Whiteouts and opaque directories of the Storage layer.
+//
+// Every Storage directory keeps its metadata in one sidecar, <dir>/.wh..dir:
+// an append-only log of the names deleted from the Source (whiteouts) and
+// whether the directory is opaque (replaces the Source directory of the
+// same name instead of merging with it) or redirected (merges with the
+// lower-layer directory at another path: a renamed directory). A sidecar
+// is read the first time its directory is looked at and then kept in
+// memory as a hash set, so lookups cost no syscalls; the number of cached
+// directories is bounded and an evicted one is simply read again. A
+// missing Storage directory is remembered too: nothing below it can have
+// metadata.
+//
+// Paths are FUSE paths ("/a/b", root "/"). Writers must have created the
+// Storage directory first (make_parent_dirs / ensure_storage_dir).
+
+#include <limits.h>
+
+#define WO_FILE ".wh..dir"
+#define WO_PREFIX ".wh."            // reserved names, never listed
+
+void wo_init(void);
+
+// 1 if the Source object at path is hidden: a component of path is whited
+// out, or lies in an opaque directory that is not redirected
+int wo_hidden(const char *path);
+// Single level: 1 if name is whited out in dir / dir is opaque
+int wo_is_whiteout(const char *dir, const char *name);
+int wo_is_opaque(const char *dir);
+
+// Hide the Source object at path; 0 or -errno
+int wo_add(const char *path);
+// Drop the whiteout of path (a Storage entry now covers it); 1 if there
+// was one, 0 if not, -errno
+int wo_remove(const char *path);
+int wo_set_opaque(const char *dir);
+
+// Merge dir with the directories at lower ("a/b", relative to every lower
+// layer) instead of those at its own path. Only the path is stored: the
+// layers that have it are found at lookup, like for any other directory,
+// so the redirect stays right when the --lower list changes between mounts
+int wo_set_redirect(const char *dir, const char *lower);
+// 1 and the target if dir is redirected, 0 if not
+int wo_redirect(const char *dir, char lower[PATH_MAX]);
+// Lower-layer path of path ("." for the root): its own path, except below
+// a redirected directory; path's own redirect is not applied. 0 or -errno
+int wo_lower_path(const char *path, char lower[PATH_MAX]);
+
+// Forget the cached state of path and everything below it (a Storage
+// directory was renamed, with its sidecars)
+void wo_invalidate_tree(const char *path);
+
+#endif
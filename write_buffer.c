@@ -0,0 +1,418 @@
+/*
+ * write_buffer.c
+ * Write-back coalescing buffer, see write_buffer.h.
+ *
+ * Each buffered file keeps a sorted list of non-overlapping, non-adjacent
+ * extents. A write that touches (overlaps or abuts) existing extents is
+ * merged into one; the common append pattern just grows the last extent
+ * with a doubling capacity. Memory is accounted by capacity against one
+ * global budget, so the total stays bounded however many files are open.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "write_buffer.h"
+
+#define WB_MIN_EXTENT 4096
+
+struct wb_extent {
+    struct wb_extent *next;
+    off_t off;
+    size_t len;
+    size_t cap;
+    char *data;
+};
+
+struct wb_file {
+    char *path;
+    int refs;
+    int fd;                     // fd riêng (không O_APPEND) trên file Storage
+    pthread_mutex_t lock;
+    struct wb_extent *extents;  // sắp theo off
+    int nextents;
+    uint64_t dirty_since;       // CLOCK_MONOTONIC ms, 0 = sạch
+    int error;                  // lỗi của lần flush nền, trả ở flush kế tiếp
+    pid_t pid;                  // người ghi gần nhất, cho bản ghi log lúc flush
+    uid_t uid;
+    struct wb_file *next;
+};
+
+static size_t wb_budget = 0;
+static size_t wb_used = 0;      // atomic, tổng cap của mọi extent
+
+// Ít file mở để ghi cùng lúc -> danh sách liên kết như lazy_copy.c
+static struct wb_file *open_files = NULL;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t timer_thread;
+static int timer_running = 0;
+static int timer_stop = 0;
+static int timer_kicked = 0;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static void (*timer_flush)(const char *path);
+
+void wb_set_budget(size_t bytes) {
+    wb_budget = bytes;
+}
+
+int wb_enabled(void) {
+    return wb_budget > 0;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Reserve delta bytes of the budget (negative releases); 0 or -ENOSPC
+static int reserve(ssize_t delta) {
+    if (delta <= 0) {
+        __atomic_sub_fetch(&wb_used, (size_t)-delta, __ATOMIC_RELAXED);
+        return 0;
+    }
+    size_t now = __atomic_add_fetch(&wb_used, (size_t)delta, __ATOMIC_RELAXED);
+    if (now > wb_budget) {
+        __atomic_sub_fetch(&wb_used, (size_t)delta, __ATOMIC_RELAXED);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static void free_extent(struct wb_extent *e) {
+    reserve(-(ssize_t)e->cap);
+    free(e->data);
+    free(e);
+}
+
+// Caller holds open_lock
+static struct wb_file *find_locked(const char *path) {
+    for (struct wb_file *f = open_files; f; f = f->next) {
+        if (strcmp(f->path, path) == 0) return f;
+    }
+    return NULL;
+}
+
+struct wb_file *wb_open(const char *path, int fd) {
+    pthread_mutex_lock(&open_lock);
+    struct wb_file *f = find_locked(path);
+    if (f) {
+        f->refs++;
+        pthread_mutex_unlock(&open_lock);
+        return f;
+    }
+
+    f = calloc(1, sizeof(*f));
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    // Mở lại không kèm O_APPEND: pwrite trên fd O_APPEND bỏ qua offset
+    int own = f ? open(proc, O_WRONLY | O_CLOEXEC) : -1;
+    if (!f || own == -1 || !(f->path = strdup(path))) {
+        if (own != -1) close(own);
+        free(f);
+        pthread_mutex_unlock(&open_lock);
+        return NULL;
+    }
+    f->refs = 1;
+    f->fd = own;
+    pthread_mutex_init(&f->lock, NULL);
+    f->next = open_files;
+    open_files = f;
+    pthread_mutex_unlock(&open_lock);
+    return f;
+}
+
+struct wb_file *wb_find(const char *path) {
+    pthread_mutex_lock(&open_lock);
+    struct wb_file *f = find_locked(path);
+    if (f) f->refs++;
+    pthread_mutex_unlock(&open_lock);
+    return f;
+}
+
+void wb_release(struct wb_file *f) {
+    if (!f) return;
+    pthread_mutex_lock(&open_lock);
+    if (--f->refs > 0) {
+        pthread_mutex_unlock(&open_lock);
+        return;
+    }
+    for (struct wb_file **pp = &open_files; *pp; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&open_lock);
+
+    // operations.c flush trước release; phần còn lại (nếu có) bị bỏ
+    while (f->extents) {
+        struct wb_extent *e = f->extents;
+        f->extents = e->next;
+        free_extent(e);
+    }
+    close(f->fd);
+    pthread_mutex_destroy(&f->lock);
+    free(f->path);
+    free(f);
+}
+
+// Caller holds f->lock. Grow e in place so it covers [e->off, end).
+static int grow_extent(struct wb_extent *e, off_t end) {
+    size_t need = (size_t)(end - e->off);
+    if (need <= e->cap) return 0;
+
+    size_t cap = e->cap * 2 > need ? e->cap * 2 : need;
+    if (reserve((ssize_t)(cap - e->cap)) != 0) {
+        // Không đủ cho gấp đôi: thử vừa đủ
+        cap = need;
+        if (reserve((ssize_t)(cap - e->cap)) != 0) return -ENOSPC;
+    }
+    char *data = realloc(e->data, cap);
+    if (!data) {
+        reserve(-(ssize_t)(cap - e->cap));
+        return -ENOMEM;
+    }
+    e->data = data;
+    e->cap = cap;
+    return 0;
+}
+
+int wb_add(struct wb_file *f, const void *buf, size_t size, off_t offset, pid_t pid, uid_t uid) {
+    if (size == 0) return 0;
+    off_t end = offset + (off_t)size;
+    int res = 0;
+
+    pthread_mutex_lock(&f->lock);
+
+    // first: extent đầu tiên chạm [offset, end] (giao nhau hoặc nối tiếp)
+    struct wb_extent **pp = &f->extents;
+    while (*pp && (*pp)->off + (off_t)(*pp)->len < offset) pp = &(*pp)->next;
+    struct wb_extent *first = *pp;
+    struct wb_extent *last = NULL;
+    int touching = 0;
+    for (struct wb_extent *e = first; e && e->off <= end; e = e->next) {
+        last = e;
+        touching++;
+    }
+
+    if (touching == 1 && first->off <= offset) {
+        // Ghi nối đuôi / ghi đè trong một extent: trường hợp hay gặp nhất
+        res = grow_extent(first, end > first->off + (off_t)first->len ? end : first->off + (off_t)first->len);
+        if (res == 0) {
+            memcpy(first->data + (offset - first->off), buf, size);
+            if ((size_t)(end - first->off) > first->len) first->len = (size_t)(end - first->off);
+        }
+    } else {
+        // Gộp mọi extent chạm vào thành một extent mới
+        off_t start = offset, stop = end;
+        size_t old_cap = 0;
+        if (touching > 0) {
+            if (first->off < start) start = first->off;
+            if (last->off + (off_t)last->len > stop) stop = last->off + (off_t)last->len;
+        }
+        for (struct wb_extent *e = first; touching && e != last->next; e = e->next) old_cap += e->cap;
+
+        size_t len = (size_t)(stop - start);
+        size_t cap = len < WB_MIN_EXTENT ? WB_MIN_EXTENT : len;
+        struct wb_extent *n = NULL;
+        if (touching == 0 && f->nextents >= WB_MAX_EXTENTS) res = -ENOSPC;
+        if (res == 0) res = reserve((ssize_t)cap - (ssize_t)old_cap);
+        if (res == 0) {
+            n = malloc(sizeof(*n));
+            char *data = n ? malloc(cap) : NULL;
+            if (!data) {
+                free(n);
+                reserve((ssize_t)old_cap - (ssize_t)cap);
+                res = -ENOMEM;
+            } else {
+                n->off = start;
+                n->len = len;
+                n->cap = cap;
+                n->data = data;
+            }
+        }
+        if (res == 0) {
+            struct wb_extent *after = touching ? last->next : first;
+            for (struct wb_extent *e = first; touching && e != after;) {
+                struct wb_extent *next = e->next;
+                memcpy(n->data + (e->off - start), e->data, e->len);
+                // cap đã được tính vào reserve ở trên
+                free(e->data);
+                free(e);
+                f->nextents--;
+                e = next;
+            }
+            memcpy(n->data + (offset - start), buf, size);
+            n->next = after;
+            *pp = n;
+            f->nextents++;
+        }
+    }
+
+    if (res == 0) {
+        if (f->dirty_since == 0) f->dirty_since = now_ms();
+        f->pid = pid;
+        f->uid = uid;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return res;
+}
+
+void wb_writer(struct wb_file *f, pid_t *pid, uid_t *uid) {
+    pthread_mutex_lock(&f->lock);
+    *pid = f->pid;
+    *uid = f->uid;
+    pthread_mutex_unlock(&f->lock);
+}
+
+int wb_dirty(struct wb_file *f) {
+    pthread_mutex_lock(&f->lock);
+    int dirty = f->extents != NULL || f->error != 0;
+    pthread_mutex_unlock(&f->lock);
+    return dirty;
+}
+
+int wb_fd(struct wb_file *f) {
+    return f->fd;
+}
+
+off_t wb_pending_end(const char *path) {
+    off_t end = -1;
+    pthread_mutex_lock(&open_lock);
+    struct wb_file *f = find_locked(path);
+    if (f) {
+        pthread_mutex_lock(&f->lock);
+        for (struct wb_extent *e = f->extents; e; e = e->next) end = e->off + (off_t)e->len;
+        pthread_mutex_unlock(&f->lock);
+    }
+    pthread_mutex_unlock(&open_lock);
+    return end;
+}
+
+int wb_drain(struct wb_file *f, wb_write_fn fn, void *ctx) {
+    pthread_mutex_lock(&f->lock);
+    int res = f->error;
+    f->error = 0;
+    while (f->extents) {
+        struct wb_extent *e = f->extents;
+        f->extents = e->next;
+        if (res == 0) res = fn(ctx, e->data, e->len, e->off);
+        free_extent(e);
+    }
+    f->nextents = 0;
+    f->dirty_since = 0;
+    pthread_mutex_unlock(&f->lock);
+    return res;
+}
+
+void wb_set_error(struct wb_file *f, int err) {
+    pthread_mutex_lock(&f->lock);
+    if (f->error == 0) f->error = err;
+    pthread_mutex_unlock(&f->lock);
+}
+
+static int in_tree(const char *path, const char *dir, size_t dlen) {
+    return strncmp(path, dir, dlen) == 0 && (path[dlen] == '\0' || path[dlen] == '/');
+}
+
+void wb_rename(const char *from, const char *to) {
+    size_t flen = strlen(from);
+    pthread_mutex_lock(&open_lock);
+    for (struct wb_file *f = open_files; f; f = f->next) {
+        if (!in_tree(f->path, from, flen)) continue;
+        char *p = malloc(strlen(to) + strlen(f->path + flen) + 1);
+        if (!p) continue;
+        strcpy(p, to);
+        strcat(p, f->path + flen);
+        free(f->path);
+        f->path = p;
+    }
+    pthread_mutex_unlock(&open_lock);
+}
+
+// --- Timer thread ---
+
+static void *timer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&timer_lock);
+    while (!timer_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (WB_FLUSH_INTERVAL_MS / 2) * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        if (!timer_kicked) pthread_cond_timedwait(&timer_cond, &timer_lock, &until);
+        int kicked = timer_kicked;
+        timer_kicked = 0;
+        if (timer_stop) break;
+        pthread_mutex_unlock(&timer_lock);
+
+        // Chụp danh sách path cần flush rồi gọi ngoài open_lock
+        // (flush_path lấy path_lock, rồi wb_find -> open_lock)
+        uint64_t now = now_ms();
+        size_t n = 0, cap = 0;
+        char **paths = NULL;
+        pthread_mutex_lock(&open_lock);
+        for (struct wb_file *f = open_files; f; f = f->next) {
+            pthread_mutex_lock(&f->lock);
+            int due = f->dirty_since && (kicked || now - f->dirty_since >= WB_FLUSH_INTERVAL_MS);
+            pthread_mutex_unlock(&f->lock);
+            if (!due) continue;
+            if (n == cap) {
+                size_t ncap = cap ? cap * 2 : 16;
+                char **np = realloc(paths, ncap * sizeof(*np));
+                if (!np) break;
+                paths = np;
+                cap = ncap;
+            }
+            if ((paths[n] = strdup(f->path)) != NULL) n++;
+        }
+        pthread_mutex_unlock(&open_lock);
+
+        for (size_t i = 0; i < n; i++) {
+            timer_flush(paths[i]);
+            free(paths[i]);
+        }
+        free(paths);
+        pthread_mutex_lock(&timer_lock);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return NULL;
+}
+
+int wb_start(void (*flush_path)(const char *path)) {
+    if (!wb_enabled()) return 0;
+    timer_flush = flush_path;
+    timer_stop = 0;
+    if (pthread_create(&timer_thread, NULL, timer_main, NULL) != 0) return -1;
+    timer_running = 1;
+    return 0;
+}
+
+// Hết budget: nhờ thread flush sớm các file khác
+void wb_kick(void) {
+    pthread_mutex_lock(&timer_lock);
+    timer_kicked = 1;
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+void wb_stop(void) {
+    if (!timer_running) return;
+    pthread_mutex_lock(&timer_lock);
+    timer_stop = 1;
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_lock);
+    pthread_join(timer_thread, NULL);
+    timer_running = 0;
+}
@@ -0,0 +1,60 @@
+#ifndef WRITE_BUFFER_H
+#define WRITE_BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Write-back coalescing buffer (--writeback=SIZE).
+//
+// Small writes to an open file are kept in memory as sorted, merged dirty
+// extents instead of going to Storage one by one. operations.c writes
+// them out (one backup, one log record) on flush/fsync/release, when the
+// global memory budget is hit, or from the timer thread once the oldest
+// dirty byte is WB_FLUSH_INTERVAL_MS old.
+//
+// One buffer per path, shared by all handles open for writing on it, so
+// handles never see each other's writes out of order.
+
+#define WB_FLUSH_INTERVAL_MS 1000
+#define WB_MAX_EXTENTS 4096             // per file, past that the caller flushes
+
+struct wb_file;
+
+// Memory budget shared by all buffered files; 0 disables (default)
+void wb_set_budget(size_t bytes);
+int wb_enabled(void);
+
+// Get the buffer of path, creating it around fd (dup'ed) on first open.
+// Every successful wb_open/wb_find needs a wb_release.
+struct wb_file *wb_open(const char *path, int fd);
+struct wb_file *wb_find(const char *path);
+void wb_release(struct wb_file *f);
+
+// Buffer a write. -ENOSPC: over the budget or extent limit, flush and retry.
+// pid/uid of the writer are kept for the log record of the flush.
+int wb_add(struct wb_file *f, const void *buf, size_t size, off_t offset, pid_t pid, uid_t uid);
+// Writer of the most recent buffered write
+void wb_writer(struct wb_file *f, pid_t *pid, uid_t *uid);
+
+int wb_dirty(struct wb_file *f);
+int wb_fd(struct wb_file *f);
+// End of the furthest buffered byte of path, or -1 (getattr size)
+off_t wb_pending_end(const char *path);
+
+// Hand every dirty extent to fn in offset order and drop it. Stops at the
+// first error (the rest is discarded, like a failed kernel write-back);
+// returns that error or one left over from a timer flush.
+typedef int (*wb_write_fn)(void *ctx, const void *data, size_t len, off_t offset);
+int wb_drain(struct wb_file *f, wb_write_fn fn, void *ctx);
+// Keep a background flush error for the next wb_drain (close/fsync report it)
+void wb_set_error(struct wb_file *f, int err);
+
+void wb_rename(const char *from, const char *to);
+
+// Timer thread: calls flush_path(path) for files dirty for too long, and
+// early when the budget runs out. flush_path must do its own locking.
+int wb_start(void (*flush_path)(const char *path));
+void wb_kick(void);
+void wb_stop(void);
+
+#endif